@@ -3,8 +3,7 @@
 #include <cstdint>
 #include <string>
 #include <map>
-
-struct _drmModeAtomicReq;
+#include <vector>
 
 #include "decls.h"
 
@@ -19,21 +18,30 @@ public:
 	AtomicReq(const AtomicReq& other) = delete;
 	AtomicReq& operator=(const AtomicReq& other) = delete;
 
+	struct Prop
+	{
+		uint32_t ob_id;
+		uint32_t prop_id;
+		uint64_t value;
+	};
+
 	void add(uint32_t ob_id, uint32_t prop_id, uint64_t value);
 	void add(DrmPropObject *ob, Property *prop, uint64_t value);
 	void add(DrmPropObject *ob, const std::string& prop, uint64_t value);
 	void add(DrmPropObject *ob, const std::map<std::string, uint64_t>& values);
+	void add(const std::vector<Prop>& props);
 
 	void add_display(Connector* conn, Crtc* crtc, Blob* videomode,
 			 Plane* primary, Framebuffer* fb);
 
 	int test(bool allow_modeset = false);
-	int commit(void* data, bool allow_modeset = false);
+	// See Crtc::page_flip() about async
+	int commit(void* data, bool allow_modeset = false, bool async = false);
 	int commit_sync(bool allow_modeset = false);
 
 private:
 	Card& m_card;
-	_drmModeAtomicReq* m_req;
+	std::vector<Prop> m_props;
 };
 
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <vector>
 #include <map>
@@ -10,6 +11,8 @@
 
 namespace kms
 {
+class CardBackend;
+
 struct CardVersion
 {
 	int major;
@@ -20,12 +23,62 @@ struct CardVersion
 	std::string desc;
 };
 
+// Counters of the ioctls done via a Card, and of the buffer memory allocated
+// and mapped via it. The ioctl counters can be reset, the memory counters
+// track the currently live buffers. The counters are atomic, as buffers may
+// be created, mapped and freed from several threads. A copy is a snapshot.
+struct CardStats
+{
+	CardStats() = default;
+	CardStats(const CardStats& other) { *this = other; }
+	CardStats& operator=(const CardStats& other);
+
+	std::atomic<uint64_t> resource_gets { 0 };	// resources, connectors, encoders, crtcs, planes, fbs
+	std::atomic<uint64_t> prop_gets { 0 };		// properties, object properties and blobs
+	std::atomic<uint64_t> prop_sets { 0 };		// legacy property sets
+	std::atomic<uint64_t> blob_creates { 0 };
+	std::atomic<uint64_t> blob_destroys { 0 };
+	std::atomic<uint64_t> atomic_commits { 0 };	// including test-only commits
+	std::atomic<uint64_t> legacy_commits { 0 };	// SetCrtc, SetPlane and PageFlip
+	std::atomic<uint64_t> vblank_queries { 0 };
+	std::atomic<uint64_t> dumb_creates { 0 };
+	std::atomic<uint64_t> dumb_destroys { 0 };
+	std::atomic<uint64_t> dumb_maps { 0 };
+	std::atomic<uint64_t> fb_adds { 0 };
+	std::atomic<uint64_t> fb_removes { 0 };
+	std::atomic<uint64_t> prime_exports { 0 };
+	std::atomic<uint64_t> prime_imports { 0 };
+	std::atomic<uint64_t> other_ioctls { 0 };	// version, caps, master, dirty fb
+	std::atomic<uint64_t> failed_ioctls { 0 };
+
+	std::atomic<uint64_t> dumb_bytes { 0 };
+	std::atomic<uint64_t> dmabuf_bytes { 0 };
+	std::atomic<uint64_t> mapped_bytes { 0 };
+};
+
+enum class DrmEventType
+{
+	Vblank = 1,
+	FlipComplete = 2,
+};
+
+struct DrmEvent
+{
+	DrmEventType type;
+	uint32_t seq;
+	double time;		// CLOCK_MONOTONIC seconds
+	uint64_t data;		// the user data given to the commit or flip
+	uint32_t crtc_id;	// 0 for vblank events
+};
+
 class Card
 {
 	friend class Framebuffer;
 public:
 	static std::unique_ptr<Card> open_named_card(const std::string& name);
 
+	// dev_path "virtual" or "virtual:<w>x<h>[@<Hz>][+<overlays>],..." opens an
+	// in-process virtual device
 	Card(const std::string& dev_path = "");
 	Card(const std::string& driver, uint32_t idx);
 	Card(int fd, bool take_ownership);
@@ -34,8 +87,10 @@ public:
 	Card(const Card& other) = delete;
 	Card& operator=(const Card& other) = delete;
 
-	int fd() const { return m_fd; }
-	unsigned int dev_minor() const { return m_minor; }
+	int fd() const;
+	unsigned int dev_minor() const;
+
+	CardBackend& backend() const { return *m_backend; }
 
 	void drop_master();
 
@@ -52,6 +107,8 @@ public:
 	bool has_atomic() const { return m_has_atomic; }
 	bool has_universal_planes() const { return m_has_universal_planes; }
 	bool has_dumb_buffers() const { return m_has_dumb; }
+	bool has_async_page_flip() const { return m_has_async_page_flip; }
+	bool has_atomic_async_page_flip() const { return m_has_atomic_async_page_flip; }
 	bool has_kms() const;
 
 	std::vector<Connector*> get_connectors() const { return m_connectors; }
@@ -66,11 +123,28 @@ public:
 
 	void call_page_flip_handlers();
 
+	// Read and decode the pending events. Blocks until there's at least one
+	// event, or with nonblock returns an empty vector if there are none.
+	// The events are returned instead of calling the page flip handlers, so
+	// the user data of the commits must not be PageFlipHandlerBase pointers
+	// when using this.
+	std::vector<DrmEvent> read_events(bool nonblock = false);
+
 	int disable_all();
 
+	// Save the atomic state of all crtcs, planes and connectors. This is
+	// done automatically when the card is opened.
+	void save_state();
+	// Restore the saved state with a single atomic commit
+	int restore_state();
+
 	const std::string& version_name() const { return m_version.name; }
 	const CardVersion& version() const { return m_version; }
 
+	const CardStats& stats() const { return m_stats; }
+	// Reset the ioctl counters
+	void reset_stats();
+
 private:
 	void setup();
 	void restore_modes();
@@ -84,14 +158,20 @@ private:
 	std::vector<Property*> m_properties;
 	std::vector<Framebuffer*> m_framebuffers;
 
-	int m_fd;
-	unsigned int m_minor;
+	std::map<DrmPropObject*, std::map<uint32_t, uint64_t>> m_saved_state;
+	std::map<uint32_t, std::vector<uint8_t>> m_saved_blobs;
+
+	std::unique_ptr<CardBackend> m_backend;
 	bool m_is_master;
 
 	bool m_has_atomic;
 	bool m_has_universal_planes;
 	bool m_has_dumb;
+	bool m_has_async_page_flip;
+	bool m_has_atomic_async_page_flip;
 
 	CardVersion m_version;
+
+	CardStats m_stats {};
 };
 }
@@ -44,6 +44,10 @@ public:
 	const std::string& subpixel_str() const;
 	std::vector<Videomode> get_modes() const;
 	std::vector<Encoder*> get_encoders() const;
+
+	bool vrr_capable() const;
+	// Vertical refresh range from the EDID monitor range limits
+	bool get_vrr_range(float& min_hz, float& max_hz) const;
 private:
 	Connector(Card& card, uint32_t id, uint32_t idx);
 	~Connector() override;
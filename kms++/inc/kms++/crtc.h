@@ -21,6 +21,12 @@ public:
 	int set_mode(Connector* conn, const Videomode& mode);
 	int set_mode(Connector* conn, Framebuffer& fb, const Videomode& mode);
 
+	// Returns false if the crtc is already driving conn with the given mode
+	bool needs_modeset(Connector* conn, const Videomode& mode);
+	// Like set_mode(), but only changes the primary plane's framebuffer if
+	// no modeset is needed
+	int set_mode_seamless(Connector* conn, Framebuffer& fb, const Videomode& mode);
+
 	int set_plane(Plane *plane, Framebuffer &fb,
 		      int32_t dst_x, int32_t dst_y, uint32_t dst_w, uint32_t dst_h,
 		      float src_x, float src_y, float src_w, float src_h);
@@ -30,7 +36,15 @@ public:
 
 	Plane* get_primary_plane();
 
-	int page_flip(Framebuffer& fb, void *data);
+	bool has_vrr() const { return has_prop("VRR_ENABLED"); }
+	int set_vrr(bool enable);
+
+	// An async flip happens immediately, without waiting for vblank, and may
+	// tear. If the card does not support it, a normal flip is done instead.
+	int page_flip(Framebuffer& fb, void *data, bool async = false);
+
+	// Get the current vblank count and the time of the latest vblank (CLOCK_MONOTONIC)
+	int get_sequence(uint64_t& seq, uint64_t& ns);
 
 	uint32_t buffer_id() const;
 	uint32_t x() const;
@@ -5,6 +5,7 @@ namespace kms
 class AtomicReq;
 class Blob;
 class Card;
+struct CardStats;
 class Connector;
 class Crtc;
 class DrmObject;
@@ -45,6 +45,9 @@ public:
 protected:
 	Framebuffer(Card& card, uint32_t width, uint32_t height);
 
+	// For the memory accounting of the subclasses
+	CardStats& card_stats() const;
+
 private:
 	uint32_t m_width;
 	uint32_t m_height;
@@ -14,3 +14,4 @@
 #include "blob.h"
 #include "pipeline.h"
 #include "pagefliphandler.h"
+#include "trace.h"
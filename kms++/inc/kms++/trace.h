@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Lightweight trace points for the hot paths of kms++ and kms++util.
+ *
+ * The trace points are compiled in only when KMSXX_TRACE_ENABLED is defined
+ * (the "trace" build option), otherwise the macros expand to nothing.
+ * Recording is enabled at runtime with the KMSXX_TRACE env variable, which
+ * gives the file where the trace is written in Chrome trace JSON format at
+ * exit. The file can be opened with chrome://tracing or ui.perfetto.dev.
+ * Without the trace points KMSXX_TRACE is ignored.
+ *
+ * Each thread records into its own fixed size ring buffer, so recording
+ * takes only the uncontended lock of the thread's own ring. When a ring is
+ * full, the oldest events are dropped.
+ *
+ * The name and category strings are stored as pointers, and must be
+ * string literals or otherwise live until the trace has been written.
+ */
+
+namespace kms
+{
+bool trace_enabled();
+void trace_set_enabled(bool enable);
+
+// CLOCK_MONOTONIC in ns, the same clock as the vblank timestamps
+uint64_t trace_now_ns();
+
+void trace_complete(const char* cat, const char* name, uint64_t start_ns, uint64_t end_ns);
+void trace_instant(const char* cat, const char* name, uint64_t arg);
+void trace_counter(const char* cat, const char* name, int64_t value);
+
+// Write the recorded events in Chrome trace JSON format. Returns 0 or -errno.
+int trace_write_json(const std::string& filename);
+// Drop the recorded events of all threads
+void trace_clear();
+
+class TraceScope
+{
+public:
+	TraceScope(const char* cat, const char* name)
+		: m_cat(cat), m_name(name), m_start(trace_enabled() ? trace_now_ns() : 0)
+	{
+	}
+
+	~TraceScope()
+	{
+		if (m_start)
+			trace_complete(m_cat, m_name, m_start, trace_now_ns());
+	}
+
+	TraceScope(const TraceScope& other) = delete;
+	TraceScope& operator=(const TraceScope& other) = delete;
+
+private:
+	const char* m_cat;
+	const char* m_name;
+	uint64_t m_start;
+};
+}
+
+#ifdef KMSXX_TRACE_ENABLED
+
+#define KMSXX_TRACE_CONCAT2(a, b) a##b
+#define KMSXX_TRACE_CONCAT(a, b) KMSXX_TRACE_CONCAT2(a, b)
+
+#define KMSXX_TRACE_SCOPE(cat, name) \
+	kms::TraceScope KMSXX_TRACE_CONCAT(kmsxx_trace_scope_, __LINE__)(cat, name)
+
+#define KMSXX_TRACE_INSTANT(cat, name, arg) \
+	do { \
+		if (kms::trace_enabled()) \
+			kms::trace_instant(cat, name, arg); \
+	} while (0)
+
+#define KMSXX_TRACE_COUNTER(cat, name, value) \
+	do { \
+		if (kms::trace_enabled()) \
+			kms::trace_counter(cat, name, value); \
+	} while (0)
+
+#else
+
+#define KMSXX_TRACE_SCOPE(cat, name) do { } while (0)
+#define KMSXX_TRACE_INSTANT(cat, name, arg) do { } while (0)
+#define KMSXX_TRACE_COUNTER(cat, name, value) do { } while (0)
+
+#endif
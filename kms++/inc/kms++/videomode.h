@@ -54,6 +54,9 @@ struct Videomode
 	std::string to_string_long_padded() const;
 
 	bool valid() const;
+
+	// Compare timings and flags, ignoring name, type and vrefresh
+	bool timings_match(const Videomode& other) const;
 };
 
 struct Videomode videomode_from_timings(uint32_t clock_khz,
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cerrno>
 #include <stdexcept>
 
 #include <xf86drm.h>
@@ -6,20 +7,7 @@
 
 #include <kms++/kms++.h>
 
-#ifndef DRM_CLIENT_CAP_ATOMIC
-
-#define DRM_MODE_ATOMIC_TEST_ONLY 0
-#define DRM_MODE_ATOMIC_NONBLOCK 0
-
-struct _drmModeAtomicReq;
-typedef struct _drmModeAtomicReq* drmModeAtomicReqPtr;
-
-static inline drmModeAtomicReqPtr drmModeAtomicAlloc() { return 0; }
-static inline void drmModeAtomicFree(drmModeAtomicReqPtr) { }
-static inline int drmModeAtomicAddProperty(drmModeAtomicReqPtr, uint32_t, uint32_t, uint64_t) { return 0; }
-static inline int drmModeAtomicCommit(int, drmModeAtomicReqPtr, int, void*) { return 0; }
-
-#endif // DRM_CLIENT_CAP_ATOMIC
+#include "cardbackend.h"
 
 using namespace std;
 
@@ -29,19 +17,15 @@ AtomicReq::AtomicReq(Card& card)
 	: m_card(card)
 {
 	assert(card.has_atomic());
-	m_req = drmModeAtomicAlloc();
 }
 
 AtomicReq::~AtomicReq()
 {
-	drmModeAtomicFree(m_req);
 }
 
 void AtomicReq::add(uint32_t ob_id, uint32_t prop_id, uint64_t value)
 {
-	int r = drmModeAtomicAddProperty(m_req, ob_id, prop_id, value);
-	if (r <= 0)
-		throw std::invalid_argument("foo");
+	m_props.push_back({ ob_id, prop_id, value });
 }
 
 void AtomicReq::add(DrmPropObject* ob, Property *prop, uint64_t value)
@@ -60,6 +44,11 @@ void AtomicReq::add(kms::DrmPropObject* ob, const map<string, uint64_t>& values)
 		add(ob, kvp.first, kvp.second);
 }
 
+void AtomicReq::add(const vector<Prop>& props)
+{
+	m_props.insert(m_props.end(), props.begin(), props.end());
+}
+
 void AtomicReq::add_display(Connector* conn, Crtc* crtc, Blob* videomode, Plane* primary, Framebuffer* fb)
 {
 	add(conn, {
@@ -87,31 +76,45 @@ void AtomicReq::add_display(Connector* conn, Crtc* crtc, Blob* videomode, Plane*
 
 int AtomicReq::test(bool allow_modeset)
 {
+	KMSXX_TRACE_SCOPE("kms", "atomic_test");
+
 	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
 
 	if (allow_modeset)
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 
-	return drmModeAtomicCommit(m_card.fd(), m_req, flags, 0);
+	return m_card.backend().atomic_commit(m_props, flags, 0);
 }
 
-int AtomicReq::commit(void* data, bool allow_modeset)
+int AtomicReq::commit(void* data, bool allow_modeset, bool async)
 {
+	KMSXX_TRACE_SCOPE("kms", "atomic_commit");
+
 	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
 
 	if (allow_modeset)
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 
-	return drmModeAtomicCommit(m_card.fd(), m_req, flags, data);
+	if (async && !allow_modeset && m_card.has_atomic_async_page_flip()) {
+		int r = m_card.backend().atomic_commit(m_props, flags | DRM_MODE_PAGE_FLIP_ASYNC, data);
+
+		// Async commits may only change FB_ID, and not on all planes
+		if (r != -EINVAL)
+			return r;
+	}
+
+	return m_card.backend().atomic_commit(m_props, flags, data);
 }
 
 int AtomicReq::commit_sync(bool allow_modeset)
 {
+	KMSXX_TRACE_SCOPE("kms", "atomic_commit_sync");
+
 	uint32_t flags = 0;
 
 	if (allow_modeset)
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 
-	return drmModeAtomicCommit(m_card.fd(), m_req, flags, 0);
+	return m_card.backend().atomic_commit(m_props, flags, 0);
 }
 }
@@ -3,6 +3,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -19,7 +21,7 @@ Blob::Blob(Card& card, void* data, size_t len)
 {
 	uint32_t id;
 
-	int r = drmModeCreatePropertyBlob(card.fd(), data, len, &id);
+	int r = card.backend().create_blob(data, len, &id);
 	if (r)
 		throw invalid_argument("FAILED TO CREATE PROP\n");
 
@@ -29,12 +31,12 @@ Blob::Blob(Card& card, void* data, size_t len)
 Blob::~Blob()
 {
 	if (m_created)
-		drmModeDestroyPropertyBlob(card().fd(), id());
+		card().backend().destroy_blob(id());
 }
 
 vector<uint8_t> Blob::data()
 {
-	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(card().fd(), id());
+	drmModePropertyBlobPtr blob = card().backend().get_blob(id());
 
 	if (!blob)
 		throw invalid_argument("Blob data not available");
@@ -43,7 +45,7 @@ vector<uint8_t> Blob::data()
 
 	auto v = vector<uint8_t>(data, data + blob->length);
 
-	drmModeFreePropertyBlob(blob);
+	card().backend().free_blob(blob);
 
 	return v;
 }
@@ -8,9 +8,8 @@
 #include <cerrno>
 #include <algorithm>
 #include <glob.h>
+#include <poll.h>
 
-#include <sys/stat.h>
-#include <sys/sysmacros.h>
 #include <sys/types.h>
 
 #include <xf86drm.h>
@@ -18,6 +17,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -79,6 +80,17 @@ static int open_device_by_path(string path)
 	return fd;
 }
 
+static unique_ptr<CardBackend> open_backend_by_path(const string& path)
+{
+	if (path == "virtual")
+		return create_virtual_backend("");
+
+	if (path.compare(0, 8, "virtual:") == 0)
+		return create_virtual_backend(path.substr(8));
+
+	return create_drm_backend(open_device_by_path(path));
+}
+
 // open Nth DRM card with the given driver name
 static int open_device_by_driver(string name, uint32_t idx)
 {
@@ -124,10 +136,10 @@ Card::Card(const std::string& dev_path)
 	const char* dev_p = getenv("KMSXX_DEVICE");
 
 	if (!dev_path.empty()) {
-		m_fd = open_device_by_path(dev_path);
+		m_backend = open_backend_by_path(dev_path);
 	} else if (dev_p) {
 		string dev(dev_p);
-		m_fd = open_device_by_path(dev);
+		m_backend = open_backend_by_path(dev);
 	} else if (drv_p) {
 		string drv(drv_p);
 
@@ -147,9 +159,9 @@ Card::Card(const std::string& dev_path)
 			num = stoul(numstr);
 		}
 
-		m_fd = open_device_by_driver(name, num);
+		m_backend = create_drm_backend(open_device_by_driver(name, num));
 	} else {
-		m_fd = open_first_kms_device();
+		m_backend = create_drm_backend(open_first_kms_device());
 	}
 
 	setup();
@@ -157,50 +169,47 @@ Card::Card(const std::string& dev_path)
 
 Card::Card(const std::string& driver, uint32_t idx)
 {
-	m_fd = open_device_by_driver(driver, idx);
+	m_backend = create_drm_backend(open_device_by_driver(driver, idx));
 
 	setup();
 }
 
 Card::Card(int fd, bool take_ownership)
 {
-	if (take_ownership) {
-		m_fd = fd;
-	} else {
-		m_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (!take_ownership) {
+		fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
 
-		if (m_fd < 0)
+		if (fd < 0)
 			throw invalid_argument(string(strerror(errno)) + " duplicating fd");
 	}
 
+	m_backend = create_drm_backend(fd);
+
 	setup();
 }
 
 void Card::setup()
 {
-	drmVersionPtr ver = drmGetVersion(m_fd);
+	m_backend = create_stats_backend(move(m_backend), m_stats);
+
+	CardBackend& be = *m_backend;
+
+	drmVersionPtr ver = be.get_version();
 	m_version.major = ver->version_major;
 	m_version.minor = ver->version_minor;
 	m_version.patchlevel = ver->version_patchlevel;
 	m_version.name = string(ver->name, ver->name_len);
 	m_version.date = string(ver->date, ver->date_len);
 	m_version.desc = string(ver->desc, ver->desc_len);
-	drmFreeVersion(ver);
+	be.free_version(ver);
 
-	struct stat stats;
 	int r;
 
-	r = fstat(m_fd, &stats);
-	if (r < 0)
-		throw invalid_argument("Can't stat device (" + string(strerror(errno)) + ")");
-
-	m_minor = minor(stats.st_dev);
-
-	r = drmSetMaster(m_fd);
+	r = be.set_master();
 	m_is_master = r == 0;
 
 	if (getenv("KMSXX_DISABLE_UNIVERSAL_PLANES") == 0) {
-		r = drmSetClientCap(m_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+		r = be.set_client_cap(DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
 		m_has_universal_planes = r == 0;
 	} else {
 		m_has_universal_planes = false;
@@ -208,7 +217,7 @@ void Card::setup()
 
 #ifdef DRM_CLIENT_CAP_ATOMIC
 	if (getenv("KMSXX_DISABLE_ATOMIC") == 0) {
-		r = drmSetClientCap(m_fd, DRM_CLIENT_CAP_ATOMIC, 1);
+		r = be.set_client_cap(DRM_CLIENT_CAP_ATOMIC, 1);
 		m_has_atomic = r == 0;
 	} else {
 		m_has_atomic = false;
@@ -218,10 +227,21 @@ void Card::setup()
 #endif
 
 	uint64_t has_dumb;
-	r = drmGetCap(m_fd, DRM_CAP_DUMB_BUFFER, &has_dumb);
+	r = be.get_cap(DRM_CAP_DUMB_BUFFER, &has_dumb);
 	m_has_dumb = r == 0 && has_dumb;
 
-	auto res = drmModeGetResources(m_fd);
+	uint64_t has_async;
+	r = be.get_cap(DRM_CAP_ASYNC_PAGE_FLIP, &has_async);
+	m_has_async_page_flip = r == 0 && has_async;
+
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+	r = be.get_cap(DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &has_async);
+	m_has_atomic_async_page_flip = m_has_atomic && r == 0 && has_async;
+#else
+	m_has_atomic_async_page_flip = false;
+#endif
+
+	auto res = be.get_resources();
 	if (res) {
 		for (int i = 0; i < res->count_connectors; ++i) {
 			uint32_t id = res->connectors[i];
@@ -244,9 +264,9 @@ void Card::setup()
 			m_encoders.push_back(ob);
 		}
 
-		drmModeFreeResources(res);
+		be.free_resources(res);
 
-		auto planeRes = drmModeGetPlaneResources(m_fd);
+		auto planeRes = be.get_plane_resources();
 		if (planeRes) {
 			for (uint i = 0; i < planeRes->count_planes; ++i) {
 				uint32_t id = planeRes->planes[i];
@@ -255,13 +275,13 @@ void Card::setup()
 				m_planes.push_back(ob);
 			}
 
-			drmModeFreePlaneResources(planeRes);
+			be.free_plane_resources(planeRes);
 		}
 	}
 
 	// collect all possible props
 	for (auto ob : get_objects()) {
-		auto props = drmModeObjectGetProperties(m_fd, ob->id(), ob->object_type());
+		auto props = be.get_object_properties(ob->id(), ob->object_type());
 
 		if (props == nullptr)
 			continue;
@@ -276,29 +296,79 @@ void Card::setup()
 			}
 		}
 
-		drmModeFreeObjectProperties(props);
+		be.free_object_properties(props);
 	}
 
 	for (auto pair : m_obmap)
 		pair.second->setup();
+
+	save_state();
 }
 
 Card::~Card()
 {
-	restore_modes();
+	if (restore_state() != 0)
+		restore_modes();
 
 	while (m_framebuffers.size() > 0)
 		delete m_framebuffers.back();
 
 	for (auto pair : m_obmap)
 		delete pair.second;
+}
 
-	close(m_fd);
+int Card::fd() const
+{
+	return m_backend->fd();
+}
+
+unsigned int Card::dev_minor() const
+{
+	return m_backend->dev_minor();
+}
+
+CardStats& CardStats::operator=(const CardStats& other)
+{
+	resource_gets = other.resource_gets.load();
+	prop_gets = other.prop_gets.load();
+	prop_sets = other.prop_sets.load();
+	blob_creates = other.blob_creates.load();
+	blob_destroys = other.blob_destroys.load();
+	atomic_commits = other.atomic_commits.load();
+	legacy_commits = other.legacy_commits.load();
+	vblank_queries = other.vblank_queries.load();
+	dumb_creates = other.dumb_creates.load();
+	dumb_destroys = other.dumb_destroys.load();
+	dumb_maps = other.dumb_maps.load();
+	fb_adds = other.fb_adds.load();
+	fb_removes = other.fb_removes.load();
+	prime_exports = other.prime_exports.load();
+	prime_imports = other.prime_imports.load();
+	other_ioctls = other.other_ioctls.load();
+	failed_ioctls = other.failed_ioctls.load();
+	dumb_bytes = other.dumb_bytes.load();
+	dmabuf_bytes = other.dmabuf_bytes.load();
+	mapped_bytes = other.mapped_bytes.load();
+
+	return *this;
+}
+
+void Card::reset_stats()
+{
+	uint64_t dumb_bytes = m_stats.dumb_bytes;
+	uint64_t dmabuf_bytes = m_stats.dmabuf_bytes;
+	uint64_t mapped_bytes = m_stats.mapped_bytes;
+
+	m_stats = CardStats {};
+
+	m_stats.dumb_bytes = dumb_bytes;
+	m_stats.dmabuf_bytes = dmabuf_bytes;
+	m_stats.mapped_bytes = mapped_bytes;
 }
 
 void Card::drop_master()
 {
-	drmDropMaster(fd());
+	m_backend->drop_master();
 	m_is_master = false;
 }
 
@@ -382,16 +452,70 @@ static void page_flip_handler(int fd, unsigned int frame,
 {
 	auto handler = (PageFlipHandlerBase*)data;
 	double time = sec + usec / 1000000.0;
+
+	KMSXX_TRACE_INSTANT("kms", "flip_event", frame);
+
 	handler->handle_page_flip(frame, time);
 }
 
 void Card::call_page_flip_handlers()
 {
+	KMSXX_TRACE_SCOPE("kms", "handle_events");
+
 	drmEventContext ev { };
 	ev.version = DRM_EVENT_CONTEXT_VERSION;
 	ev.page_flip_handler = page_flip_handler;
 
-	drmHandleEvent(fd(), &ev);
+	m_backend->handle_event(&ev);
+}
+
+static thread_local vector<DrmEvent>* t_read_events;
+
+static void read_vblank_handler(int fd, unsigned int seq,
+				unsigned int sec, unsigned int usec,
+				void* data)
+{
+	t_read_events->push_back(DrmEvent { DrmEventType::Vblank, seq, sec + usec / 1000000.0,
+					    (uint64_t)(uintptr_t)data, 0 });
+}
+
+static void read_page_flip_handler(int fd, unsigned int seq,
+				   unsigned int sec, unsigned int usec,
+				   unsigned int crtc_id, void* data)
+{
+	KMSXX_TRACE_INSTANT("kms", "flip_event", seq);
+
+	t_read_events->push_back(DrmEvent { DrmEventType::FlipComplete, seq, sec + usec / 1000000.0,
+					    (uint64_t)(uintptr_t)data, crtc_id });
+}
+
+vector<DrmEvent> Card::read_events(bool nonblock)
+{
+	KMSXX_TRACE_SCOPE("kms", "read_events");
+
+	vector<DrmEvent> events;
+
+	if (nonblock) {
+		struct pollfd pfd { m_backend->fd(), POLLIN, 0 };
+
+		if (poll(&pfd, 1, 0) <= 0)
+			return events;
+	}
+
+	drmEventContext ev { };
+	ev.version = 3;
+	ev.vblank_handler = read_vblank_handler;
+	ev.page_flip_handler2 = read_page_flip_handler;
+
+	// All the events of one read are decoded in one go
+	t_read_events = &events;
+	int r = m_backend->handle_event(&ev);
+	t_read_events = nullptr;
+
+	if (r < 0)
+		throw runtime_error("failed to read events: " + string(strerror(errno)));
+
+	return events;
 }
 
 int Card::disable_all()
@@ -414,4 +538,90 @@ int Card::disable_all()
 	return req.commit_sync(true);
 }
 
+static bool is_restorable(const Property* prop)
+{
+	if (prop->is_immutable())
+		return false;
+
+	// DPMS can only be set with the legacy ioctl
+	if (prop->name() == "DPMS")
+		return false;
+
+	return true;
+}
+
+void Card::save_state()
+{
+	m_saved_state.clear();
+	m_saved_blobs.clear();
+
+	if (!m_has_atomic)
+		return;
+
+	vector<DrmPropObject*> obs;
+	obs.insert(obs.end(), m_crtcs.begin(), m_crtcs.end());
+	obs.insert(obs.end(), m_planes.begin(), m_planes.end());
+	obs.insert(obs.end(), m_connectors.begin(), m_connectors.end());
+
+	for (DrmPropObject* ob : obs) {
+		ob->refresh_props();
+
+		auto& values = m_saved_state[ob];
+
+		for (auto pair : ob->get_prop_map()) {
+			Property* prop = get_prop(pair.first);
+			uint64_t value = pair.second;
+
+			if (!is_restorable(prop))
+				continue;
+
+			// The blobs may be gone by the time we restore, so save the contents
+			if (prop->type() == PropertyType::Blob && value != 0 &&
+			    m_saved_blobs.find(value) == m_saved_blobs.end()) {
+				try {
+					m_saved_blobs[value] = Blob(*this, value).data();
+				} catch (const invalid_argument&) {
+					continue;
+				}
+			}
+
+			values[prop->id()] = value;
+		}
+	}
+}
+
+int Card::restore_state()
+{
+	if (!m_has_atomic || m_saved_state.empty())
+		return -EOPNOTSUPP;
+
+	AtomicReq req(*this);
+	map<uint32_t, unique_ptr<Blob>> blobs;
+
+	try {
+		for (const auto& obpair : m_saved_state) {
+			for (auto pair : obpair.second) {
+				uint64_t value = pair.second;
+
+				if (get_prop(pair.first)->type() == PropertyType::Blob && value != 0) {
+					unique_ptr<Blob>& blob = blobs[value];
+
+					if (!blob) {
+						vector<uint8_t>& data = m_saved_blobs.at(value);
+						blob = unique_ptr<Blob>(new Blob(*this, data.data(), data.size()));
+					}
+
+					value = blob->id();
+				}
+
+				req.add(obpair.first->id(), pair.first, value);
+			}
+		}
+	} catch (const invalid_argument&) {
+		return -EINVAL;
+	}
+
+	return req.commit_sync(true);
+}
+
 }
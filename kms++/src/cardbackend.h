@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <kms++/atomicreq.h>
+
+namespace kms
+{
+
+// The device below Card. The calls mirror libdrm, and return negative error
+// codes with errno set. The structs returned by the get functions have to be
+// released with the matching free function of the same backend.
+class CardBackend
+{
+public:
+	virtual ~CardBackend() { }
+
+	// fd to poll for events
+	virtual int fd() const = 0;
+	virtual unsigned int dev_minor() const = 0;
+
+	virtual drmVersionPtr get_version() = 0;
+	virtual void free_version(drmVersionPtr ver) = 0;
+
+	virtual int set_master() = 0;
+	virtual int drop_master() = 0;
+	virtual int set_client_cap(uint64_t cap, uint64_t value) = 0;
+	virtual int get_cap(uint64_t cap, uint64_t* value) = 0;
+
+	virtual drmModeResPtr get_resources() = 0;
+	virtual void free_resources(drmModeResPtr res) = 0;
+	virtual drmModePlaneResPtr get_plane_resources() = 0;
+	virtual void free_plane_resources(drmModePlaneResPtr res) = 0;
+
+	virtual drmModeConnectorPtr get_connector(uint32_t id) = 0;
+	virtual void free_connector(drmModeConnectorPtr conn) = 0;
+	virtual drmModeEncoderPtr get_encoder(uint32_t id) = 0;
+	virtual void free_encoder(drmModeEncoderPtr enc) = 0;
+	virtual drmModeCrtcPtr get_crtc(uint32_t id) = 0;
+	virtual void free_crtc(drmModeCrtcPtr crtc) = 0;
+	virtual drmModePlanePtr get_plane(uint32_t id) = 0;
+	virtual void free_plane(drmModePlanePtr plane) = 0;
+	virtual drmModeFBPtr get_fb(uint32_t id) = 0;
+	virtual void free_fb(drmModeFBPtr fb) = 0;
+
+	virtual drmModePropertyPtr get_property(uint32_t id) = 0;
+	virtual void free_property(drmModePropertyPtr prop) = 0;
+	virtual drmModeObjectPropertiesPtr get_object_properties(uint32_t id, uint32_t type) = 0;
+	virtual void free_object_properties(drmModeObjectPropertiesPtr props) = 0;
+	virtual int set_object_property(uint32_t id, uint32_t type, uint32_t prop_id, uint64_t value) = 0;
+
+	virtual drmModePropertyBlobPtr get_blob(uint32_t id) = 0;
+	virtual void free_blob(drmModePropertyBlobPtr blob) = 0;
+	virtual int create_blob(const void* data, size_t len, uint32_t* id) = 0;
+	virtual int destroy_blob(uint32_t id) = 0;
+
+	virtual int set_crtc(uint32_t crtc_id, uint32_t fb_id, uint32_t x, uint32_t y,
+			     uint32_t* connectors, int count, drmModeModeInfoPtr mode) = 0;
+	virtual int set_plane(uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+			      int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+			      uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h) = 0;
+	virtual int page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void* data) = 0;
+	virtual int get_sequence(uint32_t crtc_id, uint32_t crtc_idx, uint64_t* seq, uint64_t* ns) = 0;
+
+	virtual int atomic_commit(const std::vector<AtomicReq::Prop>& props, uint32_t flags, void* data) = 0;
+
+	virtual int handle_event(drmEventContext* ev) = 0;
+
+	// modifiers can be null
+	virtual int add_fb(uint32_t width, uint32_t height, uint32_t format,
+			   const uint32_t handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+			   const uint64_t modifiers[4], uint32_t* id) = 0;
+	virtual int rm_fb(uint32_t id) = 0;
+	virtual int dirty_fb(uint32_t id, drmModeClipPtr clips, uint32_t num_clips) = 0;
+
+	virtual int create_dumb(uint32_t width, uint32_t height, uint32_t bpp,
+				uint32_t* handle, uint32_t* pitch, uint64_t* size) = 0;
+	virtual int destroy_dumb(uint32_t handle) = 0;
+	// Returns MAP_FAILED on error
+	virtual void* map_dumb(uint32_t handle, size_t size) = 0;
+	virtual int prime_handle_to_fd(uint32_t handle, uint32_t flags, int* fd) = 0;
+	virtual int prime_fd_to_handle(int fd, uint32_t* handle) = 0;
+};
+
+// Takes ownership of the fd
+std::unique_ptr<CardBackend> create_drm_backend(int fd);
+
+// config is a comma separated list of outputs, <w>x<h>[@<Hz>][+<overlays>]
+std::unique_ptr<CardBackend> create_virtual_backend(const std::string& config);
+
+// Wraps a backend, counting the calls into stats
+std::unique_ptr<CardBackend> create_stats_backend(std::unique_ptr<CardBackend> backend, CardStats& stats);
+
+}
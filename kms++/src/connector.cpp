@@ -7,6 +7,7 @@
 
 #include <kms++/kms++.h>
 #include "helpers.h"
+#include "cardbackend.h"
 
 using namespace std;
 
@@ -66,7 +67,7 @@ Connector::Connector(Card &card, uint32_t id, uint32_t idx)
 {
 	m_priv = new ConnectorPriv();
 
-	m_priv->drm_connector = drmModeGetConnector(this->card().fd(), this->id());
+	m_priv->drm_connector = this->card().backend().get_connector(this->id());
 	assert(m_priv->drm_connector);
 
 	// XXX drmModeGetConnector() does forced probe, which seems to change (at least) EDID blob id.
@@ -79,15 +80,15 @@ Connector::Connector(Card &card, uint32_t id, uint32_t idx)
 
 Connector::~Connector()
 {
-	drmModeFreeConnector(m_priv->drm_connector);
+	card().backend().free_connector(m_priv->drm_connector);
 	delete m_priv;
 }
 
 void Connector::refresh()
 {
-	drmModeFreeConnector(m_priv->drm_connector);
+	card().backend().free_connector(m_priv->drm_connector);
 
-	m_priv->drm_connector = drmModeGetConnector(this->card().fd(), this->id());
+	m_priv->drm_connector = this->card().backend().get_connector(this->id());
 	assert(m_priv->drm_connector);
 
 	// XXX drmModeGetConnector() does forced probe, which seems to change (at least) EDID blob id.
@@ -231,6 +232,38 @@ Crtc* Connector::get_current_crtc() const
 		return 0;
 }
 
+bool Connector::vrr_capable() const
+{
+	return has_prop("vrr_capable") && get_prop_value("vrr_capable");
+}
+
+bool Connector::get_vrr_range(float& min_hz, float& max_hz) const
+{
+	if (!has_prop("EDID") || get_prop_value("EDID") == 0)
+		return false;
+
+	vector<uint8_t> edid = get_prop_value_as_blob("EDID")->data();
+
+	if (edid.size() < 128)
+		return false;
+
+	// The four 18 byte descriptors in the base block
+	for (unsigned offset = 54; offset < 126; offset += 18) {
+		const uint8_t* d = &edid[offset];
+
+		// Display range limits descriptor
+		if (d[0] != 0 || d[1] != 0 || d[3] != 0xfd)
+			continue;
+
+		min_hz = d[5] + (d[4] & 0x1 ? 255 : 0);
+		max_hz = d[6] + (d[4] & 0x2 ? 255 : 0);
+
+		return true;
+	}
+
+	return false;
+}
+
 uint32_t Connector::connector_type() const
 {
 	return m_priv->drm_connector->connector_type;
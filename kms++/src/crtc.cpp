@@ -3,9 +3,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <cassert>
+#include <cerrno>
 
 #include <kms++/kms++.h>
 #include "helpers.h"
+#include "cardbackend.h"
 
 using namespace std;
 
@@ -21,21 +23,21 @@ Crtc::Crtc(Card &card, uint32_t id, uint32_t idx)
 	:DrmPropObject(card, id, DRM_MODE_OBJECT_CRTC, idx)
 {
 	m_priv = new CrtcPriv();
-	m_priv->drm_crtc = drmModeGetCrtc(this->card().fd(), this->id());
+	m_priv->drm_crtc = this->card().backend().get_crtc(this->id());
 	assert(m_priv->drm_crtc);
 }
 
 Crtc::~Crtc()
 {
-	drmModeFreeCrtc(m_priv->drm_crtc);
+	card().backend().free_crtc(m_priv->drm_crtc);
 	delete m_priv;
 }
 
 void Crtc::refresh()
 {
-	drmModeFreeCrtc(m_priv->drm_crtc);
+	card().backend().free_crtc(m_priv->drm_crtc);
 
-	m_priv->drm_crtc = drmModeGetCrtc(this->card().fd(), this->id());
+	m_priv->drm_crtc = this->card().backend().get_crtc(this->id());
 	assert(m_priv->drm_crtc);
 }
 
@@ -53,7 +55,7 @@ void Crtc::restore_mode(Connector* conn)
 
 	uint32_t conns[] = { conn->id() };
 
-	drmModeSetCrtc(card().fd(), id(), c->buffer_id,
+	card().backend().set_crtc(id(), c->buffer_id,
 		       c->x, c->y,
 		       conns, 1, &c->mode);
 }
@@ -85,14 +87,76 @@ int Crtc::set_mode(Connector* conn, Framebuffer& fb, const Videomode& mode)
 	uint32_t conns[] = { conn->id() };
 	drmModeModeInfo drmmode = video_mode_to_drm_mode(mode);
 
-	return drmModeSetCrtc(card().fd(), id(), fb.id(),
+	return card().backend().set_crtc(id(), fb.id(),
 			      0, 0,
 			      conns, 1, &drmmode);
 }
 
+bool Crtc::needs_modeset(Connector* conn, const Videomode& mode)
+{
+	// Don't refresh m_priv, it holds the mode to be restored
+	drmModeCrtcPtr c = card().backend().get_crtc(id());
+	if (!c)
+		return true;
+
+	bool same_mode = c->mode_valid && drm_mode_to_video_mode(c->mode).timings_match(mode);
+
+	card().backend().free_crtc(c);
+
+	if (!same_mode)
+		return true;
+
+	if (card().has_atomic()) {
+		refresh_props();
+		conn->refresh_props();
+
+		return get_prop_value("ACTIVE") == 0 ||
+			conn->get_prop_value("CRTC_ID") != id();
+	}
+
+	return conn->get_current_crtc() != this;
+}
+
+int Crtc::set_mode_seamless(Connector* conn, Framebuffer& fb, const Videomode& mode)
+{
+	// Legacy SetCrtc does not do a modeset if the mode stays the same
+	if (!card().has_atomic())
+		return set_mode(conn, fb, mode);
+
+	Plane* primary = get_primary_plane();
+
+	if (!needs_modeset(conn, mode)) {
+		AtomicReq req(card());
+
+		req.add(primary, {
+				{ "FB_ID", fb.id() },
+				{ "CRTC_ID", id() },
+				{ "SRC_X", 0 << 16 },
+				{ "SRC_Y", 0 << 16 },
+				{ "SRC_W", fb.width() << 16 },
+				{ "SRC_H", fb.height() << 16 },
+				{ "CRTC_X", 0 },
+				{ "CRTC_Y", 0 },
+				{ "CRTC_W", mode.hdisplay },
+				{ "CRTC_H", mode.vdisplay },
+			});
+
+		if (req.commit_sync(false) == 0)
+			return 0;
+	}
+
+	AtomicReq req(card());
+
+	unique_ptr<Blob> blob = mode.to_blob(card());
+
+	req.add_display(conn, this, blob.get(), primary, &fb);
+
+	return req.commit_sync(true);
+}
+
 int Crtc::disable_mode()
 {
-	return drmModeSetCrtc(card().fd(), id(), 0, 0, 0, 0, 0, 0);
+	return card().backend().set_crtc(id(), 0, 0, 0, 0, 0, 0);
 }
 
 static inline uint32_t conv(float x)
@@ -105,14 +169,14 @@ int Crtc::set_plane(Plane* plane, Framebuffer& fb,
 		    int32_t dst_x, int32_t dst_y, uint32_t dst_w, uint32_t dst_h,
 		    float src_x, float src_y, float src_w, float src_h)
 {
-	return drmModeSetPlane(card().fd(), plane->id(), id(), fb.id(), 0,
+	return card().backend().set_plane(plane->id(), id(), fb.id(), 0,
 			       dst_x, dst_y, dst_w, dst_h,
 			       conv(src_x), conv(src_y), conv(src_w), conv(src_h));
 }
 
 int Crtc::disable_plane(Plane* plane)
 {
-	return drmModeSetPlane(card().fd(), plane->id(), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	return card().backend().set_plane(plane->id(), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
 }
 
 Plane* Crtc::get_primary_plane()
@@ -135,9 +199,38 @@ Plane* Crtc::get_primary_plane()
 	throw invalid_argument(string("No primary plane for crtc ") + to_string(id()));
 }
 
-int Crtc::page_flip(Framebuffer& fb, void *data)
+int Crtc::set_vrr(bool enable)
+{
+	if (!card().has_atomic() || !has_vrr())
+		return -EOPNOTSUPP;
+
+	AtomicReq req(card());
+
+	req.add(this, "VRR_ENABLED", enable);
+
+	return req.commit_sync(false);
+}
+
+int Crtc::page_flip(Framebuffer& fb, void *data, bool async)
+{
+	KMSXX_TRACE_SCOPE("kms", "page_flip");
+
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT;
+
+	if (async && card().has_async_page_flip()) {
+		int r = card().backend().page_flip(id(), fb.id(), flags | DRM_MODE_PAGE_FLIP_ASYNC, data);
+
+		// The driver may refuse async flips for some configurations
+		if (r != -EINVAL)
+			return r;
+	}
+
+	return card().backend().page_flip(id(), fb.id(), flags, data);
+}
+
+int Crtc::get_sequence(uint64_t& seq, uint64_t& ns)
 {
-	return drmModePageFlip(card().fd(), id(), fb.id(), DRM_MODE_PAGE_FLIP_EVENT, data);
+	return card().backend().get_sequence(id(), idx(), &seq, &ns);
 }
 
 uint32_t Crtc::buffer_id() const
@@ -11,6 +11,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -36,7 +38,7 @@ DmabufFramebuffer::DmabufFramebuffer(Card& card, uint32_t width, uint32_t height
 
 		plane.prime_fd = fds[i];
 
-		r = drmPrimeFDToHandle(card.fd(), fds[i], &plane.handle);
+		r = card.backend().prime_fd_to_handle(fds[i], &plane.handle);
 		if (r)
 			throw invalid_argument(string("drmPrimeFDToHandle: ") + strerror(errno));
 
@@ -53,25 +55,39 @@ DmabufFramebuffer::DmabufFramebuffer(Card& card, uint32_t width, uint32_t height
 	offsets.resize(4);
 
 	if (modifiers.empty()) {
-		r = drmModeAddFB2(card.fd(), width, height, (uint32_t)format,
-				  bo_handles, pitches.data(), offsets.data(), &id, 0);
+		r = card.backend().add_fb(width, height, (uint32_t)format,
+					  bo_handles, pitches.data(), offsets.data(), nullptr, &id);
 		if (r)
 			throw invalid_argument(string("drmModeAddFB2 failed: ") + strerror(errno));
 	}
 	else {
 		modifiers.resize(4);
-		r = drmModeAddFB2WithModifiers(card.fd(), width, height, (uint32_t)format,
-					       bo_handles, pitches.data(), offsets.data(), modifiers.data(), &id, DRM_MODE_FB_MODIFIERS);
+		r = card.backend().add_fb(width, height, (uint32_t)format,
+					  bo_handles, pitches.data(), offsets.data(), modifiers.data(), &id);
 		if (r)
 			throw invalid_argument(string("drmModeAddFB2WithModifiers failed: ") + strerror(errno));
 	}
 
 	set_id(id);
+
+	for (unsigned i = 0; i < m_num_planes; ++i)
+		card_stats().dmabuf_bytes += m_planes[i].size;
 }
 
 DmabufFramebuffer::~DmabufFramebuffer()
 {
-	drmModeRmFB(card().fd(), id());
+	card().backend().rm_fb(id());
+
+	for (unsigned i = 0; i < m_num_planes; ++i) {
+		FramebufferPlane& plane = m_planes.at(i);
+
+		if (plane.map) {
+			munmap(plane.map, plane.size);
+			card_stats().mapped_bytes -= plane.size;
+		}
+
+		card_stats().dmabuf_bytes -= plane.size;
+	}
 }
 
 uint8_t* DmabufFramebuffer::map(unsigned plane)
@@ -81,10 +97,16 @@ uint8_t* DmabufFramebuffer::map(unsigned plane)
 	if (p.map)
 		return p.map;
 
+	KMSXX_TRACE_SCOPE("kms", "map");
+
 	p.map = (uint8_t *)mmap(0, p.size, PROT_READ | PROT_WRITE, MAP_SHARED,
 				p.prime_fd, 0);
-	if (p.map == MAP_FAILED)
+	if (p.map == MAP_FAILED) {
+		p.map = 0;
 		throw invalid_argument(string("mmap failed: ") + strerror(errno));
+	}
+
+	card_stats().mapped_bytes += p.size;
 
 	return p.map;
 }
@@ -98,6 +120,8 @@ int DmabufFramebuffer::prime_fd(unsigned plane)
 
 void DmabufFramebuffer::begin_cpu_access(CpuAccess access)
 {
+	KMSXX_TRACE_SCOPE("kms", "begin_cpu_access");
+
 	if (m_sync_flags != 0)
 		throw runtime_error("begin_cpu sync already started");
 
@@ -126,6 +150,8 @@ void DmabufFramebuffer::begin_cpu_access(CpuAccess access)
 
 void DmabufFramebuffer::end_cpu_access()
 {
+	KMSXX_TRACE_SCOPE("kms", "end_cpu_access");
+
 	if (m_sync_flags == 0)
 		throw runtime_error("begin_cpu sync not started");
 
@@ -0,0 +1,249 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm.h>
+#include <drm_mode.h>
+
+#include "cardbackend.h"
+
+#ifndef DRM_CLIENT_CAP_ATOMIC
+
+#define DRM_MODE_ATOMIC_TEST_ONLY 0
+#define DRM_MODE_ATOMIC_NONBLOCK 0
+
+struct _drmModeAtomicReq;
+typedef struct _drmModeAtomicReq* drmModeAtomicReqPtr;
+
+static inline drmModeAtomicReqPtr drmModeAtomicAlloc() { return 0; }
+static inline void drmModeAtomicFree(drmModeAtomicReqPtr) { }
+static inline int drmModeAtomicAddProperty(drmModeAtomicReqPtr, uint32_t, uint32_t, uint64_t) { return 0; }
+static inline int drmModeAtomicCommit(int, drmModeAtomicReqPtr, int, void*) { return 0; }
+
+#endif // DRM_CLIENT_CAP_ATOMIC
+
+using namespace std;
+
+namespace kms
+{
+
+// Passes everything through to libdrm
+class DrmBackend : public CardBackend
+{
+public:
+	DrmBackend(int fd)
+		: m_fd(fd)
+	{
+		struct stat stats;
+
+		int r = fstat(m_fd, &stats);
+		if (r < 0) {
+			int err = errno;
+			close(m_fd);
+			throw invalid_argument("Can't stat device (" + string(strerror(err)) + ")");
+		}
+
+		m_minor = minor(stats.st_dev);
+	}
+
+	~DrmBackend() override
+	{
+		close(m_fd);
+	}
+
+	int fd() const override { return m_fd; }
+	unsigned int dev_minor() const override { return m_minor; }
+
+	drmVersionPtr get_version() override { return drmGetVersion(m_fd); }
+	void free_version(drmVersionPtr ver) override { drmFreeVersion(ver); }
+
+	int set_master() override { return drmSetMaster(m_fd); }
+	int drop_master() override { return drmDropMaster(m_fd); }
+	int set_client_cap(uint64_t cap, uint64_t value) override { return drmSetClientCap(m_fd, cap, value); }
+	int get_cap(uint64_t cap, uint64_t* value) override { return drmGetCap(m_fd, cap, value); }
+
+	drmModeResPtr get_resources() override { return drmModeGetResources(m_fd); }
+	void free_resources(drmModeResPtr res) override { drmModeFreeResources(res); }
+	drmModePlaneResPtr get_plane_resources() override { return drmModeGetPlaneResources(m_fd); }
+	void free_plane_resources(drmModePlaneResPtr res) override { drmModeFreePlaneResources(res); }
+
+	drmModeConnectorPtr get_connector(uint32_t id) override { return drmModeGetConnector(m_fd, id); }
+	void free_connector(drmModeConnectorPtr conn) override { drmModeFreeConnector(conn); }
+	drmModeEncoderPtr get_encoder(uint32_t id) override { return drmModeGetEncoder(m_fd, id); }
+	void free_encoder(drmModeEncoderPtr enc) override { drmModeFreeEncoder(enc); }
+	drmModeCrtcPtr get_crtc(uint32_t id) override { return drmModeGetCrtc(m_fd, id); }
+	void free_crtc(drmModeCrtcPtr crtc) override { drmModeFreeCrtc(crtc); }
+	drmModePlanePtr get_plane(uint32_t id) override { return drmModeGetPlane(m_fd, id); }
+	void free_plane(drmModePlanePtr plane) override { drmModeFreePlane(plane); }
+	drmModeFBPtr get_fb(uint32_t id) override { return drmModeGetFB(m_fd, id); }
+	void free_fb(drmModeFBPtr fb) override { drmModeFreeFB(fb); }
+
+	drmModePropertyPtr get_property(uint32_t id) override { return drmModeGetProperty(m_fd, id); }
+	void free_property(drmModePropertyPtr prop) override { drmModeFreeProperty(prop); }
+
+	drmModeObjectPropertiesPtr get_object_properties(uint32_t id, uint32_t type) override
+	{
+		return drmModeObjectGetProperties(m_fd, id, type);
+	}
+
+	void free_object_properties(drmModeObjectPropertiesPtr props) override { drmModeFreeObjectProperties(props); }
+
+	int set_object_property(uint32_t id, uint32_t type, uint32_t prop_id, uint64_t value) override
+	{
+		return drmModeObjectSetProperty(m_fd, id, type, prop_id, value);
+	}
+
+	drmModePropertyBlobPtr get_blob(uint32_t id) override { return drmModeGetPropertyBlob(m_fd, id); }
+	void free_blob(drmModePropertyBlobPtr blob) override { drmModeFreePropertyBlob(blob); }
+	int create_blob(const void* data, size_t len, uint32_t* id) override { return drmModeCreatePropertyBlob(m_fd, data, len, id); }
+	int destroy_blob(uint32_t id) override { return drmModeDestroyPropertyBlob(m_fd, id); }
+
+	int set_crtc(uint32_t crtc_id, uint32_t fb_id, uint32_t x, uint32_t y,
+		     uint32_t* connectors, int count, drmModeModeInfoPtr mode) override
+	{
+		return drmModeSetCrtc(m_fd, crtc_id, fb_id, x, y, connectors, count, mode);
+	}
+
+	int set_plane(uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+		      int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+		      uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h) override
+	{
+		return drmModeSetPlane(m_fd, plane_id, crtc_id, fb_id, flags,
+				       crtc_x, crtc_y, crtc_w, crtc_h,
+				       src_x, src_y, src_w, src_h);
+	}
+
+	int page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void* data) override
+	{
+		return drmModePageFlip(m_fd, crtc_id, fb_id, flags, data);
+	}
+
+	int get_sequence(uint32_t crtc_id, uint32_t crtc_idx, uint64_t* seq, uint64_t* ns) override
+	{
+#ifdef DRM_IOCTL_CRTC_GET_SEQUENCE
+		if (drmCrtcGetSequence(m_fd, crtc_id, seq, ns) == 0)
+			return 0;
+#endif
+
+		drmVBlank vbl { };
+		vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE |
+						      ((crtc_idx << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK));
+		vbl.request.sequence = 0;
+
+		if (drmWaitVBlank(m_fd, &vbl))
+			return -errno;
+
+		*seq = vbl.reply.sequence;
+		*ns = vbl.reply.tval_sec * 1000000000ull + vbl.reply.tval_usec * 1000ull;
+
+		return 0;
+	}
+
+	int atomic_commit(const vector<AtomicReq::Prop>& props, uint32_t flags, void* data) override
+	{
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+		if (!req)
+			return -ENOMEM;
+
+		for (const AtomicReq::Prop& p : props) {
+			int r = drmModeAtomicAddProperty(req, p.ob_id, p.prop_id, p.value);
+			if (r < 0) {
+				drmModeAtomicFree(req);
+				return r;
+			}
+		}
+
+		int r = drmModeAtomicCommit(m_fd, req, flags, data);
+
+		drmModeAtomicFree(req);
+
+		return r;
+	}
+
+	int handle_event(drmEventContext* ev) override { return drmHandleEvent(m_fd, ev); }
+
+	int add_fb(uint32_t width, uint32_t height, uint32_t format,
+		   const uint32_t handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+		   const uint64_t modifiers[4], uint32_t* id) override
+	{
+		if (!modifiers)
+			return drmModeAddFB2(m_fd, width, height, format, handles, pitches, offsets, id, 0);
+
+		return drmModeAddFB2WithModifiers(m_fd, width, height, format, handles, pitches, offsets,
+						  modifiers, id, DRM_MODE_FB_MODIFIERS);
+	}
+
+	int rm_fb(uint32_t id) override { return drmModeRmFB(m_fd, id); }
+
+	int dirty_fb(uint32_t id, drmModeClipPtr clips, uint32_t num_clips) override
+	{
+		return drmModeDirtyFB(m_fd, id, clips, num_clips);
+	}
+
+	int create_dumb(uint32_t width, uint32_t height, uint32_t bpp,
+			uint32_t* handle, uint32_t* pitch, uint64_t* size) override
+	{
+		struct drm_mode_create_dumb creq = drm_mode_create_dumb();
+		creq.width = width;
+		creq.height = height;
+		creq.bpp = bpp;
+
+		int r = drmIoctl(m_fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+		if (r)
+			return -errno;
+
+		*handle = creq.handle;
+		*pitch = creq.pitch;
+		*size = creq.size;
+
+		return 0;
+	}
+
+	int destroy_dumb(uint32_t handle) override
+	{
+		struct drm_mode_destroy_dumb dreq = drm_mode_destroy_dumb();
+		dreq.handle = handle;
+
+		return drmIoctl(m_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq) ? -errno : 0;
+	}
+
+	void* map_dumb(uint32_t handle, size_t size) override
+	{
+		struct drm_mode_map_dumb mreq = drm_mode_map_dumb();
+		mreq.handle = handle;
+
+		int r = drmIoctl(m_fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+		if (r)
+			return MAP_FAILED;
+
+		return mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, mreq.offset);
+	}
+
+	int prime_handle_to_fd(uint32_t handle, uint32_t flags, int* fd) override
+	{
+		return drmPrimeHandleToFD(m_fd, handle, flags, fd);
+	}
+
+	int prime_fd_to_handle(int fd, uint32_t* handle) override
+	{
+		return drmPrimeFDToHandle(m_fd, fd, handle);
+	}
+
+private:
+	int m_fd;
+	unsigned int m_minor;
+};
+
+unique_ptr<CardBackend> create_drm_backend(int fd)
+{
+	return unique_ptr<CardBackend>(new DrmBackend(fd));
+}
+
+}
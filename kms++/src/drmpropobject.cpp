@@ -7,6 +7,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -30,7 +32,7 @@ DrmPropObject::~DrmPropObject()
 
 void DrmPropObject::refresh_props()
 {
-	auto props = drmModeObjectGetProperties(card().fd(), this->id(), this->object_type());
+	auto props = card().backend().get_object_properties(this->id(), this->object_type());
 
 	if (props == nullptr)
 		return;
@@ -42,7 +44,7 @@ void DrmPropObject::refresh_props()
 		m_prop_values[prop_id] = prop_value;
 	}
 
-	drmModeFreeObjectProperties(props);
+	card().backend().free_object_properties(props);
 }
 
 Property* DrmPropObject::get_prop(const string& name) const
@@ -82,12 +84,12 @@ unique_ptr<Blob> DrmPropObject::get_prop_value_as_blob(const string& name) const
 
 int DrmPropObject::set_prop_value(Property* prop, uint64_t value)
 {
-	return drmModeObjectSetProperty(card().fd(), this->id(), this->object_type(), prop->id(), value);
+	return card().backend().set_object_property(this->id(), this->object_type(), prop->id(), value);
 }
 
 int DrmPropObject::set_prop_value(uint32_t id, uint64_t value)
 {
-	return drmModeObjectSetProperty(card().fd(), this->id(), this->object_type(), id, value);
+	return card().backend().set_object_property(this->id(), this->object_type(), id, value);
 }
 
 int DrmPropObject::set_prop_value(const string &name, uint64_t value)
@@ -13,6 +13,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 using namespace std;
@@ -39,9 +41,8 @@ DumbFramebuffer::DumbFramebuffer(Card& card, uint32_t width, uint32_t height, Pi
 		FramebufferPlane& plane = m_planes.at(i);
 
 		/* create dumb buffer */
-		struct drm_mode_create_dumb creq = drm_mode_create_dumb();
-		creq.width = width;
-		creq.height = height / pi.ysub;
+		uint32_t plane_width = width;
+		uint32_t plane_height = height / pi.ysub;
 		/*
 		 * For fully planar YUV buffers, the chroma planes don't combine
 		 * U and V components, their width must thus be divided by the
@@ -49,15 +50,14 @@ DumbFramebuffer::DumbFramebuffer(Card& card, uint32_t width, uint32_t height, Pi
 		 */
 		if (format_info.type == PixelColorType::YUV &&
 		    format_info.num_planes == 3)
-			creq.width /= pi.xsub;
-		creq.bpp = pi.bitspp;
-		r = drmIoctl(card.fd(), DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+			plane_width /= pi.xsub;
+		uint64_t size;
+		r = card.backend().create_dumb(plane_width, plane_height, pi.bitspp,
+					       &plane.handle, &plane.stride, &size);
 		if (r)
 			throw invalid_argument(string("DRM_IOCTL_MODE_CREATE_DUMB failed: ") + strerror(errno));
 
-		plane.handle = creq.handle;
-		plane.stride = creq.pitch;
-		plane.size = creq.height * creq.pitch;
+		plane.size = plane_height * plane.stride;
 		plane.offset = 0;
 		plane.map = 0;
 		plane.prime_fd = -1;
@@ -77,30 +77,35 @@ DumbFramebuffer::DumbFramebuffer(Card& card, uint32_t width, uint32_t height, Pi
 		m_planes[2].offset, m_planes[3].offset,
 	};
 	uint32_t id;
-	r = drmModeAddFB2(card.fd(), width, height, (uint32_t)format,
-			  bo_handles, pitches, offsets, &id, 0);
+	r = card.backend().add_fb(width, height, (uint32_t)format,
+				  bo_handles, pitches, offsets, nullptr, &id);
 	if (r)
 		throw invalid_argument(string("drmModeAddFB2 failed: ") + strerror(errno));
 
 	set_id(id);
+
+	for (unsigned i = 0; i < m_num_planes; ++i)
+		card_stats().dumb_bytes += m_planes[i].size;
 }
 
 DumbFramebuffer::~DumbFramebuffer()
 {
 	/* delete framebuffer */
-	drmModeRmFB(card().fd(), id());
+	card().backend().rm_fb(id());
 
 	for (uint i = 0; i < m_num_planes; ++i) {
 		FramebufferPlane& plane = m_planes.at(i);
 
 		/* unmap buffer */
-		if (plane.map)
+		if (plane.map) {
+			KMSXX_TRACE_SCOPE("kms", "unmap");
 			munmap(plane.map, plane.size);
+			card_stats().mapped_bytes -= plane.size;
+		}
 
 		/* delete dumb buffer */
-		struct drm_mode_destroy_dumb dreq = drm_mode_destroy_dumb();
-		dreq.handle = plane.handle;
-		drmIoctl(card().fd(), DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+		card().backend().destroy_dumb(plane.handle);
+		card_stats().dumb_bytes -= plane.size;
 		if (plane.prime_fd >= 0)
 			::close(plane.prime_fd);
 	}
@@ -113,18 +118,15 @@ uint8_t* DumbFramebuffer::map(unsigned plane)
 	if (p.map)
 		return p.map;
 
-	/* prepare buffer for memory mapping */
-	struct drm_mode_map_dumb mreq = drm_mode_map_dumb();
-	mreq.handle = p.handle;
-	int r = drmIoctl(card().fd(), DRM_IOCTL_MODE_MAP_DUMB, &mreq);
-	if (r)
-		throw invalid_argument(string("DRM_IOCTL_MODE_MAP_DUMB failed: ") + strerror(errno));
+	KMSXX_TRACE_SCOPE("kms", "map");
 
-	/* perform actual memory mapping */
-	p.map = (uint8_t *)mmap(0, p.size, PROT_READ | PROT_WRITE, MAP_SHARED,
-					  card().fd(), mreq.offset);
-	if (p.map == MAP_FAILED)
+	p.map = (uint8_t *)card().backend().map_dumb(p.handle, p.size);
+	if (p.map == MAP_FAILED) {
+		p.map = 0;
 		throw invalid_argument(string("mmap failed: ") + strerror(errno));
+	}
+
+	card_stats().mapped_bytes += p.size;
 
 	return p.map;
 }
@@ -134,8 +136,8 @@ int DumbFramebuffer::prime_fd(unsigned int plane)
 	if (m_planes.at(plane).prime_fd >= 0)
 		return m_planes.at(plane).prime_fd;
 
-	int r = drmPrimeHandleToFD(card().fd(), m_planes.at(plane).handle,
-				   DRM_CLOEXEC | O_RDWR, &m_planes.at(plane).prime_fd);
+	int r = card().backend().prime_handle_to_fd(m_planes.at(plane).handle,
+						    DRM_CLOEXEC | O_RDWR, &m_planes.at(plane).prime_fd);
 	if (r)
 		throw std::runtime_error("drmPrimeHandleToFD failed");
 
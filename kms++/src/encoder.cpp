@@ -8,6 +8,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -36,21 +38,21 @@ Encoder::Encoder(Card &card, uint32_t id, uint32_t idx)
 	:DrmPropObject(card, id, DRM_MODE_OBJECT_ENCODER, idx)
 {
 	m_priv = new EncoderPriv();
-	m_priv->drm_encoder = drmModeGetEncoder(this->card().fd(), this->id());
+	m_priv->drm_encoder = this->card().backend().get_encoder(this->id());
 	assert(m_priv->drm_encoder);
 }
 
 Encoder::~Encoder()
 {
-	drmModeFreeEncoder(m_priv->drm_encoder);
+	card().backend().free_encoder(m_priv->drm_encoder);
 	delete m_priv;
 }
 
 void Encoder::refresh()
 {
-	drmModeFreeEncoder(m_priv->drm_encoder);
+	card().backend().free_encoder(m_priv->drm_encoder);
 
-	m_priv->drm_encoder = drmModeGetEncoder(this->card().fd(), this->id());
+	m_priv->drm_encoder = this->card().backend().get_encoder(this->id());
 	assert(m_priv->drm_encoder);
 }
 
@@ -9,6 +9,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -45,11 +47,11 @@ ExtFramebuffer::ExtFramebuffer(Card& card, uint32_t width, uint32_t height, Pixe
 	int r;
 
 	if (modifiers.empty()) {
-		r = drmModeAddFB2(card.fd(), width, height, (uint32_t)format, handles.data(), pitches.data(), offsets.data(), &id, 0);
+		r = card.backend().add_fb(width, height, (uint32_t)format, handles.data(), pitches.data(), offsets.data(), nullptr, &id);
 	}
 	else {
 		modifiers.resize(4);
-		r = drmModeAddFB2WithModifiers(card.fd(), width, height, (uint32_t)format, handles.data(), pitches.data(), offsets.data(), modifiers.data(), &id, DRM_MODE_FB_MODIFIERS);
+		r = card.backend().add_fb(width, height, (uint32_t)format, handles.data(), pitches.data(), offsets.data(), modifiers.data(), &id);
 	}
 
 	if (r)
@@ -60,7 +62,7 @@ ExtFramebuffer::ExtFramebuffer(Card& card, uint32_t width, uint32_t height, Pixe
 
 ExtFramebuffer::~ExtFramebuffer()
 {
-	drmModeRmFB(card().fd(), id());
+	card().backend().rm_fb(id());
 }
 
 }
@@ -7,6 +7,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -21,13 +23,13 @@ Framebuffer::Framebuffer(Card& card, uint32_t width, uint32_t height)
 Framebuffer::Framebuffer(Card& card, uint32_t id)
 	: DrmObject(card, id, DRM_MODE_OBJECT_FB)
 {
-	auto fb = drmModeGetFB(card.fd(), id);
+	auto fb = card.backend().get_fb(id);
 
 	if (fb) {
 		m_width = fb->width;
 		m_height = fb->height;
 
-		drmModeFreeFB(fb);
+		card.backend().free_fb(fb);
 	} else {
 		m_width = m_height = 0;
 	}
@@ -35,6 +37,11 @@ Framebuffer::Framebuffer(Card& card, uint32_t id)
 	card.m_framebuffers.push_back(this);
 }
 
+CardStats& Framebuffer::card_stats() const
+{
+	return card().m_stats;
+}
+
 void Framebuffer::flush()
 {
 	drmModeClip clip { };
@@ -42,7 +49,7 @@ void Framebuffer::flush()
 	clip.x2 = width();
 	clip.y2 = height();
 
-	drmModeDirtyFB(card().fd(), id(), &clip, 1);
+	card().backend().dirty_fb(id(), &clip, 1);
 }
 
 Framebuffer::~Framebuffer()
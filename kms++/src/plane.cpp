@@ -9,6 +9,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -23,13 +25,13 @@ Plane::Plane(Card &card, uint32_t id, uint32_t idx)
 	:DrmPropObject(card, id, DRM_MODE_OBJECT_PLANE, idx)
 {
 	m_priv = new PlanePriv();
-	m_priv->drm_plane = drmModeGetPlane(this->card().fd(), this->id());
+	m_priv->drm_plane = this->card().backend().get_plane(this->id());
 	assert(m_priv->drm_plane);
 }
 
 Plane::~Plane()
 {
-	drmModeFreePlane(m_priv->drm_plane);
+	card().backend().free_plane(m_priv->drm_plane);
 	delete m_priv;
 }
 
@@ -3,6 +3,8 @@
 
 #include <kms++/kms++.h>
 
+#include "cardbackend.h"
+
 using namespace std;
 
 namespace kms
@@ -17,7 +19,7 @@ Property::Property(Card& card, uint32_t id)
 	: DrmObject(card, id, DRM_MODE_OBJECT_PROPERTY)
 {
 	m_priv = new PropertyPriv();
-	m_priv->drm_prop = drmModeGetProperty(card.fd(), id);
+	m_priv->drm_prop = card.backend().get_property(id);
 	m_name = m_priv->drm_prop->name;
 
 	PropertyType t;
@@ -42,7 +44,7 @@ Property::Property(Card& card, uint32_t id)
 
 Property::~Property()
 {
-	drmModeFreeProperty(m_priv->drm_prop);
+	card().backend().free_property(m_priv->drm_prop);
 	delete m_priv;
 }
 
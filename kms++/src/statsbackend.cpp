@@ -0,0 +1,166 @@
+#include <sys/mman.h>
+
+#include <kms++/kms++.h>
+
+#include "cardbackend.h"
+
+using namespace std;
+
+namespace kms
+{
+
+// Passes everything through to another backend, counting the calls
+class StatsBackend : public CardBackend
+{
+public:
+	StatsBackend(unique_ptr<CardBackend> backend, CardStats& stats)
+		: m_be(move(backend)), m_stats(stats)
+	{
+	}
+
+	int fd() const override { return m_be->fd(); }
+	unsigned int dev_minor() const override { return m_be->dev_minor(); }
+
+	drmVersionPtr get_version() override { return count_ptr(m_stats.other_ioctls, m_be->get_version()); }
+	void free_version(drmVersionPtr ver) override { m_be->free_version(ver); }
+
+	int set_master() override { return count(m_stats.other_ioctls, m_be->set_master()); }
+	int drop_master() override { return count(m_stats.other_ioctls, m_be->drop_master()); }
+	int set_client_cap(uint64_t cap, uint64_t value) override { return count(m_stats.other_ioctls, m_be->set_client_cap(cap, value)); }
+	int get_cap(uint64_t cap, uint64_t* value) override { return count(m_stats.other_ioctls, m_be->get_cap(cap, value)); }
+
+	drmModeResPtr get_resources() override { return count_ptr(m_stats.resource_gets, m_be->get_resources()); }
+	void free_resources(drmModeResPtr res) override { m_be->free_resources(res); }
+	drmModePlaneResPtr get_plane_resources() override { return count_ptr(m_stats.resource_gets, m_be->get_plane_resources()); }
+	void free_plane_resources(drmModePlaneResPtr res) override { m_be->free_plane_resources(res); }
+
+	drmModeConnectorPtr get_connector(uint32_t id) override { return count_ptr(m_stats.resource_gets, m_be->get_connector(id)); }
+	void free_connector(drmModeConnectorPtr conn) override { m_be->free_connector(conn); }
+	drmModeEncoderPtr get_encoder(uint32_t id) override { return count_ptr(m_stats.resource_gets, m_be->get_encoder(id)); }
+	void free_encoder(drmModeEncoderPtr enc) override { m_be->free_encoder(enc); }
+	drmModeCrtcPtr get_crtc(uint32_t id) override { return count_ptr(m_stats.resource_gets, m_be->get_crtc(id)); }
+	void free_crtc(drmModeCrtcPtr crtc) override { m_be->free_crtc(crtc); }
+	drmModePlanePtr get_plane(uint32_t id) override { return count_ptr(m_stats.resource_gets, m_be->get_plane(id)); }
+	void free_plane(drmModePlanePtr plane) override { m_be->free_plane(plane); }
+	drmModeFBPtr get_fb(uint32_t id) override { return count_ptr(m_stats.resource_gets, m_be->get_fb(id)); }
+	void free_fb(drmModeFBPtr fb) override { m_be->free_fb(fb); }
+
+	drmModePropertyPtr get_property(uint32_t id) override { return count_ptr(m_stats.prop_gets, m_be->get_property(id)); }
+	void free_property(drmModePropertyPtr prop) override { m_be->free_property(prop); }
+	drmModeObjectPropertiesPtr get_object_properties(uint32_t id, uint32_t type) override
+	{
+		return count_ptr(m_stats.prop_gets, m_be->get_object_properties(id, type));
+	}
+	void free_object_properties(drmModeObjectPropertiesPtr props) override { m_be->free_object_properties(props); }
+	int set_object_property(uint32_t id, uint32_t type, uint32_t prop_id, uint64_t value) override
+	{
+		return count(m_stats.prop_sets, m_be->set_object_property(id, type, prop_id, value));
+	}
+
+	drmModePropertyBlobPtr get_blob(uint32_t id) override { return count_ptr(m_stats.prop_gets, m_be->get_blob(id)); }
+	void free_blob(drmModePropertyBlobPtr blob) override { m_be->free_blob(blob); }
+	int create_blob(const void* data, size_t len, uint32_t* id) override { return count(m_stats.blob_creates, m_be->create_blob(data, len, id)); }
+	int destroy_blob(uint32_t id) override { return count(m_stats.blob_destroys, m_be->destroy_blob(id)); }
+
+	int set_crtc(uint32_t crtc_id, uint32_t fb_id, uint32_t x, uint32_t y,
+		     uint32_t* connectors, int count_conns, drmModeModeInfoPtr mode) override
+	{
+		return count(m_stats.legacy_commits, m_be->set_crtc(crtc_id, fb_id, x, y, connectors, count_conns, mode));
+	}
+
+	int set_plane(uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+		      int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+		      uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h) override
+	{
+		return count(m_stats.legacy_commits, m_be->set_plane(plane_id, crtc_id, fb_id, flags,
+								     crtc_x, crtc_y, crtc_w, crtc_h,
+								     src_x, src_y, src_w, src_h));
+	}
+
+	int page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void* data) override
+	{
+		return count(m_stats.legacy_commits, m_be->page_flip(crtc_id, fb_id, flags, data));
+	}
+
+	int get_sequence(uint32_t crtc_id, uint32_t crtc_idx, uint64_t* seq, uint64_t* ns) override
+	{
+		return count(m_stats.vblank_queries, m_be->get_sequence(crtc_id, crtc_idx, seq, ns));
+	}
+
+	int atomic_commit(const vector<AtomicReq::Prop>& props, uint32_t flags, void* data) override
+	{
+		return count(m_stats.atomic_commits, m_be->atomic_commit(props, flags, data));
+	}
+
+	int handle_event(drmEventContext* ev) override { return m_be->handle_event(ev); }
+
+	int add_fb(uint32_t width, uint32_t height, uint32_t format,
+		   const uint32_t handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+		   const uint64_t modifiers[4], uint32_t* id) override
+	{
+		return count(m_stats.fb_adds, m_be->add_fb(width, height, format, handles, pitches, offsets, modifiers, id));
+	}
+
+	int rm_fb(uint32_t id) override { return count(m_stats.fb_removes, m_be->rm_fb(id)); }
+	int dirty_fb(uint32_t id, drmModeClipPtr clips, uint32_t num_clips) override
+	{
+		return count(m_stats.other_ioctls, m_be->dirty_fb(id, clips, num_clips));
+	}
+
+	int create_dumb(uint32_t width, uint32_t height, uint32_t bpp,
+			uint32_t* handle, uint32_t* pitch, uint64_t* size) override
+	{
+		return count(m_stats.dumb_creates, m_be->create_dumb(width, height, bpp, handle, pitch, size));
+	}
+
+	int destroy_dumb(uint32_t handle) override { return count(m_stats.dumb_destroys, m_be->destroy_dumb(handle)); }
+
+	void* map_dumb(uint32_t handle, size_t size) override
+	{
+		void* p = m_be->map_dumb(handle, size);
+
+		m_stats.dumb_maps++;
+		if (p == MAP_FAILED)
+			m_stats.failed_ioctls++;
+
+		return p;
+	}
+
+	int prime_handle_to_fd(uint32_t handle, uint32_t flags, int* fd) override
+	{
+		return count(m_stats.prime_exports, m_be->prime_handle_to_fd(handle, flags, fd));
+	}
+
+	int prime_fd_to_handle(int fd, uint32_t* handle) override
+	{
+		return count(m_stats.prime_imports, m_be->prime_fd_to_handle(fd, handle));
+	}
+
+private:
+	int count(atomic<uint64_t>& counter, int r)
+	{
+		counter++;
+		if (r)
+			m_stats.failed_ioctls++;
+		return r;
+	}
+
+	template<typename T>
+	T* count_ptr(atomic<uint64_t>& counter, T* p)
+	{
+		counter++;
+		if (!p)
+			m_stats.failed_ioctls++;
+		return p;
+	}
+
+	unique_ptr<CardBackend> m_be;
+	CardStats& m_stats;
+};
+
+unique_ptr<CardBackend> create_stats_backend(unique_ptr<CardBackend> backend, CardStats& stats)
+{
+	return unique_ptr<CardBackend>(new StatsBackend(move(backend), stats));
+}
+
+}
@@ -0,0 +1,291 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kms++/trace.h>
+
+using namespace std;
+
+namespace kms
+{
+
+struct TraceEvent
+{
+	const char* cat;
+	const char* name;
+	uint64_t ts;
+	// duration for complete events, the value for instant and counter events
+	uint64_t val;
+	pid_t tid;
+	char phase;
+};
+
+// Single writer ring. The owning thread is the only one to advance head, the
+// readers only advance tail. The lock keeps a reader from copying an event
+// while it is being written, and is otherwise only taken by the owner, so it
+// is uncontended.
+//
+// The rings are recycled when their thread exits, as e.g. the test pattern
+// drawing creates new worker threads for every frame.
+struct TraceRing
+{
+	static const size_t size = 1 << 15;
+
+	TraceRing() : events(size), head(0), tail(0), in_use(false) { }
+
+	mutex lock;
+	vector<TraceEvent> events;
+	atomic<uint64_t> head;
+	atomic<uint64_t> tail;
+
+	// protected by TraceState::lock
+	bool in_use;
+};
+
+struct TraceState;
+static int write_json(TraceState& state, const string& filename);
+
+struct TraceState
+{
+	~TraceState()
+	{
+		if (!filename.empty())
+			write_json(*this, filename);
+	}
+
+	mutex lock;
+	vector<unique_ptr<TraceRing>> rings;
+	map<pid_t, string> thread_names;
+	string filename;
+};
+
+static TraceState& trace_state()
+{
+	static TraceState state;
+	return state;
+}
+
+static bool trace_init()
+{
+#ifndef KMSXX_TRACE_ENABLED
+	// No trace points to record
+	return false;
+#endif
+
+	const char* filename = getenv("KMSXX_TRACE");
+
+	if (!filename || !filename[0])
+		return false;
+
+	trace_state().filename = filename;
+
+	return true;
+}
+
+static atomic<bool> s_enabled { trace_init() };
+
+struct TraceThread
+{
+	~TraceThread()
+	{
+		if (!ring)
+			return;
+
+		TraceState& state = trace_state();
+		lock_guard<mutex> lock(state.lock);
+
+		ring->in_use = false;
+	}
+
+	TraceRing* ring = nullptr;
+	pid_t tid = 0;
+};
+
+static thread_local TraceThread t_thread;
+
+static TraceRing* trace_ring()
+{
+	if (t_thread.ring)
+		return t_thread.ring;
+
+	t_thread.tid = syscall(SYS_gettid);
+
+	char name[16] { };
+	pthread_getname_np(pthread_self(), name, sizeof(name));
+
+	TraceState& state = trace_state();
+	lock_guard<mutex> lock(state.lock);
+
+	state.thread_names[t_thread.tid] = name;
+
+	for (auto& ring : state.rings) {
+		if (!ring->in_use) {
+			t_thread.ring = ring.get();
+			break;
+		}
+	}
+
+	if (!t_thread.ring) {
+		state.rings.push_back(unique_ptr<TraceRing>(new TraceRing()));
+		t_thread.ring = state.rings.back().get();
+	}
+
+	t_thread.ring->in_use = true;
+
+	return t_thread.ring;
+}
+
+static void trace_add(const char* cat, const char* name, uint64_t ts, uint64_t val, char phase)
+{
+	TraceRing* ring = trace_ring();
+
+	lock_guard<mutex> lock(ring->lock);
+
+	uint64_t head = ring->head.load(memory_order_relaxed);
+
+	ring->events[head % TraceRing::size] = TraceEvent { cat, name, ts, val, t_thread.tid, phase };
+
+	ring->head.store(head + 1, memory_order_release);
+}
+
+bool trace_enabled()
+{
+	return s_enabled.load(memory_order_relaxed);
+}
+
+void trace_set_enabled(bool enable)
+{
+	s_enabled.store(enable, memory_order_relaxed);
+}
+
+uint64_t trace_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_complete(const char* cat, const char* name, uint64_t start_ns, uint64_t end_ns)
+{
+	trace_add(cat, name, start_ns, end_ns - start_ns, 'X');
+}
+
+void trace_instant(const char* cat, const char* name, uint64_t arg)
+{
+	trace_add(cat, name, trace_now_ns(), arg, 'i');
+}
+
+void trace_counter(const char* cat, const char* name, int64_t value)
+{
+	trace_add(cat, name, trace_now_ns(), (uint64_t)value, 'C');
+}
+
+static string json_escape(const string& str)
+{
+	string s;
+
+	for (char c : str) {
+		if (c == '"' || c == '\\')
+			s += '\\';
+
+		if ((unsigned char)c < 0x20)
+			continue;
+
+		s += c;
+	}
+
+	return s;
+}
+
+static int write_json(TraceState& state, const string& filename)
+{
+	FILE* f = fopen(filename.c_str(), "w");
+	if (!f)
+		return -errno;
+
+	lock_guard<mutex> lock(state.lock);
+
+	pid_t pid = getpid();
+	bool first = true;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (auto& p : state.thread_names) {
+		fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", pid, p.first, json_escape(p.second).c_str());
+		first = false;
+	}
+
+	vector<TraceEvent> events;
+
+	for (auto& ring : state.rings) {
+		// Copy the events, so that the owner isn't blocked while writing
+		{
+			lock_guard<mutex> ring_lock(ring->lock);
+
+			uint64_t head = ring->head.load(memory_order_relaxed);
+			uint64_t tail = ring->tail.load(memory_order_relaxed);
+
+			if (head - tail > TraceRing::size)
+				tail = head - TraceRing::size;
+
+			events.clear();
+			for (uint64_t i = tail; i < head; ++i)
+				events.push_back(ring->events[i % TraceRing::size]);
+		}
+
+		for (const TraceEvent& ev : events) {
+
+			fprintf(f, "%s{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+				first ? "" : ",\n", ev.phase, ev.cat, ev.name, pid, ev.tid, ev.ts / 1000.0);
+			first = false;
+
+			switch (ev.phase) {
+			case 'X':
+				fprintf(f, ",\"dur\":%.3f}", ev.val / 1000.0);
+				break;
+			case 'i':
+				fprintf(f, ",\"s\":\"t\",\"args\":{\"arg\":%llu}}", (unsigned long long)ev.val);
+				break;
+			case 'C':
+				fprintf(f, ",\"args\":{\"value\":%lld}}", (long long)ev.val);
+				break;
+			}
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f))
+		return -errno;
+
+	return 0;
+}
+
+int trace_write_json(const string& filename)
+{
+	return write_json(trace_state(), filename);
+}
+
+void trace_clear()
+{
+	TraceState& state = trace_state();
+	lock_guard<mutex> lock(state.lock);
+
+	for (auto& ring : state.rings) {
+		lock_guard<mutex> ring_lock(ring->lock);
+		ring->tail.store(ring->head.load(memory_order_relaxed), memory_order_relaxed);
+	}
+}
+
+}
@@ -17,6 +17,16 @@ bool Videomode::valid() const
 	return !!clock;
 }
 
+bool Videomode::timings_match(const Videomode& other) const
+{
+	return clock == other.clock &&
+		hdisplay == other.hdisplay && hsync_start == other.hsync_start &&
+		hsync_end == other.hsync_end && htotal == other.htotal && hskew == other.hskew &&
+		vdisplay == other.vdisplay && vsync_start == other.vsync_start &&
+		vsync_end == other.vsync_end && vtotal == other.vtotal && vscan == other.vscan &&
+		flags == other.flags;
+}
+
 unique_ptr<Blob> Videomode::to_blob(Card& card) const
 {
 	drmModeModeInfo drm_mode = video_mode_to_drm_mode(*this);
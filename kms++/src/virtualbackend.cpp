@@ -0,0 +1,1997 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include <kms++/kms++.h>
+#include <kms++/modedb.h>
+#include <kms++/mode_cvt.h>
+
+#include "cardbackend.h"
+#include "helpers.h"
+
+using namespace std;
+
+namespace kms
+{
+
+// An in-process display device for running without display hardware. Each
+// output has a connector, an encoder, a crtc and a primary plane, and the
+// overlay planes can be used on any crtc. Vblanks are simulated from the
+// mode timings, and the page flip events are delivered via a timerfd which
+// is armed for the next pending event.
+
+static const PixelFormat virtual_plane_formats[] = {
+	PixelFormat::XRGB8888,
+	PixelFormat::XBGR8888,
+	PixelFormat::ARGB8888,
+	PixelFormat::ABGR8888,
+	PixelFormat::RGB888,
+	PixelFormat::BGR888,
+	PixelFormat::RGB565,
+	PixelFormat::BGR565,
+	PixelFormat::XRGB2101010,
+	PixelFormat::ARGB2101010,
+	PixelFormat::NV12,
+	PixelFormat::NV21,
+	PixelFormat::NV16,
+	PixelFormat::NV61,
+	PixelFormat::YUV420,
+	PixelFormat::YVU420,
+	PixelFormat::YUYV,
+	PixelFormat::UYVY,
+};
+
+struct VirtualOutputConfig
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t refresh;
+	uint32_t num_overlays;
+};
+
+static vector<VirtualOutputConfig> parse_virtual_config(const string& config)
+{
+	vector<VirtualOutputConfig> outputs;
+
+	if (config.empty())
+		return { { 1920, 1080, 60, 2 } };
+
+	size_t pos = 0;
+
+	while (pos <= config.size()) {
+		size_t end = config.find(',', pos);
+		if (end == string::npos)
+			end = config.size();
+
+		string s = config.substr(pos, end - pos);
+
+		VirtualOutputConfig out { 0, 0, 60, 2 };
+		unsigned w, h, hz, ovls;
+		char c;
+
+		if (sscanf(s.c_str(), "%ux%u@%u+%u%c", &w, &h, &hz, &ovls, &c) == 4) {
+			out = { w, h, hz, ovls };
+		} else if (sscanf(s.c_str(), "%ux%u@%u%c", &w, &h, &hz, &c) == 3) {
+			out = { w, h, hz, 2 };
+		} else if (sscanf(s.c_str(), "%ux%u+%u%c", &w, &h, &ovls, &c) == 3) {
+			out = { w, h, 60, ovls };
+		} else if (sscanf(s.c_str(), "%ux%u%c", &w, &h, &c) == 2) {
+			out = { w, h, 60, 2 };
+		} else {
+			throw invalid_argument("Bad virtual output '" + s + "'");
+		}
+
+		if (out.width == 0 || out.height == 0 || out.width > 8192 || out.height > 8192 ||
+		    out.refresh == 0 || out.refresh > 255 || out.num_overlays > 16)
+			throw invalid_argument("Bad virtual output '" + s + "'");
+
+		outputs.push_back(out);
+
+		pos = end + 1;
+	}
+
+	if (outputs.size() > 32)
+		throw invalid_argument("Too many virtual outputs");
+
+	return outputs;
+}
+
+static Videomode virtual_mode(uint32_t width, uint32_t height, uint32_t refresh)
+{
+	Videomode mode;
+
+	try {
+		mode = find_dmt(width, height, refresh, false);
+	} catch (const invalid_argument&) {
+		mode = videomode_from_cvt(width, height, refresh, false, true, false);
+		mode.vrefresh = refresh;
+	}
+
+	return mode;
+}
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t t)
+{
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000ull;
+	ts.tv_nsec = t % 1000000000ull;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+template<class T>
+static T* alloc_array(const vector<T>& v)
+{
+	if (v.empty())
+		return nullptr;
+
+	T* p = (T*)malloc(sizeof(T) * v.size());
+	memcpy(p, v.data(), sizeof(T) * v.size());
+	return p;
+}
+
+// A base block with a detailed timing descriptor for the mode and a range
+// limits descriptor, which also tells the VRR range.
+static vector<uint8_t> generate_edid(const Videomode& m, uint32_t mm_w, uint32_t mm_h,
+				     uint32_t min_hz, uint32_t max_hz)
+{
+	vector<uint8_t> e(128, 0);
+
+	static const uint8_t header[] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+	memcpy(&e[0], header, sizeof(header));
+
+	// "VRT"
+	uint16_t vendor = (('V' - '@') << 10) | (('R' - '@') << 5) | ('T' - '@');
+	e[8] = vendor >> 8;
+	e[9] = vendor & 0xff;
+
+	e[17] = 30;		// year 2020
+	e[18] = 1;		// EDID 1.4
+	e[19] = 4;
+	e[20] = 0xa5;		// digital, 8 bpc, DisplayPort
+	e[21] = (mm_w + 5) / 10;
+	e[22] = (mm_h + 5) / 10;
+	e[23] = 120;		// gamma 2.2
+	e[24] = 0x0a;		// RGB, preferred timing is native
+
+	for (unsigned i = 38; i < 54; ++i)
+		e[i] = 0x01;
+
+	// Detailed timing descriptor
+	uint8_t* d = &e[54];
+	uint16_t hblank = m.htotal - m.hdisplay;
+	uint16_t vblank = m.vtotal - m.vdisplay;
+
+	d[0] = (m.clock / 10) & 0xff;
+	d[1] = (m.clock / 10) >> 8;
+	d[2] = m.hdisplay & 0xff;
+	d[3] = hblank & 0xff;
+	d[4] = ((m.hdisplay >> 8) << 4) | (hblank >> 8);
+	d[5] = m.vdisplay & 0xff;
+	d[6] = vblank & 0xff;
+	d[7] = ((m.vdisplay >> 8) << 4) | (vblank >> 8);
+	d[8] = m.hfp() & 0xff;
+	d[9] = m.hsw() & 0xff;
+	d[10] = ((m.vfp() & 0xf) << 4) | (m.vsw() & 0xf);
+	d[11] = ((m.hfp() >> 8) << 6) | ((m.hsw() >> 8) << 4) | ((m.vfp() >> 4) << 2) | (m.vsw() >> 4);
+	d[12] = mm_w & 0xff;
+	d[13] = mm_h & 0xff;
+	d[14] = ((mm_w >> 8) << 4) | (mm_h >> 8);
+	d[17] = 0x18 |
+		(m.vsync() == SyncPolarity::Positive ? 0x04 : 0) |
+		(m.hsync() == SyncPolarity::Positive ? 0x02 : 0);
+
+	// Display range limits
+	d = &e[72];
+	d[3] = 0xfd;
+	d[4] = (min_hz > 255 ? 0x1 : 0) | (max_hz > 255 ? 0x2 : 0);
+	d[5] = min_hz > 255 ? min_hz - 255 : min_hz;
+	d[6] = max_hz > 255 ? max_hz - 255 : max_hz;
+	d[7] = 1;
+	d[8] = 255;
+	d[9] = (m.clock / 10000) + 1;
+	d[10] = 0x01;		// range limits only
+	d[11] = 0x0a;
+	memset(&d[12], 0x20, 6);
+
+	// Display name
+	d = &e[90];
+	d[3] = 0xfc;
+	memcpy(&d[5], "Virtual\n    ", 13);
+
+	// Dummy
+	e[108 + 3] = 0x10;
+
+	uint8_t sum = 0;
+	for (unsigned i = 0; i < 127; ++i)
+		sum += e[i];
+	e[127] = -sum;
+
+	return e;
+}
+
+class VirtualBackend : public CardBackend
+{
+public:
+	VirtualBackend(const string& config);
+	~VirtualBackend() override;
+
+	int fd() const override { return m_timer_fd; }
+	unsigned int dev_minor() const override { return 0; }
+
+	drmVersionPtr get_version() override;
+	void free_version(drmVersionPtr ver) override;
+
+	int set_master() override { return 0; }
+	int drop_master() override { return 0; }
+	int set_client_cap(uint64_t cap, uint64_t value) override;
+	int get_cap(uint64_t cap, uint64_t* value) override;
+
+	drmModeResPtr get_resources() override;
+	void free_resources(drmModeResPtr res) override;
+	drmModePlaneResPtr get_plane_resources() override;
+	void free_plane_resources(drmModePlaneResPtr res) override;
+
+	drmModeConnectorPtr get_connector(uint32_t id) override;
+	void free_connector(drmModeConnectorPtr conn) override;
+	drmModeEncoderPtr get_encoder(uint32_t id) override;
+	void free_encoder(drmModeEncoderPtr enc) override;
+	drmModeCrtcPtr get_crtc(uint32_t id) override;
+	void free_crtc(drmModeCrtcPtr crtc) override;
+	drmModePlanePtr get_plane(uint32_t id) override;
+	void free_plane(drmModePlanePtr plane) override;
+	drmModeFBPtr get_fb(uint32_t id) override;
+	void free_fb(drmModeFBPtr fb) override;
+
+	drmModePropertyPtr get_property(uint32_t id) override;
+	void free_property(drmModePropertyPtr prop) override;
+	drmModeObjectPropertiesPtr get_object_properties(uint32_t id, uint32_t type) override;
+	void free_object_properties(drmModeObjectPropertiesPtr props) override;
+	int set_object_property(uint32_t id, uint32_t type, uint32_t prop_id, uint64_t value) override;
+
+	drmModePropertyBlobPtr get_blob(uint32_t id) override;
+	void free_blob(drmModePropertyBlobPtr blob) override;
+	int create_blob(const void* data, size_t len, uint32_t* id) override;
+	int destroy_blob(uint32_t id) override;
+
+	int set_crtc(uint32_t crtc_id, uint32_t fb_id, uint32_t x, uint32_t y,
+		     uint32_t* connectors, int count, drmModeModeInfoPtr mode) override;
+	int set_plane(uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+		      int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+		      uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h) override;
+	int page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void* data) override;
+	int get_sequence(uint32_t crtc_id, uint32_t crtc_idx, uint64_t* seq, uint64_t* ns) override;
+
+	int atomic_commit(const vector<AtomicReq::Prop>& props, uint32_t flags, void* data) override;
+
+	int handle_event(drmEventContext* ev) override;
+
+	int add_fb(uint32_t width, uint32_t height, uint32_t format,
+		   const uint32_t handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+		   const uint64_t modifiers[4], uint32_t* id) override;
+	int rm_fb(uint32_t id) override;
+	int dirty_fb(uint32_t id, drmModeClipPtr clips, uint32_t num_clips) override;
+
+	int create_dumb(uint32_t width, uint32_t height, uint32_t bpp,
+			uint32_t* handle, uint32_t* pitch, uint64_t* size) override;
+	int destroy_dumb(uint32_t handle) override;
+	void* map_dumb(uint32_t handle, size_t size) override;
+	int prime_handle_to_fd(uint32_t handle, uint32_t flags, int* fd) override;
+	int prime_fd_to_handle(int fd, uint32_t* handle) override;
+
+private:
+	struct VProp
+	{
+		uint32_t object_type;
+		string name;
+		uint32_t flags;
+		vector<uint64_t> values;
+		vector<pair<uint64_t, string>> enums;
+		// Can only be set with the legacy ioctl
+		bool legacy_only;
+	};
+
+	struct VObject
+	{
+		uint32_t type;
+		uint32_t idx;
+		vector<uint32_t> props;
+	};
+
+	struct VConnector
+	{
+		uint32_t id;
+		uint32_t encoder_id;
+		vector<drmModeModeInfo> modes;
+		uint32_t mm_width;
+		uint32_t mm_height;
+		uint32_t vrr_min_hz;
+	};
+
+	struct VCrtc
+	{
+		uint32_t id;
+		uint32_t primary_id;
+		uint32_t vrr_min_hz;
+
+		// vblank n happens at t0 + (n - seq0) * period
+		uint64_t t0;
+		uint64_t seq0;
+		uint64_t period;
+		bool active;
+		bool vrr;
+	};
+
+	struct VPlane
+	{
+		uint32_t id;
+		uint32_t possible_crtcs;
+	};
+
+	struct VFb
+	{
+		uint32_t width;
+		uint32_t height;
+		uint32_t format;
+		uint32_t handles[4];
+		uint32_t pitches[4];
+		uint32_t offsets[4];
+	};
+
+	struct VBuffer
+	{
+		int fd;
+		size_t size;
+		dev_t dev;
+		ino_t ino;
+	};
+
+	struct VBlob
+	{
+		vector<uint8_t> data;
+		// Created by the user and not yet destroyed
+		bool user;
+	};
+
+	struct VEvent
+	{
+		uint32_t crtc_id;
+		uint64_t seq;
+		uint64_t time;
+		void* data;
+	};
+
+	typedef map<uint32_t, map<uint32_t, uint64_t>> State;
+
+	uint32_t add_prop(uint32_t object_type, const string& name, uint32_t flags,
+			  vector<uint64_t> values = {}, vector<pair<uint64_t, string>> enums = {});
+	uint32_t add_object(uint32_t type, uint32_t idx);
+	void attach_prop(uint32_t ob_id, uint32_t prop_id, uint64_t value);
+	uint32_t prop_id(uint32_t object_type, const string& name) const;
+	uint32_t new_blob(const void* data, size_t len, bool user);
+
+	bool prop_visible(const VProp& prop) const;
+	bool value_valid(const VProp& prop, uint64_t value) const;
+	const drmModeModeInfo* state_mode(const State& state, uint32_t crtc_id) const;
+	int check_state(const State& old_state, const State& new_state, bool allow_modeset) const;
+	int commit(unique_lock<mutex>& lock, const vector<AtomicReq::Prop>& props,
+		   uint32_t flags, void* data, bool legacy);
+	void next_vblank(const VCrtc& crtc, uint64_t now, uint64_t& seq, uint64_t& time) const;
+	bool crtc_busy(uint32_t crtc_id, uint64_t now, uint64_t& until) const;
+	void gc_blobs();
+	void rearm_timer();
+
+	VCrtc* find_crtc(uint32_t id);
+
+	mutable mutex m_lock;
+
+	int m_timer_fd;
+
+	bool m_universal_planes;
+	bool m_atomic;
+
+	uint32_t m_next_id;
+	uint32_t m_next_handle;
+
+	map<uint32_t, VProp> m_props;
+	map<uint32_t, VObject> m_objects;
+
+	vector<VConnector> m_connectors;
+	vector<uint32_t> m_encoders;
+	vector<VCrtc> m_crtcs;
+	vector<VPlane> m_planes;
+
+	map<uint32_t, VFb> m_fbs;
+	map<uint32_t, VBuffer> m_buffers;
+	map<uint32_t, VBlob> m_blobs;
+
+	State m_state;
+
+	vector<VEvent> m_events;
+};
+
+VirtualBackend::VirtualBackend(const string& config)
+	: m_universal_planes(false), m_atomic(false), m_next_id(1), m_next_handle(1)
+{
+	vector<VirtualOutputConfig> outputs = parse_virtual_config(config);
+
+	m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (m_timer_fd < 0)
+		throw runtime_error(string("timerfd_create failed: ") + strerror(errno));
+
+	const uint32_t num_crtcs = outputs.size();
+	const uint32_t all_crtcs = (1u << num_crtcs) - 1;
+
+	uint32_t conn_crtc_id = add_prop(DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID",
+					 DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC, { DRM_MODE_OBJECT_CRTC });
+	uint32_t dpms = add_prop(DRM_MODE_OBJECT_CONNECTOR, "DPMS", DRM_MODE_PROP_ENUM, { 0, 1, 2, 3 },
+				 { { 0, "On" }, { 1, "Standby" }, { 2, "Suspend" }, { 3, "Off" } });
+	m_props[dpms].legacy_only = true;
+	uint32_t edid = add_prop(DRM_MODE_OBJECT_CONNECTOR, "EDID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE);
+	uint32_t vrr_capable = add_prop(DRM_MODE_OBJECT_CONNECTOR, "vrr_capable",
+					DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, { 0, 1 });
+
+	uint32_t active = add_prop(DRM_MODE_OBJECT_CRTC, "ACTIVE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC, { 0, 1 });
+	uint32_t mode_id = add_prop(DRM_MODE_OBJECT_CRTC, "MODE_ID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_ATOMIC);
+	uint32_t vrr_enabled = add_prop(DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", DRM_MODE_PROP_RANGE, { 0, 1 });
+
+	uint32_t type = add_prop(DRM_MODE_OBJECT_PLANE, "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE, { 0, 1, 2 },
+				 { { DRM_PLANE_TYPE_OVERLAY, "Overlay" },
+				   { DRM_PLANE_TYPE_PRIMARY, "Primary" },
+				   { DRM_PLANE_TYPE_CURSOR, "Cursor" } });
+	uint32_t fb_id = add_prop(DRM_MODE_OBJECT_PLANE, "FB_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC,
+				  { DRM_MODE_OBJECT_FB });
+	uint32_t plane_crtc_id = add_prop(DRM_MODE_OBJECT_PLANE, "CRTC_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC,
+					  { DRM_MODE_OBJECT_CRTC });
+	vector<uint32_t> src;
+	for (const char* name : { "SRC_X", "SRC_Y", "SRC_W", "SRC_H" })
+		src.push_back(add_prop(DRM_MODE_OBJECT_PLANE, name, DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC,
+				       { 0, UINT32_MAX }));
+	vector<uint32_t> dst;
+	for (const char* name : { "CRTC_X", "CRTC_Y" })
+		dst.push_back(add_prop(DRM_MODE_OBJECT_PLANE, name, DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC,
+				       { (uint64_t)INT32_MIN, (uint64_t)INT32_MAX }));
+	for (const char* name : { "CRTC_W", "CRTC_H" })
+		dst.push_back(add_prop(DRM_MODE_OBJECT_PLANE, name, DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC,
+				       { 0, INT32_MAX }));
+	uint32_t zpos = add_prop(DRM_MODE_OBJECT_PLANE, "zpos", DRM_MODE_PROP_RANGE, { 0, 255 });
+
+	// Connectors, encoders and crtcs first, so that the resources are listed in order
+
+	for (uint32_t i = 0; i < num_crtcs; ++i) {
+		const VirtualOutputConfig& out = outputs[i];
+
+		VConnector conn { };
+		conn.id = add_object(DRM_MODE_OBJECT_CONNECTOR, i);
+		conn.mm_width = out.width * 254 / 960;
+		conn.mm_height = out.height * 254 / 960;
+		conn.vrr_min_hz = min(48u, out.refresh);
+
+		Videomode mode = virtual_mode(out.width, out.height, out.refresh);
+		mode.type = DRM_MODE_TYPE_DRIVER | DRM_MODE_TYPE_PREFERRED;
+		conn.modes.push_back(video_mode_to_drm_mode(mode));
+
+		static const uint32_t std_modes[][2] = {
+			{ 1920, 1080 }, { 1280, 720 }, { 1024, 768 }, { 800, 600 }, { 640, 480 },
+		};
+
+		for (auto& sm : std_modes) {
+			if (sm[0] > out.width || sm[1] > out.height)
+				continue;
+			if (sm[0] == out.width && sm[1] == out.height)
+				continue;
+
+			Videomode m = virtual_mode(sm[0], sm[1], 60);
+			m.type = DRM_MODE_TYPE_DRIVER;
+			conn.modes.push_back(video_mode_to_drm_mode(m));
+		}
+
+		vector<uint8_t> edid_data = generate_edid(mode, conn.mm_width, conn.mm_height,
+							  conn.vrr_min_hz, out.refresh);
+
+		attach_prop(conn.id, conn_crtc_id, 0);
+		attach_prop(conn.id, dpms, 0);
+		attach_prop(conn.id, edid, new_blob(edid_data.data(), edid_data.size(), false));
+		attach_prop(conn.id, vrr_capable, 1);
+
+		m_connectors.push_back(conn);
+	}
+
+	for (uint32_t i = 0; i < num_crtcs; ++i) {
+		uint32_t id = add_object(DRM_MODE_OBJECT_ENCODER, i);
+		m_encoders.push_back(id);
+		m_connectors[i].encoder_id = id;
+	}
+
+	for (uint32_t i = 0; i < num_crtcs; ++i) {
+		VCrtc crtc { };
+		crtc.id = add_object(DRM_MODE_OBJECT_CRTC, i);
+		crtc.vrr_min_hz = m_connectors[i].vrr_min_hz;
+
+		attach_prop(crtc.id, active, 0);
+		attach_prop(crtc.id, mode_id, 0);
+		attach_prop(crtc.id, vrr_enabled, 0);
+
+		m_crtcs.push_back(crtc);
+	}
+
+	uint32_t plane_idx = 0;
+
+	for (uint32_t i = 0; i < num_crtcs; ++i) {
+		for (uint32_t n = 0; n <= outputs[i].num_overlays; ++n) {
+			VPlane plane;
+			plane.id = add_object(DRM_MODE_OBJECT_PLANE, plane_idx++);
+			plane.possible_crtcs = n == 0 ? (1u << i) : all_crtcs;
+
+			attach_prop(plane.id, type, n == 0 ? DRM_PLANE_TYPE_PRIMARY : DRM_PLANE_TYPE_OVERLAY);
+			attach_prop(plane.id, fb_id, 0);
+			attach_prop(plane.id, plane_crtc_id, 0);
+			for (uint32_t p : src)
+				attach_prop(plane.id, p, 0);
+			for (uint32_t p : dst)
+				attach_prop(plane.id, p, 0);
+			attach_prop(plane.id, zpos, n);
+
+			if (n == 0)
+				m_crtcs[i].primary_id = plane.id;
+
+			m_planes.push_back(plane);
+		}
+	}
+}
+
+VirtualBackend::~VirtualBackend()
+{
+	for (auto& pair : m_buffers)
+		close(pair.second.fd);
+
+	close(m_timer_fd);
+}
+
+uint32_t VirtualBackend::add_prop(uint32_t object_type, const string& name, uint32_t flags,
+				  vector<uint64_t> values, vector<pair<uint64_t, string>> enums)
+{
+	uint32_t id = m_next_id++;
+	m_props[id] = VProp { object_type, name, flags, values, enums, false };
+	return id;
+}
+
+uint32_t VirtualBackend::add_object(uint32_t type, uint32_t idx)
+{
+	uint32_t id = m_next_id++;
+	m_objects[id] = VObject { type, idx, {} };
+	m_state[id];
+	return id;
+}
+
+void VirtualBackend::attach_prop(uint32_t ob_id, uint32_t prop_id, uint64_t value)
+{
+	m_objects.at(ob_id).props.push_back(prop_id);
+	m_state.at(ob_id)[prop_id] = value;
+}
+
+uint32_t VirtualBackend::prop_id(uint32_t object_type, const string& name) const
+{
+	for (const auto& pair : m_props) {
+		if (pair.second.object_type == object_type && pair.second.name == name)
+			return pair.first;
+	}
+
+	throw invalid_argument("no virtual prop " + name);
+}
+
+uint32_t VirtualBackend::new_blob(const void* data, size_t len, bool user)
+{
+	uint32_t id = m_next_id++;
+	VBlob& blob = m_blobs[id];
+	blob.data.assign((const uint8_t*)data, (const uint8_t*)data + len);
+	blob.user = user;
+	return id;
+}
+
+VirtualBackend::VCrtc* VirtualBackend::find_crtc(uint32_t id)
+{
+	for (VCrtc& crtc : m_crtcs) {
+		if (crtc.id == id)
+			return &crtc;
+	}
+
+	return nullptr;
+}
+
+bool VirtualBackend::prop_visible(const VProp& prop) const
+{
+	return m_atomic || !(prop.flags & DRM_MODE_PROP_ATOMIC);
+}
+
+drmVersionPtr VirtualBackend::get_version()
+{
+	drmVersionPtr ver = (drmVersionPtr)calloc(1, sizeof(*ver));
+
+	ver->version_major = 1;
+	ver->version_minor = 0;
+	ver->version_patchlevel = 0;
+	ver->name = strdup("virtual");
+	ver->name_len = strlen(ver->name);
+	ver->date = strdup("20200101");
+	ver->date_len = strlen(ver->date);
+	ver->desc = strdup("kms++ virtual display device");
+	ver->desc_len = strlen(ver->desc);
+
+	return ver;
+}
+
+void VirtualBackend::free_version(drmVersionPtr ver)
+{
+	if (!ver)
+		return;
+
+	free(ver->name);
+	free(ver->date);
+	free(ver->desc);
+	free(ver);
+}
+
+int VirtualBackend::set_client_cap(uint64_t cap, uint64_t value)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	if (value > 1) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	switch (cap) {
+	case DRM_CLIENT_CAP_UNIVERSAL_PLANES:
+		m_universal_planes = value;
+		return 0;
+
+	case DRM_CLIENT_CAP_ATOMIC:
+		m_atomic = value;
+		if (value)
+			m_universal_planes = true;
+		return 0;
+
+	default:
+		errno = EINVAL;
+		return -EINVAL;
+	}
+}
+
+int VirtualBackend::get_cap(uint64_t cap, uint64_t* value)
+{
+	switch (cap) {
+	case DRM_CAP_DUMB_BUFFER:
+	case DRM_CAP_VBLANK_HIGH_CRTC:
+	case DRM_CAP_TIMESTAMP_MONOTONIC:
+	case DRM_CAP_ASYNC_PAGE_FLIP:
+	case DRM_CAP_ADDFB2_MODIFIERS:
+	case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+	case DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP:
+#endif
+		*value = 1;
+		return 0;
+
+	case DRM_CAP_DUMB_PREFERRED_DEPTH:
+		*value = 24;
+		return 0;
+
+	case DRM_CAP_PRIME:
+		*value = DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT;
+		return 0;
+
+	default:
+		errno = EINVAL;
+		return -EINVAL;
+	}
+}
+
+drmModeResPtr VirtualBackend::get_resources()
+{
+	lock_guard<mutex> lock(m_lock);
+
+	vector<uint32_t> fbs, crtcs, conns;
+
+	for (auto& pair : m_fbs)
+		fbs.push_back(pair.first);
+	for (auto& crtc : m_crtcs)
+		crtcs.push_back(crtc.id);
+	for (auto& conn : m_connectors)
+		conns.push_back(conn.id);
+
+	drmModeResPtr res = (drmModeResPtr)calloc(1, sizeof(*res));
+
+	res->count_fbs = fbs.size();
+	res->fbs = alloc_array(fbs);
+	res->count_crtcs = crtcs.size();
+	res->crtcs = alloc_array(crtcs);
+	res->count_connectors = conns.size();
+	res->connectors = alloc_array(conns);
+	res->count_encoders = m_encoders.size();
+	res->encoders = alloc_array(m_encoders);
+	res->min_width = 1;
+	res->max_width = 8192;
+	res->min_height = 1;
+	res->max_height = 8192;
+
+	return res;
+}
+
+void VirtualBackend::free_resources(drmModeResPtr res)
+{
+	if (!res)
+		return;
+
+	free(res->fbs);
+	free(res->crtcs);
+	free(res->connectors);
+	free(res->encoders);
+	free(res);
+}
+
+drmModePlaneResPtr VirtualBackend::get_plane_resources()
+{
+	lock_guard<mutex> lock(m_lock);
+
+	uint32_t type = prop_id(DRM_MODE_OBJECT_PLANE, "type");
+
+	vector<uint32_t> planes;
+
+	for (auto& plane : m_planes) {
+		// Without universal planes only the overlays are exposed
+		if (!m_universal_planes && m_state.at(plane.id).at(type) != DRM_PLANE_TYPE_OVERLAY)
+			continue;
+
+		planes.push_back(plane.id);
+	}
+
+	drmModePlaneResPtr res = (drmModePlaneResPtr)calloc(1, sizeof(*res));
+	res->count_planes = planes.size();
+	res->planes = alloc_array(planes);
+
+	return res;
+}
+
+void VirtualBackend::free_plane_resources(drmModePlaneResPtr res)
+{
+	if (!res)
+		return;
+
+	free(res->planes);
+	free(res);
+}
+
+drmModeConnectorPtr VirtualBackend::get_connector(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = find_if(m_connectors.begin(), m_connectors.end(), [id](const VConnector& c) { return c.id == id; });
+	if (it == m_connectors.end()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	const VConnector& vc = *it;
+	const auto& values = m_state.at(id);
+
+	vector<uint32_t> props;
+	vector<uint64_t> prop_values;
+
+	for (uint32_t prop : m_objects.at(id).props) {
+		if (!prop_visible(m_props.at(prop)))
+			continue;
+
+		props.push_back(prop);
+		prop_values.push_back(values.at(prop));
+	}
+
+	drmModeConnectorPtr conn = (drmModeConnectorPtr)calloc(1, sizeof(*conn));
+
+	conn->connector_id = id;
+	conn->encoder_id = values.at(prop_id(DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID")) ? vc.encoder_id : 0;
+	conn->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+	conn->connector_type_id = m_objects.at(id).idx + 1;
+	conn->connection = DRM_MODE_CONNECTED;
+	conn->mmWidth = vc.mm_width;
+	conn->mmHeight = vc.mm_height;
+	conn->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+	conn->count_modes = vc.modes.size();
+	conn->modes = alloc_array(vc.modes);
+	conn->count_props = props.size();
+	conn->props = alloc_array(props);
+	conn->prop_values = alloc_array(prop_values);
+	conn->count_encoders = 1;
+	conn->encoders = alloc_array(vector<uint32_t> { vc.encoder_id });
+
+	return conn;
+}
+
+void VirtualBackend::free_connector(drmModeConnectorPtr conn)
+{
+	if (!conn)
+		return;
+
+	free(conn->modes);
+	free(conn->props);
+	free(conn->prop_values);
+	free(conn->encoders);
+	free(conn);
+}
+
+drmModeEncoderPtr VirtualBackend::get_encoder(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = find(m_encoders.begin(), m_encoders.end(), id);
+	if (it == m_encoders.end()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	uint32_t idx = it - m_encoders.begin();
+
+	drmModeEncoderPtr enc = (drmModeEncoderPtr)calloc(1, sizeof(*enc));
+
+	enc->encoder_id = id;
+	enc->encoder_type = DRM_MODE_ENCODER_VIRTUAL;
+	enc->crtc_id = m_state.at(m_connectors[idx].id).at(prop_id(DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID"));
+	enc->possible_crtcs = (1u << m_crtcs.size()) - 1;
+	enc->possible_clones = 1u << idx;
+
+	return enc;
+}
+
+void VirtualBackend::free_encoder(drmModeEncoderPtr enc)
+{
+	free(enc);
+}
+
+const drmModeModeInfo* VirtualBackend::state_mode(const State& state, uint32_t crtc_id) const
+{
+	uint64_t blob_id = state.at(crtc_id).at(prop_id(DRM_MODE_OBJECT_CRTC, "MODE_ID"));
+
+	if (blob_id == 0)
+		return nullptr;
+
+	return (const drmModeModeInfo*)m_blobs.at(blob_id).data.data();
+}
+
+drmModeCrtcPtr VirtualBackend::get_crtc(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	VCrtc* vc = find_crtc(id);
+	if (!vc) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	drmModeCrtcPtr crtc = (drmModeCrtcPtr)calloc(1, sizeof(*crtc));
+
+	crtc->crtc_id = id;
+
+	const auto& primary = m_state.at(vc->primary_id);
+
+	if (primary.at(prop_id(DRM_MODE_OBJECT_PLANE, "CRTC_ID")) == id) {
+		crtc->buffer_id = primary.at(prop_id(DRM_MODE_OBJECT_PLANE, "FB_ID"));
+		crtc->x = primary.at(prop_id(DRM_MODE_OBJECT_PLANE, "SRC_X")) >> 16;
+		crtc->y = primary.at(prop_id(DRM_MODE_OBJECT_PLANE, "SRC_Y")) >> 16;
+	}
+
+	const drmModeModeInfo* mode = state_mode(m_state, id);
+
+	if (mode) {
+		crtc->mode_valid = 1;
+		crtc->mode = *mode;
+		crtc->width = mode->hdisplay;
+		crtc->height = mode->vdisplay;
+	}
+
+	crtc->gamma_size = 0;
+
+	return crtc;
+}
+
+void VirtualBackend::free_crtc(drmModeCrtcPtr crtc)
+{
+	free(crtc);
+}
+
+drmModePlanePtr VirtualBackend::get_plane(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = find_if(m_planes.begin(), m_planes.end(), [id](const VPlane& p) { return p.id == id; });
+	if (it == m_planes.end()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	const auto& values = m_state.at(id);
+	auto val = [this, &values](const char* name) {
+		return values.at(prop_id(DRM_MODE_OBJECT_PLANE, name));
+	};
+
+	vector<uint32_t> formats;
+	for (PixelFormat f : virtual_plane_formats)
+		formats.push_back((uint32_t)f);
+
+	drmModePlanePtr plane = (drmModePlanePtr)calloc(1, sizeof(*plane));
+
+	plane->count_formats = formats.size();
+	plane->formats = alloc_array(formats);
+	plane->plane_id = id;
+	plane->crtc_id = val("CRTC_ID");
+	plane->fb_id = val("FB_ID");
+	plane->crtc_x = (int32_t)val("CRTC_X");
+	plane->crtc_y = (int32_t)val("CRTC_Y");
+	plane->x = val("SRC_X") >> 16;
+	plane->y = val("SRC_Y") >> 16;
+	plane->possible_crtcs = it->possible_crtcs;
+	plane->gamma_size = 0;
+
+	return plane;
+}
+
+void VirtualBackend::free_plane(drmModePlanePtr plane)
+{
+	if (!plane)
+		return;
+
+	free(plane->formats);
+	free(plane);
+}
+
+drmModeFBPtr VirtualBackend::get_fb(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_fbs.find(id);
+	if (it == m_fbs.end()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	const VFb& vfb = it->second;
+	const PixelFormatInfo& pfi = get_pixel_format_info((PixelFormat)vfb.format);
+
+	drmModeFBPtr fb = (drmModeFBPtr)calloc(1, sizeof(*fb));
+
+	fb->fb_id = id;
+	fb->width = vfb.width;
+	fb->height = vfb.height;
+	fb->pitch = vfb.pitches[0];
+	fb->bpp = pfi.planes[0].bitspp;
+	fb->depth = fb->bpp == 32 ? 24 : fb->bpp;
+	fb->handle = vfb.handles[0];
+
+	return fb;
+}
+
+void VirtualBackend::free_fb(drmModeFBPtr fb)
+{
+	free(fb);
+}
+
+drmModePropertyPtr VirtualBackend::get_property(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_props.find(id);
+	if (it == m_props.end()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	const VProp& vp = it->second;
+
+	drmModePropertyPtr prop = (drmModePropertyPtr)calloc(1, sizeof(*prop));
+
+	prop->prop_id = id;
+	prop->flags = vp.flags & ~DRM_MODE_PROP_ATOMIC;
+	strncpy(prop->name, vp.name.c_str(), DRM_PROP_NAME_LEN - 1);
+	prop->count_values = vp.values.size();
+	prop->values = alloc_array(vp.values);
+
+	vector<drm_mode_property_enum> enums;
+	for (const auto& e : vp.enums) {
+		drm_mode_property_enum pe { };
+		pe.value = e.first;
+		strncpy(pe.name, e.second.c_str(), DRM_PROP_NAME_LEN - 1);
+		enums.push_back(pe);
+	}
+
+	prop->count_enums = enums.size();
+	prop->enums = alloc_array(enums);
+
+	return prop;
+}
+
+void VirtualBackend::free_property(drmModePropertyPtr prop)
+{
+	if (!prop)
+		return;
+
+	free(prop->values);
+	free(prop->enums);
+	free(prop);
+}
+
+drmModeObjectPropertiesPtr VirtualBackend::get_object_properties(uint32_t id, uint32_t type)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_objects.find(id);
+	if (it == m_objects.end() || (type != DRM_MODE_OBJECT_ANY && it->second.type != type)) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	vector<uint32_t> props;
+	vector<uint64_t> values;
+
+	for (uint32_t prop : it->second.props) {
+		if (!prop_visible(m_props.at(prop)))
+			continue;
+
+		props.push_back(prop);
+		values.push_back(m_state.at(id).at(prop));
+	}
+
+	drmModeObjectPropertiesPtr res = (drmModeObjectPropertiesPtr)calloc(1, sizeof(*res));
+
+	res->count_props = props.size();
+	res->props = alloc_array(props);
+	res->prop_values = alloc_array(values);
+
+	return res;
+}
+
+void VirtualBackend::free_object_properties(drmModeObjectPropertiesPtr props)
+{
+	if (!props)
+		return;
+
+	free(props->props);
+	free(props->prop_values);
+	free(props);
+}
+
+int VirtualBackend::set_object_property(uint32_t id, uint32_t type, uint32_t prop_id, uint64_t value)
+{
+	unique_lock<mutex> lock(m_lock);
+
+	auto it = m_objects.find(id);
+	if (it == m_objects.end() || (type != DRM_MODE_OBJECT_ANY && it->second.type != type)) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	return commit(lock, { { id, prop_id, value } }, 0, nullptr, true);
+}
+
+drmModePropertyBlobPtr VirtualBackend::get_blob(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_blobs.find(id);
+	if (it == m_blobs.end()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+
+	const vector<uint8_t>& data = it->second.data;
+
+	drmModePropertyBlobPtr blob = (drmModePropertyBlobPtr)calloc(1, sizeof(*blob));
+
+	blob->id = id;
+	blob->length = data.size();
+	blob->data = malloc(data.size());
+	memcpy(blob->data, data.data(), data.size());
+
+	return blob;
+}
+
+void VirtualBackend::free_blob(drmModePropertyBlobPtr blob)
+{
+	if (!blob)
+		return;
+
+	free(blob->data);
+	free(blob);
+}
+
+int VirtualBackend::create_blob(const void* data, size_t len, uint32_t* id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	if (len == 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	*id = new_blob(data, len, true);
+
+	return 0;
+}
+
+int VirtualBackend::destroy_blob(uint32_t id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_blobs.find(id);
+	if (it == m_blobs.end() || !it->second.user) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	// The blob stays alive as long as it's used in the state
+	it->second.user = false;
+	gc_blobs();
+
+	return 0;
+}
+
+void VirtualBackend::gc_blobs()
+{
+	set<uint64_t> used;
+
+	for (const auto& obpair : m_state) {
+		for (const auto& pair : obpair.second) {
+			if (m_props.at(pair.first).flags & DRM_MODE_PROP_BLOB)
+				used.insert(pair.second);
+		}
+	}
+
+	for (auto it = m_blobs.begin(); it != m_blobs.end();) {
+		if (!it->second.user && used.find(it->first) == used.end())
+			it = m_blobs.erase(it);
+		else
+			++it;
+	}
+}
+
+int VirtualBackend::set_crtc(uint32_t crtc_id, uint32_t fb_id, uint32_t x, uint32_t y,
+			     uint32_t* connectors, int count, drmModeModeInfoPtr mode)
+{
+	unique_lock<mutex> lock(m_lock);
+
+	VCrtc* crtc = find_crtc(crtc_id);
+	if (!crtc) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	uint32_t conn_crtc_id = prop_id(DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+	uint32_t primary = crtc->primary_id;
+	auto plane_prop = [this](const char* name) { return prop_id(DRM_MODE_OBJECT_PLANE, name); };
+
+	vector<AtomicReq::Prop> props;
+
+	// Detach the connectors which are not in the new configuration
+	for (const VConnector& conn : m_connectors) {
+		bool listed = mode && find(connectors, connectors + count, conn.id) != connectors + count;
+
+		if (listed)
+			props.push_back({ conn.id, conn_crtc_id, crtc_id });
+		else if (m_state.at(conn.id).at(conn_crtc_id) == crtc_id)
+			props.push_back({ conn.id, conn_crtc_id, 0 });
+	}
+
+	if (!mode) {
+		props.push_back({ crtc_id, prop_id(DRM_MODE_OBJECT_CRTC, "ACTIVE"), 0 });
+		props.push_back({ crtc_id, prop_id(DRM_MODE_OBJECT_CRTC, "MODE_ID"), 0 });
+		props.push_back({ primary, plane_prop("FB_ID"), 0 });
+		props.push_back({ primary, plane_prop("CRTC_ID"), 0 });
+
+		return commit(lock, props, DRM_MODE_ATOMIC_ALLOW_MODESET, nullptr, true);
+	}
+
+	// -1 keeps the current fb
+	if (fb_id == (uint32_t)-1)
+		fb_id = m_state.at(primary).at(plane_prop("FB_ID"));
+
+	if (fb_id == 0 || count == 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	uint32_t blob = new_blob(mode, sizeof(*mode), false);
+
+	props.push_back({ crtc_id, prop_id(DRM_MODE_OBJECT_CRTC, "ACTIVE"), 1 });
+	props.push_back({ crtc_id, prop_id(DRM_MODE_OBJECT_CRTC, "MODE_ID"), blob });
+	props.push_back({ primary, plane_prop("FB_ID"), fb_id });
+	props.push_back({ primary, plane_prop("CRTC_ID"), crtc_id });
+	props.push_back({ primary, plane_prop("SRC_X"), (uint64_t)x << 16 });
+	props.push_back({ primary, plane_prop("SRC_Y"), (uint64_t)y << 16 });
+	props.push_back({ primary, plane_prop("SRC_W"), (uint64_t)mode->hdisplay << 16 });
+	props.push_back({ primary, plane_prop("SRC_H"), (uint64_t)mode->vdisplay << 16 });
+	props.push_back({ primary, plane_prop("CRTC_X"), 0 });
+	props.push_back({ primary, plane_prop("CRTC_Y"), 0 });
+	props.push_back({ primary, plane_prop("CRTC_W"), mode->hdisplay });
+	props.push_back({ primary, plane_prop("CRTC_H"), mode->vdisplay });
+
+	int r = commit(lock, props, DRM_MODE_ATOMIC_ALLOW_MODESET, nullptr, true);
+
+	gc_blobs();
+
+	return r;
+}
+
+int VirtualBackend::set_plane(uint32_t plane_id, uint32_t crtc_id, uint32_t fb_id, uint32_t flags,
+			      int32_t crtc_x, int32_t crtc_y, uint32_t crtc_w, uint32_t crtc_h,
+			      uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h)
+{
+	unique_lock<mutex> lock(m_lock);
+
+	auto it = m_objects.find(plane_id);
+	if (it == m_objects.end() || it->second.type != DRM_MODE_OBJECT_PLANE) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	auto plane_prop = [this](const char* name) { return prop_id(DRM_MODE_OBJECT_PLANE, name); };
+
+	vector<AtomicReq::Prop> props;
+
+	if (fb_id == 0) {
+		props.push_back({ plane_id, plane_prop("FB_ID"), 0 });
+		props.push_back({ plane_id, plane_prop("CRTC_ID"), 0 });
+	} else {
+		props.push_back({ plane_id, plane_prop("FB_ID"), fb_id });
+		props.push_back({ plane_id, plane_prop("CRTC_ID"), crtc_id });
+		props.push_back({ plane_id, plane_prop("SRC_X"), src_x });
+		props.push_back({ plane_id, plane_prop("SRC_Y"), src_y });
+		props.push_back({ plane_id, plane_prop("SRC_W"), src_w });
+		props.push_back({ plane_id, plane_prop("SRC_H"), src_h });
+		props.push_back({ plane_id, plane_prop("CRTC_X"), (uint64_t)(int64_t)crtc_x });
+		props.push_back({ plane_id, plane_prop("CRTC_Y"), (uint64_t)(int64_t)crtc_y });
+		props.push_back({ plane_id, plane_prop("CRTC_W"), crtc_w });
+		props.push_back({ plane_id, plane_prop("CRTC_H"), crtc_h });
+	}
+
+	return commit(lock, props, 0, nullptr, true);
+}
+
+int VirtualBackend::page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void* data)
+{
+	unique_lock<mutex> lock(m_lock);
+
+	VCrtc* crtc = find_crtc(crtc_id);
+	if (!crtc) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	if ((flags & ~(DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC)) || !crtc->active || fb_id == 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	uint32_t commit_flags = DRM_MODE_ATOMIC_NONBLOCK | flags;
+
+	return commit(lock, { { crtc->primary_id, prop_id(DRM_MODE_OBJECT_PLANE, "FB_ID"), fb_id } },
+		      commit_flags, data, true);
+}
+
+void VirtualBackend::next_vblank(const VCrtc& crtc, uint64_t now, uint64_t& seq, uint64_t& time) const
+{
+	if (crtc.vrr) {
+		// The panel waits for a flip until the minimum refresh rate forces
+		// a refresh, but can't refresh faster than the mode allows
+		uint64_t max_period = 1000000000ull / crtc.vrr_min_hz;
+		uint64_t n = now >= crtc.t0 ? (now - crtc.t0) / max_period : 0;
+		uint64_t last = crtc.t0 + n * max_period;
+
+		seq = crtc.seq0 + n + 1;
+		time = max(now, last + crtc.period);
+		return;
+	}
+
+	uint64_t n = now >= crtc.t0 ? (now - crtc.t0) / crtc.period + 1 : 0;
+
+	seq = crtc.seq0 + n;
+	time = crtc.t0 + n * crtc.period;
+}
+
+int VirtualBackend::get_sequence(uint32_t crtc_id, uint32_t crtc_idx, uint64_t* seq, uint64_t* ns)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	VCrtc* crtc = find_crtc(crtc_id);
+	if (!crtc) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	if (!crtc->active) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	uint64_t now = mono_ns();
+	uint64_t period = crtc->vrr ? 1000000000ull / crtc->vrr_min_hz : crtc->period;
+	uint64_t n = now >= crtc->t0 ? (now - crtc->t0) / period : 0;
+
+	*seq = crtc->seq0 + n;
+	*ns = crtc->t0 + n * period;
+
+	return 0;
+}
+
+bool VirtualBackend::crtc_busy(uint32_t crtc_id, uint64_t now, uint64_t& until) const
+{
+	bool busy = false;
+
+	for (const VEvent& ev : m_events) {
+		if (ev.crtc_id == crtc_id && ev.time > now) {
+			until = busy ? max(until, ev.time) : ev.time;
+			busy = true;
+		}
+	}
+
+	return busy;
+}
+
+bool VirtualBackend::value_valid(const VProp& prop, uint64_t value) const
+{
+	uint32_t type = prop.flags & (DRM_MODE_PROP_LEGACY_TYPE | DRM_MODE_PROP_EXTENDED_TYPE);
+
+	switch (type) {
+	case DRM_MODE_PROP_RANGE:
+		return value >= prop.values[0] && value <= prop.values[1];
+
+	case DRM_MODE_PROP_SIGNED_RANGE:
+		return (int64_t)value >= (int64_t)prop.values[0] && (int64_t)value <= (int64_t)prop.values[1];
+
+	case DRM_MODE_PROP_ENUM:
+		return find(prop.values.begin(), prop.values.end(), value) != prop.values.end();
+
+	case DRM_MODE_PROP_BLOB:
+		return value == 0 || m_blobs.find(value) != m_blobs.end();
+
+	case DRM_MODE_PROP_OBJECT:
+		if (value == 0)
+			return true;
+
+		if (prop.values[0] == DRM_MODE_OBJECT_FB)
+			return m_fbs.find(value) != m_fbs.end();
+
+		return m_objects.find(value) != m_objects.end() && m_objects.at(value).type == prop.values[0];
+
+	default:
+		return false;
+	}
+}
+
+int VirtualBackend::check_state(const State& old_state, const State& new_state, bool allow_modeset) const
+{
+	uint32_t conn_crtc_id = prop_id(DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+	uint32_t active = prop_id(DRM_MODE_OBJECT_CRTC, "ACTIVE");
+
+	for (uint32_t i = 0; i < m_crtcs.size(); ++i) {
+		const VCrtc& crtc = m_crtcs[i];
+		const drmModeModeInfo* mode = state_mode(new_state, crtc.id);
+		const drmModeModeInfo* old_mode = state_mode(old_state, crtc.id);
+
+		if (mode && (mode->clock == 0 || mode->htotal <= mode->hdisplay || mode->vtotal <= mode->vdisplay))
+			return -EINVAL;
+
+		if (new_state.at(crtc.id).at(active) && !mode)
+			return -EINVAL;
+
+		unsigned num_conns = 0;
+		bool routing_changed = false;
+
+		for (const VConnector& conn : m_connectors) {
+			bool on_new = new_state.at(conn.id).at(conn_crtc_id) == crtc.id;
+			bool on_old = old_state.at(conn.id).at(conn_crtc_id) == crtc.id;
+
+			if (on_new)
+				num_conns++;
+			if (on_new != on_old)
+				routing_changed = true;
+		}
+
+		// No cloning, and an enabled crtc needs a connector
+		if (num_conns > 1 || (mode != nullptr) != (num_conns > 0))
+			return -EINVAL;
+
+		bool mode_changed = (mode == nullptr) != (old_mode == nullptr) ||
+				    (mode && memcmp(mode, old_mode, sizeof(*mode)) != 0);
+
+		bool needs_modeset = mode_changed || routing_changed ||
+				     new_state.at(crtc.id).at(active) != old_state.at(crtc.id).at(active);
+
+		if (needs_modeset && !allow_modeset)
+			return -EINVAL;
+	}
+
+	auto plane_val = [this](const map<uint32_t, uint64_t>& values, const char* name) {
+		return values.at(prop_id(DRM_MODE_OBJECT_PLANE, name));
+	};
+
+	for (const VPlane& plane : m_planes) {
+		const auto& values = new_state.at(plane.id);
+
+		uint64_t fb_id = plane_val(values, "FB_ID");
+		uint64_t crtc_id = plane_val(values, "CRTC_ID");
+
+		if ((fb_id == 0) != (crtc_id == 0))
+			return -EINVAL;
+
+		if (fb_id == 0)
+			continue;
+
+		uint32_t crtc_idx = m_objects.at(crtc_id).idx;
+
+		if (!(plane.possible_crtcs & (1u << crtc_idx)))
+			return -EINVAL;
+
+		if (!state_mode(new_state, crtc_id))
+			return -EINVAL;
+
+		const VFb& fb = m_fbs.at(fb_id);
+
+		auto fmt = find(begin(virtual_plane_formats), end(virtual_plane_formats), (PixelFormat)fb.format);
+		if (fmt == end(virtual_plane_formats))
+			return -EINVAL;
+
+		uint64_t src_x = plane_val(values, "SRC_X");
+		uint64_t src_y = plane_val(values, "SRC_Y");
+		uint64_t src_w = plane_val(values, "SRC_W");
+		uint64_t src_h = plane_val(values, "SRC_H");
+
+		if (src_w == 0 || src_h == 0 ||
+		    src_x + src_w > (uint64_t)fb.width << 16 ||
+		    src_y + src_h > (uint64_t)fb.height << 16)
+			return -ENOSPC;
+
+		if (plane_val(values, "CRTC_W") == 0 || plane_val(values, "CRTC_H") == 0)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+int VirtualBackend::commit(unique_lock<mutex>& lock, const vector<AtomicReq::Prop>& props,
+			   uint32_t flags, void* data, bool legacy)
+{
+	int r;
+
+	if ((flags & ~DRM_MODE_ATOMIC_FLAGS) ||
+	    ((flags & DRM_MODE_ATOMIC_TEST_ONLY) && (flags & DRM_MODE_PAGE_FLIP_EVENT))) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (!legacy && !m_atomic) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	while (true) {
+		State new_state = m_state;
+		set<uint32_t> crtcs;
+
+		uint32_t conn_crtc_id = prop_id(DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+		uint32_t plane_crtc_id = prop_id(DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+		uint32_t plane_fb_id = prop_id(DRM_MODE_OBJECT_PLANE, "FB_ID");
+		uint32_t active = prop_id(DRM_MODE_OBJECT_CRTC, "ACTIVE");
+		uint32_t vrr_enabled = prop_id(DRM_MODE_OBJECT_CRTC, "VRR_ENABLED");
+
+		bool only_fbs = true;
+
+		for (const AtomicReq::Prop& p : props) {
+			auto ob = m_objects.find(p.ob_id);
+			auto prop = m_props.find(p.prop_id);
+
+			if (ob == m_objects.end() || prop == m_props.end()) {
+				r = -ENOENT;
+				goto out;
+			}
+
+			const VObject& vob = ob->second;
+			const VProp& vprop = prop->second;
+
+			if (find(vob.props.begin(), vob.props.end(), p.prop_id) == vob.props.end() ||
+			    (!prop_visible(vprop) && !legacy)) {
+				r = -ENOENT;
+				goto out;
+			}
+
+			if ((vprop.flags & DRM_MODE_PROP_IMMUTABLE) || (vprop.legacy_only && !legacy) ||
+			    !value_valid(vprop, p.value)) {
+				r = -EINVAL;
+				goto out;
+			}
+
+			uint64_t& value = new_state.at(p.ob_id).at(p.prop_id);
+
+			if (value != p.value && p.prop_id != plane_fb_id)
+				only_fbs = false;
+
+			switch (vob.type) {
+			case DRM_MODE_OBJECT_CRTC:
+				crtcs.insert(p.ob_id);
+				break;
+
+			case DRM_MODE_OBJECT_CONNECTOR:
+				crtcs.insert(new_state.at(p.ob_id).at(conn_crtc_id));
+				if (p.prop_id == conn_crtc_id)
+					crtcs.insert(p.value);
+				break;
+
+			case DRM_MODE_OBJECT_PLANE:
+				crtcs.insert(new_state.at(p.ob_id).at(plane_crtc_id));
+				if (p.prop_id == plane_crtc_id)
+					crtcs.insert(p.value);
+				break;
+			}
+
+			value = p.value;
+		}
+
+		crtcs.erase(0);
+
+		for (uint32_t crtc_id : crtcs) {
+			if (!find_crtc(crtc_id)) {
+				r = -EINVAL;
+				goto out;
+			}
+		}
+
+		r = check_state(m_state, new_state, flags & DRM_MODE_ATOMIC_ALLOW_MODESET);
+		if (r)
+			goto out;
+
+		// Async flips can only change the fbs
+		if ((flags & DRM_MODE_PAGE_FLIP_ASYNC) && !legacy &&
+		    (!only_fbs || (flags & DRM_MODE_ATOMIC_ALLOW_MODESET))) {
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+			if (crtcs.empty()) {
+				r = -EINVAL;
+				goto out;
+			}
+
+			for (uint32_t crtc_id : crtcs) {
+				if (!m_state.at(crtc_id).at(active) && !new_state.at(crtc_id).at(active)) {
+					r = -EINVAL;
+					goto out;
+				}
+			}
+		}
+
+		if (flags & DRM_MODE_ATOMIC_TEST_ONLY) {
+			r = 0;
+			goto out;
+		}
+
+		uint64_t now = mono_ns();
+		uint64_t busy_until = 0;
+		bool busy = false;
+
+		for (uint32_t crtc_id : crtcs) {
+			uint64_t until;
+			if (crtc_busy(crtc_id, now, until)) {
+				busy_until = busy ? max(busy_until, until) : until;
+				busy = true;
+			}
+		}
+
+		if (busy) {
+			if (flags & DRM_MODE_ATOMIC_NONBLOCK) {
+				r = -EBUSY;
+				goto out;
+			}
+
+			// Blocking commits wait for the previous flips to finish, and
+			// then re-check against the state at that point
+			lock.unlock();
+			sleep_until_ns(busy_until);
+			lock.lock();
+			continue;
+		}
+
+		// Apply
+
+		m_state.swap(new_state);
+		const State& old_state = new_state;
+
+		uint64_t done_time = now;
+
+		for (uint32_t crtc_id : crtcs) {
+			VCrtc& crtc = *find_crtc(crtc_id);
+			bool was_active = crtc.active;
+			const drmModeModeInfo* mode = state_mode(m_state, crtc_id);
+
+			crtc.active = m_state.at(crtc_id).at(active);
+			crtc.vrr = m_state.at(crtc_id).at(vrr_enabled) != 0;
+
+			if (crtc.active && (!was_active || memcmp(mode, state_mode(old_state, crtc_id), sizeof(*mode)) != 0)) {
+				// The vblanks restart from the modeset
+				uint64_t seq = crtc.seq0;
+				if (was_active) {
+					uint64_t t;
+					next_vblank(crtc, now, seq, t);
+				}
+
+				crtc.seq0 = seq;
+				crtc.t0 = now;
+				crtc.period = (uint64_t)mode->htotal * mode->vtotal * 1000000ull / mode->clock;
+			}
+
+			uint64_t seq = crtc.seq0;
+			uint64_t time = now;
+
+			if (crtc.active && !(flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+				next_vblank(crtc, now, seq, time);
+
+				if (crtc.vrr) {
+					crtc.t0 = time;
+					crtc.seq0 = seq;
+				}
+			} else if (crtc.active) {
+				uint64_t t;
+				next_vblank(crtc, now, seq, t);
+				seq--;
+			}
+
+			if (flags & DRM_MODE_PAGE_FLIP_EVENT)
+				m_events.push_back(VEvent { crtc_id, seq, time, data });
+
+			done_time = max(done_time, time);
+		}
+
+		gc_blobs();
+		rearm_timer();
+
+		// Blocking commits return after the flip
+		if (!(flags & DRM_MODE_ATOMIC_NONBLOCK) && done_time > now) {
+			lock.unlock();
+			sleep_until_ns(done_time);
+			lock.lock();
+		}
+
+		return 0;
+	}
+
+out:
+	if (r)
+		errno = -r;
+
+	return r;
+}
+
+int VirtualBackend::atomic_commit(const vector<AtomicReq::Prop>& props, uint32_t flags, void* data)
+{
+	unique_lock<mutex> lock(m_lock);
+
+	return commit(lock, props, flags, data, false);
+}
+
+void VirtualBackend::rearm_timer()
+{
+	struct itimerspec its { };
+
+	if (!m_events.empty()) {
+		uint64_t t = m_events[0].time;
+		for (const VEvent& ev : m_events)
+			t = min(t, ev.time);
+
+		// A zero value would disarm the timer
+		t = max(t, (uint64_t)1);
+
+		its.it_value.tv_sec = t / 1000000000ull;
+		its.it_value.tv_nsec = t % 1000000000ull;
+	}
+
+	timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int VirtualBackend::handle_event(drmEventContext* evctx)
+{
+	vector<VEvent> events;
+
+	{
+		unique_lock<mutex> lock(m_lock);
+
+		if (m_events.empty())
+			return 0;
+
+		uint64_t first = m_events[0].time;
+		for (const VEvent& ev : m_events)
+			first = min(first, ev.time);
+
+		// Like a read on a DRM fd, block until there's an event
+		if (first > mono_ns()) {
+			lock.unlock();
+			sleep_until_ns(first);
+			lock.lock();
+		}
+
+		uint64_t expirations;
+		if (read(m_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+			return -errno;
+
+		uint64_t now = mono_ns();
+
+		for (auto it = m_events.begin(); it != m_events.end();) {
+			if (it->time <= now) {
+				events.push_back(*it);
+				it = m_events.erase(it);
+			} else {
+				++it;
+			}
+		}
+
+		sort(events.begin(), events.end(), [](const VEvent& a, const VEvent& b) { return a.time < b.time; });
+
+		rearm_timer();
+	}
+
+	// The handlers may commit, so they're called without the lock
+	for (const VEvent& ev : events) {
+		unsigned sec = ev.time / 1000000000ull;
+		unsigned usec = (ev.time % 1000000000ull) / 1000;
+
+		if (evctx->version >= 3 && evctx->page_flip_handler2)
+			evctx->page_flip_handler2(m_timer_fd, ev.seq, sec, usec, ev.crtc_id, ev.data);
+		else if (evctx->page_flip_handler)
+			evctx->page_flip_handler(m_timer_fd, ev.seq, sec, usec, ev.data);
+	}
+
+	return 0;
+}
+
+int VirtualBackend::add_fb(uint32_t width, uint32_t height, uint32_t format,
+			   const uint32_t handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+			   const uint64_t modifiers[4], uint32_t* id)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	const PixelFormatInfo* pfi;
+
+	try {
+		pfi = &get_pixel_format_info((PixelFormat)format);
+	} catch (const invalid_argument&) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	if (width == 0 || height == 0 || width > 8192 || height > 8192) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	VFb fb { };
+	fb.width = width;
+	fb.height = height;
+	fb.format = format;
+
+	for (unsigned i = 0; i < pfi->num_planes; ++i) {
+		const PixelFormatPlaneInfo& pi = pfi->planes[i];
+
+		auto buf = m_buffers.find(handles[i]);
+
+		// Only linear buffers
+		if (buf == m_buffers.end() || (modifiers && modifiers[i] != DRM_FORMAT_MOD_LINEAR)) {
+			errno = EINVAL;
+			return -EINVAL;
+		}
+
+		// Same as with the dumb buffers, only the fully planar chroma planes are subsampled
+		uint32_t plane_w = width;
+		if (pfi->type == PixelColorType::YUV && pfi->num_planes == 3)
+			plane_w /= pi.xsub;
+
+		uint64_t min_pitch = (uint64_t)plane_w * pi.bitspp / 8;
+		uint64_t end = (uint64_t)offsets[i] + (uint64_t)pitches[i] * (height / pi.ysub);
+
+		if (pitches[i] < min_pitch || end > buf->second.size) {
+			errno = EINVAL;
+			return -EINVAL;
+		}
+
+		fb.handles[i] = handles[i];
+		fb.pitches[i] = pitches[i];
+		fb.offsets[i] = offsets[i];
+	}
+
+	*id = m_next_id++;
+	m_fbs[*id] = fb;
+
+	return 0;
+}
+
+int VirtualBackend::rm_fb(uint32_t id)
+{
+	unique_lock<mutex> lock(m_lock);
+
+	if (m_fbs.find(id) == m_fbs.end()) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	// Like the kernel, disable the planes which still use the fb
+	uint32_t fb_id = prop_id(DRM_MODE_OBJECT_PLANE, "FB_ID");
+	uint32_t crtc_id = prop_id(DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+
+	for (const VPlane& plane : m_planes) {
+		auto& values = m_state.at(plane.id);
+
+		if (values.at(fb_id) == id) {
+			values[fb_id] = 0;
+			values[crtc_id] = 0;
+		}
+	}
+
+	m_fbs.erase(id);
+
+	return 0;
+}
+
+int VirtualBackend::dirty_fb(uint32_t id, drmModeClipPtr clips, uint32_t num_clips)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	if (m_fbs.find(id) == m_fbs.end()) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+int VirtualBackend::create_dumb(uint32_t width, uint32_t height, uint32_t bpp,
+				uint32_t* handle, uint32_t* pitch, uint64_t* size)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	if (width == 0 || height == 0 || bpp == 0 || width > 16384 || height > 16384) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	uint32_t p = ((width * bpp + 7) / 8 + 63) & ~63u;
+	uint64_t s = (uint64_t)p * height;
+
+	int fd = memfd_create("kms++-dumb", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, s) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -err;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+
+	*handle = m_next_handle++;
+	*pitch = p;
+	*size = s;
+
+	m_buffers[*handle] = VBuffer { fd, s, st.st_dev, st.st_ino };
+
+	return 0;
+}
+
+int VirtualBackend::destroy_dumb(uint32_t handle)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_buffers.find(handle);
+	if (it == m_buffers.end()) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	close(it->second.fd);
+	m_buffers.erase(it);
+
+	return 0;
+}
+
+void* VirtualBackend::map_dumb(uint32_t handle, size_t size)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_buffers.find(handle);
+	if (it == m_buffers.end() || size > it->second.size) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	return mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, it->second.fd, 0);
+}
+
+int VirtualBackend::prime_handle_to_fd(uint32_t handle, uint32_t flags, int* fd)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_buffers.find(handle);
+	if (it == m_buffers.end()) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	// The memfd works as the dmabuf, the fd can be mmapped the same way
+	int r = fcntl(it->second.fd, (flags & DRM_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+	if (r < 0)
+		return -errno;
+
+	*fd = r;
+
+	return 0;
+}
+
+int VirtualBackend::prime_fd_to_handle(int fd, uint32_t* handle)
+{
+	lock_guard<mutex> lock(m_lock);
+
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	// The same buffer gets the same handle
+	for (const auto& pair : m_buffers) {
+		if (pair.second.dev == st.st_dev && pair.second.ino == st.st_ino) {
+			*handle = pair.first;
+			return 0;
+		}
+	}
+
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	int dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dupfd < 0)
+		return -errno;
+
+	*handle = m_next_handle++;
+	m_buffers[*handle] = VBuffer { dupfd, (size_t)size, st.st_dev, st.st_ino };
+
+	return 0;
+}
+
+unique_ptr<CardBackend> create_virtual_backend(const string& config)
+{
+	return unique_ptr<CardBackend>(new VirtualBackend(config));
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+#include <kms++util/color.h>
+
+namespace kms
+{
+class IFramebuffer;
+
+struct FbCompareResult
+{
+	// Largest absolute difference of any component, in 8-bit scale
+	unsigned max_error;
+	// Number of pixels where any component differs
+	uint64_t diff_pixels;
+	// Mean squared error over all components
+	double mse;
+	// In dB, infinity for identical frames
+	double psnr;
+	// Mean SSIM of the luma, over 8x8 blocks
+	double ssim;
+};
+
+// Compare two framebuffers of the same size. The formats may differ: two RGB
+// framebuffers are compared in RGB, otherwise the comparison is done in YUV,
+// converting RGB with the given yuvt. Subsampled chroma is compared at full
+// resolution and deeper than 8-bit components are compared in 8-bit.
+//
+// If diff is given, it must be a XRGB8888 or ARGB8888 framebuffer of the same
+// size, and each of its pixels is set to gray showing the largest component
+// difference of the pixel, multiplied by 8.
+FbCompareResult fb_compare(IFramebuffer& a, IFramebuffer& b, IFramebuffer* diff = nullptr,
+			   YUVType yuvt = YUVType::BT601_Lim);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+namespace kms
+{
+
+// Paces flips at the content frame rate on a VRR display, keeping the flip
+// rate inside the panel's refresh range with a margin. If the content rate is
+// below the range, each content frame is shown for multiple flips. If no whole
+// number of flips per frame fits in the range, flips run at the top of the
+// range and each flip shows the content frame of its time.
+//
+// Times are CLOCK_MONOTONIC seconds, the same as in the page flip events.
+class FramePacer
+{
+public:
+	FramePacer(double content_fps, double min_hz, double max_hz);
+
+	// Flips per content frame, 0 if the frames are picked by time
+	unsigned repeats() const { return m_repeats; }
+	double flip_interval() const { return m_interval; }
+
+	// Time when the next flip should be committed
+	double next_flip_time() const;
+	// Content frame to be shown in the next flip
+	uint64_t content_frame() const { return frame_at(m_flip); }
+	// true if the next flip shows the same content frame as the previous one
+	bool next_is_repeat() const { return m_flip > 0 && frame_at(m_flip) == frame_at(m_flip - 1); }
+
+	// Call from the page flip handler
+	void flip_presented(double time);
+
+private:
+	uint64_t frame_at(uint64_t flip) const;
+
+	double m_fps;
+	unsigned m_repeats;
+	double m_interval;
+
+	uint64_t m_flip;
+	double m_start;
+};
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <kms++/pixelformats.h>
+
+namespace kms
+{
+class IFramebuffer;
+class RawVideoWriter;
+
+// Writes frames to a raw file from a separate writer thread, so that a slow
+// disk doesn't stall the capture or display loop. record() copies the frame
+// into one of a fixed number of buffers, and the writer thread writes the
+// queued buffers in large batches.
+//
+// The planes of each frame are written tightly packed, without the stride
+// padding. An index file, <filename>.idx, gets a line for each written frame
+// with the frame number, its offset in the raw file and its timestamp. Frame
+// numbers of dropped frames are missing from the index.
+//
+// If filename ends with ".kmsv", the frames are written with a RawVideoWriter
+// instead, and no separate index file is written.
+class FrameRecorder
+{
+public:
+	// What record() does when all the buffers are waiting to be written
+	enum class Policy {
+		// Wait for the writer thread
+		Block,
+		// Drop the oldest frame not yet being written
+		DropOldest,
+	};
+
+	// With direct, the file is written with O_DIRECT, bypassing the page
+	// cache, through an aligned staging buffer.
+	FrameRecorder(const std::string& filename, uint32_t width, uint32_t height, PixelFormat format,
+		      unsigned num_buffers = 8, Policy policy = Policy::Block, bool direct = false);
+	~FrameRecorder();
+
+	FrameRecorder(const FrameRecorder& other) = delete;
+	FrameRecorder& operator=(const FrameRecorder& other) = delete;
+
+	// Size of a frame in the file
+	size_t frame_size() const { return m_frame_size; }
+
+	// Queue the frame for writing. timestamp is in CLOCK_MONOTONIC seconds,
+	// by default the current time.
+	void record(IFramebuffer& fb);
+	void record(IFramebuffer& fb, double timestamp);
+
+	// Wait until all the queued frames have been written, including the
+	// data staged for O_DIRECT. Throws if a write has failed.
+	void flush();
+
+	uint64_t frames_recorded() const { return m_frames_recorded; }
+	uint64_t frames_written() const { return m_frames_written; }
+	uint64_t frames_dropped() const { return m_frames_dropped; }
+
+private:
+	struct FrameBuffer
+	{
+		uint8_t* data;
+		uint64_t frame_num;
+		double timestamp;
+	};
+
+	void open_raw(const std::string& filename);
+	void copy_frame(IFramebuffer& fb, uint8_t* dst);
+	void write_frame(const FrameBuffer& buf);
+	void write_data(const uint8_t* data, size_t len);
+	void flush_staging();
+	void write_staged_blocks();
+	void check_error();
+	void writer_main();
+
+	uint32_t m_width;
+	uint32_t m_height;
+	PixelFormat m_format;
+	size_t m_frame_size;
+	Policy m_policy;
+	bool m_direct;
+
+	int m_fd = -1;
+	FILE* m_index = nullptr;
+	std::unique_ptr<RawVideoWriter> m_video;
+	uint64_t m_offset = 0;
+
+	std::vector<FrameBuffer> m_bufs;
+	std::vector<unsigned> m_free;
+	std::deque<unsigned> m_pending;
+	// Buffers taken by the writer thread
+	std::vector<unsigned> m_writing;
+
+	// Aligned staging buffer for O_DIRECT
+	uint8_t* m_staging = nullptr;
+	size_t m_staging_size = 0;
+	size_t m_staging_used = 0;
+
+	std::atomic<uint64_t> m_frames_recorded { 0 };
+	std::atomic<uint64_t> m_frames_written { 0 };
+	std::atomic<uint64_t> m_frames_dropped { 0 };
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::thread m_writer;
+	bool m_stop = false;
+	// errno of a failed write in the writer thread
+	std::atomic<int> m_error { 0 };
+};
+
+}
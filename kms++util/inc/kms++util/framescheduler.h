@@ -0,0 +1,65 @@
+#pragma once
+
+#include <kms++/kms++.h>
+
+namespace kms
+{
+
+// Predicts the vblanks of a crtc and tells when to start a frame so that it is
+// committed just in time for the next vblank. The frame cost and the safety
+// margin are tuned from the measured frames and the missed deadlines.
+//
+// Times are CLOCK_MONOTONIC seconds, the same as in the page flip events.
+class FrameScheduler
+{
+public:
+	FrameScheduler(Crtc* crtc, const Videomode& mode);
+
+	static double now();
+
+	// Time when the next frame should be started
+	double wakeup_time() const;
+	// Seconds until wakeup_time(), 0 if it has passed
+	double time_to_wakeup() const;
+	// Predicted time of the vblank the next frame is targeted at
+	double target_vblank_time() const;
+
+	// Call when starting to render a frame
+	void frame_start();
+	// Call when the commit for the frame has returned
+	void frame_committed();
+	// Call instead of committing if there was nothing new to show
+	void frame_skipped();
+	// Call from the page flip handler
+	void frame_presented(uint32_t frame, double time);
+
+	double frame_period() const { return m_period; }
+	double frame_cost() const { return m_frame_cost; }
+	double margin() const { return m_margin; }
+	unsigned missed_frames() const { return m_missed; }
+
+private:
+	void resync();
+	uint64_t target_seq(double t) const;
+	double seq_time(uint64_t seq) const { return m_anchor_time + (double)(seq - m_anchor_seq) * m_period; }
+
+	Crtc* m_crtc;
+
+	double m_period;
+	uint64_t m_anchor_seq;
+	double m_anchor_time;
+	uint32_t m_anchor_frame;
+	bool m_have_frame;
+
+	uint64_t m_presented_seq;
+	uint64_t m_next_seq;
+
+	double m_frame_cost;
+	double m_margin;
+	unsigned m_missed;
+
+	double m_frame_start;
+	uint64_t m_frame_seq;
+};
+
+}
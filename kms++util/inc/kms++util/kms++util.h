@@ -9,6 +9,10 @@
 #include <kms++util/stopwatch.h>
 #include <kms++util/opts.h>
 #include <kms++util/resourcemanager.h>
+#include <kms++util/framescheduler.h>
+#include <kms++util/framepacer.h>
+#include <kms++util/presentationqueue.h>
+#include <kms++util/fbcompare.h>
 
 #include <cstdio>
 #include <cstdlib>
@@ -29,6 +33,12 @@ void draw_text(IFramebuffer& buf, uint32_t x, uint32_t y, const std::string& str
 void draw_color_bar(IFramebuffer& buf, int old_xpos, int xpos, int width);
 
 void draw_test_pattern(IFramebuffer &fb, YUVType yuvt = YUVType::BT601_Lim);
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+// CRC of the concatenation of two blocks, given the CRCs of the blocks
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+// CRC32C of the visible pixels of each plane, skipping the stride padding
+std::vector<uint32_t> fb_crc32c(IFramebuffer& fb);
 }
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+namespace kms
+{
+
+// Schedules captured frames for display by their capture timestamps instead of
+// their arrival. Each frame is due at its timestamp plus a fixed delay, and
+// at each vblank the newest due frame is shown. Older due frames are dropped,
+// and if no frame is due the current one is repeated, so that a source
+// drifting against the display slips a whole frame at a time instead of
+// juddering.
+//
+// Frames are identified by a caller chosen id, e.g. a buffer index. Times are
+// CLOCK_MONOTONIC seconds, the same as in V4L2 monotonic timestamps and the
+// page flip events.
+class PresentationQueue
+{
+public:
+	// With delay 0, the delay follows the measured capture to push latency
+	PresentationQueue(double display_period, double delay = 0);
+
+	// Add a captured frame
+	void push(uint32_t id, double timestamp);
+
+	// Call with the time of each flip, to keep the predicted vblanks in
+	// phase with the display
+	void vblank(double time);
+	// Predicted time of the first vblank after t
+	double next_vblank(double t) const;
+	// Predicted vblank at which the oldest queued frame is due, 0 if the
+	// queue is empty
+	double next_due_vblank() const;
+
+	// Pick the frame to show at the vblank at vblank_time. Returns false if
+	// no new frame is due, and the current frame should be repeated.
+	bool select(double vblank_time, uint32_t& id);
+	// Frames dropped by select(), to be given back to the source
+	std::vector<uint32_t> take_dropped();
+
+	bool empty() const { return m_frames.empty(); }
+	size_t size() const { return m_frames.size(); }
+
+	double delay() const;
+	double display_period() const { return m_display_period; }
+	// 0 until two frames have been pushed
+	double source_period() const { return m_source_period; }
+	// How fast the source clock drifts against the display, in ppm,
+	// relative to the nearest integer ratio of the frame rates
+	double drift_ppm() const;
+
+	uint64_t frames_shown() const { return m_shown; }
+	uint64_t frames_dropped() const { return m_dropped; }
+	// vblanks a frame was shown for more than the frame rate ratio calls for
+	uint64_t frames_repeated() const { return m_repeated; }
+
+private:
+	void fit_source_period(double timestamp);
+
+	struct Frame
+	{
+		uint32_t id;
+		double timestamp;
+	};
+
+	double m_display_period;
+	double m_fixed_delay;
+	// Peak capture to push latency
+	double m_latency = 0;
+
+	std::deque<Frame> m_frames;
+	std::vector<uint32_t> m_dropped_ids;
+
+	double m_vblank_anchor = 0;
+
+	double m_last_timestamp = 0;
+	double m_source_period = 0;
+
+	// Least squares fit of the timestamps against the frame numbers,
+	// which count the frames lost by the source
+	uint64_t m_source_frame = 0;
+	double m_fit_t0 = 0;
+	uint64_t m_fit_n = 0;
+	double m_fit_mean_k = 0;
+	double m_fit_mean_t = 0;
+	double m_fit_kk = 0;
+	double m_fit_kt = 0;
+
+	double m_last_shown_vblank = 0;
+
+	uint64_t m_shown = 0;
+	uint64_t m_dropped = 0;
+	uint64_t m_repeated = 0;
+};
+
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <kms++/pixelformats.h>
+
+namespace kms
+{
+class IFramebuffer;
+class ExtCPUFramebuffer;
+
+// An indexed raw video file. The file starts with a header page giving the
+// size, format and plane layout of the frames. The frames follow, each
+// starting at a page aligned offset and with each plane page aligned, and
+// the file ends with a table of the offset and timestamp of each frame.
+//
+// Page aligned frames can be written with O_DIRECT, and a frame can be
+// mapped on its own, e.g. for V4L2 USERPTR buffers.
+
+class RawVideoWriter
+{
+public:
+	// fps is only stored in the header, 0 if not known. With direct, the
+	// file is written with O_DIRECT if the filesystem supports it.
+	RawVideoWriter(const std::string& filename, uint32_t width, uint32_t height, PixelFormat format,
+		       double fps = 0, bool direct = false);
+	~RawVideoWriter();
+
+	RawVideoWriter(const RawVideoWriter& other) = delete;
+	RawVideoWriter& operator=(const RawVideoWriter& other) = delete;
+
+	// Size of a frame in the file, a multiple of the page size
+	size_t frame_stride() const { return m_frame_stride; }
+	size_t plane_offset(unsigned plane) const { return m_plane_offsets[plane]; }
+	uint32_t stride(unsigned plane) const { return m_strides[plane]; }
+
+	// Copy the frame from fb to buf, laid out as in the file
+	void pack_frame(IFramebuffer& fb, uint8_t* buf) const;
+
+	// Write a frame of frame_stride() bytes laid out as in the file. With
+	// O_DIRECT, data has to be page aligned. timestamp is in seconds.
+	void write_frame(const uint8_t* data, double timestamp);
+	void write_frame(IFramebuffer& fb, double timestamp);
+
+	uint64_t num_frames() const { return m_index.size() / 2; }
+
+	// Write the index and the header. Called by the destructor.
+	void close();
+
+private:
+	// Fill the first page of m_buf with the header
+	void fill_header(uint64_t index_offset);
+	void write_data(const void* data, size_t len);
+
+	int m_fd;
+	bool m_direct;
+
+	uint32_t m_width;
+	uint32_t m_height;
+	PixelFormat m_format;
+	double m_fps;
+
+	uint32_t m_strides[4] { };
+	size_t m_plane_offsets[4] { };
+	size_t m_frame_stride;
+
+	uint64_t m_offset;
+	// Offset and timestamp in ns of each frame
+	std::vector<uint64_t> m_index;
+
+	// Page aligned buffer for write_frame(IFramebuffer&) and the header
+	uint8_t* m_buf = nullptr;
+};
+
+class RawVideoReader
+{
+public:
+	RawVideoReader(const std::string& filename);
+	~RawVideoReader();
+
+	RawVideoReader(const RawVideoReader& other) = delete;
+	RawVideoReader& operator=(const RawVideoReader& other) = delete;
+
+	// true if the file starts with the RawVideoWriter header
+	static bool is_raw_video(const std::string& filename);
+
+	uint32_t width() const { return m_width; }
+	uint32_t height() const { return m_height; }
+	PixelFormat format() const { return m_format; }
+	// 0 if not known
+	double fps() const { return m_fps; }
+	unsigned num_planes() const { return m_num_planes; }
+	uint32_t stride(unsigned plane) const { return m_strides[plane]; }
+
+	uint64_t num_frames() const { return m_num_frames; }
+	// false if the writer didn't finish, and the frames have no timestamps
+	bool has_index() const { return m_index != nullptr; }
+
+	// The file is mapped privately: writes to the frames are allowed, but
+	// don't change the file
+	uint8_t* frame(uint64_t n) const { return m_map + frame_offset(n); }
+	uint8_t* plane(uint64_t n, unsigned plane) const { return frame(n) + m_plane_offsets[plane]; }
+	size_t plane_offset(unsigned plane) const { return m_plane_offsets[plane]; }
+	uint64_t frame_offset(uint64_t n) const;
+	size_t frame_size() const { return m_frame_size; }
+
+	// In seconds, relative to the first frame
+	double timestamp(uint64_t n) const;
+	// The last frame whose timestamp is not after t
+	uint64_t find_frame(double t) const;
+
+	// A framebuffer using the mapped frame, without copying
+	std::unique_ptr<ExtCPUFramebuffer> framebuffer(uint64_t n) const;
+
+	// Ask the kernel to start reading the frames in the background, and
+	// mark the frames before them as the first ones to be reclaimed
+	void prefetch(uint64_t first, unsigned count);
+
+	int fd() const { return m_fd; }
+
+private:
+	int m_fd;
+	uint8_t* m_map = nullptr;
+	size_t m_size;
+
+	uint32_t m_width;
+	uint32_t m_height;
+	PixelFormat m_format;
+	double m_fps;
+	unsigned m_num_planes;
+	uint32_t m_strides[4] { };
+	size_t m_plane_offsets[4] { };
+	size_t m_plane_sizes[4] { };
+	size_t m_frame_size;
+	uint64_t m_frame_stride;
+	uint64_t m_first_offset;
+
+	uint64_t m_num_frames;
+	// Offset and timestamp pairs, nullptr if the file has no index
+	const uint64_t* m_index = nullptr;
+};
+
+}
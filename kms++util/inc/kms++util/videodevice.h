@@ -2,6 +2,8 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <unordered_map>
 #include <kms++/kms++.h>
 
 class VideoStreamer;
@@ -65,7 +67,23 @@ public:
 		OutputMulti,
 	};
 
+	// The V4L2 memory type of the buffers. With Dmabuf and Userptr the
+	// device accesses the queued framebuffers directly. With Mmap the
+	// device allocates the buffers: export_framebuffers() makes them
+	// available for zero-copy use, other queued framebuffers are copied
+	// to or from them.
+	enum class MemoryType {
+		Auto,
+		Mmap,
+		Userptr,
+		Dmabuf,
+	};
+
 	VideoStreamer(int fd, StreamerType type);
+	~VideoStreamer();
+
+	VideoStreamer(const VideoStreamer& other) = delete;
+	VideoStreamer& operator=(const VideoStreamer& other) = delete;
 
 	std::vector<std::string> get_ports();
 	void set_port(uint32_t index);
@@ -74,16 +92,65 @@ public:
 	void set_format(kms::PixelFormat fmt, uint32_t width, uint32_t height);
 	void get_selection(uint32_t& left, uint32_t& top, uint32_t& width, uint32_t& height);
 	void set_selection(uint32_t& left, uint32_t& top, uint32_t& width, uint32_t& height);
+
+	// Probed once, before any buffers are allocated
+	std::vector<MemoryType> get_memory_types();
+	// Call before set_queue_size(). Auto selects Dmabuf, Mmap or Userptr,
+	// in that order, depending on what the device supports.
+	void set_memory_type(MemoryType type);
+	// The selected type after set_queue_size()
+	MemoryType memory_type() const { return m_memory; }
+
 	void set_queue_size(uint32_t queue_size);
-	void queue(kms::DumbFramebuffer* fb);
-	kms::DumbFramebuffer* dequeue();
+	// Export the Mmap buffers as framebuffers on the card. The framebuffers
+	// are owned by the streamer.
+	std::vector<kms::Framebuffer*> export_framebuffers(kms::Card& card);
+	void queue(kms::Framebuffer* fb);
+	kms::Framebuffer* dequeue();
+	// Capture time of the last dequeued buffer in CLOCK_MONOTONIC
+	// seconds, 0 if the device doesn't use monotonic timestamps
+	double timestamp() const { return m_timestamp; }
 	void stream_on();
 	void stream_off();
 
 	int fd() const { return m_fd; }
 
 private:
+	struct MmapPlane
+	{
+		uint8_t* map;
+		uint32_t length;
+	};
+
+	void free_buffers();
+	uint8_t* mmap_plane(uint32_t idx, unsigned plane);
+	void copy_to_mmap(uint32_t idx, kms::Framebuffer* fb);
+	void copy_from_mmap(uint32_t idx, kms::Framebuffer* fb);
+
 	int m_fd;
 	StreamerType m_type;
-	std::vector<kms::DumbFramebuffer*> m_fbs;
+	MemoryType m_memory = MemoryType::Auto;
+	MemoryType m_requested_memory = MemoryType::Auto;
+	std::vector<MemoryType> m_memory_types;
+	bool m_memory_types_probed = false;
+	// The queued framebuffer of each V4L2 buffer index
+	std::vector<kms::Framebuffer*> m_fbs;
+	// A bit for each free index
+	uint64_t m_free_indices = 0;
+	// The index last used for each framebuffer. Queuing a framebuffer
+	// again to the same index lets the kernel reuse its dmabuf mapping.
+	std::unordered_map<kms::Framebuffer*, uint32_t> m_fb_indices;
+
+	// The current format, for copying to and from the Mmap buffers
+	kms::PixelFormat m_format = kms::PixelFormat::Undefined;
+	uint32_t m_width = 0;
+	uint32_t m_height = 0;
+	// Pitches reported by the driver, which may be padded
+	uint32_t m_bytesperline[4] { };
+
+	double m_timestamp = 0;
+
+	std::vector<std::vector<MmapPlane>> m_mmap_bufs;
+	std::vector<std::unique_ptr<kms::Framebuffer>> m_exported_fbs;
+	std::vector<int> m_exported_fds;
 };
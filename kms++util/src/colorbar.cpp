@@ -99,6 +99,8 @@ static void drm_draw_color_bar_semiplanar_yuv(IFramebuffer& buf, int old_xpos, i
 
 void draw_color_bar(IFramebuffer& buf, int old_xpos, int xpos, int width)
 {
+	KMSXX_TRACE_SCOPE("draw", "draw_color_bar");
+
 	switch (buf.format()) {
 	case PixelFormat::NV12:
 	case PixelFormat::NV21:
@@ -20,7 +20,8 @@ CPUFramebuffer::CPUFramebuffer(uint32_t width, uint32_t height, PixelFormat form
 		plane.stride = width * pi.bitspp / 8;
 		plane.size = plane.stride * height/ pi.ysub;
 		plane.offset = 0;
-		plane.map = new uint8_t[plane.size];
+		// zeroed, like dumb buffers
+		plane.map = new uint8_t[plane.size]();
 	}
 }
 
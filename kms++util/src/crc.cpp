@@ -0,0 +1,354 @@
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_CRC32C
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include <kms++/kms++.h>
+#include <kms++util/kms++util.h>
+
+using namespace std;
+
+namespace kms
+{
+
+// CRC32C (Castagnoli), reflected
+static const uint32_t crc32c_poly = 0x82f63b78;
+
+struct Crc32cTables
+{
+	Crc32cTables()
+	{
+		for (unsigned i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (unsigned j = 0; j < 8; ++j)
+				crc = crc & 1 ? (crc >> 1) ^ crc32c_poly : crc >> 1;
+			slice[0][i] = crc;
+		}
+
+		for (unsigned i = 0; i < 256; ++i)
+			for (unsigned s = 1; s < 8; ++s)
+				slice[s][i] = (slice[s - 1][i] >> 8) ^ slice[0][slice[s - 1][i] & 0xff];
+	}
+
+	uint32_t slice[8][256];
+};
+
+static const Crc32cTables s_tables;
+
+// Slicing-by-8, crc is not pre/post-inverted
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	const auto& t = s_tables.slice;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+
+		crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^
+		      t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+		      t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+		      t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#if defined(HAS_X86_CRC32C)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+#if defined(__x86_64__)
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static bool has_hw_crc32c()
+{
+	static const bool has = __builtin_cpu_supports("sse4.2");
+	return has;
+}
+
+#elif defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static bool has_hw_crc32c()
+{
+	return true;
+}
+
+#else
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	return crc32c_sw(crc, p, len);
+}
+
+static bool has_hw_crc32c()
+{
+	return false;
+}
+
+#endif
+
+static uint32_t crc32c_raw(uint32_t crc, const uint8_t* p, size_t len)
+{
+	if (has_hw_crc32c())
+		return crc32c_hw(crc, p, len);
+
+	return crc32c_sw(crc, p, len);
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+	return ~crc32c_raw(~crc, (const uint8_t*)data, len);
+}
+
+// GF(2) polynomial multiplication modulo the CRC polynomial, as in zlib's
+// crc32_combine()
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1u << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ crc32c_poly : b >> 1;
+	}
+
+	return p;
+}
+
+// x^(8 * len) modulo the CRC polynomial
+static uint32_t x8nmodp(uint64_t len)
+{
+	uint32_t p = 1u << 31;		// x^0
+	uint32_t x2n = 1u << 30;	// x^1, squared for each bit of the length
+
+	// start from x^8, for bytes
+	for (unsigned i = 0; i < 3; ++i)
+		x2n = multmodp(x2n, x2n);
+
+	while (len) {
+		if (len & 1)
+			p = multmodp(x2n, p);
+		len >>= 1;
+		x2n = multmodp(x2n, x2n);
+	}
+
+	return p;
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	return multmodp(x8nmodp(len2), crc1) ^ crc2;
+}
+
+static unsigned visible_row_bytes(IFramebuffer& fb, unsigned plane)
+{
+	const PixelFormatInfo& fi = get_pixel_format_info(fb.format());
+	const PixelFormatPlaneInfo& pi = fi.planes[plane];
+
+	unsigned bytes = fb.width() * pi.bitspp / 8;
+
+	// The chroma planes of fully planar YUV formats don't combine U and V
+	if (fi.type == PixelColorType::YUV && fi.num_planes == 3)
+		bytes /= pi.xsub;
+
+	return min(bytes, fb.stride(plane));
+}
+
+#if defined(HAS_X86_CRC32C)
+
+// Copy with non-temporal loads, which are much faster than normal loads from
+// write-combined memory
+__attribute__((target("sse4.1")))
+static void stream_copy(uint8_t* dst, const uint8_t* src, size_t len)
+{
+	size_t head = min(len, (size_t)(-(uintptr_t)src & 15));
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+
+	while (len >= 64) {
+		__m128i a = _mm_stream_load_si128((__m128i*)src);
+		__m128i b = _mm_stream_load_si128((__m128i*)(src + 16));
+		__m128i c = _mm_stream_load_si128((__m128i*)(src + 32));
+		__m128i d = _mm_stream_load_si128((__m128i*)(src + 48));
+
+		_mm_storeu_si128((__m128i*)dst, a);
+		_mm_storeu_si128((__m128i*)(dst + 16), b);
+		_mm_storeu_si128((__m128i*)(dst + 32), c);
+		_mm_storeu_si128((__m128i*)(dst + 48), d);
+
+		dst += 64;
+		src += 64;
+		len -= 64;
+	}
+
+	memcpy(dst, src, len);
+}
+
+static bool has_stream_load()
+{
+	static const bool has = __builtin_cpu_supports("sse4.1");
+	return has;
+}
+
+#endif
+
+// CRC of rows [start, end) of a plane, not pre/post-inverted. DRM buffer
+// mappings may be uncached or write-combined, so those rows are first copied
+// to a cached bounce buffer with non-temporal loads.
+static uint32_t crc_rows(const uint8_t* base, uint32_t stride, size_t row_bytes,
+			 unsigned start, unsigned end, uint32_t crc, bool uncached)
+{
+
+#if defined(HAS_X86_CRC32C)
+	if (uncached && has_stream_load()) {
+		vector<uint8_t> bounce(row_bytes);
+
+		for (unsigned y = start; y < end; ++y) {
+			stream_copy(bounce.data(), base + (size_t)stride * y, row_bytes);
+			crc = crc32c_raw(crc, bounce.data(), row_bytes);
+		}
+
+		return crc;
+	}
+#endif
+
+	for (unsigned y = start; y < end; ++y)
+		crc = crc32c_raw(crc, base + (size_t)stride * y, row_bytes);
+
+	return crc;
+}
+
+// Planes smaller than this are not worth splitting between threads
+static const size_t crc_min_thread_bytes = 256 * 1024;
+
+static uint32_t plane_crc32c(IFramebuffer& fb, unsigned plane, bool uncached)
+{
+	const PixelFormatInfo& fi = get_pixel_format_info(fb.format());
+	const unsigned rows = fb.height() / fi.planes[plane].ysub;
+	const size_t row_bytes = visible_row_bytes(fb, plane);
+
+	// Map in this thread, the framebuffers map lazily without locking
+	const uint8_t* base = fb.map(plane);
+	const uint32_t stride = fb.stride(plane);
+
+	unsigned num_threads = 1;
+
+#ifdef HAS_PTHREAD
+	num_threads = min((size_t)max(thread::hardware_concurrency(), 1u),
+			  max(row_bytes * rows / crc_min_thread_bytes, (size_t)1));
+	num_threads = min(num_threads, max(rows, 1u));
+#endif
+
+	if (num_threads == 1)
+		return ~crc_rows(base, stride, row_bytes, 0, rows, ~0u, uncached);
+
+	vector<uint32_t> crcs(num_threads);
+	vector<unsigned> starts(num_threads + 1);
+
+	for (unsigned n = 0; n <= num_threads; ++n)
+		starts[n] = rows * n / num_threads;
+
+#ifdef HAS_PTHREAD
+	vector<thread> workers;
+
+	for (unsigned n = 0; n < num_threads; ++n)
+		workers.push_back(thread([&, n]() {
+			crcs[n] = ~crc_rows(base, stride, row_bytes, starts[n], starts[n + 1], ~0u, uncached);
+		}));
+
+	for (thread& t : workers)
+		t.join();
+#endif
+
+	uint32_t crc = crcs[0];
+
+	for (unsigned n = 1; n < num_threads; ++n)
+		crc = crc32c_combine(crc, crcs[n], row_bytes * (starts[n + 1] - starts[n]));
+
+	return crc;
+}
+
+vector<uint32_t> fb_crc32c(IFramebuffer& fb)
+{
+	// Buffers from a DRM device may be mapped uncached
+	bool uncached = dynamic_cast<Framebuffer*>(&fb) != nullptr;
+
+	vector<uint32_t> crcs;
+
+	for (unsigned p = 0; p < fb.num_planes(); ++p)
+		crcs.push_back(plane_crc32c(fb, p, uncached));
+
+	return crcs;
+}
+
+}
@@ -393,6 +393,8 @@ void draw_yuv420_macropixel(IFramebuffer& buf, unsigned x, unsigned y,
 
 void draw_rect(IFramebuffer &fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h, RGB color)
 {
+	KMSXX_TRACE_SCOPE("draw", "draw_rect");
+
 	unsigned i, j;
 	YUV yuvcolor = color.yuv();
 
@@ -565,6 +567,8 @@ static void draw_char(IFramebuffer& buf, uint32_t xpos, uint32_t ypos, char c, R
 
 void draw_text(IFramebuffer& buf, uint32_t x, uint32_t y, const string& str, RGB color)
 {
+	KMSXX_TRACE_SCOPE("draw", "draw_text");
+
 	for(unsigned i = 0; i < str.size(); i++)
 		draw_char(buf, (x + 8 * i), y, str[i], color);
 }
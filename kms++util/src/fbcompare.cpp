@@ -0,0 +1,597 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <kms++/kms++.h>
+#include <kms++util/kms++util.h>
+#include <kms++util/fbcompare.h>
+
+using namespace std;
+
+namespace kms
+{
+
+// One row of a framebuffer, unpacked to 8-bit R, G, B or Y, U, V components
+struct CompareRow
+{
+	CompareRow(unsigned width) : c { vector<uint8_t>(width), vector<uint8_t>(width), vector<uint8_t>(width) } { }
+
+	vector<uint8_t> c[3];
+};
+
+static inline uint8_t expand(uint32_t v, unsigned bits)
+{
+	// Replicate the high bits to the low bits, so that max maps to 255
+	v <<= 8 - bits;
+	while (bits < 8) {
+		v |= v >> bits;
+		bits *= 2;
+	}
+	return (uint8_t)v;
+}
+
+static void unpack_rgb_row(IFramebuffer& fb, unsigned y, CompareRow& row)
+{
+	const unsigned w = fb.width();
+	const uint8_t* p = fb.map(0) + (size_t)fb.stride(0) * y;
+	const uint32_t* p32 = (const uint32_t*)p;
+	const uint16_t* p16 = (const uint16_t*)p;
+	uint8_t* r = row.c[0].data();
+	uint8_t* g = row.c[1].data();
+	uint8_t* b = row.c[2].data();
+
+	switch (fb.format()) {
+	case PixelFormat::XRGB8888:
+	case PixelFormat::ARGB8888:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x] >> 16;
+			g[x] = p32[x] >> 8;
+			b[x] = p32[x];
+		}
+		break;
+	case PixelFormat::XBGR8888:
+	case PixelFormat::ABGR8888:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x];
+			g[x] = p32[x] >> 8;
+			b[x] = p32[x] >> 16;
+		}
+		break;
+	case PixelFormat::RGBX8888:
+	case PixelFormat::RGBA8888:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x] >> 24;
+			g[x] = p32[x] >> 16;
+			b[x] = p32[x] >> 8;
+		}
+		break;
+	case PixelFormat::BGRX8888:
+	case PixelFormat::BGRA8888:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x] >> 8;
+			g[x] = p32[x] >> 16;
+			b[x] = p32[x] >> 24;
+		}
+		break;
+	case PixelFormat::XRGB2101010:
+	case PixelFormat::ARGB2101010:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x] >> 22;
+			g[x] = p32[x] >> 12;
+			b[x] = p32[x] >> 2;
+		}
+		break;
+	case PixelFormat::XBGR2101010:
+	case PixelFormat::ABGR2101010:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x] >> 2;
+			g[x] = p32[x] >> 12;
+			b[x] = p32[x] >> 22;
+		}
+		break;
+	case PixelFormat::RGBX1010102:
+	case PixelFormat::RGBA1010102:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x] >> 24;
+			g[x] = p32[x] >> 14;
+			b[x] = p32[x] >> 4;
+		}
+		break;
+	case PixelFormat::BGRX1010102:
+	case PixelFormat::BGRA1010102:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p32[x] >> 4;
+			g[x] = p32[x] >> 14;
+			b[x] = p32[x] >> 24;
+		}
+		break;
+	case PixelFormat::RGB888:
+		for (unsigned x = 0; x < w; ++x) {
+			b[x] = p[x * 3 + 0];
+			g[x] = p[x * 3 + 1];
+			r[x] = p[x * 3 + 2];
+		}
+		break;
+	case PixelFormat::BGR888:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = p[x * 3 + 0];
+			g[x] = p[x * 3 + 1];
+			b[x] = p[x * 3 + 2];
+		}
+		break;
+	case PixelFormat::RGB565:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = expand((p16[x] >> 11) & 0x1f, 5);
+			g[x] = expand((p16[x] >> 5) & 0x3f, 6);
+			b[x] = expand(p16[x] & 0x1f, 5);
+		}
+		break;
+	case PixelFormat::BGR565:
+		for (unsigned x = 0; x < w; ++x) {
+			b[x] = expand((p16[x] >> 11) & 0x1f, 5);
+			g[x] = expand((p16[x] >> 5) & 0x3f, 6);
+			r[x] = expand(p16[x] & 0x1f, 5);
+		}
+		break;
+	case PixelFormat::XRGB4444:
+	case PixelFormat::ARGB4444:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = expand((p16[x] >> 8) & 0xf, 4);
+			g[x] = expand((p16[x] >> 4) & 0xf, 4);
+			b[x] = expand(p16[x] & 0xf, 4);
+		}
+		break;
+	case PixelFormat::XRGB1555:
+	case PixelFormat::ARGB1555:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = expand((p16[x] >> 10) & 0x1f, 5);
+			g[x] = expand((p16[x] >> 5) & 0x1f, 5);
+			b[x] = expand(p16[x] & 0x1f, 5);
+		}
+		break;
+	case PixelFormat::RGB332:
+		for (unsigned x = 0; x < w; ++x) {
+			r[x] = expand((p[x] >> 5) & 0x7, 3);
+			g[x] = expand((p[x] >> 2) & 0x7, 3);
+			b[x] = expand(p[x] & 0x3, 2);
+		}
+		break;
+	default:
+		throw invalid_argument("fb_compare: unsupported pixel format");
+	}
+}
+
+// The chroma of the last pixel of an odd width 4:2:2 or 4:2:0 row may be
+// outside the row, so repeat the previous pixel's chroma
+static void odd_width_chroma(uint8_t* ou, uint8_t* ov, unsigned w)
+{
+	ou[w - 1] = w > 1 ? ou[w - 2] : 128;
+	ov[w - 1] = w > 1 ? ov[w - 2] : 128;
+}
+
+// The subsampled planes of an odd height frame have no row for the last luma
+// row, so reuse the previous one
+static unsigned chroma_row(IFramebuffer& fb, unsigned y, unsigned ysub)
+{
+	unsigned rows = fb.height() / ysub;
+
+	return min(y / ysub, rows > 0 ? rows - 1 : 0);
+}
+
+static void unpack_yuv_row(IFramebuffer& fb, unsigned y, CompareRow& row)
+{
+	const unsigned w = fb.width();
+	const uint8_t* py = fb.map(0) + (size_t)fb.stride(0) * y;
+	uint8_t* oy = row.c[0].data();
+	uint8_t* ou = row.c[1].data();
+	uint8_t* ov = row.c[2].data();
+
+	// Offsets of Y0, U, Y1, V in a packed 4:2:2 macropixel
+	unsigned y0, u, y1, v;
+
+	switch (fb.format()) {
+	case PixelFormat::YUYV: y0 = 0; u = 1; y1 = 2; v = 3; break;
+	case PixelFormat::YVYU: y0 = 0; v = 1; y1 = 2; u = 3; break;
+	case PixelFormat::UYVY: u = 0; y0 = 1; v = 2; y1 = 3; break;
+	case PixelFormat::VYUY: v = 0; y0 = 1; u = 2; y1 = 3; break;
+	default: y0 = u = y1 = v = 0; break;
+	}
+
+	switch (fb.format()) {
+	case PixelFormat::YUYV:
+	case PixelFormat::YVYU:
+	case PixelFormat::UYVY:
+	case PixelFormat::VYUY:
+		for (unsigned x = 0; x + 1 < w; x += 2) {
+			const uint8_t* m = py + x * 2;
+			oy[x] = m[y0];
+			oy[x + 1] = m[y1];
+			ou[x] = ou[x + 1] = m[u];
+			ov[x] = ov[x + 1] = m[v];
+		}
+
+		// The last macropixel of an odd width row has only the first luma
+		if (w & 1) {
+			oy[w - 1] = py[(w - 1) * 2 + y0];
+			odd_width_chroma(ou, ov, w);
+		}
+		return;
+	default:
+		break;
+	}
+
+	memcpy(oy, py, w);
+
+	switch (fb.format()) {
+	case PixelFormat::NV12:
+	case PixelFormat::NV21:
+	case PixelFormat::NV16:
+	case PixelFormat::NV61:
+	{
+		bool swap = fb.format() == PixelFormat::NV21 || fb.format() == PixelFormat::NV61;
+		unsigned cy = chroma_row(fb, y, get_pixel_format_info(fb.format()).planes[1].ysub);
+		const uint8_t* puv = fb.map(1) + (size_t)fb.stride(1) * cy;
+
+		for (unsigned x = 0; x + 1 < w; x += 2) {
+			uint8_t cu = puv[x + (swap ? 1 : 0)];
+			uint8_t cv = puv[x + (swap ? 0 : 1)];
+			ou[x] = ou[x + 1] = cu;
+			ov[x] = ov[x + 1] = cv;
+		}
+
+		if (w & 1)
+			odd_width_chroma(ou, ov, w);
+		break;
+	}
+	case PixelFormat::YUV420:
+	case PixelFormat::YVU420:
+	case PixelFormat::YUV422:
+	case PixelFormat::YVU422:
+	case PixelFormat::YUV444:
+	case PixelFormat::YVU444:
+	{
+		const PixelFormatPlaneInfo& pi = get_pixel_format_info(fb.format()).planes[1];
+		bool swap = fb.format() == PixelFormat::YVU420 || fb.format() == PixelFormat::YVU422 ||
+			    fb.format() == PixelFormat::YVU444;
+		unsigned cy = chroma_row(fb, y, pi.ysub);
+		const uint8_t* pu = fb.map(swap ? 2 : 1) + (size_t)fb.stride(swap ? 2 : 1) * cy;
+		const uint8_t* pv = fb.map(swap ? 1 : 2) + (size_t)fb.stride(swap ? 1 : 2) * cy;
+
+		for (unsigned x = 0; x < w; ++x) {
+			ou[x] = pu[x / pi.xsub];
+			ov[x] = pv[x / pi.xsub];
+		}
+		break;
+	}
+	default:
+		throw invalid_argument("fb_compare: unsupported pixel format");
+	}
+}
+
+// The unpacking runs in the worker threads, so check the formats up front
+static bool unpack_supported(PixelFormat fmt)
+{
+	switch (fmt) {
+	case PixelFormat::XRGB8888:
+	case PixelFormat::ARGB8888:
+	case PixelFormat::XBGR8888:
+	case PixelFormat::ABGR8888:
+	case PixelFormat::RGBX8888:
+	case PixelFormat::RGBA8888:
+	case PixelFormat::BGRX8888:
+	case PixelFormat::BGRA8888:
+	case PixelFormat::XRGB2101010:
+	case PixelFormat::ARGB2101010:
+	case PixelFormat::XBGR2101010:
+	case PixelFormat::ABGR2101010:
+	case PixelFormat::RGBX1010102:
+	case PixelFormat::RGBA1010102:
+	case PixelFormat::BGRX1010102:
+	case PixelFormat::BGRA1010102:
+	case PixelFormat::RGB888:
+	case PixelFormat::BGR888:
+	case PixelFormat::RGB565:
+	case PixelFormat::BGR565:
+	case PixelFormat::XRGB4444:
+	case PixelFormat::ARGB4444:
+	case PixelFormat::XRGB1555:
+	case PixelFormat::ARGB1555:
+	case PixelFormat::RGB332:
+	case PixelFormat::YUYV:
+	case PixelFormat::YVYU:
+	case PixelFormat::UYVY:
+	case PixelFormat::VYUY:
+	case PixelFormat::NV12:
+	case PixelFormat::NV21:
+	case PixelFormat::NV16:
+	case PixelFormat::NV61:
+	case PixelFormat::YUV420:
+	case PixelFormat::YVU420:
+	case PixelFormat::YUV422:
+	case PixelFormat::YVU422:
+	case PixelFormat::YUV444:
+	case PixelFormat::YVU444:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void unpack_row(IFramebuffer& fb, unsigned y, bool yuv_space, YUVType yuvt, CompareRow& row)
+{
+	if (get_pixel_format_info(fb.format()).type == PixelColorType::YUV) {
+		unpack_yuv_row(fb, y, row);
+		return;
+	}
+
+	unpack_rgb_row(fb, y, row);
+
+	if (!yuv_space)
+		return;
+
+	for (unsigned x = 0; x < fb.width(); ++x) {
+		YUV yuv = RGB(row.c[0][x], row.c[1][x], row.c[2][x]).yuv(yuvt);
+		row.c[0][x] = yuv.y;
+		row.c[1][x] = yuv.u;
+		row.c[2][x] = yuv.v;
+	}
+}
+
+// Accumulates the squared differences of a and b, and updates maxd with the
+// absolute differences
+static uint64_t diff_components(const uint8_t* a, const uint8_t* b, uint8_t* maxd, unsigned n)
+{
+	uint64_t sse = 0;
+	unsigned x = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	// 32-bit lanes can't overflow within a row of less than 64k pixels
+	__m128i acc = zero;
+
+	for (; x + 16 <= n; x += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+		__m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+		__m128i m = _mm_loadu_si128((const __m128i*)(maxd + x));
+
+		_mm_storeu_si128((__m128i*)(maxd + x), _mm_max_epu8(m, d));
+
+		__m128i lo = _mm_unpacklo_epi8(d, zero);
+		__m128i hi = _mm_unpackhi_epi8(d, zero);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+	}
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i*)lanes, acc);
+	sse = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+
+	for (; x + 16 <= n; x += 16) {
+		uint8x16_t d = vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x));
+
+		vst1q_u8(maxd + x, vmaxq_u8(vld1q_u8(maxd + x), d));
+
+		acc = vpadalq_u16(acc, vmull_u8(vget_low_u8(d), vget_low_u8(d)));
+		acc = vpadalq_u16(acc, vmull_u8(vget_high_u8(d), vget_high_u8(d)));
+	}
+
+	sse = (uint64_t)vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+	      vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+	for (; x < n; ++x) {
+		unsigned d = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+		maxd[x] = max<unsigned>(maxd[x], d);
+		sse += d * d;
+	}
+
+	return sse;
+}
+
+static const unsigned ssim_block = 8;
+
+struct CompareAccum
+{
+	uint64_t sse = 0;
+	unsigned max_error = 0;
+	uint64_t diff_pixels = 0;
+	double ssim_sum = 0;
+	uint64_t ssim_blocks = 0;
+};
+
+static double block_ssim(const uint8_t* la, const uint8_t* lb, unsigned width, unsigned x0)
+{
+	const double c1 = (0.01 * 255) * (0.01 * 255);
+	const double c2 = (0.03 * 255) * (0.03 * 255);
+	const double n = ssim_block * ssim_block;
+
+	uint32_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+
+	for (unsigned y = 0; y < ssim_block; ++y) {
+		const uint8_t* pa = la + y * width + x0;
+		const uint8_t* pb = lb + y * width + x0;
+
+		for (unsigned x = 0; x < ssim_block; ++x) {
+			uint32_t va = pa[x];
+			uint32_t vb = pb[x];
+			sa += va;
+			sb += vb;
+			saa += va * va;
+			sbb += vb * vb;
+			sab += va * vb;
+		}
+	}
+
+	double ma = sa / n;
+	double mb = sb / n;
+	double va = saa / n - ma * ma;
+	double vb = sbb / n - mb * mb;
+	double cov = sab / n - ma * mb;
+
+	return ((2 * ma * mb + c1) * (2 * cov + c2)) /
+	       ((ma * ma + mb * mb + c1) * (va + vb + c2));
+}
+
+// Compare rows [start, end), start being a multiple of the SSIM block height
+static void compare_part(IFramebuffer& a, IFramebuffer& b, IFramebuffer* diff, bool yuv_space,
+			 YUVType yuvt, unsigned start, unsigned end, CompareAccum& accum)
+{
+	const unsigned w = a.width();
+
+	CompareRow ra(w);
+	CompareRow rb(w);
+	vector<uint8_t> maxd(w);
+
+	// Luma of a band of rows, for SSIM
+	vector<uint8_t> luma_a(w * ssim_block);
+	vector<uint8_t> luma_b(w * ssim_block);
+
+	for (unsigned y = start; y < end; ++y) {
+		unpack_row(a, y, yuv_space, yuvt, ra);
+		unpack_row(b, y, yuv_space, yuvt, rb);
+
+		fill(maxd.begin(), maxd.end(), 0);
+
+		for (unsigned c = 0; c < 3; ++c)
+			accum.sse += diff_components(ra.c[c].data(), rb.c[c].data(), maxd.data(), w);
+
+		for (unsigned x = 0; x < w; ++x) {
+			accum.max_error = max<unsigned>(accum.max_error, maxd[x]);
+			accum.diff_pixels += maxd[x] != 0;
+		}
+
+		if (diff) {
+			uint32_t* p = (uint32_t*)(diff->map(0) + (size_t)diff->stride(0) * y);
+
+			for (unsigned x = 0; x < w; ++x) {
+				uint32_t v = min(maxd[x] * 8u, 255u);
+				p[x] = 0xff000000 | (v << 16) | (v << 8) | v;
+			}
+		}
+
+		uint8_t* la = &luma_a[(y % ssim_block) * w];
+		uint8_t* lb = &luma_b[(y % ssim_block) * w];
+
+		if (yuv_space) {
+			memcpy(la, ra.c[0].data(), w);
+			memcpy(lb, rb.c[0].data(), w);
+		} else {
+			for (unsigned x = 0; x < w; ++x) {
+				la[x] = (77 * ra.c[0][x] + 150 * ra.c[1][x] + 29 * ra.c[2][x]) >> 8;
+				lb[x] = (77 * rb.c[0][x] + 150 * rb.c[1][x] + 29 * rb.c[2][x]) >> 8;
+			}
+		}
+
+		if (y % ssim_block != ssim_block - 1)
+			continue;
+
+		for (unsigned x = 0; x + ssim_block <= w; x += ssim_block) {
+			accum.ssim_sum += block_ssim(luma_a.data(), luma_b.data(), w, x);
+			accum.ssim_blocks++;
+		}
+	}
+}
+
+FbCompareResult fb_compare(IFramebuffer& a, IFramebuffer& b, IFramebuffer* diff, YUVType yuvt)
+{
+	KMSXX_TRACE_SCOPE("util", "fb_compare");
+
+	if (a.width() != b.width() || a.height() != b.height())
+		throw invalid_argument("fb_compare: framebuffer sizes differ");
+
+	if (diff) {
+		if (diff->width() != a.width() || diff->height() != a.height())
+			throw invalid_argument("fb_compare: diff framebuffer size differs");
+
+		if (diff->format() != PixelFormat::XRGB8888 && diff->format() != PixelFormat::ARGB8888)
+			throw invalid_argument("fb_compare: diff framebuffer must be XRGB8888 or ARGB8888");
+	}
+
+	if (!unpack_supported(a.format()) || !unpack_supported(b.format()))
+		throw invalid_argument("fb_compare: unsupported pixel format");
+
+	bool yuv_space = get_pixel_format_info(a.format()).type == PixelColorType::YUV ||
+			 get_pixel_format_info(b.format()).type == PixelColorType::YUV;
+
+	const unsigned h = a.height();
+
+	vector<CompareAccum> accums;
+
+#ifdef HAS_PTHREAD
+	// Create the mmaps before starting the threads
+	for (IFramebuffer* fb : { &a, &b, diff }) {
+		if (!fb)
+			continue;
+		for (unsigned i = 0; i < fb->num_planes(); ++i)
+			fb->map(i);
+	}
+
+	unsigned num_threads = max(thread::hardware_concurrency(), 1u);
+	unsigned part = (h / num_threads) / ssim_block * ssim_block;
+
+	if (part == 0) {
+		num_threads = 1;
+		part = h;
+	}
+
+	accums.resize(num_threads);
+	vector<thread> workers;
+
+	for (unsigned n = 0; n < num_threads; ++n) {
+		unsigned start = n * part;
+		unsigned end = start + part;
+
+		if (n == num_threads - 1)
+			end = h;
+
+		workers.push_back(thread([&, n, start, end]() {
+			compare_part(a, b, diff, yuv_space, yuvt, start, end, accums[n]);
+		}));
+	}
+
+	for (thread& t : workers)
+		t.join();
+#else
+	accums.resize(1);
+	compare_part(a, b, diff, yuv_space, yuvt, 0, h, accums[0]);
+#endif
+
+	CompareAccum total;
+
+	for (const CompareAccum& acc : accums) {
+		total.sse += acc.sse;
+		total.max_error = max(total.max_error, acc.max_error);
+		total.diff_pixels += acc.diff_pixels;
+		total.ssim_sum += acc.ssim_sum;
+		total.ssim_blocks += acc.ssim_blocks;
+	}
+
+	FbCompareResult res;
+
+	res.max_error = total.max_error;
+	res.diff_pixels = total.diff_pixels;
+	res.mse = (double)total.sse / ((double)a.width() * h * 3);
+
+	if (res.mse == 0)
+		res.psnr = numeric_limits<double>::infinity();
+	else
+		res.psnr = 10 * log10(255.0 * 255.0 / res.mse);
+
+	res.ssim = total.ssim_blocks ? total.ssim_sum / total.ssim_blocks : 1.0;
+
+	return res;
+}
+
+}
@@ -0,0 +1,68 @@
+#include <cmath>
+#include <algorithm>
+
+#include <kms++util/framepacer.h>
+#include <kms++util/framescheduler.h>
+
+using namespace std;
+
+namespace kms
+{
+
+// Flips late by a little at the bottom of the range would make the panel
+// insert a refresh, and flips early at the top would wait for the next one
+static const double vrr_margin = 0.02;
+
+FramePacer::FramePacer(double content_fps, double min_hz, double max_hz)
+	: m_fps(content_fps), m_flip(0), m_start(0)
+{
+	double lo = min_hz * (1 + vrr_margin);
+	double hi = max_hz > 0 ? max_hz * (1 - vrr_margin) : HUGE_VAL;
+
+	// A range too narrow for the margin
+	if (hi < lo)
+		lo = hi = (min_hz + max_hz) / 2;
+
+	unsigned n = max(1.0, ceil(lo / content_fps));
+
+	if (content_fps * n <= hi) {
+		m_repeats = n;
+		m_interval = 1.0 / (content_fps * n);
+	} else {
+		// No whole number of flips per frame fits, e.g. 40 fps on a
+		// 48-60 Hz panel, or the content is faster than the panel
+		m_repeats = 0;
+		m_interval = 1.0 / hi;
+	}
+}
+
+uint64_t FramePacer::frame_at(uint64_t flip) const
+{
+	if (m_repeats)
+		return flip / m_repeats;
+
+	// The small bias keeps exact frame boundaries from rounding down
+	return (uint64_t)(flip * m_interval * m_fps + 1e-6);
+}
+
+double FramePacer::next_flip_time() const
+{
+	if (m_flip == 0)
+		return FrameScheduler::now();
+
+	return m_start + m_flip * m_interval;
+}
+
+void FramePacer::flip_presented(double time)
+{
+	if (m_flip == 0)
+		m_start = time;
+
+	// If we're more than a flip late, restart the cadence from here
+	if (time > m_start + m_flip * m_interval + m_interval)
+		m_start = time - m_flip * m_interval;
+
+	m_flip++;
+}
+
+}
@@ -0,0 +1,420 @@
+#include <cstring>
+#include <cinttypes>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <kms++/kms++.h>
+#include <kms++util/kms++util.h>
+#include <kms++util/framerecorder.h>
+#include <kms++util/rawvideo.h>
+
+using namespace std;
+
+namespace kms
+{
+
+// Alignment of the buffers and of the O_DIRECT writes
+static const size_t rec_align = 4096;
+// O_DIRECT writes are done in chunks of at least this size
+static const size_t rec_min_staging_size = 4 * 1024 * 1024;
+
+static size_t round_up(size_t v, size_t align)
+{
+	return (v + align - 1) / align * align;
+}
+
+static unsigned packed_row_bytes(const PixelFormatInfo& pfi, unsigned plane, uint32_t width)
+{
+	const PixelFormatPlaneInfo& pi = pfi.planes[plane];
+
+	unsigned bytes = width * pi.bitspp / 8;
+
+	// The chroma planes of fully planar YUV formats don't combine U and V
+	if (pfi.type == PixelColorType::YUV && pfi.num_planes == 3)
+		bytes /= pi.xsub;
+
+	return bytes;
+}
+
+static uint8_t* alloc_aligned(size_t size)
+{
+	void* p;
+
+	int r = posix_memalign(&p, rec_align, size);
+	if (r)
+		throw system_error(r, generic_category());
+
+	return (uint8_t*)p;
+}
+
+FrameRecorder::FrameRecorder(const string& filename, uint32_t width, uint32_t height, PixelFormat format,
+			     unsigned num_buffers, Policy policy, bool direct)
+	: m_width(width), m_height(height), m_format(format), m_policy(policy), m_direct(direct)
+{
+	FAIL_IF(num_buffers == 0, "No buffers");
+
+	const PixelFormatInfo& pfi = get_pixel_format_info(format);
+
+	const string ext = ".kmsv";
+
+	if (filename.size() > ext.size() && filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0) {
+		// The buffers are page aligned, so the writer can use O_DIRECT
+		// without staging
+		m_video = unique_ptr<RawVideoWriter>(new RawVideoWriter(filename, width, height, format, 0, direct));
+		m_frame_size = m_video->frame_stride();
+		m_direct = false;
+	} else {
+		m_frame_size = 0;
+		for (unsigned i = 0; i < pfi.num_planes; ++i)
+			m_frame_size += (size_t)packed_row_bytes(pfi, i, width) * (height / pfi.planes[i].ysub);
+
+		open_raw(filename);
+	}
+
+#ifndef HAS_PTHREAD
+	// Without threads the frames are written in record(), one at a time
+	num_buffers = 1;
+#endif
+
+	m_bufs.resize(num_buffers);
+	m_free.reserve(num_buffers);
+
+	for (unsigned i = 0; i < num_buffers; ++i) {
+		m_bufs[i].data = alloc_aligned(round_up(m_frame_size, rec_align));
+		m_free.push_back(i);
+	}
+
+	m_writing.reserve(num_buffers);
+
+#ifdef HAS_PTHREAD
+	m_writer = thread(&FrameRecorder::writer_main, this);
+#endif
+}
+
+FrameRecorder::~FrameRecorder()
+{
+#ifdef HAS_PTHREAD
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+
+	m_cond.notify_all();
+	m_writer.join();
+#endif
+
+	flush_staging();
+
+	if (m_video) {
+		try {
+			m_video->close();
+		} catch (system_error& e) {
+			fprintf(stderr, "FrameRecorder: %s\n", e.what());
+		}
+	}
+
+	if (m_fd >= 0)
+		::close(m_fd);
+
+	if (m_index)
+		fclose(m_index);
+
+	for (auto& buf : m_bufs)
+		free(buf.data);
+
+	free(m_staging);
+}
+
+void FrameRecorder::open_raw(const string& filename)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+	// Not all filesystems support O_DIRECT
+	if (m_direct)
+		m_fd = ::open(filename.c_str(), flags | O_DIRECT, 0666);
+
+	if (m_fd < 0) {
+		m_direct = false;
+		m_fd = ::open(filename.c_str(), flags, 0666);
+	}
+
+	if (m_fd < 0)
+		throw system_error(errno, generic_category(), filename);
+
+	string index_name = filename + ".idx";
+	m_index = fopen(index_name.c_str(), "w");
+	if (!m_index) {
+		int err = errno;
+		::close(m_fd);
+		throw system_error(err, generic_category(), index_name);
+	}
+
+	fprintf(m_index, "# %ux%u %s, frame size %zu\n", m_width, m_height,
+		PixelFormatToFourCC(m_format).c_str(), m_frame_size);
+	fprintf(m_index, "# frame offset timestamp\n");
+
+	if (m_direct) {
+		m_staging_size = round_up(max(m_frame_size, rec_min_staging_size), rec_align);
+		m_staging = alloc_aligned(m_staging_size);
+	}
+}
+
+void FrameRecorder::copy_frame(IFramebuffer& fb, uint8_t* dst)
+{
+	if (m_video) {
+		m_video->pack_frame(fb, dst);
+		return;
+	}
+
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+	fb.begin_cpu_access(CpuAccess::Read);
+
+	for (unsigned i = 0; i < pfi.num_planes; ++i) {
+		const unsigned row_bytes = packed_row_bytes(pfi, i, m_width);
+		const unsigned rows = m_height / pfi.planes[i].ysub;
+		const uint32_t stride = fb.stride(i);
+		const uint8_t* src = fb.map(i);
+
+		if (stride == row_bytes) {
+			memcpy(dst, src, (size_t)row_bytes * rows);
+			dst += (size_t)row_bytes * rows;
+			continue;
+		}
+
+		for (unsigned y = 0; y < rows; ++y) {
+			memcpy(dst, src + (size_t)stride * y, row_bytes);
+			dst += row_bytes;
+		}
+	}
+
+	fb.end_cpu_access();
+}
+
+void FrameRecorder::write_data(const uint8_t* data, size_t len)
+{
+	while (len) {
+		ssize_t r = ::write(m_fd, data, len);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			throw system_error(errno, generic_category());
+		}
+
+		data += r;
+		len -= r;
+	}
+}
+
+void FrameRecorder::flush_staging()
+{
+	if (!m_direct || m_staging_used == 0 || m_error)
+		return;
+
+	// The tail is not a multiple of the block size, so write it without
+	// O_DIRECT
+	int flags = fcntl(m_fd, F_GETFL);
+	fcntl(m_fd, F_SETFL, flags & ~O_DIRECT);
+
+	try {
+		write_data(m_staging, m_staging_used);
+	} catch (system_error& e) {
+		fprintf(stderr, "FrameRecorder: write failed: %s\n", e.what());
+	}
+
+	m_staging_used = 0;
+}
+
+void FrameRecorder::write_staged_blocks()
+{
+	if (!m_direct || m_staging_used == 0 || m_error)
+		return;
+
+	size_t aligned = m_staging_used / rec_align * rec_align;
+	size_t tail = m_staging_used - aligned;
+
+	try {
+		if (aligned) {
+			write_data(m_staging, aligned);
+			memmove(m_staging, m_staging + aligned, tail);
+			m_staging_used = tail;
+		}
+
+		if (tail) {
+			// Write the partial block without O_DIRECT and without moving
+			// the file position, so that the next block write covers it
+			off_t pos = lseek(m_fd, 0, SEEK_CUR);
+			int flags = fcntl(m_fd, F_GETFL);
+
+			fcntl(m_fd, F_SETFL, flags & ~O_DIRECT);
+			ssize_t r = pwrite(m_fd, m_staging, tail, pos);
+			int err = errno;
+			fcntl(m_fd, F_SETFL, flags);
+
+			if (r != (ssize_t)tail)
+				throw system_error(r < 0 ? err : EIO, generic_category());
+		}
+	} catch (system_error& e) {
+		m_error = e.code().value();
+	}
+}
+
+void FrameRecorder::write_frame(const FrameBuffer& buf)
+{
+	if (m_error)
+		return;
+
+	KMSXX_TRACE_SCOPE("recorder", "write");
+
+	try {
+		if (m_video) {
+			m_video->write_frame(buf.data, buf.timestamp);
+		} else if (!m_direct) {
+			write_data(buf.data, m_frame_size);
+		} else {
+			const uint8_t* p = buf.data;
+			size_t left = m_frame_size;
+
+			while (left) {
+				size_t n = min(left, m_staging_size - m_staging_used);
+
+				memcpy(m_staging + m_staging_used, p, n);
+				m_staging_used += n;
+				p += n;
+				left -= n;
+
+				if (m_staging_used == m_staging_size) {
+					write_data(m_staging, m_staging_size);
+					m_staging_used = 0;
+				}
+			}
+		}
+	} catch (system_error& e) {
+		m_error = e.code().value();
+		return;
+	}
+
+	if (m_index)
+		fprintf(m_index, "%" PRIu64 " %" PRIu64 " %.6f\n", buf.frame_num, m_offset, buf.timestamp);
+
+	m_offset += m_frame_size;
+	m_frames_written++;
+}
+
+void FrameRecorder::check_error()
+{
+	if (m_error)
+		throw system_error(m_error, generic_category(), "FrameRecorder write failed");
+}
+
+void FrameRecorder::record(IFramebuffer& fb)
+{
+	record(fb, FrameScheduler::now());
+}
+
+void FrameRecorder::record(IFramebuffer& fb, double timestamp)
+{
+	KMSXX_TRACE_SCOPE("recorder", "record");
+
+	FAIL_IF(fb.width() != m_width || fb.height() != m_height || fb.format() != m_format,
+		"Framebuffer doesn't match the recording");
+
+	uint64_t frame_num = m_frames_recorded++;
+
+#ifdef HAS_PTHREAD
+	unique_lock<mutex> lock(m_mutex);
+
+	check_error();
+
+	if (m_free.empty()) {
+		if (m_policy == Policy::Block) {
+			m_cond.wait(lock, [this]() { return !m_free.empty(); });
+		} else if (!m_pending.empty()) {
+			m_free.push_back(m_pending.front());
+			m_pending.pop_front();
+			m_frames_dropped++;
+		} else {
+			// All the buffers are being written
+			m_frames_dropped++;
+			return;
+		}
+	}
+
+	unsigned idx = m_free.back();
+	m_free.pop_back();
+
+	lock.unlock();
+
+	FrameBuffer& buf = m_bufs[idx];
+	copy_frame(fb, buf.data);
+	buf.frame_num = frame_num;
+	buf.timestamp = timestamp;
+
+	lock.lock();
+
+	m_pending.push_back(idx);
+	m_cond.notify_all();
+#else
+	check_error();
+
+	FrameBuffer& buf = m_bufs[0];
+	copy_frame(fb, buf.data);
+	buf.frame_num = frame_num;
+	buf.timestamp = timestamp;
+
+	write_frame(buf);
+#endif
+}
+
+void FrameRecorder::flush()
+{
+#ifdef HAS_PTHREAD
+	unique_lock<mutex> lock(m_mutex);
+
+	m_cond.wait(lock, [this]() { return m_pending.empty() && m_writing.empty(); });
+#endif
+
+	// The writer is idle, so the staging buffer can be written here
+	write_staged_blocks();
+
+	if (m_index)
+		fflush(m_index);
+
+	check_error();
+}
+
+void FrameRecorder::writer_main()
+{
+#ifdef HAS_PTHREAD
+	unique_lock<mutex> lock(m_mutex);
+
+	while (true) {
+		m_cond.wait(lock, [this]() { return m_stop || !m_pending.empty(); });
+
+		// Write everything queued before stopping
+		if (m_pending.empty())
+			break;
+
+		m_writing.assign(m_pending.begin(), m_pending.end());
+		m_pending.clear();
+
+		lock.unlock();
+
+		for (unsigned idx : m_writing)
+			write_frame(m_bufs[idx]);
+
+		lock.lock();
+
+		m_free.insert(m_free.end(), m_writing.begin(), m_writing.end());
+		m_writing.clear();
+
+		m_cond.notify_all();
+	}
+#endif
+}
+
+}
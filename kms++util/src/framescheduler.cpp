@@ -0,0 +1,155 @@
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+
+#include <kms++util/framescheduler.h>
+
+using namespace std;
+
+namespace kms
+{
+
+static const double min_margin = 0.0005;
+
+FrameScheduler::FrameScheduler(Crtc* crtc, const Videomode& mode)
+	: m_crtc(crtc), m_missed(0), m_frame_start(0), m_frame_seq(0)
+{
+	m_period = 1.0 / (mode.valid() ? mode.calculated_vrefresh() : 60);
+
+	// Start pessimistic, the frame cost and the margin will adapt
+	m_frame_cost = m_period / 2;
+	m_margin = 0.002;
+
+	resync();
+
+	m_presented_seq = m_anchor_seq;
+	m_next_seq = target_seq(now());
+}
+
+double FrameScheduler::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+void FrameScheduler::resync()
+{
+	uint64_t seq, ns;
+
+	if (m_crtc->get_sequence(seq, ns) == 0) {
+		m_anchor_seq = seq;
+		m_anchor_time = ns / 1000000000.0;
+		m_anchor_frame = (uint32_t)seq;
+		m_have_frame = true;
+	} else {
+		m_anchor_seq = 0;
+		m_anchor_time = now();
+		m_anchor_frame = 0;
+		m_have_frame = false;
+	}
+}
+
+// The first vblank that a frame started at t can make
+uint64_t FrameScheduler::target_seq(double t) const
+{
+	double latch = t + m_frame_cost + m_margin;
+	int64_t n = (int64_t)ceil((latch - m_anchor_time) / m_period);
+
+	uint64_t seq = m_anchor_seq + max<int64_t>(n, 1);
+
+	// Only one flip can be pending, so we can't make the vblank of the previous flip
+	return max(seq, m_presented_seq + 1);
+}
+
+double FrameScheduler::wakeup_time() const
+{
+	return seq_time(m_next_seq) - m_frame_cost - m_margin;
+}
+
+double FrameScheduler::time_to_wakeup() const
+{
+	return max(wakeup_time() - now(), 0.0);
+}
+
+double FrameScheduler::target_vblank_time() const
+{
+	return seq_time(m_next_seq);
+}
+
+void FrameScheduler::frame_start()
+{
+	m_frame_start = now();
+
+	KMSXX_TRACE_INSTANT("sched", "frame_start", m_next_seq);
+
+	// If we're already past the vblank, aim at the next possible one
+	if (m_frame_start >= seq_time(m_next_seq))
+		m_next_seq = target_seq(m_frame_start);
+
+	m_frame_seq = m_next_seq;
+}
+
+void FrameScheduler::frame_committed()
+{
+	double cost = now() - m_frame_start;
+
+	// Follow the peaks immediately, decay slowly
+	m_frame_cost = max(cost, m_frame_cost + (cost - m_frame_cost) * 0.05);
+
+	KMSXX_TRACE_COUNTER("sched", "frame_cost_us", (int64_t)(m_frame_cost * 1000000));
+}
+
+void FrameScheduler::frame_skipped()
+{
+	// Nothing will be presented at the target vblank, move to the next one
+	m_next_seq = max(m_frame_seq, m_next_seq) + 1;
+	m_frame_seq = 0;
+}
+
+void FrameScheduler::frame_presented(uint32_t frame, double time)
+{
+	int64_t num = llround((time - m_anchor_time) / m_period);
+
+	// Prefer the hw vblank counter if it agrees with the timestamps
+	if (m_have_frame) {
+		int64_t df = (uint32_t)(frame - m_anchor_frame);
+		if (df > 0 && abs(df - num) <= 1)
+			num = df;
+	}
+
+	if (num <= 0) {
+		// Timestamps went backwards, e.g. after a modeset
+		resync();
+		num = 0;
+	} else {
+		double period = (time - m_anchor_time) / num;
+
+		if (fabs(period - m_period) < m_period * 0.1)
+			m_period += (period - m_period) * 0.1;
+	}
+
+	uint64_t seq = m_anchor_seq + num;
+
+	m_anchor_seq = seq;
+	m_anchor_time = time;
+	m_anchor_frame = frame;
+	m_have_frame = true;
+
+	m_presented_seq = seq;
+
+	if (m_frame_seq) {
+		if (seq > m_frame_seq) {
+			m_missed++;
+			m_margin = min(m_margin * 2, m_period / 2);
+		} else {
+			m_margin = max(m_margin * 0.99, min_margin);
+		}
+
+		m_frame_seq = 0;
+	}
+
+	m_next_seq = target_seq(now());
+}
+
+}
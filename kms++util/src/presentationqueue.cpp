@@ -0,0 +1,170 @@
+#include <cmath>
+#include <algorithm>
+
+#include <kms++util/presentationqueue.h>
+#include <kms++util/framescheduler.h>
+
+using namespace std;
+
+namespace kms
+{
+
+PresentationQueue::PresentationQueue(double display_period, double delay)
+	: m_display_period(display_period), m_fixed_delay(delay)
+{
+}
+
+double PresentationQueue::delay() const
+{
+	if (m_fixed_delay > 0)
+		return m_fixed_delay;
+
+	// A frame for a vblank is committed up to a display period before it
+	return m_latency + m_display_period;
+}
+
+void PresentationQueue::push(uint32_t id, double timestamp)
+{
+	double latency = FrameScheduler::now() - timestamp;
+
+	// Follow the peaks immediately, decay slowly. Ignore timestamps that
+	// are clearly not from CLOCK_MONOTONIC.
+	if (latency >= 0 && latency < 1)
+		m_latency = max(latency, m_latency + (latency - m_latency) * 0.05);
+
+	double delta = timestamp - m_last_timestamp;
+
+	if (m_last_timestamp == 0 || delta > 0) {
+		if (m_fit_n > 0) {
+			// Frames lost by the source show up as multiples of the period
+			int64_t n = m_source_period > 0 ? llround(delta / m_source_period) : 1;
+			m_source_frame += max<int64_t>(n, 1);
+		}
+
+		fit_source_period(timestamp);
+
+		m_last_timestamp = timestamp;
+	}
+
+	m_frames.push_back({ id, timestamp });
+}
+
+void PresentationQueue::fit_source_period(double timestamp)
+{
+	// Fit over the whole stream, so that the jitter of the single
+	// timestamps averages out and the drift remains
+	if (m_fit_n == 0)
+		m_fit_t0 = timestamp;
+
+	double k = m_source_frame;
+	double t = timestamp - m_fit_t0;
+
+	m_fit_n++;
+
+	double dk = k - m_fit_mean_k;
+	m_fit_mean_k += dk / m_fit_n;
+	double dt = t - m_fit_mean_t;
+	m_fit_mean_t += dt / m_fit_n;
+
+	m_fit_kk += dk * (k - m_fit_mean_k);
+	m_fit_kt += dk * (t - m_fit_mean_t);
+
+	if (m_fit_kk > 0)
+		m_source_period = m_fit_kt / m_fit_kk;
+}
+
+void PresentationQueue::vblank(double time)
+{
+	if (m_vblank_anchor > 0) {
+		int64_t n = llround((time - m_vblank_anchor) / m_display_period);
+
+		if (n > 0) {
+			double period = (time - m_vblank_anchor) / n;
+
+			if (fabs(period - m_display_period) < m_display_period * 0.1)
+				m_display_period += (period - m_display_period) * 0.1;
+		}
+	}
+
+	m_vblank_anchor = time;
+}
+
+double PresentationQueue::next_vblank(double t) const
+{
+	if (m_vblank_anchor == 0)
+		return t + m_display_period;
+
+	double n = floor((t - m_vblank_anchor) / m_display_period) + 1;
+
+	return m_vblank_anchor + n * m_display_period;
+}
+
+double PresentationQueue::next_due_vblank() const
+{
+	if (m_frames.empty())
+		return 0;
+
+	return next_vblank(m_frames.front().timestamp + delay());
+}
+
+bool PresentationQueue::select(double vblank_time, uint32_t& id)
+{
+	const double pts_offset = delay();
+
+	bool found = false;
+
+	while (!m_frames.empty() && m_frames.front().timestamp + pts_offset <= vblank_time) {
+		if (found) {
+			m_dropped_ids.push_back(id);
+			m_dropped++;
+		}
+
+		id = m_frames.front().id;
+		found = true;
+
+		m_frames.pop_front();
+	}
+
+	if (!found)
+		return false;
+
+	if (m_last_shown_vblank > 0) {
+		int64_t shown_for = llround((vblank_time - m_last_shown_vblank) / m_display_period);
+		int64_t expected = m_source_period > m_display_period ? llround(m_source_period / m_display_period) : 1;
+
+		if (shown_for > expected)
+			m_repeated += shown_for - expected;
+	}
+
+	m_last_shown_vblank = vblank_time;
+	m_shown++;
+
+	return true;
+}
+
+vector<uint32_t> PresentationQueue::take_dropped()
+{
+	vector<uint32_t> v;
+	v.swap(m_dropped_ids);
+	return v;
+}
+
+double PresentationQueue::drift_ppm() const
+{
+	if (m_source_period <= 0)
+		return 0;
+
+	double ratio;
+
+	if (m_source_period >= m_display_period) {
+		double n = llround(m_source_period / m_display_period);
+		ratio = m_source_period / (n * m_display_period);
+	} else {
+		double n = llround(m_display_period / m_source_period);
+		ratio = n * m_source_period / m_display_period;
+	}
+
+	return (ratio - 1) * 1000000;
+}
+
+}
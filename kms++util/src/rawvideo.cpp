@@ -0,0 +1,441 @@
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <kms++/kms++.h>
+#include <kms++util/kms++util.h>
+#include <kms++util/rawvideo.h>
+
+using namespace std;
+
+namespace kms
+{
+
+// Alignment of the frames and planes in the file, independent of the page
+// size of the machine
+static const size_t raw_video_align = 4096;
+
+static const char raw_video_magic[8] = { 'K', 'M', 'S', 'V', 'I', 'D', 'E', 'O' };
+static const uint32_t raw_video_version = 1;
+
+// The first page of the file. Little endian.
+struct RawVideoHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;		// offset of the first frame
+	uint32_t width;
+	uint32_t height;
+	uint32_t fourcc;
+	uint32_t num_planes;
+	uint32_t strides[4];
+	uint64_t plane_offsets[4];	// from the start of the frame
+	uint64_t frame_size;		// bytes used of each frame
+	uint64_t frame_stride;		// distance between frames
+	uint64_t num_frames;
+	uint64_t index_offset;		// 0 if the index was not written
+	double fps;
+};
+
+static_assert(sizeof(RawVideoHeader) <= raw_video_align, "RawVideoHeader too big");
+
+static size_t round_up(size_t v, size_t align)
+{
+	return (v + align - 1) / align * align;
+}
+
+static unsigned packed_row_bytes(const PixelFormatInfo& pfi, unsigned plane, uint32_t width)
+{
+	const PixelFormatPlaneInfo& pi = pfi.planes[plane];
+
+	unsigned bytes = width * pi.bitspp / 8;
+
+	// The chroma planes of fully planar YUV formats don't combine U and V
+	if (pfi.type == PixelColorType::YUV && pfi.num_planes == 3)
+		bytes /= pi.xsub;
+
+	return bytes;
+}
+
+RawVideoWriter::RawVideoWriter(const string& filename, uint32_t width, uint32_t height, PixelFormat format,
+			       double fps, bool direct)
+	: m_direct(direct), m_width(width), m_height(height), m_format(format), m_fps(fps)
+{
+	const PixelFormatInfo& pfi = get_pixel_format_info(format);
+
+	size_t offset = 0;
+
+	for (unsigned i = 0; i < pfi.num_planes; ++i) {
+		m_strides[i] = packed_row_bytes(pfi, i, width);
+		m_plane_offsets[i] = offset;
+		offset += round_up((size_t)m_strides[i] * (height / pfi.planes[i].ysub), raw_video_align);
+	}
+
+	m_frame_stride = offset;
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+	m_fd = -1;
+
+	// Not all filesystems support O_DIRECT
+	if (m_direct)
+		m_fd = ::open(filename.c_str(), flags | O_DIRECT, 0666);
+
+	if (m_fd < 0) {
+		m_direct = false;
+		m_fd = ::open(filename.c_str(), flags, 0666);
+	}
+
+	if (m_fd < 0)
+		throw system_error(errno, generic_category(), filename);
+
+	void* p;
+	int r = posix_memalign(&p, raw_video_align, max(m_frame_stride, raw_video_align));
+	if (r) {
+		::close(m_fd);
+		throw system_error(r, generic_category());
+	}
+
+	m_buf = (uint8_t*)p;
+
+	// The header is written again with the index when closing. Until then,
+	// the frames can be found from the size of the file.
+	fill_header(0);
+	write_data(m_buf, raw_video_align);
+
+	m_offset = raw_video_align;
+}
+
+RawVideoWriter::~RawVideoWriter()
+{
+	try {
+		close();
+	} catch (system_error& e) {
+		fprintf(stderr, "RawVideoWriter: %s\n", e.what());
+	}
+
+	free(m_buf);
+}
+
+void RawVideoWriter::fill_header(uint64_t index_offset)
+{
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+	RawVideoHeader hdr { };
+
+	memcpy(hdr.magic, raw_video_magic, sizeof(hdr.magic));
+	hdr.version = raw_video_version;
+	hdr.header_size = raw_video_align;
+	hdr.width = m_width;
+	hdr.height = m_height;
+	hdr.fourcc = (uint32_t)m_format;
+	hdr.num_planes = pfi.num_planes;
+
+	for (unsigned i = 0; i < pfi.num_planes; ++i) {
+		hdr.strides[i] = m_strides[i];
+		hdr.plane_offsets[i] = m_plane_offsets[i];
+	}
+
+	unsigned last = pfi.num_planes - 1;
+	hdr.frame_size = m_plane_offsets[last] + (size_t)m_strides[last] * (m_height / pfi.planes[last].ysub);
+	hdr.frame_stride = m_frame_stride;
+	hdr.num_frames = num_frames();
+	hdr.index_offset = index_offset;
+	hdr.fps = m_fps;
+
+	memset(m_buf, 0, raw_video_align);
+	memcpy(m_buf, &hdr, sizeof(hdr));
+}
+
+void RawVideoWriter::write_data(const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+
+	while (len) {
+		ssize_t r = ::write(m_fd, p, len);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			throw system_error(errno, generic_category());
+		}
+
+		p += r;
+		len -= r;
+	}
+}
+
+void RawVideoWriter::pack_frame(IFramebuffer& fb, uint8_t* buf) const
+{
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+	FAIL_IF(fb.width() != m_width || fb.height() != m_height || fb.format() != m_format,
+		"Framebuffer doesn't match the video");
+
+	fb.begin_cpu_access(CpuAccess::Read);
+
+	for (unsigned i = 0; i < pfi.num_planes; ++i) {
+		const unsigned rows = m_height / pfi.planes[i].ysub;
+		const size_t size = (size_t)m_strides[i] * rows;
+		const size_t padded = (i + 1 < pfi.num_planes ? m_plane_offsets[i + 1] : m_frame_stride) - m_plane_offsets[i];
+		const uint8_t* src = fb.map(i);
+		uint8_t* dst = buf + m_plane_offsets[i];
+
+		if (fb.stride(i) == m_strides[i]) {
+			memcpy(dst, src, size);
+		} else {
+			for (unsigned y = 0; y < rows; ++y)
+				memcpy(dst + (size_t)m_strides[i] * y, src + (size_t)fb.stride(i) * y, m_strides[i]);
+		}
+
+		memset(dst + size, 0, padded - size);
+	}
+
+	fb.end_cpu_access();
+}
+
+void RawVideoWriter::write_frame(const uint8_t* data, double timestamp)
+{
+	FAIL_IF(m_fd < 0, "RawVideoWriter closed");
+
+	write_data(data, m_frame_stride);
+
+	m_index.push_back(m_offset);
+	m_index.push_back((uint64_t)(int64_t)llround(timestamp * 1000000000.0));
+
+	m_offset += m_frame_stride;
+}
+
+void RawVideoWriter::write_frame(IFramebuffer& fb, double timestamp)
+{
+	pack_frame(fb, m_buf);
+	write_frame(m_buf, timestamp);
+}
+
+void RawVideoWriter::close()
+{
+	if (m_fd < 0)
+		return;
+
+	int fd = m_fd;
+
+	// The index is not a multiple of the block size
+	if (m_direct) {
+		int flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+	}
+
+	try {
+		write_data(m_index.data(), m_index.size() * sizeof(uint64_t));
+
+		fill_header(m_offset);
+
+		if (pwrite(fd, m_buf, raw_video_align, 0) != (ssize_t)raw_video_align)
+			throw system_error(errno, generic_category());
+	} catch (...) {
+		::close(fd);
+		m_fd = -1;
+		throw;
+	}
+
+	::close(fd);
+	m_fd = -1;
+}
+
+bool RawVideoReader::is_raw_video(const string& filename)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	char magic[sizeof(raw_video_magic)];
+	bool match = ::read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		     memcmp(magic, raw_video_magic, sizeof(magic)) == 0;
+
+	::close(fd);
+
+	return match;
+}
+
+RawVideoReader::RawVideoReader(const string& filename)
+{
+	m_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0)
+		throw system_error(errno, generic_category(), filename);
+
+	struct stat st;
+	if (fstat(m_fd, &st) != 0 || (size_t)st.st_size < raw_video_align) {
+		::close(m_fd);
+		throw runtime_error("Bad raw video file");
+	}
+
+	m_size = st.st_size;
+
+	// Private writable mapping, so that the frames can be used as
+	// framebuffers that may be written to
+	void* p = mmap(0, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, 0);
+	if (p == MAP_FAILED) {
+		int err = errno;
+		::close(m_fd);
+		throw system_error(err, generic_category(), filename);
+	}
+
+	m_map = (uint8_t*)p;
+
+	RawVideoHeader hdr;
+	memcpy(&hdr, m_map, sizeof(hdr));
+
+	bool valid = memcmp(hdr.magic, raw_video_magic, sizeof(hdr.magic)) == 0 &&
+		     hdr.version == raw_video_version &&
+		     hdr.header_size >= sizeof(hdr) && hdr.header_size <= m_size &&
+		     hdr.num_planes >= 1 && hdr.num_planes <= 4 &&
+		     hdr.frame_stride >= hdr.frame_size && hdr.frame_size > 0;
+
+	// The destructor doesn't run if the constructor throws
+	auto fail = [this](const char* msg) {
+		munmap(m_map, m_size);
+		::close(m_fd);
+		throw runtime_error(msg);
+	};
+
+	if (!valid)
+		fail("Bad raw video header");
+
+	m_width = hdr.width;
+	m_height = hdr.height;
+	m_format = (PixelFormat)hdr.fourcc;
+	m_fps = hdr.fps;
+	m_num_planes = hdr.num_planes;
+	m_frame_size = hdr.frame_size;
+	m_frame_stride = hdr.frame_stride;
+	m_first_offset = hdr.header_size;
+
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+	if (pfi.num_planes != m_num_planes)
+		fail("Bad number of planes");
+
+	for (unsigned i = 0; i < m_num_planes; ++i) {
+		m_strides[i] = hdr.strides[i];
+		m_plane_offsets[i] = hdr.plane_offsets[i];
+		m_plane_sizes[i] = (size_t)m_strides[i] * (m_height / pfi.planes[i].ysub);
+
+		if (m_plane_offsets[i] + m_plane_sizes[i] > m_frame_size)
+			fail("Bad plane layout");
+	}
+
+	uint64_t index_size = hdr.num_frames * 2 * sizeof(uint64_t);
+
+	if (hdr.index_offset && hdr.index_offset <= m_size && index_size <= m_size - hdr.index_offset) {
+		m_index = (const uint64_t*)(m_map + hdr.index_offset);
+		m_num_frames = hdr.num_frames;
+	} else {
+		// The writer didn't finish, but the frames are evenly spaced
+		m_num_frames = (m_size - m_first_offset) / m_frame_stride;
+	}
+}
+
+RawVideoReader::~RawVideoReader()
+{
+	munmap(m_map, m_size);
+	::close(m_fd);
+}
+
+uint64_t RawVideoReader::frame_offset(uint64_t n) const
+{
+	if (n >= m_num_frames)
+		throw runtime_error("Bad frame number " + to_string(n));
+
+	uint64_t offset = m_index ? m_index[n * 2] : m_first_offset + n * m_frame_stride;
+
+	if (offset > m_size || m_frame_size > m_size - offset)
+		throw runtime_error("Bad frame offset in the index");
+
+	return offset;
+}
+
+double RawVideoReader::timestamp(uint64_t n) const
+{
+	if (!m_index)
+		return m_fps > 0 ? n / m_fps : 0;
+
+	return (int64_t)(m_index[n * 2 + 1] - m_index[1]) / 1000000000.0;
+}
+
+uint64_t RawVideoReader::find_frame(double t) const
+{
+	if (m_num_frames == 0)
+		return 0;
+
+	if (!m_index) {
+		if (m_fps <= 0 || t <= 0)
+			return 0;
+
+		return min((uint64_t)(t * m_fps), m_num_frames - 1);
+	}
+
+	// Binary search for the first frame after t
+	uint64_t lo = 0;
+	uint64_t hi = m_num_frames;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (timestamp(mid) <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? lo - 1 : 0;
+}
+
+unique_ptr<ExtCPUFramebuffer> RawVideoReader::framebuffer(uint64_t n) const
+{
+	uint8_t* buffers[4] { };
+	uint32_t sizes[4] { };
+	uint32_t pitches[4] { };
+	uint32_t offsets[4] { };
+
+	for (unsigned i = 0; i < m_num_planes; ++i) {
+		buffers[i] = plane(n, i);
+		sizes[i] = m_plane_sizes[i];
+		pitches[i] = m_strides[i];
+	}
+
+	return unique_ptr<ExtCPUFramebuffer>(new ExtCPUFramebuffer(m_width, m_height, m_format,
+								   buffers, sizes, pitches, offsets));
+}
+
+void RawVideoReader::prefetch(uint64_t first, unsigned count)
+{
+	if (first >= m_num_frames)
+		return;
+
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+
+	uint64_t last = min(first + count, m_num_frames) - 1;
+
+	size_t start = frame_offset(first) / page_size * page_size;
+	size_t end = frame_offset(last) + m_frame_size;
+
+	madvise(m_map + start, end - start, MADV_WILLNEED);
+
+#ifdef MADV_COLD
+	// Not MADV_DONTNEED, which would discard the writes to the private
+	// mapping. Cold pages are only reclaimed first.
+	size_t first_page = round_up(m_first_offset, page_size);
+
+	if (start > first_page)
+		madvise(m_map + first_page, start - first_page, MADV_COLD);
+#endif
+}
+
+}
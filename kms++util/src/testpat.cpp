@@ -200,6 +200,8 @@ static void draw_test_pattern_impl(IFramebuffer& fb, YUVType yuvt)
 
 void draw_test_pattern(IFramebuffer &fb, YUVType yuvt)
 {
+	KMSXX_TRACE_SCOPE("draw", "draw_test_pattern");
+
 #ifdef DRAW_PERF_PRINT
 	Stopwatch sw;
 	sw.start();
@@ -1,7 +1,10 @@
 #include <string>
+#include <cstring>
+#include <algorithm>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <linux/videodev2.h>
 #include <sys/ioctl.h>
@@ -25,9 +28,77 @@ using namespace kms;
  * Since here we have hybrid DRM/V4L2 user space helper functions
  * we need to translate DRM::NV12 to V4L2:NM12 pixel format back
  * and forth to keep the data view consistent.
+ *
+ * The same applies to the other semi-planar and planar YUV formats,
+ * e.g. DRM::YUV420 is V4L2:YM12.
  */
+static const struct {
+	PixelFormat drm;
+	uint32_t v4l2;
+} v4l2_mplane_formats[] = {
+	{ PixelFormat::NV12, V4L2_PIX_FMT_NV12M },
+	{ PixelFormat::NV21, V4L2_PIX_FMT_NV21M },
+	{ PixelFormat::NV16, V4L2_PIX_FMT_NV16M },
+	{ PixelFormat::NV61, V4L2_PIX_FMT_NV61M },
+	{ PixelFormat::YUV420, V4L2_PIX_FMT_YUV420M },
+	{ PixelFormat::YVU420, V4L2_PIX_FMT_YVU420M },
+	{ PixelFormat::YUV422, V4L2_PIX_FMT_YUV422M },
+	{ PixelFormat::YVU422, V4L2_PIX_FMT_YVU422M },
+	{ PixelFormat::YUV444, V4L2_PIX_FMT_YUV444M },
+	{ PixelFormat::YVU444, V4L2_PIX_FMT_YVU444M },
+};
+
+static uint32_t drm_to_v4l2_format(PixelFormat fmt)
+{
+	for (const auto& f : v4l2_mplane_formats) {
+		if (f.drm == fmt)
+			return f.v4l2;
+	}
+
+	return (uint32_t)fmt;
+}
+
+static PixelFormat v4l2_to_drm_format(uint32_t fmt)
+{
+	for (const auto& f : v4l2_mplane_formats) {
+		if (f.v4l2 == fmt)
+			return f.drm;
+	}
+
+	return (PixelFormat)fmt;
+}
+
+// The V4L2 formats with contiguous planes. The multi-planar API uses the
+// non-contiguous ones for the DRM formats instead.
+static bool is_v4l2_contiguous_format(uint32_t fmt)
+{
+	for (const auto& f : v4l2_mplane_formats) {
+		if ((uint32_t)f.drm == fmt)
+			return true;
+	}
+
+	return false;
+}
+
+static uint32_t v4l2_bytesperline(const PixelFormatInfo& pfi, unsigned plane, uint32_t width)
+{
+	const PixelFormatPlaneInfo& pfpi = pfi.planes[plane];
+
+	uint32_t bytesperline = width * pfpi.bitspp / 8;
+
+	// The chroma planes of fully planar YUV formats don't combine U and V
+	if (pfi.type == PixelColorType::YUV && pfi.num_planes == 3)
+		bytesperline /= pfpi.xsub;
+
+	return bytesperline;
+}
 
 /* V4L2 helper funcs */
+static bool is_mplane(uint32_t buf_type)
+{
+	return buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE || buf_type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+}
+
 static vector<PixelFormat> v4l2_get_formats(int fd, uint32_t buf_type)
 {
 	vector<PixelFormat> v;
@@ -36,10 +107,8 @@ static vector<PixelFormat> v4l2_get_formats(int fd, uint32_t buf_type)
 	desc.type = buf_type;
 
 	while (ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0) {
-		if (desc.pixelformat == V4L2_PIX_FMT_NV12M)
-			v.push_back(PixelFormat::NV12);
-		else if (desc.pixelformat != V4L2_PIX_FMT_NV12)
-			v.push_back((PixelFormat)desc.pixelformat);
+		if (!is_mplane(buf_type) || !is_v4l2_contiguous_format(desc.pixelformat))
+			v.push_back(v4l2_to_drm_format(desc.pixelformat));
 
 		desc.index++;
 	}
@@ -63,12 +132,7 @@ static void v4l2_set_format(int fd, PixelFormat fmt, uint32_t width, uint32_t he
 
 	if (mplane) {
 		v4l2_pix_format_mplane& mp = v4lfmt.fmt.pix_mp;
-		uint32_t used_fmt;
-
-		if (fmt == PixelFormat::NV12)
-			used_fmt = V4L2_PIX_FMT_NV12M;
-		else
-			used_fmt = (uint32_t)fmt;
+		uint32_t used_fmt = drm_to_v4l2_format(fmt);
 
 		mp.pixelformat = used_fmt;
 		mp.width = width;
@@ -80,7 +144,7 @@ static void v4l2_set_format(int fd, PixelFormat fmt, uint32_t width, uint32_t he
 			const PixelFormatPlaneInfo& pfpi = pfi.planes[i];
 			v4l2_plane_pix_format& p = mp.plane_fmt[i];
 
-			p.bytesperline = width * pfpi.bitspp / 8;
+			p.bytesperline = v4l2_bytesperline(pfi, i, width);
 			p.sizeimage = p.bytesperline * height / pfpi.ysub;
 		}
 
@@ -97,7 +161,7 @@ static void v4l2_set_format(int fd, PixelFormat fmt, uint32_t width, uint32_t he
 			const PixelFormatPlaneInfo& pfpi = pfi.planes[i];
 			v4l2_plane_pix_format& p = mp.plane_fmt[i];
 
-			ASSERT(p.bytesperline == width * pfpi.bitspp / 8);
+			ASSERT(p.bytesperline == v4l2_bytesperline(pfi, i, width));
 			ASSERT(p.sizeimage == p.bytesperline * height / pfpi.ysub);
 		}
 	} else {
@@ -175,55 +239,91 @@ static void v4l2_set_selection(int fd, uint32_t& left, uint32_t& top, uint32_t&
 	height = selection.r.height;
 }
 
-static void v4l2_request_bufs(int fd, uint32_t queue_size, uint32_t buf_type)
+static uint32_t v4l2_memory(VideoStreamer::MemoryType type)
+{
+	switch (type) {
+	case VideoStreamer::MemoryType::Mmap:
+		return V4L2_MEMORY_MMAP;
+	case VideoStreamer::MemoryType::Userptr:
+		return V4L2_MEMORY_USERPTR;
+	case VideoStreamer::MemoryType::Dmabuf:
+		return V4L2_MEMORY_DMABUF;
+	default:
+		FAIL("Bad MemoryType");
+	}
+}
+
+static void v4l2_request_bufs(int fd, uint32_t queue_size, uint32_t buf_type, uint32_t memory)
 {
 	v4l2_requestbuffers v4lreqbuf { };
 	v4lreqbuf.type = buf_type;
-	v4lreqbuf.memory = V4L2_MEMORY_DMABUF;
+	v4lreqbuf.memory = memory;
 	v4lreqbuf.count = queue_size;
 	int r = ioctl(fd, VIDIOC_REQBUFS, &v4lreqbuf);
 	ASSERT(r == 0);
 	ASSERT(v4lreqbuf.count == queue_size);
 }
 
-static void v4l2_queue_dmabuf(int fd, uint32_t index, DumbFramebuffer* fb, uint32_t buf_type)
+// With V4L2_MEMORY_MMAP fb is not used, and mmap_lengths gives the lengths of
+// the num_planes planes of the V4L2 buffer
+static void v4l2_queue(int fd, uint32_t index, Framebuffer* fb, uint32_t buf_type, uint32_t memory,
+		       unsigned num_planes, const uint32_t* mmap_lengths)
 {
 	v4l2_buffer buf { };
 	buf.type = buf_type;
-	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.memory = memory;
 	buf.index = index;
 
-	const PixelFormatInfo& pfi = get_pixel_format_info(fb->format());
-
-	bool mplane = buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE || buf_type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-
-	if (mplane) {
-		buf.length = pfi.num_planes;
+	v4l2_plane planes[4] { };
 
-		v4l2_plane planes[4] { };
+	if (is_mplane(buf_type)) {
+		buf.length = num_planes;
 		buf.m.planes = planes;
 
-		for (unsigned i = 0; i < pfi.num_planes; ++i) {
-			planes[i].m.fd = fb->prime_fd(i);
-			planes[i].bytesused = fb->size(i);
-			planes[i].length = fb->size(i);
+		for (unsigned i = 0; i < num_planes; ++i) {
+			switch (memory) {
+			case V4L2_MEMORY_DMABUF:
+				planes[i].m.fd = fb->prime_fd(i);
+				planes[i].length = fb->size(i);
+				break;
+			case V4L2_MEMORY_USERPTR:
+				planes[i].m.userptr = (unsigned long)fb->map(i);
+				planes[i].length = fb->size(i);
+				break;
+			case V4L2_MEMORY_MMAP:
+				planes[i].length = mmap_lengths[i];
+				break;
+			}
+
+			planes[i].bytesused = planes[i].length;
 		}
-
-		int r = ioctl(fd, VIDIOC_QBUF, &buf);
-		ASSERT(r == 0);
 	} else {
-		buf.m.fd = fb->prime_fd(0);
+		switch (memory) {
+		case V4L2_MEMORY_DMABUF:
+			buf.m.fd = fb->prime_fd(0);
+			buf.length = fb->size(0);
+			break;
+		case V4L2_MEMORY_USERPTR:
+			buf.m.userptr = (unsigned long)fb->map(0);
+			buf.length = fb->size(0);
+			break;
+		case V4L2_MEMORY_MMAP:
+			buf.length = mmap_lengths[0];
+			break;
+		}
 
-		int r = ioctl(fd, VIDIOC_QBUF, &buf);
-		ASSERT(r == 0);
+		buf.bytesused = buf.length;
 	}
+
+	int r = ioctl(fd, VIDIOC_QBUF, &buf);
+	ASSERT(r == 0);
 }
 
-static uint32_t v4l2_dequeue(int fd, uint32_t buf_type)
+static uint32_t v4l2_dequeue(int fd, uint32_t buf_type, uint32_t memory, double& timestamp)
 {
 	v4l2_buffer buf { };
 	buf.type = buf_type;
-	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.memory = memory;
 
 	// V4L2 crashes if planes are not set
 	v4l2_plane planes[4] { };
@@ -234,6 +334,11 @@ static uint32_t v4l2_dequeue(int fd, uint32_t buf_type)
 	if (r)
 		throw system_error(errno, generic_category());
 
+	if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		timestamp = buf.timestamp.tv_sec + buf.timestamp.tv_usec / 1000000.0;
+	else
+		timestamp = 0;
+
 	return buf.index;
 }
 
@@ -413,6 +518,11 @@ VideoStreamer::VideoStreamer(int fd, StreamerType type)
 
 }
 
+VideoStreamer::~VideoStreamer()
+{
+	free_buffers();
+}
+
 std::vector<string> VideoStreamer::get_ports()
 {
 	vector<string> v;
@@ -510,34 +620,343 @@ void VideoStreamer::set_selection(uint32_t& left, uint32_t& top, uint32_t& width
 	v4l2_set_selection(m_fd, left, top, width, height, get_buf_type(m_type));
 }
 
+static bool is_capture(VideoStreamer::StreamerType type)
+{
+	return type == VideoStreamer::StreamerType::CaptureSingle || type == VideoStreamer::StreamerType::CaptureMulti;
+}
+
+vector<VideoStreamer::MemoryType> VideoStreamer::get_memory_types()
+{
+	// REQBUFS frees the allocated buffers, so probe only before the
+	// first allocation
+	if (m_memory_types_probed)
+		return m_memory_types;
+
+	FAIL_IF(!m_fbs.empty(), "Buffers allocated before probing the memory types");
+
+	m_memory_types_probed = true;
+
+	vector<MemoryType>& v = m_memory_types;
+
+	v4l2_requestbuffers v4lreqbuf { };
+	v4lreqbuf.type = get_buf_type(m_type);
+	v4lreqbuf.memory = V4L2_MEMORY_MMAP;
+	v4lreqbuf.count = 0;
+
+	int r = ioctl(m_fd, VIDIOC_REQBUFS, &v4lreqbuf);
+
+	if (r == 0 && v4lreqbuf.capabilities) {
+		if (v4lreqbuf.capabilities & V4L2_BUF_CAP_SUPPORTS_MMAP)
+			v.push_back(MemoryType::Mmap);
+		if (v4lreqbuf.capabilities & V4L2_BUF_CAP_SUPPORTS_USERPTR)
+			v.push_back(MemoryType::Userptr);
+		if (v4lreqbuf.capabilities & V4L2_BUF_CAP_SUPPORTS_DMABUF)
+			v.push_back(MemoryType::Dmabuf);
+
+		return v;
+	}
+
+	// Older kernels don't report the capabilities, so try each type
+	for (MemoryType type : { MemoryType::Mmap, MemoryType::Userptr, MemoryType::Dmabuf }) {
+		v4lreqbuf = { };
+		v4lreqbuf.type = get_buf_type(m_type);
+		v4lreqbuf.memory = v4l2_memory(type);
+		v4lreqbuf.count = 0;
+
+		if (ioctl(m_fd, VIDIOC_REQBUFS, &v4lreqbuf) == 0)
+			v.push_back(type);
+	}
+
+	return v;
+}
+
+void VideoStreamer::set_memory_type(MemoryType type)
+{
+	m_requested_memory = type;
+}
+
 void VideoStreamer::set_queue_size(uint32_t queue_size)
 {
-	v4l2_request_bufs(m_fd, queue_size, get_buf_type(m_type));
-	m_fbs.resize(queue_size);
+	uint32_t buf_type = get_buf_type(m_type);
+
+	free_buffers();
+
+	vector<MemoryType> types = get_memory_types();
+
+	MemoryType memory = m_requested_memory;
+
+	if (memory == MemoryType::Auto) {
+		FAIL_IF(types.empty(), "No supported memory types");
+
+		// USERPTR can't pin the DRM dumb buffer mappings, so prefer Mmap
+		for (MemoryType type : { MemoryType::Dmabuf, MemoryType::Mmap, MemoryType::Userptr }) {
+			if (find(types.begin(), types.end(), type) != types.end()) {
+				memory = type;
+				break;
+			}
+		}
+	}
+
+	// The free indices are tracked in a 64-bit mask
+	FAIL_IF(queue_size > 64, "Too many buffers: %u", queue_size);
+
+	v4l2_request_bufs(m_fd, queue_size, buf_type, v4l2_memory(memory));
+
+	m_memory = memory;
+	m_fbs.assign(queue_size, nullptr);
+	m_free_indices = queue_size == 64 ? ~0ull : (1ull << queue_size) - 1;
+	m_fb_indices.clear();
+	m_fb_indices.reserve(queue_size * 2);
+
+	if (memory != MemoryType::Mmap)
+		return;
+
+	v4l2_format v4lfmt { };
+	v4lfmt.type = buf_type;
+	int r = ioctl(m_fd, VIDIOC_G_FMT, &v4lfmt);
+	ASSERT(r == 0);
+
+	unsigned fmt_planes;
+
+	if (is_mplane(buf_type)) {
+		m_format = v4l2_to_drm_format(v4lfmt.fmt.pix_mp.pixelformat);
+		m_width = v4lfmt.fmt.pix_mp.width;
+		m_height = v4lfmt.fmt.pix_mp.height;
+
+		fmt_planes = min<unsigned>(v4lfmt.fmt.pix_mp.num_planes, 4);
+		for (unsigned i = 0; i < fmt_planes; ++i)
+			m_bytesperline[i] = v4lfmt.fmt.pix_mp.plane_fmt[i].bytesperline;
+	} else {
+		m_format = (PixelFormat)v4lfmt.fmt.pix.pixelformat;
+		m_width = v4lfmt.fmt.pix.width;
+		m_height = v4lfmt.fmt.pix.height;
+
+		fmt_planes = 1;
+		m_bytesperline[0] = v4lfmt.fmt.pix.bytesperline;
+	}
+
+	// The driver reports only the first pitch of the planes sharing a
+	// buffer. The other planes are padded in proportion.
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+	uint32_t min_bpl0 = v4l2_bytesperline(pfi, 0, m_width);
+
+	for (unsigned i = fmt_planes; i < pfi.num_planes; ++i)
+		m_bytesperline[i] = (uint64_t)m_bytesperline[0] * v4l2_bytesperline(pfi, i, m_width) / min_bpl0;
+
+	for (uint32_t idx = 0; idx < queue_size; ++idx) {
+		v4l2_buffer buf { };
+		buf.type = buf_type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = idx;
+
+		v4l2_plane planes[4] { };
+		buf.m.planes = planes;
+		buf.length = 4;
+
+		r = ioctl(m_fd, VIDIOC_QUERYBUF, &buf);
+		ASSERT(r == 0);
+
+		vector<MmapPlane> mmap_planes;
+
+		unsigned num_planes = is_mplane(buf_type) ? buf.length : 1;
+
+		for (unsigned i = 0; i < num_planes; ++i) {
+			uint32_t length = is_mplane(buf_type) ? planes[i].length : buf.length;
+			uint32_t offset = is_mplane(buf_type) ? planes[i].m.mem_offset : buf.m.offset;
+
+			void* map = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+			if (map == MAP_FAILED)
+				throw system_error(errno, generic_category());
+
+			mmap_planes.push_back({ (uint8_t*)map, length });
+		}
+
+		m_mmap_bufs.push_back(move(mmap_planes));
+	}
+}
+
+vector<Framebuffer*> VideoStreamer::export_framebuffers(Card& card)
+{
+	FAIL_IF(m_memory != MemoryType::Mmap, "Only Mmap buffers can be exported");
+	FAIL_IF(!m_exported_fbs.empty(), "Buffers already exported");
+
+	uint32_t buf_type = get_buf_type(m_type);
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+	vector<Framebuffer*> v;
+
+	for (uint32_t idx = 0; idx < m_mmap_bufs.size(); ++idx) {
+		FAIL_IF(m_mmap_bufs[idx].size() != pfi.num_planes, "Bad number of planes");
+
+		vector<int> fds;
+		vector<uint32_t> pitches;
+		vector<uint32_t> offsets;
+
+		for (unsigned i = 0; i < pfi.num_planes; ++i) {
+			v4l2_exportbuffer expbuf { };
+			expbuf.type = buf_type;
+			expbuf.index = idx;
+			expbuf.plane = i;
+			expbuf.flags = O_RDWR | O_CLOEXEC;
+
+			int r = ioctl(m_fd, VIDIOC_EXPBUF, &expbuf);
+			if (r)
+				throw system_error(errno, generic_category());
+
+			m_exported_fds.push_back(expbuf.fd);
+
+			fds.push_back(expbuf.fd);
+			pitches.push_back(m_bytesperline[i]);
+			offsets.push_back(0);
+		}
+
+		auto fb = new DmabufFramebuffer(card, m_width, m_height, m_format, fds, pitches, offsets);
+		m_exported_fbs.emplace_back(fb);
+		m_fb_indices[fb] = idx;
+		v.push_back(fb);
+	}
+
+	return v;
 }
 
-void VideoStreamer::queue(DumbFramebuffer* fb)
+void VideoStreamer::free_buffers()
 {
-	uint32_t idx;
+	// The framebuffers don't own the fds, so close them after the framebuffers
+	m_exported_fbs.clear();
+	m_fb_indices.clear();
+
+	for (int fd : m_exported_fds)
+		::close(fd);
+	m_exported_fds.clear();
+
+	for (auto& planes : m_mmap_bufs)
+		for (auto& p : planes)
+			munmap(p.map, p.length);
+	m_mmap_bufs.clear();
+}
 
-	for (idx = 0; idx < m_fbs.size(); ++idx) {
-		if (m_fbs[idx] == nullptr)
-			break;
+// The single-planar V4L2 formats with multiple DRM planes, e.g.
+// V4L2_PIX_FMT_NV12, have the planes one after another in one buffer
+uint8_t* VideoStreamer::mmap_plane(uint32_t idx, unsigned plane)
+{
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+	const vector<MmapPlane>& bufs = m_mmap_bufs[idx];
+
+	if (bufs.size() == pfi.num_planes)
+		return bufs[plane].map;
+
+	FAIL_IF(bufs.size() != 1, "Bad number of planes");
+
+	size_t offset = 0;
+	for (unsigned i = 0; i < plane; ++i)
+		offset += (size_t)m_bytesperline[i] * (m_height / pfi.planes[i].ysub);
+
+	size_t size = (size_t)m_bytesperline[plane] * (m_height / pfi.planes[plane].ysub);
+
+	FAIL_IF(offset + size > bufs[0].length, "Buffer too small for the format");
+
+	return bufs[0].map + offset;
+}
+
+void VideoStreamer::copy_to_mmap(uint32_t idx, Framebuffer* fb)
+{
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+	for (unsigned i = 0; i < pfi.num_planes; ++i) {
+		const PixelFormatPlaneInfo& pfpi = pfi.planes[i];
+		uint32_t bytesperline = m_bytesperline[i];
+		uint32_t len = min(bytesperline, fb->stride(i));
+
+		uint8_t* dst = mmap_plane(idx, i);
+		const uint8_t* src = fb->map(i);
+
+		for (uint32_t y = 0; y < m_height / pfpi.ysub; ++y)
+			memcpy(dst + bytesperline * y, src + fb->stride(i) * y, len);
 	}
+}
+
+void VideoStreamer::copy_from_mmap(uint32_t idx, Framebuffer* fb)
+{
+	const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+	for (unsigned i = 0; i < pfi.num_planes; ++i) {
+		const PixelFormatPlaneInfo& pfpi = pfi.planes[i];
+		uint32_t bytesperline = m_bytesperline[i];
+		uint32_t len = min(bytesperline, fb->stride(i));
+
+		const uint8_t* src = mmap_plane(idx, i);
+		uint8_t* dst = fb->map(i);
+
+		for (uint32_t y = 0; y < m_height / pfpi.ysub; ++y)
+			memcpy(dst + fb->stride(i) * y, src + bytesperline * y, len);
+	}
+}
 
-	FAIL_IF(idx == m_fbs.size(), "queue full");
+void VideoStreamer::queue(Framebuffer* fb)
+{
+	KMSXX_TRACE_SCOPE("v4l2", "queue");
+
+	uint32_t idx;
+
+	auto iter = m_fb_indices.find(fb);
+
+	if (iter != m_fb_indices.end() && (m_free_indices & (1ull << iter->second))) {
+		idx = iter->second;
+	} else {
+		// Exported buffers always use their own index
+		if (!m_exported_fbs.empty()) {
+			FAIL_IF(iter == m_fb_indices.end(), "fb is not an exported framebuffer");
+			FAIL("fb already queued");
+		}
+
+		FAIL_IF(m_free_indices == 0, "queue full");
+
+		idx = __builtin_ctzll(m_free_indices);
+
+		if (iter != m_fb_indices.end()) {
+			iter->second = idx;
+		} else {
+			// Forget stale framebuffers if new ones keep coming
+			if (m_fb_indices.size() >= m_fbs.size() * 2)
+				m_fb_indices.clear();
+
+			m_fb_indices.emplace(fb, idx);
+		}
+	}
 
+	m_free_indices &= ~(1ull << idx);
 	m_fbs[idx] = fb;
 
-	v4l2_queue_dmabuf(m_fd, idx, fb, get_buf_type(m_type));
+	uint32_t buf_type = get_buf_type(m_type);
+
+	if (m_memory == MemoryType::Mmap) {
+		if (m_exported_fbs.empty() && !is_capture(m_type))
+			copy_to_mmap(idx, fb);
+
+		const auto& planes = m_mmap_bufs[idx];
+		uint32_t lengths[4];
+
+		for (unsigned i = 0; i < planes.size(); ++i)
+			lengths[i] = planes[i].length;
+
+		v4l2_queue(m_fd, idx, fb, buf_type, V4L2_MEMORY_MMAP, planes.size(), lengths);
+	} else {
+		v4l2_queue(m_fd, idx, fb, buf_type, v4l2_memory(m_memory), fb->num_planes(), nullptr);
+	}
 }
 
-DumbFramebuffer* VideoStreamer::dequeue()
+Framebuffer* VideoStreamer::dequeue()
 {
-	uint32_t idx = v4l2_dequeue(m_fd, get_buf_type(m_type));
+	KMSXX_TRACE_SCOPE("v4l2", "dequeue");
+
+	uint32_t idx = v4l2_dequeue(m_fd, get_buf_type(m_type), v4l2_memory(m_memory), m_timestamp);
 
 	auto fb = m_fbs[idx];
 	m_fbs[idx] = nullptr;
+	m_free_indices |= 1ull << idx;
+
+	if (m_memory == MemoryType::Mmap && m_exported_fbs.empty() && is_capture(m_type))
+		copy_from_mmap(idx, fb);
 
 	return fb;
 }
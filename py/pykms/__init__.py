@@ -1,7 +1,7 @@
 from .pykms import *
+from contextlib import contextmanager
 from enum import Enum
-import os
-import struct
+import asyncio
 
 #
 # Common RGB colours
@@ -76,9 +76,23 @@ def __card_disable_planes(self):
 
 Card.disable_planes = __card_disable_planes
 
-class DrmEventType(Enum):
-    VBLANK = 0x01
-    FLIP_COMPLETE = 0x02
+#
+# Framebuffer API extensions
+#
+
+# Context manager for begin_cpu_access/end_cpu_access:
+#
+# with fb.cpu_access(CpuAccess.Write):
+#     numpy.asarray(fb.map(0))[:] = 0
+@contextmanager
+def __fb_cpu_access(self, access=CpuAccess.ReadWrite):
+    self.begin_cpu_access(access)
+    try:
+        yield self
+    finally:
+        self.end_cpu_access()
+
+Framebuffer.cpu_access = __fb_cpu_access
 
 #
 # AtomicReq API extensions
@@ -138,60 +152,73 @@ pykms.AtomicReq.add_connector = __atomic_req_add_connector
 pykms.AtomicReq.add_crtc = __atomic_req_add_crtc
 pykms.AtomicReq.add_plane = __atomic_req_add_plane
 
-# struct drm_event {
-#   __u32 type;
-#   __u32 length;
-#};
+#
+# asyncio support
 #
 
-_drm_ev = struct.Struct("II")
+class AsyncEventReader:
+    """Reads the DRM events of a card in an asyncio event loop.
 
-#struct drm_event_vblank {
-#   struct drm_event base;
-#   __u64 user_data;
-#   __u32 tv_sec;
-#   __u32 tv_usec;
-#   __u32 sequence;
-#   __u32 reserved;
-#};
+    commit() and page_flip() return futures which are resolved with the
+    DrmEvent of the flip. Events not claimed by a future can be awaited
+    with read_event().
+    """
 
-_drm_ev_vbl = struct.Struct("QIIII") # Note: doesn't contain drm_event
+    def __init__(self, card, loop=None):
+        self.card = card
+        self.loop = loop if loop else asyncio.get_event_loop()
+        self.waiters = {}
+        self.events = asyncio.Queue()
+        # User data for the flips, 0 is left for others
+        self.next_data = 1
 
-class DrmEvent:
-    def __init__(self, type, seq, time, data):
-        self.type = type
-        self.seq = seq
-        self.time = time
-        self.data = data
+        self.loop.add_reader(card.fd, self.__read)
 
-# Return DrmEvents. Note: blocks if there's nothing to read
-def __card_read_events(self):
-    buf = os.read(self.fd, _drm_ev_vbl.size * 20)
+    def close(self):
+        self.loop.remove_reader(self.card.fd)
 
-    if len(buf) == 0:
-        return
+        for fut in self.waiters.values():
+            fut.cancel()
+        self.waiters.clear()
 
-    if len(buf) < _drm_ev.size:
-        raise RuntimeError("Partial DRM event")
+    def __read(self):
+        for ev in self.card.read_events(nonblock=True):
+            fut = self.waiters.pop(ev.data, None)
+            if fut and not fut.done():
+                fut.set_result(ev)
+            else:
+                self.events.put_nowait(ev)
 
-    idx = 0
+    def __new_waiter(self):
+        data = self.next_data
+        self.next_data = self.next_data % 0xffffffff + 1
 
-    while idx < len(buf):
-        ev_tuple = _drm_ev.unpack_from(buf, idx)
+        fut = self.loop.create_future()
+        self.waiters[data] = fut
+        return data, fut
 
-        type = DrmEventType(ev_tuple[0])
+    def commit(self, req, allow_modeset=False):
+        """Commit req and return a future for its flip event"""
+        data, fut = self.__new_waiter()
 
-        if type != DrmEventType.VBLANK and type != DrmEventType.FLIP_COMPLETE:
-            raise RuntimeError("Illegal DRM event type")
+        ret = req.commit(data, allow_modeset)
+        if ret < 0:
+            del self.waiters[data]
+            raise RuntimeError("commit failed with %d" % ret)
 
-        vbl_tuple = _drm_ev_vbl.unpack_from(buf, idx + _drm_ev.size)
+        return fut
 
-        seq = vbl_tuple[3]
-        time = vbl_tuple[1] + vbl_tuple[2] / 1000000.0;
-        udata = vbl_tuple[0]
+    def page_flip(self, crtc, fb):
+        """Legacy page flip, returns a future for its flip event"""
+        data, fut = self.__new_waiter()
 
-        yield DrmEvent(type, seq, time, udata)
+        try:
+            crtc.page_flip(fb, data)
+        except:
+            del self.waiters[data]
+            raise
 
-        idx += ev_tuple[1]
+        return fut
 
-Card.read_events = __card_read_events
+    async def read_event(self):
+        return await self.events.get()
@@ -1,5 +1,6 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <pybind11/numpy.h>
 #include <kms++/kms++.h>
 
 namespace py = pybind11;
@@ -17,12 +18,80 @@ static vector<unique_ptr<T, py::nodelete>> convert_vector(const vector<T*>& sour
 	return v;
 }
 
+// A plane of a framebuffer, exported with the buffer protocol. Holds a
+// reference to the python framebuffer object to keep the mapping alive.
+struct FramebufferPlane
+{
+	py::object owner;
+	Framebuffer* fb;
+	unsigned plane;
+};
+
+// The plane as a (rows, cols, bytes per col) uint8 array. A col is a pixel,
+// or a macropixel for subsampled YUV formats, e.g. a UV pair of NV12 or a
+// YUYV quad.
+static py::buffer_info plane_buffer_info(Framebuffer& fb, unsigned plane)
+{
+	const PixelFormatInfo& fi = get_pixel_format_info(fb.format());
+	const PixelFormatPlaneInfo& pi = fi.planes[plane];
+
+	size_t rows = fb.height() / pi.ysub;
+	size_t cols = fb.width() / pi.xsub;
+	size_t row_bytes = (size_t)fb.width() * pi.bitspp / 8;
+
+	// The chroma planes of fully planar YUV formats don't combine U and V
+	if (fi.type == PixelColorType::YUV && fi.num_planes == 3)
+		row_bytes /= pi.xsub;
+
+	size_t col_bytes = row_bytes / cols;
+
+	return py::buffer_info(fb.map(plane), 1, py::format_descriptor<uint8_t>::format(), 3,
+			       { rows, cols, col_bytes },
+			       { (size_t)fb.stride(plane), col_bytes, (size_t)1 });
+}
+
 void init_pykmsbase(py::module &m)
 {
+	py::class_<CardStats>(m, "CardStats")
+			.def_property_readonly("resource_gets", [](const CardStats& s) { return s.resource_gets.load(); })
+			.def_property_readonly("prop_gets", [](const CardStats& s) { return s.prop_gets.load(); })
+			.def_property_readonly("prop_sets", [](const CardStats& s) { return s.prop_sets.load(); })
+			.def_property_readonly("blob_creates", [](const CardStats& s) { return s.blob_creates.load(); })
+			.def_property_readonly("blob_destroys", [](const CardStats& s) { return s.blob_destroys.load(); })
+			.def_property_readonly("atomic_commits", [](const CardStats& s) { return s.atomic_commits.load(); })
+			.def_property_readonly("legacy_commits", [](const CardStats& s) { return s.legacy_commits.load(); })
+			.def_property_readonly("vblank_queries", [](const CardStats& s) { return s.vblank_queries.load(); })
+			.def_property_readonly("dumb_creates", [](const CardStats& s) { return s.dumb_creates.load(); })
+			.def_property_readonly("dumb_destroys", [](const CardStats& s) { return s.dumb_destroys.load(); })
+			.def_property_readonly("dumb_maps", [](const CardStats& s) { return s.dumb_maps.load(); })
+			.def_property_readonly("fb_adds", [](const CardStats& s) { return s.fb_adds.load(); })
+			.def_property_readonly("fb_removes", [](const CardStats& s) { return s.fb_removes.load(); })
+			.def_property_readonly("prime_exports", [](const CardStats& s) { return s.prime_exports.load(); })
+			.def_property_readonly("prime_imports", [](const CardStats& s) { return s.prime_imports.load(); })
+			.def_property_readonly("other_ioctls", [](const CardStats& s) { return s.other_ioctls.load(); })
+			.def_property_readonly("failed_ioctls", [](const CardStats& s) { return s.failed_ioctls.load(); })
+			.def_property_readonly("dumb_bytes", [](const CardStats& s) { return s.dumb_bytes.load(); })
+			.def_property_readonly("dmabuf_bytes", [](const CardStats& s) { return s.dmabuf_bytes.load(); })
+			.def_property_readonly("mapped_bytes", [](const CardStats& s) { return s.mapped_bytes.load(); })
+			;
+
+	py::enum_<DrmEventType>(m, "DrmEventType")
+			.value("VBLANK", DrmEventType::Vblank)
+			.value("FLIP_COMPLETE", DrmEventType::FlipComplete)
+			;
+
+	py::class_<DrmEvent>(m, "DrmEvent")
+			.def_readonly("type", &DrmEvent::type)
+			.def_readonly("seq", &DrmEvent::seq)
+			.def_readonly("time", &DrmEvent::time)
+			.def_readonly("data", &DrmEvent::data)
+			.def_readonly("crtc_id", &DrmEvent::crtc_id)
+			;
+
 	py::class_<Card>(m, "Card")
-			.def(py::init<>())
-			.def(py::init<const string&>())
-			.def(py::init<const string&, uint32_t>())
+			.def(py::init<>(), py::call_guard<py::gil_scoped_release>())
+			.def(py::init<const string&>(), py::call_guard<py::gil_scoped_release>())
+			.def(py::init<const string&, uint32_t>(), py::call_guard<py::gil_scoped_release>())
 			.def_property_readonly("fd", &Card::fd)
 			.def_property_readonly("minor", &Card::dev_minor)
 			.def_property_readonly("get_first_connected_connector", &Card::get_first_connected_connector)
@@ -47,7 +116,21 @@ void init_pykmsbase(py::module &m)
 			})
 
 			.def_property_readonly("has_atomic", &Card::has_atomic)
+			.def_property_readonly("has_async_page_flip", &Card::has_async_page_flip)
+			.def_property_readonly("has_atomic_async_page_flip", &Card::has_atomic_async_page_flip)
 			.def("get_prop", (Property* (Card::*)(uint32_t) const)&Card::get_prop)
+			.def("save_state", &Card::save_state)
+			.def("restore_state", &Card::restore_state)
+
+			.def_property_readonly("stats", [](Card* self) {
+				return self->stats();
+			})
+			.def("reset_stats", &Card::reset_stats)
+
+			// Returns a list of DrmEvents. Blocks if there's nothing to
+			// read, unless nonblock is set.
+			.def("read_events", &Card::read_events, py::arg("nonblock") = false,
+			     py::call_guard<py::gil_scoped_release>())
 
 			.def_property_readonly("version_name", &Card::version_name);
 			;
@@ -79,20 +162,34 @@ void init_pykmsbase(py::module &m)
 			.def("get_mode", (Videomode (Connector::*)(const string& mode) const)&Connector::get_mode)
 			.def("get_mode", (Videomode (Connector::*)(unsigned xres, unsigned yres, float refresh, bool ilace) const)&Connector::get_mode)
 			.def("connected", &Connector::connected)
+			.def_property_readonly("vrr_capable", &Connector::vrr_capable)
+			.def("get_vrr_range", [](Connector* self) -> py::object {
+				float min_hz, max_hz;
+				if (!self->get_vrr_range(min_hz, max_hz))
+					return py::none();
+				return py::make_tuple(min_hz, max_hz);
+			})
 			.def("__repr__", [](const Connector& o) { return "<pykms.Connector " + to_string(o.id()) + ">"; })
 			.def("refresh", &Connector::refresh)
 			;
 
 	py::class_<Crtc, DrmPropObject, unique_ptr<Crtc, py::nodelete>>(m, "Crtc")
-			.def("set_mode", (int (Crtc::*)(Connector*, const Videomode&))&Crtc::set_mode)
-			.def("set_mode", (int (Crtc::*)(Connector*, Framebuffer&, const Videomode&))&Crtc::set_mode)
-			.def("disable_mode", &Crtc::disable_mode)
+			.def("set_mode", (int (Crtc::*)(Connector*, const Videomode&))&Crtc::set_mode,
+			     py::call_guard<py::gil_scoped_release>())
+			.def("set_mode", (int (Crtc::*)(Connector*, Framebuffer&, const Videomode&))&Crtc::set_mode,
+			     py::call_guard<py::gil_scoped_release>())
+			.def("needs_modeset", &Crtc::needs_modeset)
+			.def("set_mode_seamless", &Crtc::set_mode_seamless, py::call_guard<py::gil_scoped_release>())
+			.def_property_readonly("has_vrr", &Crtc::has_vrr)
+			.def("set_vrr", &Crtc::set_vrr, py::call_guard<py::gil_scoped_release>())
+			.def("disable_mode", &Crtc::disable_mode, py::call_guard<py::gil_scoped_release>())
 			.def("page_flip",
-			     [](Crtc* self, Framebuffer& fb, uint32_t data)
+			     [](Crtc* self, Framebuffer& fb, uint32_t data, bool async)
 				{
-					self->page_flip(fb, (void*)(intptr_t)data);
-				}, py::arg("fb"), py::arg("data") = 0)
-			.def("set_plane", &Crtc::set_plane)
+					self->page_flip(fb, (void*)(intptr_t)data, async);
+				}, py::arg("fb"), py::arg("data") = 0, py::arg("async") = false,
+			     py::call_guard<py::gil_scoped_release>())
+			.def("set_plane", &Crtc::set_plane, py::call_guard<py::gil_scoped_release>())
 			.def_property_readonly("possible_planes", &Crtc::get_possible_planes)
 			.def_property_readonly("primary_plane", &Crtc::get_primary_plane)
 			.def_property_readonly("mode", &Crtc::mode)
@@ -144,6 +241,17 @@ void init_pykmsbase(py::module &m)
 			.def_property_readonly("card", &DrmObject::card)
 			;
 
+	py::enum_<CpuAccess>(m, "CpuAccess")
+			.value("Read", CpuAccess::Read)
+			.value("Write", CpuAccess::Write)
+			.value("ReadWrite", CpuAccess::ReadWrite)
+			;
+
+	py::class_<FramebufferPlane>(m, "FramebufferPlane", py::buffer_protocol())
+			.def_buffer([](FramebufferPlane& p) { return plane_buffer_info(*p.fb, p.plane); })
+			.def_readonly("plane", &FramebufferPlane::plane)
+			;
+
 	py::class_<Framebuffer>(m, "Framebuffer")
 			.def_property_readonly("width", &Framebuffer::width)
 			.def_property_readonly("height", &Framebuffer::height)
@@ -153,6 +261,16 @@ void init_pykmsbase(py::module &m)
 			.def("size", &Framebuffer::size)
 			.def("offset", &Framebuffer::offset)
 			.def("fd", &Framebuffer::prime_fd)
+			// Returns a writable memoryview of the plane's existing mapping,
+			// e.g. for numpy.asarray()
+			.def("map", [](py::object self, unsigned plane) {
+				Framebuffer& fb = self.cast<Framebuffer&>();
+				if (plane >= fb.num_planes())
+					throw py::index_error("plane index out of range");
+				return py::memoryview(py::cast(FramebufferPlane { self, &fb, plane }));
+			})
+			.def("begin_cpu_access", &Framebuffer::begin_cpu_access)
+			.def("end_cpu_access", &Framebuffer::end_cpu_access)
 
 			// XXX pybind11 doesn't support a base object (DrmObject) with custom holder-type,
 			// and a subclass with standard holder-type.
@@ -165,9 +283,11 @@ void init_pykmsbase(py::module &m)
 
 	py::class_<DumbFramebuffer, Framebuffer>(m, "DumbFramebuffer")
 			.def(py::init<Card&, uint32_t, uint32_t, const string&>(),
-			     py::keep_alive<1, 2>())	// Keep Card alive until this is destructed
+			     py::keep_alive<1, 2>(),	// Keep Card alive until this is destructed
+			     py::call_guard<py::gil_scoped_release>())
 			.def(py::init<Card&, uint32_t, uint32_t, PixelFormat>(),
-			     py::keep_alive<1, 2>())	// Keep Card alive until this is destructed
+			     py::keep_alive<1, 2>(),	// Keep Card alive until this is destructed
+			     py::call_guard<py::gil_scoped_release>())
 			;
 
 	py::class_<DmabufFramebuffer, Framebuffer>(m, "DmabufFramebuffer")
@@ -278,12 +398,41 @@ void init_pykmsbase(py::module &m)
 			.def("add", (void (AtomicReq::*)(DrmPropObject*, const string&, uint64_t)) &AtomicReq::add)
 			.def("add", (void (AtomicReq::*)(DrmPropObject*, Property*, uint64_t)) &AtomicReq::add)
 			.def("add", (void (AtomicReq::*)(DrmPropObject*, const map<string, uint64_t>&)) &AtomicReq::add)
-			.def("test", &AtomicReq::test, py::arg("allow_modeset") = false)
+
+			// Add many properties in one call, given as (object id, property id,
+			// value) rows. The property ids can be resolved once with
+			// obj.get_prop(name).id and reused for every commit.
+			// Registered first, so that numpy arrays of any integer type are
+			// converted as a whole. Only ndarrays match py::array.
+			.def("add_bulk", [](AtomicReq* self, py::array array) {
+				auto rows = py::array_t<uint64_t, py::array::c_style | py::array::forcecast>::ensure(array);
+				if (!rows || rows.ndim() != 2 || rows.shape(1) != 3)
+					throw invalid_argument("add_bulk: expected an array of shape (N, 3)");
+
+				auto r = rows.unchecked<2>();
+				vector<AtomicReq::Prop> props(r.shape(0));
+
+				for (ssize_t i = 0; i < r.shape(0); ++i)
+					props[i] = { (uint32_t)r(i, 0), (uint32_t)r(i, 1), r(i, 2) };
+
+				self->add(props);
+			})
+			.def("add_bulk", [](AtomicReq* self, const vector<tuple<uint32_t, uint32_t, uint64_t>>& rows) {
+				vector<AtomicReq::Prop> props;
+				props.reserve(rows.size());
+				for (const auto& r : rows)
+					props.push_back({ get<0>(r), get<1>(r), get<2>(r) });
+				self->add(props);
+			})
+			.def("test", &AtomicReq::test, py::arg("allow_modeset") = false,
+			     py::call_guard<py::gil_scoped_release>())
 			.def("commit",
-			     [](AtomicReq* self, uint32_t data, bool allow)
+			     [](AtomicReq* self, uint32_t data, bool allow, bool async)
 				{
-					return self->commit((void*)(intptr_t)data, allow);
-				}, py::arg("data") = 0, py::arg("allow_modeset") = false)
-			.def("commit_sync", &AtomicReq::commit_sync, py::arg("allow_modeset") = false)
+					return self->commit((void*)(intptr_t)data, allow, async);
+				}, py::arg("data") = 0, py::arg("allow_modeset") = false, py::arg("async") = false,
+			     py::call_guard<py::gil_scoped_release>())
+			.def("commit_sync", &AtomicReq::commit_sync, py::arg("allow_modeset") = false,
+			     py::call_guard<py::gil_scoped_release>())
 			;
 }
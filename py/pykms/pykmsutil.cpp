@@ -40,6 +40,32 @@ void init_pykmstest(py::module &m)
 			     py::arg("crtc"),
 			     py::arg("format") = PixelFormat::Undefined)
 			;
+	py::class_<PresentationQueue>(m, "PresentationQueue")
+			.def(py::init<double, double>(),
+			     py::arg("display_period"),
+			     py::arg("delay") = 0)
+			.def("push", &PresentationQueue::push)
+			.def("vblank", &PresentationQueue::vblank)
+			.def("next_vblank", &PresentationQueue::next_vblank)
+			.def_property_readonly("next_due_vblank", &PresentationQueue::next_due_vblank)
+			// Returns the id of the frame to show, or None to repeat
+			.def("select", [](PresentationQueue* self, double vblank_time) -> py::object {
+				uint32_t id;
+				if (!self->select(vblank_time, id))
+					return py::none();
+				return py::int_(id);
+			})
+			.def("take_dropped", &PresentationQueue::take_dropped)
+			.def("__len__", &PresentationQueue::size)
+			.def_property_readonly("delay", &PresentationQueue::delay)
+			.def_property_readonly("display_period", &PresentationQueue::display_period)
+			.def_property_readonly("source_period", &PresentationQueue::source_period)
+			.def_property_readonly("drift_ppm", &PresentationQueue::drift_ppm)
+			.def_property_readonly("frames_shown", &PresentationQueue::frames_shown)
+			.def_property_readonly("frames_dropped", &PresentationQueue::frames_dropped)
+			.def_property_readonly("frames_repeated", &PresentationQueue::frames_repeated)
+			;
+
 	py::enum_<YUVType>(m, "YUVType")
 			.value("BT601_Lim", YUVType::BT601_Lim)
 			.value("BT601_Full", YUVType::BT601_Full)
@@ -47,19 +73,39 @@ void init_pykmstest(py::module &m)
 			.value("BT709_Full", YUVType::BT709_Full)
 			;
 
+	py::class_<FbCompareResult>(m, "FbCompareResult")
+			.def_readonly("max_error", &FbCompareResult::max_error)
+			.def_readonly("diff_pixels", &FbCompareResult::diff_pixels)
+			.def_readonly("mse", &FbCompareResult::mse)
+			.def_readonly("psnr", &FbCompareResult::psnr)
+			.def_readonly("ssim", &FbCompareResult::ssim)
+			;
+
 	// Use lambdas to handle IFramebuffer
+	// The drawing functions only touch the framebuffer memory, so the GIL is
+	// released while they run
 	m.def("draw_test_pattern", [](Framebuffer& fb, YUVType yuvt) { draw_test_pattern(fb, yuvt); },
 	      py::arg("fb"),
-	      py::arg("yuvt") = YUVType::BT601_Lim);
+	      py::arg("yuvt") = YUVType::BT601_Lim,
+	      py::call_guard<py::gil_scoped_release>());
 	m.def("draw_color_bar", [](Framebuffer& fb, int old_xpos, int xpos, int width) {
 		draw_color_bar(fb, old_xpos, xpos, width);
-	} );
+	}, py::call_guard<py::gil_scoped_release>());
 	m.def("draw_rect", [](Framebuffer& fb, uint32_t x, uint32_t y, uint32_t w, uint32_t h, RGB color) {
 		draw_rect(fb, x, y, w, h, color);
-	} );
+	}, py::call_guard<py::gil_scoped_release>());
 	m.def("draw_circle", [](Framebuffer& fb, int32_t xCenter, int32_t yCenter, int32_t radius, RGB color) {
 		draw_circle(fb, xCenter, yCenter, radius, color);
-	} );
+	}, py::call_guard<py::gil_scoped_release>());
 	m.def("draw_text", [](Framebuffer& fb, uint32_t x, uint32_t y, const string& str, RGB color) {
-		draw_text(fb, x, y, str, color); } );
+		draw_text(fb, x, y, str, color); }, py::call_guard<py::gil_scoped_release>());
+	m.def("fb_crc32c", [](Framebuffer& fb) { return fb_crc32c(fb); }, py::call_guard<py::gil_scoped_release>());
+	m.def("fb_compare", [](Framebuffer& a, Framebuffer& b, Framebuffer* diff, YUVType yuvt) {
+		return fb_compare(a, b, diff, yuvt);
+	},
+	      py::arg("a"),
+	      py::arg("b"),
+	      py::arg("diff") = nullptr,
+	      py::arg("yuvt") = YUVType::BT601_Lim,
+	      py::call_guard<py::gil_scoped_release>());
 }
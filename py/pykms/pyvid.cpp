@@ -12,7 +12,7 @@ using namespace std;
 void init_pyvid(py::module &m)
 {
 	py::class_<VideoDevice>(m, "VideoDevice")
-			.def(py::init<const string&>())
+			.def(py::init<const string&>(), py::call_guard<py::gil_scoped_release>())
 			.def_property_readonly("fd", &VideoDevice::fd)
 			.def_property_readonly("has_capture", &VideoDevice::has_capture)
 			.def_property_readonly("has_output", &VideoDevice::has_output)
@@ -24,7 +24,16 @@ void init_pyvid(py::module &m)
 			.def("get_capture_devices", &VideoDevice::get_capture_devices)
 			;
 
-	py::class_<VideoStreamer>(m, "VideoStreamer")
+	py::class_<VideoStreamer> streamer(m, "VideoStreamer");
+
+	py::enum_<VideoStreamer::MemoryType>(streamer, "MemoryType")
+			.value("Auto", VideoStreamer::MemoryType::Auto)
+			.value("Mmap", VideoStreamer::MemoryType::Mmap)
+			.value("Userptr", VideoStreamer::MemoryType::Userptr)
+			.value("Dmabuf", VideoStreamer::MemoryType::Dmabuf)
+			;
+
+	streamer
 			.def_property_readonly("fd", &VideoStreamer::fd)
 			.def_property_readonly("ports", &VideoStreamer::get_ports)
 			.def("set_port", &VideoStreamer::set_port)
@@ -39,10 +48,18 @@ void init_pyvid(py::module &m)
 				self->set_selection(left, top, width, height);
 				return make_tuple(left, top, width, height);
 			} )
+			.def_property_readonly("memory_types", &VideoStreamer::get_memory_types)
+			.def_property("memory_type", &VideoStreamer::memory_type, &VideoStreamer::set_memory_type)
 			.def("set_queue_size", &VideoStreamer::set_queue_size)
-			.def("queue", &VideoStreamer::queue)
-			.def("dequeue", &VideoStreamer::dequeue)
-			.def("stream_on", &VideoStreamer::stream_on)
-			.def("stream_off", &VideoStreamer::stream_off)
+			// The framebuffers are owned by the streamer
+			.def("export_framebuffers", &VideoStreamer::export_framebuffers,
+			     py::return_value_policy::reference_internal, py::keep_alive<1, 2>())
+			// The GIL is released around the blocking ioctls
+			.def("queue", &VideoStreamer::queue, py::call_guard<py::gil_scoped_release>())
+			.def("dequeue", &VideoStreamer::dequeue, py::call_guard<py::gil_scoped_release>())
+			// Capture time of the last dequeued buffer, 0 if not monotonic
+			.def_property_readonly("timestamp", &VideoStreamer::timestamp)
+			.def("stream_on", &VideoStreamer::stream_on, py::call_guard<py::gil_scoped_release>())
+			.def("stream_off", &VideoStreamer::stream_off, py::call_guard<py::gil_scoped_release>())
 			;
 }
@@ -0,0 +1,62 @@
+#!/usr/bin/python3
+
+# Flip with a moving color bar, driven by asyncio
+
+import argparse
+import asyncio
+import time
+import pykms
+
+bar_width = 20
+bar_speed = 8
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-c", "--connector", default="")
+parser.add_argument("-n", "--frames", type=int, default=600)
+args = parser.parse_args()
+
+card = pykms.Card()
+res = pykms.ResourceManager(card)
+conn = res.reserve_connector(args.connector)
+crtc = res.reserve_crtc(conn)
+plane = res.reserve_primary_plane(crtc)
+mode = conn.get_default_mode()
+modeb = mode.to_blob(card)
+
+fbs = [pykms.DumbFramebuffer(card, mode.hdisplay, mode.vdisplay, "XR24") for i in range(2)]
+
+async def flip_loop():
+    reader = pykms.AsyncEventReader(card)
+
+    req = pykms.AtomicReq(card)
+    req.add_connector(conn, crtc)
+    req.add_crtc(crtc, modeb)
+    req.add_plane(plane, fbs[0], crtc)
+    await reader.commit(req, allow_modeset=True)
+
+    xpos = 0
+    start = time.perf_counter()
+    start_seq = None
+
+    for i in range(args.frames):
+        fb = fbs[(i + 1) % 2]
+
+        old_xpos = (xpos + (fb.width - bar_width - bar_speed)) % (fb.width - bar_width)
+        xpos = (xpos + bar_speed) % (fb.width - bar_width)
+        pykms.draw_color_bar(fb, old_xpos, xpos, bar_width)
+
+        req = pykms.AtomicReq(card)
+        req.add(plane, "FB_ID", fb.id)
+        ev = await reader.commit(req)
+
+        if start_seq is None:
+            start_seq = ev.seq
+
+    elapsed = time.perf_counter() - start
+
+    print("{} flips in {:.2f} s, {:.2f} fps, {} vblanks".format(
+          args.frames, elapsed, args.frames / elapsed, ev.seq - start_seq + 1))
+
+    reader.close()
+
+asyncio.run(flip_loop())
@@ -9,6 +9,8 @@ import time
 parser = argparse.ArgumentParser()
 parser.add_argument("width", type=int)
 parser.add_argument("height", type=int)
+parser.add_argument("--mmap", action="store_true", help="capture to V4L2 allocated buffers")
+parser.add_argument("--sched", action="store_true", help="show frames at the vblanks matching their capture timestamps")
 args = parser.parse_args()
 
 w = args.width
@@ -34,28 +36,98 @@ req.commit_sync(allow_modeset = True)
 
 NUM_BUFS = 5
 
-fbs = []
-for i in range(NUM_BUFS):
-    fb = pykms.DumbFramebuffer(card, w, h, fmt)
-    fbs.append(fb)
-
 vidpath = pykms.VideoDevice.get_capture_devices()[0]
 
 vid = pykms.VideoDevice(vidpath)
 cap = vid.capture_streamer
 cap.set_port(0)
 cap.set_format(fmt, w, h)
+
+if args.mmap:
+    cap.memory_type = pykms.VideoStreamer.MemoryType.Mmap
+
 cap.set_queue_size(NUM_BUFS)
 
+if args.mmap:
+    fbs = cap.export_framebuffers(card)
+else:
+    fbs = []
+    for i in range(NUM_BUFS):
+        fb = pykms.DumbFramebuffer(card, w, h, fmt)
+        fbs.append(fb)
+
 for fb in fbs:
     cap.queue(fb)
 
 cap.stream_on()
 
+if args.sched:
+    if not card.has_atomic:
+        print("--sched needs atomic modesetting")
+        exit(1)
+
+    pq = pykms.PresentationQueue(1 / mode.vrefresh)
+    fbs_by_id = {fb.id: fb for fb in fbs}
+    current_fb = None
+    queued_fb = None
+
+def now():
+    return time.clock_gettime(time.CLOCK_MONOTONIC)
+
+def show_next():
+    global queued_fb
+
+    if queued_fb:
+        return
+
+    fb_id = pq.select(pq.next_vblank(now()))
+
+    for dropped in pq.take_dropped():
+        cap.queue(fbs_by_id[dropped])
+
+    if fb_id is None:
+        return
+
+    fb = fbs_by_id[fb_id]
+
+    req = pykms.AtomicReq(card)
+    req.add_plane(plane, fb, crtc)
+    req.commit()
+
+    queued_fb = fb
+
+def time_to_next():
+    if not args.sched or queued_fb or len(pq) == 0:
+        return None
+
+    # Commit half a frame before the vblank the frame is due at
+    t = pq.next_due_vblank - pq.display_period / 2
+
+    return max(t - now(), 0)
+
+def readdrm(conn, mask):
+    global current_fb, queued_fb
+
+    for ev in card.read_events():
+        pq.vblank(ev.time)
+
+        if queued_fb:
+            if current_fb:
+                cap.queue(current_fb)
+            current_fb = queued_fb
+            queued_fb = None
+
+    show_next()
 
 def readvid(conn, mask):
     fb = cap.dequeue()
 
+    if args.sched:
+        # Not all devices use monotonic timestamps
+        pq.push(fb.id, cap.timestamp or now())
+        show_next()
+        return
+
     if card.has_atomic:
         plane.set_props({
             "FB_ID": fb.id,
@@ -74,14 +146,26 @@ def readvid(conn, mask):
 def readkey(conn, mask):
     #print("KEY EVENT");
     sys.stdin.readline()
+
+    if args.sched:
+        print("shown {}, dropped {}, repeated {}, drift {:.0f} ppm, delay {:.1f} ms".format(
+            pq.frames_shown, pq.frames_dropped, pq.frames_repeated,
+            pq.drift_ppm, pq.delay * 1000))
+
     exit(0)
 
 sel = selectors.DefaultSelector()
 sel.register(cap.fd, selectors.EVENT_READ, readvid)
 sel.register(sys.stdin, selectors.EVENT_READ, readkey)
+if args.sched:
+    sel.register(card.fd, selectors.EVENT_READ, readdrm)
 
 while True:
-    events = sel.select()
+    events = sel.select(time_to_next())
+
+    if args.sched and time_to_next() == 0:
+        show_next()
+
     for key, mask in events:
         callback = key.data
         callback(key.fileobj, mask)
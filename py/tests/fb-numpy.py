@@ -0,0 +1,35 @@
+#!/usr/bin/python3
+
+# Draw gradients with numpy directly into the framebuffer mappings
+
+import argparse
+import numpy as np
+import pykms
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-c", "--connector", default="")
+parser.add_argument("-f", "--format", default="XR24")
+args = parser.parse_args()
+
+card = pykms.Card()
+res = pykms.ResourceManager(card)
+conn = res.reserve_connector(args.connector)
+crtc = res.reserve_crtc(conn)
+mode = conn.get_default_mode()
+
+fb = pykms.DumbFramebuffer(card, mode.hdisplay, mode.vdisplay, args.format)
+
+with fb.cpu_access(pykms.CpuAccess.Write):
+    for p in range(fb.num_planes):
+        # shape is (rows, cols, bytes per col)
+        a = np.asarray(fb.map(p))
+        rows, cols, _ = a.shape
+
+        h = np.linspace(0, 255, cols, dtype=np.uint8)
+        v = np.linspace(0, 255, rows, dtype=np.uint8)
+
+        a[:] = (h[np.newaxis, :, np.newaxis] // 2 + v[:, np.newaxis, np.newaxis] // 2)
+
+crtc.set_mode(conn, fb, mode)
+
+input("press enter to exit\n")
@@ -0,0 +1,63 @@
+#!/usr/bin/python3
+
+# Check that pykms releases the GIL during long calls. A Python thread ticks
+# while the main thread draws test patterns. If the GIL was held during the
+# drawing, the ticker would stall for the whole call.
+
+import sys
+import threading
+import time
+import pykms
+
+card = pykms.Card()
+res = pykms.ResourceManager(card)
+conn = res.reserve_connector()
+crtc = res.reserve_crtc(conn)
+mode = conn.get_default_mode()
+
+fb = pykms.DumbFramebuffer(card, mode.hdisplay, mode.vdisplay, "XR24")
+
+running = True
+max_gap = 0
+ticks = 0
+
+def ticker():
+    global max_gap, ticks
+
+    prev = time.perf_counter()
+
+    while running:
+        time.sleep(0.0005)
+        now = time.perf_counter()
+        max_gap = max(max_gap, now - prev)
+        prev = now
+        ticks += 1
+
+t = threading.Thread(target=ticker)
+t.start()
+
+num_draws = 20
+durations = []
+
+for i in range(num_draws):
+    start = time.perf_counter()
+    pykms.draw_test_pattern(fb)
+    durations.append(time.perf_counter() - start)
+
+running = False
+t.join()
+
+avg = sum(durations) / len(durations)
+
+print("draw_test_pattern avg {:.2f} ms, ticker max gap {:.2f} ms, {} ticks".format(
+      avg * 1000, max_gap * 1000, ticks))
+
+# The ticker must have run during the draws, and not only between them. Very
+# short draws can't be told apart from scheduling noise.
+if avg < 0.005:
+    print("draws too short for a reliable result")
+elif max_gap >= avg:
+    print("FAIL: ticker stalled during the drawing")
+    sys.exit(1)
+
+print("OK")
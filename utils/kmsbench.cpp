@@ -0,0 +1,489 @@
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <kms++/kms++.h>
+
+#include <kms++util/kms++util.h>
+
+using namespace std;
+using namespace kms;
+
+static const char* usage_str =
+		"Usage: kmsbench [OPTION]...\n\n"
+		"Run microbenchmarks and print the results as JSON\n\n"
+		"Options:\n"
+		"      --device=DEVICE       DEVICE is the card used for the commit benchmarks,\n"
+		"                            the default is \"virtual\"\n"
+		"  -s, --size=WxH            Framebuffer size, can be given multiple times\n"
+		"  -f, --format=FOURCC       Pixel format, can be given multiple times\n"
+		"  -b, --bench=NAME          Run only the benchmarks whose name contains NAME\n"
+		"  -t, --time=SECS           Minimum run time for each benchmark (default 0.5)\n"
+		"  -o, --output=FILE         Write the JSON to FILE instead of stdout\n"
+		"  -l, --list                List the benchmarks\n"
+		;
+
+static void usage()
+{
+	puts(usage_str);
+}
+
+static const PixelFormat all_formats[] = {
+	PixelFormat::XRGB8888,
+	PixelFormat::XBGR8888,
+	PixelFormat::RGBX8888,
+	PixelFormat::BGRX8888,
+	PixelFormat::ARGB8888,
+	PixelFormat::ABGR8888,
+	PixelFormat::RGBA8888,
+	PixelFormat::BGRA8888,
+	PixelFormat::XRGB2101010,
+	PixelFormat::XBGR2101010,
+	PixelFormat::RGBX1010102,
+	PixelFormat::BGRX1010102,
+	PixelFormat::ARGB2101010,
+	PixelFormat::ABGR2101010,
+	PixelFormat::RGBA1010102,
+	PixelFormat::BGRA1010102,
+	PixelFormat::RGB888,
+	PixelFormat::BGR888,
+	PixelFormat::RGB565,
+	PixelFormat::BGR565,
+	PixelFormat::RGB332,
+	PixelFormat::XRGB4444,
+	PixelFormat::ARGB4444,
+	PixelFormat::XRGB1555,
+	PixelFormat::ARGB1555,
+	PixelFormat::UYVY,
+	PixelFormat::YUYV,
+	PixelFormat::YVYU,
+	PixelFormat::VYUY,
+	PixelFormat::NV12,
+	PixelFormat::NV21,
+	PixelFormat::NV16,
+	PixelFormat::NV61,
+	PixelFormat::YUV420,
+	PixelFormat::YVU420,
+	PixelFormat::YUV422,
+	PixelFormat::YVU422,
+	PixelFormat::YUV444,
+	PixelFormat::YVU444,
+};
+
+struct BenchResult
+{
+	string name;
+	string format;
+	uint32_t width;
+	uint32_t height;
+
+	unsigned iterations;
+	double median_us;
+	double p99_us;
+	double min_us;
+	double max_us;
+
+	// bytes touched per iteration, 0 if not meaningful
+	uint64_t bytes;
+};
+
+static double s_min_time = 0.5;
+static vector<string> s_filters;
+static bool s_list;
+
+static vector<BenchResult> s_results;
+
+static bool bench_enabled(const string& name)
+{
+	if (s_filters.empty())
+		return true;
+
+	for (const string& f : s_filters) {
+		if (name.find(f) != string::npos)
+			return true;
+	}
+
+	return false;
+}
+
+static double percentile(const vector<double>& sorted, double p)
+{
+	size_t idx = min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+	return sorted[idx];
+}
+
+// Run func repeatedly for at least s_min_time seconds, with a warm-up round
+// which is not included in the results
+static void run_bench(const string& name, const string& format, uint32_t width, uint32_t height,
+		      uint64_t bytes, function<void()> func)
+{
+	if (!bench_enabled(name))
+		return;
+
+	if (s_list) {
+		printf("%s %s %ux%u\n", name.c_str(), format.c_str(), width, height);
+		return;
+	}
+
+	const unsigned min_iterations = 5;
+	const unsigned max_iterations = 100000;
+
+	fprintf(stderr, "%s %s %ux%u...", name.c_str(), format.c_str(), width, height);
+
+	try {
+		func();
+	} catch (const exception& e) {
+		fprintf(stderr, " skipped: %s\n", e.what());
+		return;
+	}
+
+	vector<double> times;
+	Stopwatch total;
+	total.start();
+
+	while (times.size() < max_iterations &&
+	       (times.size() < min_iterations || total.elapsed_s() < s_min_time)) {
+		Stopwatch sw;
+		sw.start();
+
+		func();
+
+		times.push_back(sw.elapsed_us());
+	}
+
+	sort(times.begin(), times.end());
+
+	BenchResult res;
+	res.name = name;
+	res.format = format;
+	res.width = width;
+	res.height = height;
+	res.iterations = times.size();
+	res.median_us = percentile(times, 0.5);
+	res.p99_us = percentile(times, 0.99);
+	res.min_us = times.front();
+	res.max_us = times.back();
+	res.bytes = bytes;
+
+	fprintf(stderr, " %.1f us\n", res.median_us);
+
+	s_results.push_back(res);
+}
+
+static uint64_t fb_bytes(IFramebuffer& fb)
+{
+	uint64_t bytes = 0;
+
+	for (unsigned i = 0; i < fb.num_planes(); ++i)
+		bytes += fb.size(i);
+
+	return bytes;
+}
+
+static void bench_drawing(const vector<pair<uint32_t, uint32_t>>& sizes, const vector<PixelFormat>& formats)
+{
+	for (PixelFormat format : formats) {
+		string fourcc = PixelFormatToFourCC(format);
+
+		for (auto size : sizes) {
+			uint32_t w = size.first;
+			uint32_t h = size.second;
+
+			CPUFramebuffer fb(w, h, format);
+			uint64_t bytes = fb_bytes(fb);
+
+			run_bench("draw_test_pattern", fourcc, w, h, bytes, [&fb]() {
+				draw_test_pattern(fb);
+			});
+
+			run_bench("draw_rect", fourcc, w, h, bytes, [&fb]() {
+				draw_rect(fb, 0, 0, fb.width(), fb.height(), RGB(255, 0, 0));
+			});
+
+			// A line of text at the top, as kmstest draws
+			string text = "kmsbench 0123456789 ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+			uint32_t text_w = min<uint32_t>(text.size() * 8, w) & ~7;
+			text.resize(text_w / 8);
+
+			run_bench("draw_text", fourcc, w, h, bytes * text_w * 8 / ((uint64_t)w * h), [&fb, text]() {
+				draw_text(fb, 0, 0, text, RGB(255, 255, 255));
+			});
+
+			// A 20 pixel wide bar moving 1 pixel, as kmstest --flip draws
+			const int bar_w = 20;
+			int xpos = 0;
+
+			run_bench("draw_color_bar", fourcc, w, h, bytes * bar_w * 2 / w, [&fb, &xpos, bar_w]() {
+				int old_xpos = xpos;
+				xpos = (xpos + 1) % (fb.width() - bar_w);
+				draw_color_bar(fb, old_xpos, xpos, bar_w);
+			});
+		}
+	}
+}
+
+static void bench_color(const vector<pair<uint32_t, uint32_t>>& sizes)
+{
+	static const pair<YUVType, const char*> yuv_types[] = {
+		{ YUVType::BT601_Lim, "BT601_Lim" },
+		{ YUVType::BT601_Full, "BT601_Full" },
+		{ YUVType::BT709_Lim, "BT709_Lim" },
+		{ YUVType::BT709_Full, "BT709_Full" },
+	};
+
+	for (auto size : sizes) {
+		uint32_t w = size.first;
+		uint32_t h = size.second;
+
+		vector<RGB> rgb(w * h);
+		for (size_t i = 0; i < rgb.size(); ++i)
+			rgb[i] = RGB((uint32_t)(i * 2654435761u));
+
+		vector<YUV> yuv(w * h);
+
+		for (auto& t : yuv_types) {
+			YUVType type = t.first;
+
+			run_bench(string("rgb_to_yuv_") + t.second, "", w, h, rgb.size() * 4, [&rgb, &yuv, type]() {
+				for (size_t i = 0; i < rgb.size(); ++i)
+					yuv[i] = rgb[i].yuv(type);
+			});
+		}
+
+		vector<uint16_t> rgb565(w * h);
+
+		run_bench("rgb_to_rgb565", "", w, h, rgb.size() * 4, [&rgb, &rgb565]() {
+			for (size_t i = 0; i < rgb.size(); ++i)
+				rgb565[i] = rgb[i].rgb565();
+		});
+
+		vector<uint32_t> argb2101010(w * h);
+
+		run_bench("rgb_to_argb2101010", "", w, h, rgb.size() * 4, [&rgb, &argb2101010]() {
+			for (size_t i = 0; i < rgb.size(); ++i)
+				argb2101010[i] = rgb[i].argb2101010();
+		});
+	}
+}
+
+static void bench_crc(const vector<pair<uint32_t, uint32_t>>& sizes)
+{
+	for (auto size : sizes) {
+		uint32_t w = size.first;
+		uint32_t h = size.second;
+
+		CPUFramebuffer fb(w, h, PixelFormat::XRGB8888);
+		draw_test_pattern(fb);
+
+		run_bench("crc32c", "XR24", w, h, fb_bytes(fb), [&fb]() {
+			fb_crc32c(fb);
+		});
+	}
+}
+
+static void bench_atomic(const string& dev_path)
+{
+	if (s_list) {
+		for (auto name : { "prop_lookup", "prop_value_lookup", "atomic_req_build", "atomic_req_test" })
+			run_bench(name, "", 0, 0, 0, []() { });
+		return;
+	}
+
+	if (!bench_enabled("prop_lookup") && !bench_enabled("prop_value_lookup") &&
+	    !bench_enabled("atomic_req"))
+		return;
+
+	Card card(dev_path);
+
+	if (!card.has_atomic()) {
+		fprintf(stderr, "atomic modesetting not supported, skipping the commit benchmarks\n");
+		return;
+	}
+
+	ResourceManager resman(card);
+
+	Connector* conn = resman.reserve_connector();
+	if (!conn) {
+		fprintf(stderr, "no connector, skipping the commit benchmarks\n");
+		return;
+	}
+
+	Crtc* crtc = resman.reserve_crtc(conn);
+	Plane* plane = resman.reserve_primary_plane(crtc);
+	if (!plane) {
+		fprintf(stderr, "no primary plane, skipping the commit benchmarks\n");
+		return;
+	}
+
+	static const char* plane_props[] = {
+		"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+		"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+	};
+
+	run_bench("prop_lookup", "", 0, 0, 0, [plane]() {
+		for (const char* name : plane_props) {
+			if (!plane->get_prop(name))
+				throw runtime_error("prop not found");
+		}
+	});
+
+	run_bench("prop_value_lookup", "", 0, 0, 0, [plane]() {
+		uint64_t sum = 0;
+		for (const char* name : plane_props)
+			sum += plane->get_prop_value(name);
+		(void)sum;
+	});
+
+	Videomode mode = conn->get_default_mode();
+	unique_ptr<Blob> mode_blob = mode.to_blob(card);
+
+	unique_ptr<DumbFramebuffer> fb;
+	if (card.has_dumb_buffers())
+		fb = unique_ptr<DumbFramebuffer>(new DumbFramebuffer(card, mode.hdisplay, mode.vdisplay, PixelFormat::XRGB8888));
+
+	uint32_t fb_id = fb ? fb->id() : 0;
+
+	auto build = [&](AtomicReq& req) {
+		req.add(conn, { { "CRTC_ID", crtc->id() } });
+		req.add(crtc, { { "ACTIVE", 1 }, { "MODE_ID", mode_blob->id() } });
+		req.add(plane, {
+				{ "FB_ID", fb_id },
+				{ "CRTC_ID", fb_id ? crtc->id() : 0 },
+				{ "SRC_X", 0 },
+				{ "SRC_Y", 0 },
+				{ "SRC_W", mode.hdisplay << 16 },
+				{ "SRC_H", mode.vdisplay << 16 },
+				{ "CRTC_X", 0 },
+				{ "CRTC_Y", 0 },
+				{ "CRTC_W", mode.hdisplay },
+				{ "CRTC_H", mode.vdisplay },
+			});
+	};
+
+	run_bench("atomic_req_build", "", 0, 0, 0, [&card, &build]() {
+		AtomicReq req(card);
+		build(req);
+	});
+
+	run_bench("atomic_req_test", "", 0, 0, 0, [&card, &build]() {
+		AtomicReq req(card);
+		build(req);
+		int r = req.test(true);
+		if (r)
+			throw runtime_error(fmt::format("atomic test failed: {}", r));
+	});
+}
+
+static string results_to_json()
+{
+	string s;
+
+	s += "{\n";
+	s += "  \"results\": [\n";
+
+	for (size_t i = 0; i < s_results.size(); ++i) {
+		const BenchResult& r = s_results[i];
+
+		double bytes_per_sec = r.bytes && r.median_us > 0 ? r.bytes / (r.median_us / 1000000.0) : 0;
+
+		s += fmt::format("    {{ \"name\": \"{}\", \"format\": \"{}\", \"width\": {}, \"height\": {}, "
+				 "\"iterations\": {}, \"median_us\": {:.3f}, \"p99_us\": {:.3f}, "
+				 "\"min_us\": {:.3f}, \"max_us\": {:.3f}, \"bytes\": {}, \"bytes_per_sec\": {:.0f} }}{}\n",
+				 r.name, r.format, r.width, r.height,
+				 r.iterations, r.median_us, r.p99_us,
+				 r.min_us, r.max_us, r.bytes, bytes_per_sec,
+				 i + 1 < s_results.size() ? "," : "");
+	}
+
+	s += "  ]\n";
+	s += "}\n";
+
+	return s;
+}
+
+int main(int argc, char **argv)
+{
+	string dev_path = "virtual";
+	string output;
+	vector<pair<uint32_t, uint32_t>> sizes;
+	vector<PixelFormat> formats;
+
+	OptionSet optionset = {
+		Option("|device=", [&dev_path](string s)
+		{
+			dev_path = s;
+		}),
+		Option("s|size=", [&sizes](string s)
+		{
+			uint32_t w, h;
+			if (sscanf(s.c_str(), "%ux%u", &w, &h) != 2 || w < 32 || h < 8)
+				EXIT("Bad size '%s'", s.c_str());
+			sizes.push_back({ w, h });
+		}),
+		Option("f|format=", [&formats](string s)
+		{
+			if (s.size() != 4)
+				EXIT("Bad pixel format '%s'", s.c_str());
+			formats.push_back(FourCCToPixelFormat(s));
+		}),
+		Option("b|bench=", [](string s)
+		{
+			s_filters.push_back(s);
+		}),
+		Option("t|time=", [](string s)
+		{
+			s_min_time = stod(s);
+		}),
+		Option("o|output=", [&output](string s)
+		{
+			output = s;
+		}),
+		Option("l|list", []()
+		{
+			s_list = true;
+		}),
+		Option("h|help", []()
+		{
+			usage();
+			exit(-1);
+		}),
+	};
+
+	optionset.parse(argc, argv);
+
+	if (optionset.params().size() > 0) {
+		usage();
+		exit(-1);
+	}
+
+	if (sizes.empty())
+		sizes = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+
+	if (formats.empty())
+		formats.assign(begin(all_formats), end(all_formats));
+
+	bench_drawing(sizes, formats);
+	bench_color(sizes);
+	bench_crc(sizes);
+	bench_atomic(dev_path);
+
+	if (s_list)
+		return 0;
+
+	string json = results_to_json();
+
+	if (output.empty()) {
+		fputs(json.c_str(), stdout);
+	} else {
+		FILE* f = fopen(output.c_str(), "w");
+		EXIT_IF(!f, "Failed to open '%s'", output.c_str());
+		fputs(json.c_str(), f);
+		fclose(f);
+	}
+
+	return 0;
+}
@@ -7,11 +7,16 @@
 #include <fstream>
 #include <sys/ioctl.h>
 #include <glob.h>
+#include <cinttypes>
+#include <cmath>
 
 #include <kms++/kms++.h>
 #include <kms++util/kms++util.h>
+#include <kms++util/framerecorder.h>
 
-#define CAMERA_BUF_QUEUE_SIZE	3
+// One buffer shown, one in a pending commit, the frames waiting in the
+// presentation queue, and at least one queued for capture
+#define CAMERA_BUF_QUEUE_SIZE	6
 #define MAX_CAMERA		9
 
 using namespace std;
@@ -27,27 +32,56 @@ class CameraPipeline
 public:
 	CameraPipeline(int cam_fd, Card& card, Crtc* crtc, Plane* plane, uint32_t x, uint32_t y,
 		       uint32_t iw, uint32_t ih, PixelFormat pixfmt,
-		       BufferProvider buffer_provider);
+		       BufferProvider buffer_provider, double display_period, double delay);
 	~CameraPipeline();
 
 	CameraPipeline(const CameraPipeline& other) = delete;
 	CameraPipeline& operator=(const CameraPipeline& other) = delete;
 
-	void show_next_frame(AtomicReq &req);
+	// Dequeue a captured frame to the presentation queue
+	void dequeue_frame();
+	bool has_queued_frames() const { return !m_queue.empty(); }
+	// Add the frame due at vblank_time to the commit. Returns false if
+	// the current frame is repeated.
+	bool commit_frame(AtomicReq& req, double vblank_time);
+	// Call when the commit with the frame has been flipped to
+	void frame_presented(double time);
+
 	int fd() const { return m_fd; }
 	void start_streaming();
+	void start_recording(const string& filename);
+	void print_recording_stats();
+	void print_stats(unsigned idx);
 private:
 	DmabufFramebuffer* GetDmabufFrameBuffer(Card& card, uint32_t i, PixelFormat pixfmt);
+	void queue_buffer(int fb_index);
+
 	int m_fd;	/* camera file descriptor */
 	Crtc* m_crtc;
 	Plane* m_plane;
 	BufferProvider m_buffer_provider;
 	vector<Framebuffer*> m_fb;
+	// Capture timestamp of the frame in each buffer
+	vector<double> m_fb_timestamps;
 	int m_prev_fb_index;
+	// Dequeued frames waiting for their vblank
+	PresentationQueue m_queue;
+	// In a commit waiting for the flip
+	int m_queued_fb_index = -1;
+	double m_queued_time = 0;
 	uint32_t m_in_width, m_in_height; /* camera capture resolution */
 	/* image properties for display */
 	uint32_t m_out_width, m_out_height;
 	uint32_t m_out_x, m_out_y;
+	PixelFormat m_pixfmt;
+	unique_ptr<FrameRecorder> m_recorder;
+	string m_record_filename;
+
+	unsigned m_captured = 0;
+	unsigned m_shown = 0;
+	// From the capture timestamp to the flip
+	double m_latency_sum = 0;
+	double m_latency_max = 0;
 };
 
 static int buffer_export(int v4lfd, enum v4l2_buf_type bt, uint32_t index, int *dmafd)
@@ -98,8 +132,9 @@ bool inline better_size(struct v4l2_frmsize_discrete* v4ldisc,
 
 CameraPipeline::CameraPipeline(int cam_fd, Card& card, Crtc *crtc, Plane* plane, uint32_t x, uint32_t y,
 			       uint32_t iw, uint32_t ih, PixelFormat pixfmt,
-			       BufferProvider buffer_provider)
-	: m_fd(cam_fd), m_crtc(crtc), m_buffer_provider(buffer_provider), m_prev_fb_index(-1)
+			       BufferProvider buffer_provider, double display_period, double delay)
+	: m_fd(cam_fd), m_crtc(crtc), m_buffer_provider(buffer_provider), m_prev_fb_index(-1),
+	  m_queue(display_period, delay), m_pixfmt(pixfmt)
 {
 
 	int r;
@@ -186,6 +221,8 @@ CameraPipeline::CameraPipeline(int cam_fd, Card& card, Crtc *crtc, Plane* plane,
 		m_fb.push_back(fb);
 	}
 
+	m_fb_timestamps.resize(m_fb.size());
+
 	m_plane = plane;
 
 	// Do initial plane setup with first fb, so that we only need to
@@ -227,44 +264,119 @@ void CameraPipeline::start_streaming()
 	FAIL_IF(r, "Failed to enable camera stream: %d", r);
 }
 
-void CameraPipeline::show_next_frame(AtomicReq& req)
+void CameraPipeline::queue_buffer(int fb_index)
 {
-	int r;
-	uint32_t v4l_mem;
+	struct v4l2_buffer v4l2buf = { };
+	v4l2buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	v4l2buf.index = fb_index;
 
-	if (m_buffer_provider == BufferProvider::V4L2)
-		v4l_mem = V4L2_MEMORY_MMAP;
-	else
-		v4l_mem = V4L2_MEMORY_DMABUF;
+	if (m_buffer_provider == BufferProvider::V4L2) {
+		v4l2buf.memory = V4L2_MEMORY_MMAP;
+	} else {
+		v4l2buf.memory = V4L2_MEMORY_DMABUF;
+		v4l2buf.m.fd = m_fb[fb_index]->prime_fd(0);
+	}
+
+	int r = ioctl(m_fd, VIDIOC_QBUF, &v4l2buf);
+	ASSERT(r == 0);
+}
+
+void CameraPipeline::dequeue_frame()
+{
+	int r;
 
 	struct v4l2_buffer v4l2buf = { };
 	v4l2buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	v4l2buf.memory = v4l_mem;
+	v4l2buf.memory = m_buffer_provider == BufferProvider::V4L2 ? V4L2_MEMORY_MMAP : V4L2_MEMORY_DMABUF;
 	r = ioctl(m_fd, VIDIOC_DQBUF, &v4l2buf);
 	if (r != 0) {
 		printf("VIDIOC_DQBUF ioctl failed with %d\n", errno);
 		return;
 	}
 
-	unsigned fb_index = v4l2buf.index;
+	m_captured++;
 
-	Framebuffer *fb = m_fb[fb_index];
+	Framebuffer *fb = m_fb[v4l2buf.index];
 
-	req.add(m_plane, "FB_ID", fb->id());
+	double time;
+	if (v4l2buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		time = v4l2buf.timestamp.tv_sec + v4l2buf.timestamp.tv_usec / 1000000.0;
+	else
+		time = FrameScheduler::now();
 
-	if (m_prev_fb_index >= 0) {
-		memset(&v4l2buf, 0, sizeof(v4l2buf));
-		v4l2buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		v4l2buf.memory = v4l_mem;
-		v4l2buf.index = m_prev_fb_index;
-		if (m_buffer_provider == BufferProvider::DRM)
-			v4l2buf.m.fd = m_fb[m_prev_fb_index]->prime_fd(0);
-		r = ioctl(m_fd, VIDIOC_QBUF, &v4l2buf);
-		ASSERT(r == 0);
+	if (m_recorder)
+		m_recorder->record(*fb, time);
 
-	}
+	m_fb_timestamps[v4l2buf.index] = time;
+	m_queue.push(v4l2buf.index, time);
+}
+
+bool CameraPipeline::commit_frame(AtomicReq& req, double vblank_time)
+{
+	uint32_t fb_index;
+	bool found = m_queue.select(vblank_time, fb_index);
+
+	for (uint32_t idx : m_queue.take_dropped())
+		queue_buffer(idx);
 
-	m_prev_fb_index = fb_index;
+	if (!found)
+		return false;
+
+	req.add(m_plane, "FB_ID", m_fb[fb_index]->id());
+
+	m_queued_fb_index = fb_index;
+	m_queued_time = m_fb_timestamps[fb_index];
+
+	return true;
+}
+
+void CameraPipeline::frame_presented(double time)
+{
+	m_queue.vblank(time);
+
+	if (m_queued_fb_index < 0)
+		return;
+
+	if (m_prev_fb_index >= 0)
+		queue_buffer(m_prev_fb_index);
+
+	m_prev_fb_index = m_queued_fb_index;
+	m_queued_fb_index = -1;
+
+	double latency = time - m_queued_time;
+
+	m_shown++;
+	m_latency_sum += latency;
+	m_latency_max = max(m_latency_max, latency);
+}
+
+void CameraPipeline::print_stats(unsigned idx)
+{
+	printf("Camera %u: captured %u, shown %u, dropped %" PRIu64 ", repeated %" PRIu64 ", latency avg %.1f ms, max %.1f ms\n",
+	       idx, m_captured, m_shown, m_queue.frames_dropped(), m_queue.frames_repeated(),
+	       m_shown ? m_latency_sum / m_shown * 1000 : 0.0, m_latency_max * 1000);
+	printf("Camera %u: %.3f fps, drift %.0f ppm, delay %.1f ms\n", idx,
+	       m_queue.source_period() > 0 ? 1 / m_queue.source_period() : 0.0,
+	       m_queue.drift_ppm(), m_queue.delay() * 1000);
+}
+
+void CameraPipeline::start_recording(const string& filename)
+{
+	// Drop frames rather than stall the display if the disk is too slow
+	m_recorder = unique_ptr<FrameRecorder>(new FrameRecorder(filename, m_in_width, m_in_height, m_pixfmt,
+								 8, FrameRecorder::Policy::DropOldest));
+	m_record_filename = filename;
+}
+
+void CameraPipeline::print_recording_stats()
+{
+	if (!m_recorder)
+		return;
+
+	m_recorder->flush();
+
+	printf("Wrote %" PRIu64 " frames to %s, dropped %" PRIu64 "\n",
+	       m_recorder->frames_written(), m_record_filename.c_str(), m_recorder->frames_dropped());
 }
 
 static bool is_capture_dev(int fd)
@@ -286,11 +398,97 @@ std::vector<std::string> glob(const std::string& pat)
 	return ret;
 }
 
+// Collects the frames due at the next vblank from all the cameras, and shows
+// them with a single atomic commit at a deadline before the vblank. Only one
+// commit is pending at a time, so the cameras never hit EBUSY.
+class FrameBatcher : private PageFlipHandlerBase
+{
+public:
+	FrameBatcher(Card& card, Crtc* crtc, const vector<CameraPipeline*>& cameras)
+		: m_card(card), m_cameras(cameras), m_sched(crtc, crtc->mode())
+	{
+	}
+
+	// Seconds until the queued frames should be committed, 0 if now, or -1
+	// if there's nothing to commit
+	double time_to_commit() const
+	{
+		if (m_commit_pending)
+			return -1;
+
+		for (auto cam : m_cameras) {
+			if (cam->has_queued_frames())
+				return m_sched.time_to_wakeup();
+		}
+
+		return -1;
+	}
+
+	void commit()
+	{
+		m_sched.frame_start();
+
+		double vblank_time = m_sched.target_vblank_time();
+
+		AtomicReq req(m_card);
+
+		unsigned num_frames = 0;
+
+		for (auto cam : m_cameras) {
+			if (cam->commit_frame(req, vblank_time))
+				num_frames++;
+		}
+
+		// No frame is due yet, try again for the next vblank
+		if (num_frames == 0) {
+			m_sched.frame_skipped();
+			return;
+		}
+
+		int r = req.commit(this);
+		FAIL_IF(r, "Atomic commit failed: %d", r);
+
+		m_sched.frame_committed();
+
+		m_commit_pending = true;
+		m_commits++;
+		m_committed_frames += num_frames;
+	}
+
+	void print_stats()
+	{
+		printf("%u commits, %.2f frames per commit, %u missed vblanks\n", m_commits,
+		       m_commits ? (double)m_committed_frames / m_commits : 0.0, m_sched.missed_frames());
+	}
+
+private:
+	void handle_page_flip(uint32_t frame, double time) override
+	{
+		m_sched.frame_presented(frame, time);
+
+		for (auto cam : m_cameras)
+			cam->frame_presented(time);
+
+		m_commit_pending = false;
+	}
+
+	Card& m_card;
+	const vector<CameraPipeline*>& m_cameras;
+	FrameScheduler m_sched;
+
+	bool m_commit_pending = false;
+	unsigned m_commits = 0;
+	unsigned m_committed_frames = 0;
+};
+
 static const char* usage_str =
 		"Usage: kmscapture [OPTIONS]\n\n"
 		"Options:\n"
 		"  -s, --single                Single camera mode. Open only /dev/video0\n"
 		"      --buffer-type=<drm|v4l> Use DRM or V4L provided buffers. Default: DRM\n"
+		"  -w, --write                 Write captured frames to kmscapture-<n>.raw files\n"
+		"      --indexed               Write indexed kmscapture-<n>.kmsv files instead\n"
+		"      --delay=<ms>            Show frames this long after their capture. Default: auto\n"
 		"  -h, --help                  Print this help\n"
 		;
 
@@ -298,6 +496,9 @@ int main(int argc, char** argv)
 {
 	BufferProvider buffer_provider = BufferProvider::DRM;
 	bool single_cam = false;
+	bool write_files = false;
+	bool write_indexed = false;
+	double delay = 0;
 
 	OptionSet optionset = {
 		Option("s|single", [&]()
@@ -313,6 +514,18 @@ int main(int argc, char** argv)
 			else
 				FAIL("Invalid buffer provider: %s", s.c_str());
 		}),
+		Option("w|write", [&]()
+		{
+			write_files = true;
+		}),
+		Option("|indexed", [&]()
+		{
+			write_indexed = true;
+		}),
+		Option("|delay=", [&](string s)
+		{
+			delay = stod(s) / 1000;
+		}),
 		Option("h|help", [&]()
 		{
 			puts(usage_str);
@@ -372,6 +585,7 @@ int main(int argc, char** argv)
 	FAIL_IF(available_planes.size() < camera_fds.size(), "Not enough video planes for cameras");
 
 	uint32_t plane_w = crtc->width() / camera_fds.size();
+	double display_period = 1.0 / crtc->mode().calculated_vrefresh();
 	vector<CameraPipeline*> cameras;
 
 	for (unsigned i = 0; i < camera_fds.size(); ++i) {
@@ -379,13 +593,14 @@ int main(int argc, char** argv)
 		Plane* plane = available_planes[i];
 
 		auto cam = new CameraPipeline(cam_fd, card, crtc, plane, i * plane_w, 0,
-					      plane_w, crtc->height(), pixfmt, buffer_provider);
+					      plane_w, crtc->height(), pixfmt, buffer_provider,
+					      display_period, delay);
 		cameras.push_back(cam);
 	}
 
 	unsigned nr_cameras = cameras.size();
 
-	vector<pollfd> fds(nr_cameras + 1);
+	vector<pollfd> fds(nr_cameras + 2);
 
 	for (unsigned i = 0; i < nr_cameras; i++) {
 		fds[i].fd = cameras[i]->fd();
@@ -393,32 +608,51 @@ int main(int argc, char** argv)
 	}
 	fds[nr_cameras].fd = 0;
 	fds[nr_cameras].events =  POLLIN;
+	fds[nr_cameras + 1].fd = card.fd();
+	fds[nr_cameras + 1].events =  POLLIN;
+
+	FrameBatcher batcher(card, crtc, cameras);
+
+	if (write_files) {
+		for (unsigned i = 0; i < nr_cameras; i++)
+			cameras[i]->start_recording("kmscapture-" + to_string(i) + (write_indexed ? ".kmsv" : ".raw"));
+	}
 
 	for (auto cam : cameras)
 		cam->start_streaming();
 
 	while (true) {
-		int r = poll(fds.data(), nr_cameras + 1, -1);
-		ASSERT(r > 0);
+		double wait = batcher.time_to_commit();
+
+		if (wait == 0) {
+			batcher.commit();
+			continue;
+		}
+
+		int timeout = wait < 0 ? -1 : (int)ceil(wait * 1000);
+
+		int r = poll(fds.data(), fds.size(), timeout);
+		ASSERT(r >= 0);
 
 		if (fds[nr_cameras].revents != 0)
 			break;
 
-		AtomicReq req(card);
-
 		for (unsigned i = 0; i < nr_cameras; i++) {
 			if (!fds[i].revents)
 				continue;
-			cameras[i]->show_next_frame(req);
+			cameras[i]->dequeue_frame();
 			fds[i].revents = 0;
 		}
 
-		r = req.test();
-		FAIL_IF(r, "Atomic commit failed: %d", r);
-
-		req.commit_sync();
+		if (fds[nr_cameras + 1].revents)
+			card.call_page_flip_handlers();
 	}
 
-	for (auto cam : cameras)
-		delete cam;
+	batcher.print_stats();
+
+	for (unsigned i = 0; i < nr_cameras; i++) {
+		cameras[i]->print_stats(i);
+		cameras[i]->print_recording_stats();
+		delete cameras[i];
+	}
 }
@@ -16,6 +16,7 @@ static struct {
 	bool print_props;
 	bool print_modes;
 	bool print_list;
+	bool print_stats;
 	bool x_modeline;
 } s_opts;
 
@@ -469,6 +470,39 @@ static void print_modes(Card& card)
 	}
 }
 
+static void print_stats(Card& card)
+{
+	const CardStats& st = card.stats();
+
+	const pair<const char*, uint64_t> counters[] = {
+		{ "resource gets", st.resource_gets },
+		{ "property gets", st.prop_gets },
+		{ "property sets", st.prop_sets },
+		{ "blob creates", st.blob_creates },
+		{ "blob destroys", st.blob_destroys },
+		{ "atomic commits", st.atomic_commits },
+		{ "legacy commits", st.legacy_commits },
+		{ "vblank queries", st.vblank_queries },
+		{ "dumb creates", st.dumb_creates },
+		{ "dumb destroys", st.dumb_destroys },
+		{ "dumb maps", st.dumb_maps },
+		{ "fb adds", st.fb_adds },
+		{ "fb removes", st.fb_removes },
+		{ "prime exports", st.prime_exports },
+		{ "prime imports", st.prime_imports },
+		{ "other ioctls", st.other_ioctls },
+		{ "failed ioctls", st.failed_ioctls },
+		{ "dumb bytes", st.dumb_bytes },
+		{ "dmabuf bytes", st.dmabuf_bytes },
+		{ "mapped bytes", st.mapped_bytes },
+	};
+
+	fmt::print("Stats\n");
+
+	for (auto& c : counters)
+		fmt::print("    {:<16}{}\n", c.first, c.second);
+}
+
 static const char* usage_str =
 		"Usage: kmsprint [OPTIONS]\n\n"
 		"Options:\n"
@@ -477,6 +511,7 @@ static const char* usage_str =
 		"  -m, --modes             Print modes\n"
 		"      --xmode             Print modes using X modeline\n"
 		"  -p, --props             Print properties\n"
+		"      --stats             Print the ioctl and memory counters of the card\n"
 		;
 
 static void usage()
@@ -508,6 +543,9 @@ int main(int argc, char **argv)
 		Option("|xmode", []() {
 			s_opts.x_modeline = true;
 		}),
+		Option("|stats", []() {
+			s_opts.print_stats = true;
+		}),
 		Option("h|help", []()
 		{
 			usage();
@@ -526,11 +564,13 @@ int main(int argc, char **argv)
 
 	if (s_opts.print_modes) {
 		print_modes(card);
-		return 0;
+	} else {
+		if (s_opts.print_list)
+			print_as_list(card);
+		else
+			print_as_tree(card);
 	}
 
-	if (s_opts.print_list)
-		print_as_list(card);
-	else
-		print_as_tree(card);
+	if (s_opts.print_stats)
+		print_stats(card);
 }
@@ -3,10 +3,13 @@
 #include <algorithm>
 #include <regex>
 #include <set>
-#include <chrono>
+#include <limits>
 #include <cstdint>
 #include <cinttypes>
+#include <cmath>
+#include <ctime>
 
+#include <csignal>
 #include <sys/select.h>
 
 #include <fmt/format.h>
@@ -42,7 +45,7 @@ struct PlaneInfo
 	unsigned view_w;
 	unsigned view_h;
 
-	vector<Framebuffer*> fbs;
+	vector<IFramebuffer*> fbs;
 
 	vector<PropInfo> props;
 };
@@ -53,7 +56,7 @@ struct OutputInfo
 
 	Crtc* crtc;
 	Videomode mode;
-	vector<Framebuffer*> legacy_fbs;
+	vector<IFramebuffer*> legacy_fbs;
 
 	vector<PlaneInfo> planes;
 
@@ -66,11 +69,21 @@ static bool s_use_cea;
 static unsigned s_num_buffers = 1;
 static bool s_flip_mode;
 static bool s_flip_sync;
+static bool s_flip_late;
+static bool s_flip_async;
+static bool s_vrr;
+static double s_vrr_fps;
 static bool s_cvt;
 static bool s_cvt_v2;
 static bool s_cvt_vid_opt;
 static unsigned s_max_flips;
 static bool s_print_crc;
+static bool s_full_modeset;
+static bool s_headless;
+static double s_headless_hz = -1;
+static string s_record_path;
+static FILE* s_stats_csv;
+static string s_stats_json;
 
 __attribute__ ((unused))
 static void print_regex_match(smatch sm)
@@ -313,12 +326,28 @@ static void get_props(Card& card, vector<PropInfo> &props, const DrmPropObject*
 		pi.prop = propobj->get_prop(pi.name);
 }
 
-static vector<Framebuffer*> get_default_fb(Card& card, unsigned width, unsigned height)
+// In headless mode the framebuffers are CPUFramebuffers, otherwise DumbFramebuffers
+static IFramebuffer* create_fb(Card& card, unsigned width, unsigned height, PixelFormat format)
 {
-	vector<Framebuffer*> v;
+	if (s_headless)
+		return new CPUFramebuffer(width, height, format);
+
+	return new DumbFramebuffer(card, width, height, format);
+}
+
+static Framebuffer* drm_fb(IFramebuffer* fb)
+{
+	auto drmfb = dynamic_cast<Framebuffer*>(fb);
+	ASSERT(drmfb);
+	return drmfb;
+}
+
+static vector<IFramebuffer*> get_default_fb(Card& card, unsigned width, unsigned height)
+{
+	vector<IFramebuffer*> v;
 
 	for (unsigned i = 0; i < s_num_buffers; ++i)
-		v.push_back(new DumbFramebuffer(card, width, height, PixelFormat::XRGB8888));
+		v.push_back(create_fb(card, width, height, PixelFormat::XRGB8888));
 
 	return v;
 }
@@ -355,10 +384,10 @@ static void parse_fb(Card& card, const string& fb_str, OutputInfo* output, Plane
 			format = FourCCToPixelFormat(sm[3]);
 	}
 
-	vector<Framebuffer*> v;
+	vector<IFramebuffer*> v;
 
 	for (unsigned i = 0; i < s_num_buffers; ++i)
-		v.push_back(new DumbFramebuffer(card, w, h, format));
+		v.push_back(create_fb(card, w, h, format));
 
 	if (pinfo)
 		pinfo->fbs = v;
@@ -384,7 +413,7 @@ static const char* usage_str =
 		"Usage: kmstest [OPTION]...\n\n"
 		"Show a test pattern on a display or plane\n\n"
 		"Options:\n"
-		"      --device=DEVICE       DEVICE is the path to DRM card to open\n"
+		"      --device=DEVICE       DEVICE is the path to DRM card to open, or \"virtual[:WxH[@Hz][+N],...]\"\n"
 		"  -c, --connector=CONN      CONN is <connector>\n"
 		"  -r, --crtc=CRTC           CRTC is [<crtc>:]<w>x<h>[@<Hz>]\n"
 		"                            or\n"
@@ -398,7 +427,17 @@ static const char* usage_str =
 		"      --cvt=CVT             Create videomode with CVT. CVT is 'v1', 'v2' or 'v2o'\n"
 		"      --flip[=max]          Do page flipping for each output with an optional maximum flips count\n"
 		"      --sync                Synchronize page flipping\n"
-		"      --crc                 Print CRC16 for framebuffer contents\n"
+		"      --late                Draw and commit flips as late as possible before the vblank\n"
+		"      --async               Use async (tearing) page flips\n"
+		"      --vrr[=FPS]           Enable VRR, and pace flips at FPS\n"
+		"      --crc                 Print CRC32C for framebuffer contents\n"
+		"      --full-modeset        Do a modeset even if the current modes match\n"
+		"      --stats-csv=FILE      Write the timings of each flipped frame to FILE as CSV\n"
+		"      --headless[=HZ]       Render into memory instead of a display, HZ frames per second\n"
+		"                            (default is the refresh rate of the mode, 0 is unpaced)\n"
+		"      --record=FILE         In headless mode, write the frames of the first plane of each\n"
+		"                            output to FILE, in Y4M format if FILE ends with .y4m, else raw\n"
+		"      --stats-json=FILE     Write the flip statistics summary to FILE as JSON at exit\n"
 		"\n"
 		"<connector>, <crtc> and <plane> can be given by index (<idx>) or id (@<id>).\n"
 		"<connector> can also be given by name.\n"
@@ -408,6 +447,9 @@ static const char* usage_str =
 		"an earlier option.\n"
 		"If you omit parameters, kmstest tries to guess what you mean\n"
 		"\n"
+		"In headless mode the outputs and planes are set up on the virtual device, unless\n"
+		"--device is given, but nothing is committed. --flip renders 300 frames by default.\n"
+		"\n"
 		"Examples:\n"
 		"\n"
 		"Set eDP-1 mode to 1920x1080@60, show XR24 framebuffer on the crtc, and a 400x400 XB24 plane:\n"
@@ -501,6 +543,20 @@ static vector<Arg> parse_cmdline(int argc, char **argv)
 		{
 			s_flip_sync = true;
 		}),
+		Option("|late", []()
+		{
+			s_flip_late = true;
+		}),
+		Option("|async", []()
+		{
+			s_flip_async = true;
+		}),
+		Option("|vrr?", [&](string s)
+		{
+			s_vrr = true;
+			if (!s.empty())
+				s_vrr_fps = stod(s);
+		}),
 		Option("|cvt=", [&](string s)
 		{
 			if (s == "v1")
@@ -517,6 +573,26 @@ static vector<Arg> parse_cmdline(int argc, char **argv)
 		Option("|crc", []() {
 			s_print_crc = true;
 		}),
+		Option("|full-modeset", []() {
+			s_full_modeset = true;
+		}),
+		Option("|stats-csv=", [](string s) {
+			s_stats_csv = fopen(s.c_str(), "w");
+			if (!s_stats_csv)
+				EXIT("Failed to open %s: %s", s.c_str(), strerror(errno));
+			fmt::print(s_stats_csv, "output,frame,seq,flip_time,interval_ms,latency_ms,draw_ms,missed\n");
+		}),
+		Option("|stats-json=", [](string s) {
+			s_stats_json = s;
+		}),
+		Option("|headless?", [](string s) {
+			s_headless = true;
+			if (!s.empty())
+				s_headless_hz = stod(s);
+		}),
+		Option("|record=", [](string s) {
+			s_record_path = s;
+		}),
 		Option("h|help", [&]()
 		{
 			usage();
@@ -698,46 +774,24 @@ static vector<OutputInfo> setups_to_outputs(Card& card, ResourceManager& resman,
 	return outputs;
 }
 
-static uint16_t crc16(uint16_t crc, uint8_t data)
+static string fb_crc(IFramebuffer *fb)
 {
-	const uint16_t CRC16_IBM = 0x8005;
-
-	for (uint8_t i = 0; i < 8; i++) {
-		if (((crc & 0x8000) >> 8) ^ (data & 0x80))
-			crc = (crc << 1)  ^ CRC16_IBM;
-		else
-			crc = (crc << 1);
+	vector<string> crcs;
 
-		data <<= 1;
-	}
+	for (uint32_t crc : fb_crc32c(*fb))
+		crcs.push_back(fmt::format("{:#010x}", crc));
 
-	return crc;
+	return join(crcs, " ");
 }
 
-static string fb_crc(IFramebuffer *fb)
+static string fb_desc(IFramebuffer* fb)
 {
-	uint8_t *p = fb->map(0);
-	uint16_t r, g, b;
-
-	r = g = b = 0;
-
-	for (unsigned y = 0; y < fb->height(); ++y) {
-		for (unsigned x = 0; x < fb->width(); ++x) {
-			uint32_t *p32 = (uint32_t*)(p + fb->stride(0) * y + x * 4);
-			RGB rgb(*p32);
-
-			r = crc16(r, rgb.r);
-			r = crc16(r, 0);
+	string fourcc = PixelFormatToFourCC(fb->format());
 
-			g = crc16(g, rgb.g);
-			g = crc16(g, 0);
+	if (s_headless)
+		return fmt::format("{}x{}-{}", fb->width(), fb->height(), fourcc);
 
-			b = crc16(b, rgb.b);
-			b = crc16(b, 0);
-		}
-	}
-
-	return fmt::format("{:#06x} {:#06x} {:#06x}", r, g, b);
+	return fmt::format("{} {}x{}-{}", drm_fb(fb)->id(), fb->width(), fb->height(), fourcc);
 }
 
 static void print_outputs(const vector<OutputInfo>& outputs)
@@ -759,8 +813,7 @@ static void print_outputs(const vector<OutputInfo>& outputs)
 		fmt::print(": {}\n", o.mode.to_string_long());
 
 		if (!o.legacy_fbs.empty()) {
-			auto fb = o.legacy_fbs[0];
-			fmt::print("    Fb {} {}x{}-{}\n", fb->id(), fb->width(), fb->height(), PixelFormatToFourCC(fb->format()));
+			fmt::print("    Fb {}\n", fb_desc(o.legacy_fbs[0]));
 		}
 
 		for (unsigned j = 0; j < o.planes.size(); ++j) {
@@ -772,10 +825,9 @@ static void print_outputs(const vector<OutputInfo>& outputs)
 				fmt::print(" {}={}", prop.prop->name(), prop.val);
 			fmt::print("\n");
 
-			fmt::print("    Fb {} {}x{}-{}\n", fb->id(), fb->width(), fb->height(),
-				   PixelFormatToFourCC(fb->format()));
+			fmt::print("    Fb {}\n", fb_desc(fb));
 			if (s_print_crc)
-				fmt::print("      CRC16 {}\n", fb_crc(fb).c_str());
+				fmt::print("      CRC32C {}\n", fb_crc(fb).c_str());
 		}
 	}
 }
@@ -818,7 +870,7 @@ static void set_crtcs_n_planes_legacy(Card& card, const vector<OutputInfo>& outp
 		}
 
 		if (!o.legacy_fbs.empty()) {
-			auto fb = o.legacy_fbs[0];
+			auto fb = drm_fb(o.legacy_fbs[0]);
 			r = crtc->set_mode(conn, *fb, o.mode);
 			if (r)
 				fmt::print(stderr, "crtc->set_mode() failed for crtc {}: {}\n",
@@ -831,7 +883,7 @@ static void set_crtcs_n_planes_legacy(Card& card, const vector<OutputInfo>& outp
 				EXIT_IF(r, "failed to set plane property %s\n", prop.name.c_str());
 			}
 
-			auto fb = p.fbs[0];
+			auto fb = drm_fb(p.fbs[0]);
 			r = crtc->set_plane(p.plane, *fb,
 						p.x, p.y, p.w, p.h,
 						0, 0, fb->width(), fb->height());
@@ -842,10 +894,123 @@ static void set_crtcs_n_planes_legacy(Card& card, const vector<OutputInfo>& outp
 	}
 }
 
+static void add_outputs_to_req(AtomicReq& req, const vector<OutputInfo>& outputs,
+			       bool modeset, vector<unique_ptr<Blob>>& blobs)
+{
+	for (const OutputInfo& o : outputs) {
+		auto conn = o.connector;
+		auto crtc = o.crtc;
+
+		req.add(conn, {
+				{ "CRTC_ID", crtc->id() },
+			});
+
+		for (const PropInfo &prop: o.conn_props)
+			req.add(conn, prop.prop, prop.val);
+
+		if (modeset) {
+			blobs.emplace_back(o.mode.to_blob(crtc->card()));
+			Blob* mode_blob = blobs.back().get();
+
+			req.add(crtc, {
+					{ "ACTIVE", 1 },
+					{ "MODE_ID", mode_blob->id() },
+				});
+		}
+
+		if (s_vrr && crtc->has_vrr())
+			req.add(crtc, "VRR_ENABLED", 1);
+
+		for (const PropInfo &prop: o.crtc_props)
+			req.add(crtc, prop.prop, prop.val);
+
+		for (const PlaneInfo& p : o.planes) {
+			auto fb = drm_fb(p.fbs[0]);
+
+			req.add(p.plane, {
+					{ "FB_ID", fb->id() },
+					{ "CRTC_ID", crtc->id() },
+					{ "SRC_X", (p.view_x ?: 0) << 16 },
+					{ "SRC_Y", (p.view_y ?: 0) << 16 },
+					{ "SRC_W", (p.view_w ?: fb->width()) << 16 },
+					{ "SRC_H", (p.view_h ?: fb->height()) << 16 },
+					{ "CRTC_X", p.x },
+					{ "CRTC_Y", p.y },
+					{ "CRTC_W", p.w },
+					{ "CRTC_H", p.h },
+				});
+
+			for (const PropInfo &prop: p.props)
+				req.add(p.plane, prop.prop, prop.val);
+		}
+	}
+}
+
+// If the crtcs are already showing the requested modes, only change the planes
+static bool try_takeover_atomic(Card& card, const vector<OutputInfo>& outputs)
+{
+	for (const OutputInfo& o : outputs) {
+		if (o.crtc->needs_modeset(o.connector, o.mode))
+			return false;
+	}
+
+	AtomicReq req(card);
+	bool allow_modeset = false;
+
+	// Disable unused crtcs. This is a modeset, but not on the crtcs we keep.
+	for (Crtc* crtc : card.get_crtcs()) {
+		if (find_if(outputs.begin(), outputs.end(), [crtc](const OutputInfo& o) { return o.crtc == crtc; }) != outputs.end())
+			continue;
+
+		crtc->refresh_props();
+		if (crtc->get_prop_value("ACTIVE") == 0)
+			continue;
+
+		req.add(crtc, {
+				{ "ACTIVE", 0 },
+			});
+
+		allow_modeset = true;
+	}
+
+	// Disable unused planes
+	for (Plane* plane : card.get_planes()) {
+		bool used = any_of(outputs.begin(), outputs.end(), [plane](const OutputInfo& o) {
+			return any_of(o.planes.begin(), o.planes.end(), [plane](const PlaneInfo& p) { return p.plane == plane; });
+		});
+
+		if (used)
+			continue;
+
+		req.add(plane, {
+				{ "FB_ID", 0 },
+				{ "CRTC_ID", 0 },
+			});
+	}
+
+	vector<unique_ptr<Blob>> blobs;
+
+	add_outputs_to_req(req, outputs, false, blobs);
+
+	if (req.test(allow_modeset))
+		return false;
+
+	int r = req.commit_sync(allow_modeset);
+	if (r)
+		EXIT("Atomic commit failed: %d\n", r);
+
+	return true;
+}
+
 static void set_crtcs_n_planes_atomic(Card& card, const vector<OutputInfo>& outputs)
 {
 	int r;
 
+	if (!s_full_modeset && try_takeover_atomic(card, outputs)) {
+		fmt::print("Current modes kept, skipped modeset\n");
+		return;
+	}
+
 	// XXX DRM framework doesn't allow moving an active plane from one crtc to another.
 	// See drm_atomic.c::plane_switching_crtc().
 	// For the time being, disable all crtcs and planes here.
@@ -879,48 +1044,7 @@ static void set_crtcs_n_planes_atomic(Card& card, const vector<OutputInfo>& outp
 
 	AtomicReq req(card);
 
-	for (const OutputInfo& o : outputs) {
-		auto conn = o.connector;
-		auto crtc = o.crtc;
-
-		blobs.emplace_back(o.mode.to_blob(card));
-		Blob* mode_blob = blobs.back().get();
-
-		req.add(conn, {
-				{ "CRTC_ID", crtc->id() },
-			});
-
-		for (const PropInfo &prop: o.conn_props)
-			req.add(conn, prop.prop, prop.val);
-
-		req.add(crtc, {
-				{ "ACTIVE", 1 },
-				{ "MODE_ID", mode_blob->id() },
-			});
-
-		for (const PropInfo &prop: o.crtc_props)
-			req.add(crtc, prop.prop, prop.val);
-
-		for (const PlaneInfo& p : o.planes) {
-			auto fb = p.fbs[0];
-
-			req.add(p.plane, {
-					{ "FB_ID", fb->id() },
-					{ "CRTC_ID", crtc->id() },
-					{ "SRC_X", (p.view_x ?: 0) << 16 },
-					{ "SRC_Y", (p.view_y ?: 0) << 16 },
-					{ "SRC_W", (p.view_w ?: fb->width()) << 16 },
-					{ "SRC_H", (p.view_h ?: fb->height()) << 16 },
-					{ "CRTC_X", p.x },
-					{ "CRTC_Y", p.y },
-					{ "CRTC_W", p.w },
-					{ "CRTC_H", p.h },
-				});
-
-			for (const PropInfo &prop: p.props)
-				req.add(p.plane, prop.prop, prop.val);
-		}
-	}
+	add_outputs_to_req(req, outputs, true, blobs);
 
 	r = req.test(true);
 	if (r)
@@ -941,22 +1065,317 @@ static void set_crtcs_n_planes(Card& card, const vector<OutputInfo>& outputs)
 
 static bool max_flips_reached;
 
+static const unsigned bar_width = 20;
+static const unsigned bar_speed = 8;
+
+static unsigned get_bar_pos(IFramebuffer* fb, unsigned frame_num)
+{
+	return (frame_num * bar_speed) % (fb->width() - bar_width + 1);
+}
+
+static void draw_flip_bar(IFramebuffer* fb, unsigned frame_num)
+{
+	int old_xpos = frame_num < s_num_buffers ? -1 : get_bar_pos(fb, frame_num - s_num_buffers);
+	int new_xpos = get_bar_pos(fb, frame_num);
+
+	draw_color_bar(*fb, old_xpos, new_xpos, bar_width);
+	draw_text(*fb, fb->width() / 2, 0, to_string(frame_num), RGB(255, 255, 255));
+}
+static volatile sig_atomic_t s_interrupted;
+
+static void sigint_handler(int sig)
+{
+	s_interrupted = 1;
+}
+
+struct StatAccum
+{
+	StatAccum() { reset(); }
+
+	void reset()
+	{
+		count = 0;
+		sum = max = 0;
+		min = numeric_limits<double>::max();
+	}
+
+	void add(double v)
+	{
+		count++;
+		sum += v;
+		min = std::min(min, v);
+		max = std::max(max, v);
+	}
+
+	double avg() const { return count ? sum / count : 0; }
+
+	unsigned count;
+	double sum;
+	double min;
+	double max;
+};
+
+// Timing statistics of the flips of one FlipState: the intervals between the
+// flip events, the latency from the commit to the flip event, the time used
+// for drawing, and the vblanks missed according to the vblank sequence. A flip
+// targets the first vblank after its commit, so vblanks skipped on purpose by
+// committing later are not counted as missed. All times are in seconds.
+class FlipStats
+{
+public:
+	FlipStats(const string& name, double vblank_period)
+		: m_name(name), m_vblank_period(vblank_period), m_frames(0), m_missed(0),
+		  m_first_flip_time(0), m_prev_flip_time(0), m_prev_seq(0), m_draw_time(0),
+		  m_commit_time(0), m_target_seq(0), m_window_frames(0), m_window_missed(0),
+		  m_window_start(0)
+	{
+	}
+
+	void frame_drawn(double draw_time)
+	{
+		m_draw_time += draw_time;
+	}
+
+	void frame_committed(double time)
+	{
+		m_commit_time = time;
+
+		// The vblanks that passed since the previous flip can't be hit anymore
+		uint32_t passed = 0;
+		if (m_frames && m_vblank_period > 0 && time > m_prev_flip_time)
+			passed = (uint32_t)((time - m_prev_flip_time) / m_vblank_period);
+
+		m_target_seq = m_prev_seq + 1 + passed;
+	}
+
+	void frame_presented(uint32_t seq, double time)
+	{
+		double interval = 0;
+		unsigned missed = 0;
+
+		if (m_frames) {
+			interval = time - m_prev_flip_time;
+
+			m_interval.add(interval);
+			m_window_interval.add(interval);
+
+			unsigned bucket = min((unsigned)(interval * 1000), max_histogram_ms);
+			if (m_histogram.size() <= bucket)
+				m_histogram.resize(bucket + 1);
+			m_histogram[bucket]++;
+
+			// Async flips and VRR may land before the target
+			int32_t late = (int32_t)(seq - m_target_seq);
+			if (late > 0)
+				missed = late;
+		} else {
+			m_first_flip_time = time;
+			m_window_start = time;
+		}
+
+		double latency = m_commit_time ? time - m_commit_time : 0;
+
+		m_latency.add(latency);
+		m_window_latency.add(latency);
+		m_window_latencies.push_back(latency);
+
+		m_draw.add(m_draw_time);
+		m_window_draw.add(m_draw_time);
+
+		m_missed += missed;
+		m_window_missed += missed;
+
+		if (s_stats_csv)
+			fmt::print(s_stats_csv, "{},{},{},{:.6f},{:.3f},{:.3f},{:.3f},{}\n",
+				   m_name, m_frames, seq, time, interval * 1000, latency * 1000,
+				   m_draw_time * 1000, missed);
+
+		m_frames++;
+		m_window_frames++;
+		m_prev_flip_time = time;
+		m_prev_seq = seq;
+		m_draw_time = 0;
+	}
+
+	unsigned window_frames() const { return m_window_frames; }
+	unsigned missed() const { return m_missed; }
+
+	// Print the statistics since the previous call, without a newline so that
+	// the caller can append its own
+	void print_window()
+	{
+		double fsec = m_prev_flip_time - m_window_start;
+
+		sort(m_window_latencies.begin(), m_window_latencies.end());
+		double p99 = m_window_latencies.empty() ? 0 :
+			     m_window_latencies[(m_window_latencies.size() - 1) * 99 / 100];
+
+		fmt::print("Connector {}: fps {:.2f}", m_name,
+			   fsec > 0 ? m_window_interval.count / fsec : 0);
+		if (m_window_interval.count)
+			fmt::print(", interval min/avg/max {:.2f}/{:.2f}/{:.2f} ms",
+				   m_window_interval.min * 1000, m_window_interval.avg() * 1000,
+				   m_window_interval.max * 1000);
+		fmt::print(", latency avg/p99/max {:.2f}/{:.2f}/{:.2f} ms",
+			   m_window_latency.avg() * 1000, p99 * 1000, m_window_latency.max * 1000);
+		fmt::print(", draw avg/max {:.2f}/{:.2f} ms",
+			   m_window_draw.avg() * 1000, m_window_draw.max * 1000);
+		fmt::print(", missed vblanks {}", m_window_missed);
+
+		m_window_frames = 0;
+		m_window_missed = 0;
+		m_window_start = m_prev_flip_time;
+		m_window_interval.reset();
+		m_window_latency.reset();
+		m_window_draw.reset();
+		m_window_latencies.clear();
+	}
+
+	void print_summary() const
+	{
+		double fsec = m_prev_flip_time - m_first_flip_time;
+
+		fmt::print("Connector {}: {} frames in {:.2f} s, fps {:.2f}, missed vblanks {}\n",
+			   m_name, m_frames, fsec, fsec > 0 ? m_interval.count / fsec : 0, m_missed);
+
+		if (!m_frames)
+			return;
+
+		if (m_interval.count)
+			fmt::print("  interval min/avg/max {:.2f}/{:.2f}/{:.2f} ms\n",
+				   m_interval.min * 1000, m_interval.avg() * 1000, m_interval.max * 1000);
+		fmt::print("  latency min/avg/max {:.2f}/{:.2f}/{:.2f} ms\n",
+			   m_latency.min * 1000, m_latency.avg() * 1000, m_latency.max * 1000);
+		fmt::print("  draw min/avg/max {:.2f}/{:.2f}/{:.2f} ms\n",
+			   m_draw.min * 1000, m_draw.avg() * 1000, m_draw.max * 1000);
+
+		if (m_histogram.empty())
+			return;
+
+		fmt::print("  interval histogram:\n");
+		for (unsigned ms = 0; ms < m_histogram.size(); ++ms) {
+			if (!m_histogram[ms])
+				continue;
+
+			fmt::print("    {:>3}{} ms: {}\n", ms, ms == max_histogram_ms ? "+" : " ",
+				   m_histogram[ms]);
+		}
+	}
+
+	string to_json() const
+	{
+		double fsec = m_prev_flip_time - m_first_flip_time;
+
+		auto accum_json = [](const StatAccum& a) {
+			if (!a.count)
+				return string("null");
+			return fmt::format("{{ \"min\": {:.3f}, \"avg\": {:.3f}, \"max\": {:.3f} }}",
+					   a.min * 1000, a.avg() * 1000, a.max * 1000);
+		};
+
+		string hist;
+		for (unsigned ms = 0; ms < m_histogram.size(); ++ms) {
+			if (!m_histogram[ms])
+				continue;
+
+			hist += fmt::format("{}\"{}\": {}", hist.empty() ? "" : ", ", ms, m_histogram[ms]);
+		}
+
+		return fmt::format("{{ \"output\": \"{}\", \"frames\": {}, \"duration_s\": {:.3f}, "
+				   "\"missed_vblanks\": {}, \"interval_ms\": {}, \"latency_ms\": {}, "
+				   "\"draw_ms\": {}, \"interval_histogram_ms\": {{ {} }} }}",
+				   m_name, m_frames, fsec, m_missed, accum_json(m_interval),
+				   accum_json(m_latency), accum_json(m_draw), hist);
+	}
+
+private:
+	// Intervals longer than this go to the last bucket
+	static const unsigned max_histogram_ms = 250;
+
+	string m_name;
+	double m_vblank_period;
+
+	unsigned m_frames;
+	unsigned m_missed;
+	double m_first_flip_time;
+	double m_prev_flip_time;
+	uint32_t m_prev_seq;
+
+	// of the frame being prepared
+	double m_draw_time;
+	double m_commit_time;
+	uint32_t m_target_seq;
+
+	StatAccum m_interval;
+	StatAccum m_latency;
+	StatAccum m_draw;
+	vector<unsigned> m_histogram;
+
+	unsigned m_window_frames;
+	unsigned m_window_missed;
+	double m_window_start;
+	StatAccum m_window_interval;
+	StatAccum m_window_latency;
+	StatAccum m_window_draw;
+	vector<double> m_window_latencies;
+};
+
 class FlipState : private PageFlipHandlerBase
 {
 public:
 	FlipState(Card& card, const string& name, vector<const OutputInfo*> outputs)
-		: m_card(card), m_name(name), m_outputs(outputs)
+		: m_card(card), m_name(name), m_outputs(outputs), m_waiting(false),
+		  m_stats(name, 1.0 / outputs[0]->mode.calculated_vrefresh())
 	{
+		if (s_vrr_fps) {
+			const OutputInfo* o = outputs[0];
+			float min_hz = 0, max_hz = o->mode.calculated_vrefresh();
+
+			if (!o->connector->get_vrr_range(min_hz, max_hz))
+				fmt::print("Connector {}: no VRR range in EDID, assuming up to {:.2f} Hz\n", m_name, max_hz);
+
+			m_pacer = unique_ptr<FramePacer>(new FramePacer(s_vrr_fps, min_hz, max_hz));
+
+			if (m_pacer->repeats())
+				fmt::print("Connector {}: VRR range {:.0f}-{:.0f} Hz, {} flips per frame, interval {:.2f} ms\n",
+					   m_name, min_hz, max_hz, m_pacer->repeats(), m_pacer->flip_interval() * 1000);
+			else
+				fmt::print("Connector {}: VRR range {:.0f}-{:.0f} Hz, frames picked by time, interval {:.2f} ms\n",
+					   m_name, min_hz, max_hz, m_pacer->flip_interval() * 1000);
+		} else if (s_flip_late) {
+			m_sched = unique_ptr<FrameScheduler>(new FrameScheduler(outputs[0]->crtc, outputs[0]->mode));
+		}
 	}
 
 	void start_flipping()
 	{
-		m_prev_frame = m_prev_print = std::chrono::steady_clock::now();
-		m_slowest_frame = std::chrono::duration<float>::min();
 		m_frame_num = 0;
 		queue_next();
 	}
 
+	const FlipStats& stats() const { return m_stats; }
+
+	// Seconds until the next scheduled flip, or -1 if none
+	double time_to_next() const
+	{
+		if (!m_waiting)
+			return -1;
+
+		if (m_pacer)
+			return max(m_pacer->next_flip_time() - FrameScheduler::now(), 0.0);
+
+		return m_sched->time_to_wakeup();
+	}
+
+	void run_scheduled()
+	{
+		if (!m_waiting || time_to_next() > 0)
+			return;
+
+		m_waiting = false;
+		queue_next();
+	}
+
 private:
 	void handle_page_flip(uint32_t frame, double time)
 	{
@@ -971,75 +1390,78 @@ private:
 		if (s_max_flips && m_frame_num >= s_max_flips)
 			max_flips_reached = true;
 
-		auto now = std::chrono::steady_clock::now();
+		m_stats.frame_presented(frame, time);
 
-		std::chrono::duration<float> diff = now - m_prev_frame;
-		if (diff > m_slowest_frame)
-			m_slowest_frame = diff;
+		if (m_sched)
+			m_sched->frame_presented(frame, time);
 
-		if (m_frame_num  % 100 == 0) {
-			std::chrono::duration<float> fsec = now - m_prev_print;
-			fmt::print("Connector {}: fps {:.2f}, slowest {:.2f} ms\n",
-				   m_name.c_str(),
-				   100.0 / fsec.count(),
-				   m_slowest_frame.count() * 1000);
-			m_prev_print = now;
-			m_slowest_frame = std::chrono::duration<float>::min();
-		}
+		if (m_pacer)
+			m_pacer->flip_presented(time);
 
-		m_prev_frame = now;
+		if (m_stats.window_frames() >= 100) {
+			m_stats.print_window();
+			if (m_sched)
+				fmt::print(", frame cost {:.2f} ms, margin {:.2f} ms, missed deadlines {}",
+					   m_sched->frame_cost() * 1000,
+					   m_sched->margin() * 1000,
+					   m_sched->missed_frames());
+			fmt::print("\n");
+		}
 
-		queue_next();
+		if (m_sched || m_pacer)
+			m_waiting = true;
+		else
+			queue_next();
 	}
 
-	static unsigned get_bar_pos(Framebuffer* fb, unsigned frame_num)
+	void draw_bar(IFramebuffer* fb, unsigned frame_num)
 	{
-		return (frame_num * bar_speed) % (fb->width() - bar_width + 1);
-	}
+		double start = FrameScheduler::now();
 
-	static void draw_bar(Framebuffer* fb, unsigned frame_num)
-	{
-		int old_xpos = frame_num < s_num_buffers ? -1 : get_bar_pos(fb, frame_num - s_num_buffers);
-		int new_xpos = get_bar_pos(fb, frame_num);
+		draw_flip_bar(fb, frame_num);
 
-		draw_color_bar(*fb, old_xpos, new_xpos, bar_width);
-		draw_text(*fb, fb->width() / 2, 0, to_string(frame_num), RGB(255, 255, 255));
+		m_stats.frame_drawn(FrameScheduler::now() - start);
 	}
 
-	static void do_flip_output(AtomicReq& req, unsigned frame_num, const OutputInfo& o)
+	void do_flip_output(AtomicReq& req, unsigned frame_num, bool draw, const OutputInfo& o)
 	{
 		unsigned cur = frame_num % s_num_buffers;
 
 		for (const PlaneInfo& p : o.planes) {
 			auto fb = p.fbs[cur];
 
-			draw_bar(fb, frame_num);
+			if (draw)
+				draw_bar(fb, frame_num);
 
 			req.add(p.plane, {
-					{ "FB_ID", fb->id() },
+					{ "FB_ID", drm_fb(fb)->id() },
 				});
 		}
 	}
 
-	void do_flip_output_legacy(unsigned frame_num, const OutputInfo& o)
+	void do_flip_output_legacy(unsigned frame_num, bool draw, const OutputInfo& o)
 	{
 		unsigned cur = frame_num % s_num_buffers;
 
 		if (!o.legacy_fbs.empty()) {
 			auto fb = o.legacy_fbs[cur];
 
-			draw_bar(fb, frame_num);
+			if (draw)
+				draw_bar(fb, frame_num);
+
+			m_stats.frame_committed(FrameScheduler::now());
 
-			int r = o.crtc->page_flip(*fb, this);
+			int r = o.crtc->page_flip(*drm_fb(fb), this, s_flip_async);
 			ASSERT(r == 0);
 		}
 
 		for (const PlaneInfo& p : o.planes) {
 			auto fb = p.fbs[cur];
 
-			draw_bar(fb, frame_num);
+			if (draw)
+				draw_bar(fb, frame_num);
 
-			int r = o.crtc->set_plane(p.plane, *fb,
+			int r = o.crtc->set_plane(p.plane, *drm_fb(fb),
 						  p.x, p.y, p.w, p.h,
 						  0, 0, fb->width(), fb->height());
 			ASSERT(r == 0);
@@ -1050,19 +1472,31 @@ private:
 	{
 		m_flip_count = 0;
 
+		if (m_sched)
+			m_sched->frame_start();
+
+		// With VRR pacing a content frame may be shown for multiple flips
+		unsigned frame_num = m_pacer ? m_pacer->content_frame() : m_frame_num;
+		bool draw = !m_pacer || !m_pacer->next_is_repeat();
+
 		if (m_card.has_atomic()) {
 			AtomicReq req(m_card);
 
 			for (auto o : m_outputs)
-				do_flip_output(req, m_frame_num, *o);
+				do_flip_output(req, frame_num, draw, *o);
+
+			m_stats.frame_committed(FrameScheduler::now());
 
-			int r = req.commit(this);
+			int r = req.commit(this, false, s_flip_async);
 			if (r)
 				EXIT("Flip commit failed: %d\n", r);
 		} else {
 			ASSERT(m_outputs.size() == 1);
-			do_flip_output_legacy(m_frame_num, *m_outputs[0]);
+			do_flip_output_legacy(frame_num, draw, *m_outputs[0]);
 		}
+
+		if (m_sched)
+			m_sched->frame_committed();
 	}
 
 	Card& m_card;
@@ -1071,14 +1505,229 @@ private:
 	unsigned m_frame_num;
 	unsigned m_flip_count;
 
-	chrono::steady_clock::time_point m_prev_print;
-	chrono::steady_clock::time_point m_prev_frame;
-	chrono::duration<float> m_slowest_frame;
+	unique_ptr<FrameScheduler> m_sched;
+	unique_ptr<FramePacer> m_pacer;
+	bool m_waiting;
+
+	FlipStats m_stats;
+};
+
+// Writes frames into a file, raw or in Y4M format. Y4M supports only planar
+// and semiplanar YUV formats, of which the semiplanar ones are converted to
+// planar.
+class FrameFileWriter
+{
+public:
+	FrameFileWriter(const string& filename, IFramebuffer* fb, double fps)
+		: m_bytes(0)
+	{
+		const string ext = ".y4m";
+
+		m_y4m = filename.size() > ext.size() &&
+			filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+
+		if (m_y4m) {
+			const PixelFormatInfo& pi = get_pixel_format_info(fb->format());
+
+			if (pi.type != PixelColorType::YUV || pi.num_planes < 2)
+				EXIT("Y4M requires a planar or semiplanar YUV framebuffer, not %s",
+				     PixelFormatToFourCC(fb->format()).c_str());
+
+			m_xsub = pi.planes[1].xsub;
+			m_ysub = pi.planes[1].ysub;
+		}
+
+		m_file = fopen(filename.c_str(), "w");
+		if (!m_file)
+			EXIT("Failed to open %s: %s", filename.c_str(), strerror(errno));
+
+		if (m_y4m) {
+			const char* chroma = m_xsub == 1 ? "444" : m_ysub == 1 ? "422" : "420jpeg";
+
+			fmt::print(m_file, "YUV4MPEG2 W{} H{} F{}:1000 Ip A1:1 C{}\n",
+				   fb->width(), fb->height(), lround(fps * 1000), chroma);
+		}
+	}
+
+	~FrameFileWriter()
+	{
+		fclose(m_file);
+	}
+
+	void write(IFramebuffer* fb)
+	{
+		if (!m_y4m) {
+			for (unsigned i = 0; i < fb->num_planes(); ++i)
+				write_data(fb->map(i), fb->size(i));
+			return;
+		}
+
+		write_data("FRAME\n", 6);
+
+		const uint32_t w = fb->width();
+		const uint32_t h = fb->height();
+		const uint32_t cw = w / m_xsub;
+		const uint32_t ch = h / m_ysub;
+
+		for (unsigned y = 0; y < h; ++y)
+			write_data(fb->map(0) + fb->stride(0) * y, w);
+
+		bool swap_uv = false;
+
+		switch (fb->format()) {
+		case PixelFormat::NV21:
+		case PixelFormat::NV61:
+		case PixelFormat::YVU420:
+		case PixelFormat::YVU422:
+		case PixelFormat::YVU444:
+			swap_uv = true;
+			break;
+		default:
+			break;
+		}
+
+		if (fb->num_planes() == 3) {
+			unsigned u = swap_uv ? 2 : 1;
+			unsigned v = swap_uv ? 1 : 2;
+
+			for (unsigned y = 0; y < ch; ++y)
+				write_data(fb->map(u) + fb->stride(u) * y, cw);
+			for (unsigned y = 0; y < ch; ++y)
+				write_data(fb->map(v) + fb->stride(v) * y, cw);
+			return;
+		}
+
+		m_chroma.resize(cw * ch * 2);
+		uint8_t* u = m_chroma.data() + (swap_uv ? cw * ch : 0);
+		uint8_t* v = m_chroma.data() + (swap_uv ? 0 : cw * ch);
+
+		for (unsigned y = 0; y < ch; ++y) {
+			const uint8_t* p = fb->map(1) + fb->stride(1) * y;
+
+			for (unsigned x = 0; x < cw; ++x) {
+				*u++ = p[x * 2];
+				*v++ = p[x * 2 + 1];
+			}
+		}
+
+		write_data(m_chroma.data(), m_chroma.size());
+	}
+
+	uint64_t bytes_written() const { return m_bytes; }
+
+private:
+	void write_data(const void* data, size_t size)
+	{
+		if (fwrite(data, 1, size, m_file) != size)
+			EXIT("Failed to write frame: %s", strerror(errno));
+		m_bytes += size;
+	}
 
-	static const unsigned bar_width = 20;
-	static const unsigned bar_speed = 8;
+	FILE* m_file;
+	bool m_y4m;
+	unsigned m_xsub;
+	unsigned m_ysub;
+	vector<uint8_t> m_chroma;
+	uint64_t m_bytes;
 };
 
+static IFramebuffer* first_fb(const OutputInfo& o, unsigned idx)
+{
+	if (!o.legacy_fbs.empty())
+		return o.legacy_fbs[idx];
+
+	return o.planes[0].fbs[idx];
+}
+
+// Render the outputs into CPUFramebuffers, optionally writing them to files
+static void main_headless(const vector<OutputInfo>& outputs)
+{
+	double hz = s_headless_hz >= 0 ? s_headless_hz : outputs[0].mode.calculated_vrefresh();
+	unsigned num_frames = s_flip_mode ? (s_max_flips ?: 300) : 1;
+
+	vector<unique_ptr<FrameFileWriter>> writers;
+
+	for (unsigned i = 0; i < outputs.size() && !s_record_path.empty(); ++i) {
+		string path = s_record_path;
+
+		// file.y4m, file-1.y4m, file-2.y4m...
+		if (i > 0) {
+			size_t dot = path.find_last_of('.');
+			if (dot == string::npos || path.find('/', dot) != string::npos)
+				dot = path.size();
+			path.insert(dot, "-" + to_string(i));
+		}
+
+		writers.emplace_back(new FrameFileWriter(path, first_fb(outputs[i], 0),
+							 hz > 0 ? hz : outputs[i].mode.calculated_vrefresh()));
+	}
+
+	struct sigaction sa { };
+	sa.sa_handler = sigint_handler;
+	sigaction(SIGINT, &sa, NULL);
+
+	StatAccum render;
+	StatAccum write;
+
+	double start = FrameScheduler::now();
+	unsigned n;
+
+	for (n = 0; n < num_frames && !s_interrupted; ++n) {
+		unsigned cur = n % s_num_buffers;
+		double t = FrameScheduler::now();
+
+		if (!s_flip_mode) {
+			draw_test_patterns(outputs);
+		} else {
+			for (const OutputInfo& o : outputs) {
+				if (!o.legacy_fbs.empty())
+					draw_flip_bar(o.legacy_fbs[cur], n);
+
+				for (const PlaneInfo& p : o.planes)
+					draw_flip_bar(p.fbs[cur], n);
+			}
+		}
+
+		render.add(FrameScheduler::now() - t);
+
+		if (!writers.empty()) {
+			t = FrameScheduler::now();
+
+			for (unsigned i = 0; i < outputs.size(); ++i)
+				writers[i]->write(first_fb(outputs[i], cur));
+
+			write.add(FrameScheduler::now() - t);
+		}
+
+		if (hz > 0) {
+			double next = start + (n + 1) / hz;
+			struct timespec ts;
+			ts.tv_sec = (time_t)next;
+			ts.tv_nsec = (long)((next - ts.tv_sec) * 1000000000);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+	}
+
+	double elapsed = FrameScheduler::now() - start;
+
+	if (!s_flip_mode)
+		print_outputs(outputs);
+
+	fmt::print("Headless: {} frames in {:.2f} s, fps {:.2f}\n", n, elapsed, elapsed > 0 ? n / elapsed : 0);
+	fmt::print("  render avg/max {:.3f}/{:.3f} ms, throughput {:.1f} fps\n",
+		   render.avg() * 1000, render.max * 1000, render.sum > 0 ? render.count / render.sum : 0);
+
+	if (!writers.empty()) {
+		uint64_t bytes = 0;
+		for (auto& w : writers)
+			bytes += w->bytes_written();
+
+		fmt::print("  write avg/max {:.3f}/{:.3f} ms, {:.1f} MB, {:.1f} MB/s\n",
+			   write.avg() * 1000, write.max * 1000, bytes / 1000000.0,
+			   write.sum > 0 ? bytes / write.sum / 1000000 : 0);
+	}
+}
+
 static void main_flip(Card& card, const vector<OutputInfo>& outputs)
 {
 	fd_set fds;
@@ -1107,17 +1756,35 @@ static void main_flip(Card& card, const vector<OutputInfo>& outputs)
 		flipstates.push_back(move(fs));
 	}
 
+	// Stop on ctrl-c too, so that the statistics get printed
+	struct sigaction sa { };
+	sa.sa_handler = sigint_handler;
+	sigaction(SIGINT, &sa, NULL);
+
 	for (unique_ptr<FlipState>& fs : flipstates)
 		fs->start_flipping();
 
-	while (!max_flips_reached) {
+	while (!max_flips_reached && !s_interrupted) {
 		int r;
 
 		FD_SET(0, &fds);
 		FD_SET(fd, &fds);
 
-		r = select(fd + 1, &fds, NULL, NULL, NULL);
-		if (r < 0) {
+		double wait = -1;
+		for (unique_ptr<FlipState>& fs : flipstates) {
+			double t = fs->time_to_next();
+			if (t >= 0 && (wait < 0 || t < wait))
+				wait = t;
+		}
+
+		struct timeval tv;
+		tv.tv_sec = (time_t)wait;
+		tv.tv_usec = (suseconds_t)((wait - tv.tv_sec) * 1000000);
+
+		r = select(fd + 1, &fds, NULL, NULL, wait >= 0 ? &tv : NULL);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
 			fmt::print(stderr, "select() failed with {}: {}\n", errno, strerror(errno));
 			break;
 		} else if (FD_ISSET(0, &fds)) {
@@ -1126,6 +1793,29 @@ static void main_flip(Card& card, const vector<OutputInfo>& outputs)
 		} else if (FD_ISSET(fd, &fds)) {
 			card.call_page_flip_handlers();
 		}
+
+		for (unique_ptr<FlipState>& fs : flipstates)
+			fs->run_scheduled();
+	}
+
+	for (unique_ptr<FlipState>& fs : flipstates)
+		fs->stats().print_summary();
+
+	if (s_stats_csv)
+		fclose(s_stats_csv);
+
+	if (!s_stats_json.empty()) {
+		FILE* f = fopen(s_stats_json.c_str(), "w");
+		if (!f)
+			EXIT("Failed to open %s: %s", s_stats_json.c_str(), strerror(errno));
+
+		fmt::print(f, "{{\n  \"outputs\": [\n");
+		for (size_t i = 0; i < flipstates.size(); ++i)
+			fmt::print(f, "    {}{}\n", flipstates[i]->stats().to_json(),
+				   i == flipstates.size() - 1 ? "" : ",");
+		fmt::print(f, "  ]\n}}\n");
+
+		fclose(f);
 	}
 }
 
@@ -1133,18 +1823,43 @@ int main(int argc, char **argv)
 {
 	vector<Arg> output_args = parse_cmdline(argc, argv);
 
-	Card card(s_device_path);
+	if (!s_record_path.empty() && !s_headless)
+		EXIT("--record requires --headless");
+
+	Card card(s_headless && s_device_path.empty() ? "virtual" : s_device_path);
 
-	if (!card.is_master())
+	if (!card.is_master() && !s_headless)
 		EXIT("Could not get DRM master permission. Card already in use?");
 
 	if (!card.has_atomic() && s_flip_sync)
 		EXIT("Synchronized flipping requires atomic modesetting");
 
+	if (s_flip_async && !(card.has_atomic() ? card.has_atomic_async_page_flip() : card.has_async_page_flip()))
+		fmt::print(stderr, "Async page flips not supported, using normal flips\n");
+
 	ResourceManager resman(card);
 
 	vector<OutputInfo> outputs = setups_to_outputs(card, resman, output_args);
 
+	if (s_vrr) {
+		if (!card.has_atomic())
+			EXIT("VRR requires atomic modesetting");
+
+		for (const OutputInfo& o : outputs) {
+			if (!o.connector->vrr_capable())
+				fmt::print(stderr, "Connector {} is not VRR capable\n", o.connector->fullname());
+			if (!o.crtc->has_vrr())
+				fmt::print(stderr, "Crtc {} does not support VRR\n", o.crtc->id());
+		}
+	}
+
+	if (s_headless) {
+		if (s_flip_mode)
+			print_outputs(outputs);
+		main_headless(outputs);
+		return 0;
+	}
+
 	if (!s_flip_mode)
 		draw_test_patterns(outputs);
 
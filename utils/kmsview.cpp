@@ -1,33 +1,578 @@
 #include <cstdio>
-#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+#include <poll.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <kms++/kms++.h>
 #include <kms++util/kms++util.h>
+#include <kms++util/rawvideo.h>
 
 using namespace std;
 using namespace kms;
 
-static void read_frame(ifstream& is, DumbFramebuffer* fb, Crtc* crtc, Plane* plane)
+// Frames to prefetch ahead of the frame being uploaded
+static const unsigned prefetch_frames = 8;
+// Framebuffers in the ring: one shown, one queued for flip, one being filled
+static const unsigned num_fbs = 3;
+
+static unsigned packed_row_bytes(const PixelFormatInfo& pfi, unsigned plane, uint32_t width)
+{
+	const PixelFormatPlaneInfo& pi = pfi.planes[plane];
+
+	unsigned bytes = width * pi.bitspp / 8;
+
+	// The chroma planes of fully planar YUV formats don't combine U and V
+	if (pfi.type == PixelColorType::YUV && pfi.num_planes == 3)
+		bytes /= pi.xsub;
+
+	return bytes;
+}
+
+// A memory mapped raw, Y4M or indexed raw video file. Raw files are
+// concatenated frames with packed planes, or with the planes of dumb buffers
+// including the stride padding, as older wbcap versions wrote. Y4M files give the size, format and
+// frame rate in the header, and each frame starts with a FRAME line. Indexed
+// files (.kmsv) are read with RawVideoReader, and have a timestamp for each
+// frame.
+class VideoFile
 {
-	for (unsigned i = 0; i < fb->num_planes(); ++i)
-		is.read((char*)fb->map(i), fb->size(i));
+public:
+	VideoFile(const string& filename)
+	{
+		if (RawVideoReader::is_raw_video(filename)) {
+			open_indexed(filename);
+			return;
+		}
+
+		m_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if (m_fd < 0)
+			EXIT("Failed to open %s: %s", filename.c_str(), strerror(errno));
+
+		struct stat st;
+		int r = fstat(m_fd, &st);
+		ASSERT(r == 0);
+
+		m_size = st.st_size;
+
+		if (m_size) {
+			void* p = mmap(0, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+			if (p == MAP_FAILED)
+				EXIT("Failed to mmap %s: %s", filename.c_str(), strerror(errno));
+
+			m_map = (const uint8_t*)p;
+
+			madvise((void*)m_map, m_size, MADV_SEQUENTIAL);
+		}
+
+		m_y4m = m_size >= 10 && memcmp(m_map, "YUV4MPEG2 ", 10) == 0;
+
+		if (m_y4m)
+			parse_y4m_header();
+	}
+
+	~VideoFile()
+	{
+		if (m_map)
+			munmap((void*)m_map, m_size);
+
+		if (m_fd >= 0)
+			::close(m_fd);
+	}
+
+	VideoFile(const VideoFile& other) = delete;
+	VideoFile& operator=(const VideoFile& other) = delete;
+
+	bool is_y4m() const { return m_y4m; }
+	bool is_indexed() const { return m_video != nullptr; }
+	uint32_t width() const { return m_width; }
+	uint32_t height() const { return m_height; }
+	PixelFormat format() const { return m_format; }
+	// 0 if not known
+	double fps() const { return m_fps; }
+	size_t frame_size() const { return m_frame_size; }
+	size_t plane_offset(unsigned plane) const { return m_plane_offsets[plane]; }
+	uint32_t stride(unsigned plane) const { return m_strides[plane]; }
+
+	// Indexed files have a timestamp for each frame, unless the writer
+	// didn't finish
+	bool has_timestamps() const { return m_video && m_video->has_index(); }
+	// In seconds, relative to the first frame
+	double timestamp(unsigned n) const { return m_video->timestamp(n); }
+	unsigned find_frame(double t) const { return m_video->find_frame(t); }
 
-	unsigned w = min(crtc->width(), fb->width());
-	unsigned h = min(crtc->height(), fb->height());
+	void set_format(uint32_t width, uint32_t height, PixelFormat format)
+	{
+		m_width = width;
+		m_height = height;
+		m_format = format;
 
-	int r = crtc->set_plane(plane, *fb,
-				0, 0, w, h,
-				0, 0, fb->width(), fb->height());
+		update_frame_size();
+	}
+
+	// Raw frames with the planes laid out like in fb, stride padding included
+	void set_padded_layout(IFramebuffer& fb)
+	{
+		m_frame_size = 0;
+		for (unsigned i = 0; i < fb.num_planes(); ++i) {
+			m_plane_offsets[i] = m_frame_size;
+			m_strides[i] = fb.stride(i);
+			m_frame_size += fb.size(i);
+		}
+	}
+
+	// nullptr after the last frame
+	const uint8_t* frame(unsigned n)
+	{
+		if (m_video)
+			return n < m_video->num_frames() ? m_video->frame(n) : nullptr;
+
+		if (!m_y4m) {
+			if (((uint64_t)n + 1) * m_frame_size > m_size)
+				return nullptr;
+
+			return m_map + (size_t)n * m_frame_size;
+		}
+
+		// The Y4M frame headers are parsed as the frames are played
+		while (m_offsets.size() <= n) {
+			if (!parse_y4m_frame())
+				return nullptr;
+		}
+
+		return m_map + m_offsets[n];
+	}
 
-	ASSERT(r == 0);
+	// Ask the kernel to start reading the frames in the background
+	void prefetch(unsigned first, unsigned count)
+	{
+		if (m_video) {
+			m_video->prefetch(first, count);
+			return;
+		}
+
+		size_t start = estimate_offset(first);
+		size_t end = min(m_size, estimate_offset(first + count));
+
+		advise(start, end, MADV_WILLNEED);
+	}
+
+	// The frames before this one won't be needed soon
+	void release_before(unsigned n)
+	{
+		// RawVideoReader::prefetch() releases the earlier frames
+		if (m_video)
+			return;
+
+		advise(0, min(m_size, estimate_offset(n)), MADV_DONTNEED);
+	}
+
+private:
+	void open_indexed(const string& filename)
+	{
+		m_video = unique_ptr<RawVideoReader>(new RawVideoReader(filename));
+
+		m_y4m = false;
+		m_width = m_video->width();
+		m_height = m_video->height();
+		m_format = m_video->format();
+		m_fps = m_video->fps();
+		m_frame_size = m_video->frame_size();
+
+		for (unsigned i = 0; i < m_video->num_planes(); ++i) {
+			m_plane_offsets[i] = m_video->plane_offset(i);
+			m_strides[i] = m_video->stride(i);
+		}
+	}
+
+	void update_frame_size()
+	{
+		const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+		m_frame_size = 0;
+		for (unsigned i = 0; i < pfi.num_planes; ++i) {
+			m_plane_offsets[i] = m_frame_size;
+			m_strides[i] = packed_row_bytes(pfi, i, m_width);
+			m_frame_size += (size_t)m_strides[i] * (m_height / pfi.planes[i].ysub);
+		}
+	}
+
+	// Returns the line at pos without the newline, and moves pos past it
+	string read_line(size_t& pos)
+	{
+		const uint8_t* nl = (const uint8_t*)memchr(m_map + pos, '\n', m_size - pos);
+		if (!nl)
+			return string();
+
+		string line((const char*)m_map + pos, nl - (m_map + pos));
+		pos = nl - m_map + 1;
+		return line;
+	}
+
+	void parse_y4m_header()
+	{
+		size_t pos = 0;
+		string header = read_line(pos);
+
+		FAIL_IF(pos == 0, "Bad Y4M header");
+
+		string colorspace = "420jpeg";
+
+		istringstream is(header);
+		string param;
+
+		// Skip the YUV4MPEG2 signature
+		is >> param;
+
+		while (is >> param) {
+			const string v = param.substr(1);
+
+			switch (param[0]) {
+			case 'W':
+				m_width = stoul(v);
+				break;
+			case 'H':
+				m_height = stoul(v);
+				break;
+			case 'F': {
+				size_t colon = v.find(':');
+				if (colon != string::npos && stoul(v.substr(colon + 1)) != 0)
+					m_fps = stod(v.substr(0, colon)) / stod(v.substr(colon + 1));
+				break;
+			}
+			case 'C':
+				colorspace = v;
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (colorspace.compare(0, 3, "420") == 0)
+			m_format = PixelFormat::YUV420;
+		else if (colorspace == "422")
+			m_format = PixelFormat::YUV422;
+		else if (colorspace == "444")
+			m_format = PixelFormat::YUV444;
+		else
+			EXIT("Unsupported Y4M colorspace %s", colorspace.c_str());
+
+		FAIL_IF(m_width == 0 || m_height == 0, "No frame size in Y4M header");
+
+		update_frame_size();
+
+		m_next_frame_pos = pos;
+	}
+
+	bool parse_y4m_frame()
+	{
+		size_t pos = m_next_frame_pos;
+
+		if (m_size - pos < 5 || memcmp(m_map + pos, "FRAME", 5) != 0)
+			return false;
+
+		read_line(pos);
+
+		if (pos == m_next_frame_pos || m_size - pos < m_frame_size)
+			return false;
+
+		m_offsets.push_back(pos);
+		m_next_frame_pos = pos + m_frame_size;
+
+		return true;
+	}
+
+	size_t estimate_offset(unsigned n) const
+	{
+		if (!m_y4m)
+			return (size_t)n * m_frame_size;
+
+		if (n < m_offsets.size())
+			return m_offsets[n];
+
+		// Assume plain "FRAME\n" headers for the frames not parsed yet
+		return m_next_frame_pos + (size_t)(n - m_offsets.size()) * (m_frame_size + 6);
+	}
+
+	void advise(size_t start, size_t end, int advice)
+	{
+		const size_t page_size = sysconf(_SC_PAGESIZE);
+
+		start = start / page_size * page_size;
+
+		if (end <= start)
+			return;
+
+		madvise((void*)(m_map + start), end - start, advice);
+	}
+
+	int m_fd = -1;
+	const uint8_t* m_map = nullptr;
+	size_t m_size;
+
+	bool m_y4m;
+	uint32_t m_width = 0;
+	uint32_t m_height = 0;
+	PixelFormat m_format = PixelFormat::Undefined;
+	double m_fps = 0;
+	size_t m_frame_size = 0;
+	size_t m_plane_offsets[4] { };
+	uint32_t m_strides[4] { };
+
+	unique_ptr<RawVideoReader> m_video;
+
+	// Y4M frame data offsets
+	vector<size_t> m_offsets;
+	size_t m_next_frame_pos = 0;
+};
+
+static void upload_frame(const VideoFile& file, const uint8_t* frame, DumbFramebuffer* fb)
+{
+	const PixelFormatInfo& pfi = get_pixel_format_info(fb->format());
+
+	for (unsigned i = 0; i < fb->num_planes(); ++i) {
+		const unsigned row_bytes = packed_row_bytes(pfi, i, fb->width());
+		const unsigned rows = fb->height() / pfi.planes[i].ysub;
+		const uint32_t src_stride = file.stride(i);
+		const uint8_t* src = frame + file.plane_offset(i);
+		uint8_t* dst = fb->map(i);
+
+		if (fb->stride(i) == src_stride) {
+			memcpy(dst, src, (size_t)src_stride * rows);
+			continue;
+		}
+
+		for (unsigned y = 0; y < rows; ++y)
+			memcpy(dst + (size_t)fb->stride(i) * y, src + (size_t)src_stride * y, row_bytes);
+	}
 }
 
+// Uploads the frames to a ring of framebuffers ahead of time, and flips to
+// them on vblank at the content frame rate, or at the frame timestamps of
+// indexed files. Frames are dropped if the display or the upload can't keep
+// up.
+class Player : private PageFlipHandlerBase
+{
+public:
+	Player(Card& card, Crtc* crtc, Plane* plane, VideoFile& file, double fps)
+		: m_card(card), m_crtc(crtc), m_plane(plane), m_file(file), m_fps(fps)
+	{
+		m_period = 1.0 / m_crtc->mode().calculated_vrefresh();
+
+		for (unsigned i = 0; i < num_fbs; ++i) {
+			auto fb = new DumbFramebuffer(card, file.width(), file.height(), file.format());
+			m_fbs.emplace_back(fb);
+			m_free_fbs.push_back(fb);
+		}
+	}
+
+	// Upload the next frame if a framebuffer is free. Returns false after
+	// the last frame.
+	bool fill()
+	{
+		if (m_ready_fb || m_free_fbs.empty())
+			return !m_eof;
+
+		unsigned n = m_next_frame;
+
+		// Skip the frames whose time has already passed
+		if (timed() && m_have_start) {
+			double t = FrameScheduler::now() + m_period - m_start_time;
+
+			n = max(n, frame_at(t + frame_time(m_base_frame)));
+		}
+
+		const uint8_t* data = m_file.frame(n);
+
+		if (!data) {
+			m_eof = true;
+			return false;
+		}
+
+		m_dropped += n - m_next_frame;
+
+		m_file.prefetch(n + 1, prefetch_frames);
+		if (n > prefetch_frames)
+			m_file.release_before(n - prefetch_frames);
+
+		auto fb = m_free_fbs.back();
+		m_free_fbs.pop_back();
+
+		upload_frame(m_file, data, fb);
+
+		m_ready_fb = fb;
+		m_ready_frame = n;
+		m_next_frame = n + 1;
+
+		return true;
+	}
+
+	// Seconds until the ready frame should be committed, 0 if now, or -1
+	// if there's nothing to commit
+	double time_to_commit() const
+	{
+		if (!m_ready_fb || m_queued_fb)
+			return -1;
+
+		if (!timed() || !m_have_start)
+			return 0;
+
+		double due = m_start_time + frame_time(m_ready_frame) - frame_time(m_base_frame);
+
+		// The flip happens on the first vblank after the commit, so commit
+		// half a frame before the frame is due, to flip on the vblank
+		// closest to its time
+		double commit = due - m_period / 2;
+
+		return max(commit - FrameScheduler::now(), 0.0);
+	}
+
+	// Returns the frame number of the committed frame
+	unsigned commit()
+	{
+		auto fb = m_ready_fb;
+		m_ready_fb = nullptr;
+		m_queued_frame = m_ready_frame;
+
+		if (m_card.has_atomic()) {
+			AtomicReq req(m_card);
+
+			if (!m_plane_set) {
+				req.add(m_plane, "CRTC_ID", m_crtc->id());
+				req.add(m_plane, "CRTC_X", 0);
+				req.add(m_plane, "CRTC_Y", 0);
+				req.add(m_plane, "CRTC_W", min(m_crtc->width(), fb->width()));
+				req.add(m_plane, "CRTC_H", min(m_crtc->height(), fb->height()));
+				req.add(m_plane, "SRC_X", 0);
+				req.add(m_plane, "SRC_Y", 0);
+				req.add(m_plane, "SRC_W", fb->width() << 16);
+				req.add(m_plane, "SRC_H", fb->height() << 16);
+			}
+
+			req.add(m_plane, "FB_ID", fb->id());
+
+			int r = req.commit(this);
+			FAIL_IF(r, "Flip commit failed: %d", r);
+
+			m_plane_set = true;
+			m_queued_fb = fb;
+		} else {
+			// Legacy SetPlane has no completion event, and usually
+			// waits for the vblank
+			unsigned w = min(m_crtc->width(), fb->width());
+			unsigned h = min(m_crtc->height(), fb->height());
+
+			int r = m_crtc->set_plane(m_plane, *fb, 0, 0, w, h, 0, 0, fb->width(), fb->height());
+			FAIL_IF(r, "SetPlane failed: %d", r);
+
+			m_queued_fb = fb;
+			handle_page_flip(0, FrameScheduler::now());
+		}
+
+		return m_queued_frame;
+	}
+
+	// Continue from frame n. The frame timing restarts from the flip of the
+	// next committed frame.
+	void seek(unsigned n)
+	{
+		if (m_ready_fb) {
+			m_free_fbs.push_back(m_ready_fb);
+			m_ready_fb = nullptr;
+		}
+
+		m_next_frame = n;
+		m_base_frame = n;
+		m_eof = false;
+		m_have_start = false;
+	}
+
+	// Frames are shown at the frame rate or at the frame timestamps,
+	// otherwise one frame per commit
+	bool timed() const { return m_fps > 0 || m_file.has_timestamps(); }
+
+	bool flip_pending() const { return m_queued_fb != nullptr; }
+	unsigned shown() const { return m_shown; }
+	unsigned dropped() const { return m_dropped; }
+
+private:
+	// The frame rate given by the user overrides the timestamps
+	double frame_time(unsigned n) const
+	{
+		return m_fps > 0 ? n / m_fps : m_file.timestamp(n);
+	}
+
+	unsigned frame_at(double t) const
+	{
+		if (t <= 0)
+			return 0;
+
+		return m_fps > 0 ? (unsigned)(t * m_fps) : m_file.find_frame(t);
+	}
+
+	void handle_page_flip(uint32_t frame, double time) override
+	{
+		// Time the frames from the first flip after the start or a seek
+		if (!m_have_start && m_queued_frame == m_base_frame) {
+			m_start_time = time;
+			m_have_start = true;
+		}
+
+		if (m_current_fb)
+			m_free_fbs.push_back(m_current_fb);
+
+		m_current_fb = m_queued_fb;
+		m_queued_fb = nullptr;
+
+		m_shown++;
+	}
+
+	Card& m_card;
+	Crtc* m_crtc;
+	Plane* m_plane;
+	VideoFile& m_file;
+	double m_fps;
+	double m_period;
+
+	vector<unique_ptr<DumbFramebuffer>> m_fbs;
+	vector<DumbFramebuffer*> m_free_fbs;
+	DumbFramebuffer* m_ready_fb = nullptr;
+	DumbFramebuffer* m_queued_fb = nullptr;
+	DumbFramebuffer* m_current_fb = nullptr;
+
+	unsigned m_next_frame = 0;
+	unsigned m_ready_frame = 0;
+	unsigned m_queued_frame = 0;
+	// The frame the timing starts from
+	unsigned m_base_frame = 0;
+	bool m_eof = false;
+	bool m_plane_set = false;
+
+	bool m_have_start = false;
+	double m_start_time = 0;
+
+	unsigned m_shown = 0;
+	unsigned m_dropped = 0;
+};
+
 static const char* usage_str =
-		"Usage: kmsview [options] <file> <width> <height> <fourcc>\n\n"
+		"Usage: kmsview [options] <file> [<width> <height> <fourcc>]\n\n"
+		"The size and format are read from the header of Y4M and indexed (.kmsv) files\n\n"
 		"Options:\n"
 		"  -c, --connector <name>	Output connector\n"
-		"  -t, --time <ms>		Milliseconds to sleep between frames\n"
+		"      --device <path>		DRM device\n"
+		"  -t, --time <ms>		Milliseconds to show each frame\n"
+		"  -f, --fps <fps>		Frame rate, default from the header or the timestamps\n"
+		"  -s, --start <frame>		First frame to show\n"
+		"      --padded			Raw frames are dumb buffers with the stride padding,\n"
+		"				as written by older wbcap versions\n"
+		"\n"
+		"Without a frame rate, enter shows the next frame. A frame number followed\n"
+		"by enter jumps to the frame.\n"
 		;
 
 static void usage()
@@ -38,6 +583,9 @@ static void usage()
 int main(int argc, char** argv)
 {
 	uint32_t time = 0;
+	double fps = 0;
+	unsigned start = 0;
+	bool padded = false;
 	string dev_path;
 	string conn_name;
 
@@ -54,6 +602,18 @@ int main(int argc, char** argv)
 		{
 			time = stoul(str);
 		}),
+		Option("f|fps=", [&fps](const string& str)
+		{
+			fps = stod(str);
+		}),
+		Option("s|start=", [&start](const string& str)
+		{
+			start = stoul(str);
+		}),
+		Option("|padded", [&padded]()
+		{
+			padded = true;
+		}),
 		Option("h|help", []()
 		{
 			usage();
@@ -65,59 +625,134 @@ int main(int argc, char** argv)
 
 	vector<string> params = optionset.params();
 
-	if (params.size() != 4) {
+	if (params.size() != 1 && params.size() != 4) {
 		usage();
 		exit(-1);
 	}
 
-	string filename = params[0];
-	uint32_t w = stoi(params[1]);
-	uint32_t h = stoi(params[2]);
-	string modestr = params[3];
-
-	auto pixfmt = FourCCToPixelFormat(modestr);
+	VideoFile file(params[0]);
 
-	ifstream is(filename, ifstream::binary);
+	if (params.size() == 4) {
+		FAIL_IF(file.is_indexed(), "The size and format of indexed files can't be changed");
+		file.set_format(stoi(params[1]), stoi(params[2]), FourCCToPixelFormat(params[3]));
+	} else if (!file.is_y4m() && !file.is_indexed()) {
+		EXIT("The size and format are needed for raw files");
+	}
 
-	is.seekg(0, std::ios::end);
-	unsigned fsize = is.tellg();
-	is.seekg(0);
+	FAIL_IF(padded && (file.is_y4m() || file.is_indexed()), "Only raw files can be padded");
 
+	if (time)
+		fps = 1000.0 / time;
+	else if (fps == 0 && !file.has_timestamps())
+		fps = file.fps();
 
 	Card card(dev_path);
 	ResourceManager res(card);
 
+	if (padded) {
+		DumbFramebuffer fb(card, file.width(), file.height(), file.format());
+		file.set_padded_layout(fb);
+	}
+
+	printf("%ux%u %s, frame size %zu\n", file.width(), file.height(),
+	       PixelFormatToFourCC(file.format()).c_str(), file.frame_size());
+
+	if (fps > 0)
+		printf("%.2f fps\n", fps);
+	else if (file.has_timestamps())
+		printf("Using frame timestamps\n");
+
 	auto conn = res.reserve_connector(conn_name);
 	auto crtc = res.reserve_crtc(conn);
-	auto plane = res.reserve_overlay_plane(crtc, pixfmt);
+	auto plane = res.reserve_overlay_plane(crtc, file.format());
 	FAIL_IF(!plane, "available plane not found");
 
-	auto fb = new DumbFramebuffer(card, w, h, pixfmt);
-
-	unsigned frame_size = 0;
-	for (unsigned i = 0; i < fb->num_planes(); ++i)
-		frame_size += fb->size(i);
+	unique_ptr<Framebuffer> mode_fb;
 
-	unsigned num_frames = fsize / frame_size;
-	printf("file size %u, frame size %u, frames %u\n", fsize, frame_size, num_frames);
+	if (!crtc->mode_valid()) {
+		Videomode mode = conn->get_default_mode();
+		int r;
 
-	for (unsigned i = 0; i < num_frames; ++i) {
-		printf("frame %d", i); fflush(stdout);
-		read_frame(is, fb, crtc, plane);
-		if (!time) {
-			getchar();
+		if (card.has_atomic()) {
+			r = crtc->set_mode(conn, mode);
 		} else {
-			usleep(time * 1000);
-			printf("\n");
+			// The legacy modeset needs a framebuffer
+			mode_fb = unique_ptr<Framebuffer>(new DumbFramebuffer(card, mode.hdisplay, mode.vdisplay,
+									    PixelFormat::XRGB8888));
+			r = crtc->set_mode(conn, *mode_fb, mode);
 		}
+
+		FAIL_IF(r, "Modeset failed: %d", r);
 	}
 
-	is.close();
+	Player player(card, crtc, plane, file, fps);
+
+	if (start)
+		player.seek(start);
+
+	vector<pollfd> fds(2);
+
+	fds[0].fd = 0;
+	fds[0].events = POLLIN;
+	fds[1].fd = card.fd();
+	fds[1].events = POLLIN;
+
+	bool step = !player.timed();
+	bool advance = true;
+
+	while (true) {
+		bool more = player.fill();
+
+		if (!more && !player.flip_pending())
+			break;
+
+		double wait = -1;
+
+		if (advance) {
+			wait = player.time_to_commit();
+
+			if (wait == 0) {
+				unsigned n = player.commit();
 
-	if (time) {
-		printf("press enter to exit\n");
-		getchar();
+				if (step) {
+					printf("frame %u", n); fflush(stdout);
+					advance = false;
+				}
+
+				continue;
+			}
+		}
+
+		int timeout = wait < 0 ? -1 : (int)ceil(wait * 1000);
+
+		int r = poll(fds.data(), fds.size(), timeout);
+		ASSERT(r >= 0);
+
+		if (fds[0].revents) {
+			char line[64];
+
+			if (!fgets(line, sizeof(line), stdin))
+				break;
+
+			char* end;
+			unsigned long n = strtoul(line, &end, 10);
+
+			if (end != line) {
+				player.seek(n);
+				advance = true;
+			} else if (!step) {
+				break;
+			} else {
+				advance = true;
+			}
+		}
+
+		if (fds[1].revents)
+			card.call_page_flip_handlers();
 	}
 
-	delete fb;
+	printf("\nshown %u frames, dropped %u\n", player.shown(), player.dropped());
+
+	printf("press enter to exit\n");
+	getchar();
 }
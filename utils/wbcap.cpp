@@ -2,11 +2,13 @@
 #include <poll.h>
 #include <unistd.h>
 #include <algorithm>
-#include <fstream>
+#include <cinttypes>
+#include <cmath>
 
 #include <kms++/kms++.h>
 #include <kms++util/kms++util.h>
 #include <kms++util/videodevice.h>
+#include <kms++util/framerecorder.h>
 
 #define CAMERA_BUF_QUEUE_SIZE 5
 
@@ -59,38 +61,46 @@ public:
 
 	DumbFramebuffer* Dequeue()
 	{
-		auto fb = m_capdev.dequeue();
+		auto fb = static_cast<DumbFramebuffer*>(m_capdev.dequeue());
 
 		auto iter = find(s_wb_fbs.begin(), s_wb_fbs.end(), fb);
 		s_wb_fbs.erase(iter);
 
-		s_ready_fbs.insert(s_ready_fbs.begin(), fb);
-
 		return fb;
 	}
 
-	void Queue()
+	// Capture time of the last dequeued frame
+	double timestamp() const
 	{
-		if (s_free_fbs.size() == 0)
-			return;
+		double ts = m_capdev.timestamp();
+		return ts > 0 ? ts : FrameScheduler::now();
+	}
 
-		auto fb = s_free_fbs.back();
-		s_free_fbs.pop_back();
+	void Queue()
+	{
+		while (s_free_fbs.size() > 0) {
+			auto fb = s_free_fbs.back();
+			s_free_fbs.pop_back();
 
-		m_capdev.queue(fb);
+			m_capdev.queue(fb);
 
-		s_wb_fbs.insert(s_wb_fbs.begin(), fb);
+			s_wb_fbs.insert(s_wb_fbs.begin(), fb);
+		}
 	}
 
 private:
 	VideoStreamer& m_capdev;
 };
 
+// Shows the captured frames on the destination display at the vblanks
+// matching their capture timestamps. The source and destination displays
+// run from different clocks, so frames are dropped or repeated as they drift.
 class WBFlipState : private PageFlipHandlerBase
 {
 public:
 	WBFlipState(Card& card, Crtc* crtc, Plane* plane)
-		: m_card(card), m_crtc(crtc), m_plane(plane)
+		: m_card(card), m_crtc(crtc), m_plane(plane),
+		  m_queue(1.0 / crtc->mode().calculated_vrefresh())
 	{
 		auto fb = s_ready_fbs.back();
 		s_ready_fbs.pop_back();
@@ -116,16 +126,46 @@ public:
 		m_current_fb = fb;
 	}
 
+	void push(DumbFramebuffer* fb, double timestamp)
+	{
+		auto iter = find(s_fbs.begin(), s_fbs.end(), fb);
+		m_queue.push(iter - s_fbs.begin(), timestamp);
+	}
+
+	void print_stats() const
+	{
+		printf("shown %" PRIu64 ", dropped %" PRIu64 ", repeated %" PRIu64 ", drift %.0f ppm, delay %.1f ms\n",
+		       m_queue.frames_shown(), m_queue.frames_dropped(), m_queue.frames_repeated(),
+		       m_queue.drift_ppm(), m_queue.delay() * 1000);
+	}
+
+	// Seconds until queue_next() should be called, or -1 if not needed
+	double time_to_next() const
+	{
+		if (m_queued_fb || m_queue.empty())
+			return -1;
+
+		// Commit half a frame before the vblank the frame is due at
+		double t = m_queue.next_due_vblank() - m_queue.display_period() / 2;
+
+		return max(t - FrameScheduler::now(), 0.0);
+	}
+
 	void queue_next()
 	{
 		if (m_queued_fb)
 			return;
 
-		if (s_ready_fbs.size() == 0)
+		uint32_t idx;
+		bool found = m_queue.select(m_queue.next_vblank(FrameScheduler::now()), idx);
+
+		for (uint32_t dropped : m_queue.take_dropped())
+			s_free_fbs.insert(s_free_fbs.begin(), s_fbs[dropped]);
+
+		if (!found)
 			return;
 
-		auto fb = s_ready_fbs.back();
-		s_ready_fbs.pop_back();
+		auto fb = s_fbs[idx];
 
 		AtomicReq req(m_card);
 		req.add(m_plane, "FB_ID", fb->id());
@@ -140,6 +180,8 @@ public:
 private:
 	void handle_page_flip(uint32_t frame, double time)
 	{
+		m_queue.vblank(time);
+
 		if (m_queued_fb) {
 			if (m_current_fb)
 				s_free_fbs.insert(s_free_fbs.begin(), m_current_fb);
@@ -157,6 +199,8 @@ private:
 
 	DumbFramebuffer* m_current_fb = nullptr;
 	DumbFramebuffer* m_queued_fb = nullptr;
+
+	PresentationQueue m_queue;
 };
 
 class BarFlipState : private PageFlipHandlerBase
@@ -255,6 +299,9 @@ static const char* usage_str =
 		"  -M, --dmode=MODE          Destination connector videomode\n"
 		"  -f, --format=4CC          Format\n"
 		"  -w, --write               Write captured frames to wbcap.raw file\n"
+		"      --drop                Drop the oldest frames instead of waiting for the disk\n"
+		"      --direct              Write the file with O_DIRECT\n"
+		"      --indexed             Write an indexed wbcap.kmsv file instead of wbcap.raw\n"
 		"  -h, --help                Print this help\n"
 		;
 
@@ -266,6 +313,9 @@ int main(int argc, char** argv)
 	string dst_mode_name;
 	PixelFormat pixfmt = PixelFormat::XRGB8888;
 	bool write_file = false;
+	auto write_policy = FrameRecorder::Policy::Block;
+	bool write_direct = false;
+	bool write_indexed = false;
 
 	OptionSet optionset = {
 		Option("s|src=", [&](string s)
@@ -292,6 +342,18 @@ int main(int argc, char** argv)
 		{
 			write_file = true;
 		}),
+		Option("|drop", [&]()
+		{
+			write_policy = FrameRecorder::Policy::DropOldest;
+		}),
+		Option("|direct", [&]()
+		{
+			write_direct = true;
+		}),
+		Option("|indexed", [&]()
+		{
+			write_indexed = true;
+		}),
 		Option("h|help", [&]()
 		{
 			puts(usage_str);
@@ -377,16 +439,20 @@ int main(int argc, char** argv)
 	fds[2].fd = card.fd();
 	fds[2].events =  POLLIN;
 
-	uint32_t dst_frame_num = 0;
-
-	const string filename = "wbcap.raw";
-	unique_ptr<ofstream> os;
-	if (write_file)
-		os = unique_ptr<ofstream>(new ofstream(filename, ofstream::binary));
+	const string filename = write_indexed ? "wbcap.kmsv" : "wbcap.raw";
+	unique_ptr<FrameRecorder> recorder;
+	if (write_file) {
+		recorder = unique_ptr<FrameRecorder>(new FrameRecorder(filename, dst_width, dst_height, pixfmt,
+								       8, write_policy, write_direct));
+		printf("Writing frames to %s\n", filename.c_str());
+	}
 
 	while (true) {
-		int r = poll(fds.data(), fds.size(), -1);
-		ASSERT(r > 0);
+		double wait = wbflipper.time_to_next();
+		int timeout = wait < 0 ? -1 : (int)ceil(wait * 1000);
+
+		int r = poll(fds.data(), fds.size(), timeout);
+		ASSERT(r >= 0);
 
 		if (fds[0].revents != 0)
 			break;
@@ -395,26 +461,33 @@ int main(int argc, char** argv)
 			fds[1].revents = 0;
 
 			DumbFramebuffer* fb = wb.Dequeue();
+			double ts = wb.timestamp();
 
-			if (write_file) {
-				printf("Writing frame %u to %s\n", dst_frame_num, filename.c_str());
-
-				for (unsigned i = 0; i < fb->num_planes(); ++i)
-					os->write((char*)fb->map(i), fb->size(i));
+			if (recorder)
+				recorder->record(*fb, ts);
 
-				dst_frame_num++;
-			}
-
-			wbflipper.queue_next();
+			wbflipper.push(fb, ts);
 		}
 
 		if (fds[2].revents) {
 			fds[2].revents = 0;
 
 			card.call_page_flip_handlers();
-			wb.Queue();
 		}
+
+		if (wbflipper.time_to_next() == 0)
+			wbflipper.queue_next();
+
+		wb.Queue();
 	}
 
 	printf("exiting...\n");
+
+	wbflipper.print_stats();
+
+	if (recorder) {
+		recorder->flush();
+		printf("Wrote %" PRIu64 " frames to %s, dropped %" PRIu64 "\n",
+		       recorder->frames_written(), filename.c_str(), recorder->frames_dropped());
+	}
 }
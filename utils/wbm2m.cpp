@@ -1,9 +1,11 @@
 #include <cstdio>
+#include <cstring>
+#include <cinttypes>
 #include <poll.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <algorithm>
 #include <regex>
-#include <fstream>
 #include <map>
 #include <system_error>
 #include <fmt/format.h>
@@ -11,9 +13,8 @@
 #include <kms++/kms++.h>
 #include <kms++util/kms++util.h>
 #include <kms++util/videodevice.h>
-
-const uint32_t NUM_SRC_BUFS=2;
-const uint32_t NUM_DST_BUFS=2;
+#include <kms++util/framerecorder.h>
+#include <kms++util/rawvideo.h>
 
 using namespace std;
 using namespace kms;
@@ -21,22 +22,30 @@ using namespace kms;
 static const char* usage_str =
 		"Usage: wbm2m [OPTIONS]\n\n"
 		"Options:\n"
+		"  -s, --src=WxH             Source size (default 800x480, or from an indexed input file)\n"
+		"  -S, --src-format=4CC      Source format (default XR24)\n"
+		"  -d, --dst=WxH             Output size (default the source size)\n"
 		"  -f, --format=4CC          Output format\n"
 		"  -c, --crop=CROP           CROP is <x>,<y>-<w>x<h>\n"
+		"  -i, --input=FILE          Read the source frames from a raw or indexed (.kmsv) file\n"
+		"                            instead of drawing a test pattern\n"
+		"  -n, --frames=N            Number of frames to process (default 10, or the input file length)\n"
+		"  -q, --queue=N             Buffers queued on each side of the device (default 4)\n"
+		"  -o, --output=FILE         Output file (default wb-out-<w>x<h>-<4CC>.raw)\n"
 		"  -h, --help                Print this help\n"
 		;
 
 const int bar_speed = 4;
 const int bar_width = 10;
 
-static unsigned get_bar_pos(DumbFramebuffer* fb, unsigned frame_num)
+static unsigned get_bar_pos(Framebuffer* fb, unsigned frame_num)
 {
 	return (frame_num * bar_speed) % (fb->width() - bar_width + 1);
 }
 
-static void read_frame(DumbFramebuffer* fb, unsigned frame_num)
+static void draw_frame(Framebuffer* fb, unsigned frame_num)
 {
-	static map<DumbFramebuffer*, int> s_bar_pos_map;
+	static map<Framebuffer*, int> s_bar_pos_map;
 
 	int old_pos = -1;
 	if (s_bar_pos_map.find(fb) != s_bar_pos_map.end())
@@ -48,6 +57,137 @@ static void read_frame(DumbFramebuffer* fb, unsigned frame_num)
 	s_bar_pos_map[fb] = pos;
 }
 
+static unsigned packed_row_bytes(const PixelFormatInfo& pfi, unsigned plane, uint32_t width)
+{
+	const PixelFormatPlaneInfo& pi = pfi.planes[plane];
+
+	unsigned bytes = width * pi.bitspp / 8;
+
+	// The chroma planes of fully planar YUV formats don't combine U and V
+	if (pfi.type == PixelColorType::YUV && pfi.num_planes == 3)
+		bytes /= pi.xsub;
+
+	return bytes;
+}
+
+static void copy_plane_rows(uint8_t* dst, uint32_t dst_stride, const uint8_t* src, uint32_t src_stride,
+			    unsigned row_bytes, unsigned rows)
+{
+	if (dst_stride == src_stride) {
+		memcpy(dst, src, (size_t)src_stride * rows);
+		return;
+	}
+
+	for (unsigned y = 0; y < rows; ++y)
+		memcpy(dst + (size_t)dst_stride * y, src + (size_t)src_stride * y, row_bytes);
+}
+
+// The source frames: a moving bar test pattern, or frames from a raw file of
+// packed frames or an indexed file. File frames are repeated from the start
+// if more frames are needed.
+class FrameSource
+{
+public:
+	FrameSource(uint32_t width, uint32_t height, PixelFormat format)
+		: m_width(width), m_height(height), m_format(format)
+	{
+	}
+
+	~FrameSource()
+	{
+		if (m_fd >= 0)
+			::close(m_fd);
+	}
+
+	FrameSource(const FrameSource& other) = delete;
+	FrameSource& operator=(const FrameSource& other) = delete;
+
+	void open(const string& filename)
+	{
+		if (RawVideoReader::is_raw_video(filename)) {
+			m_video = unique_ptr<RawVideoReader>(new RawVideoReader(filename));
+			m_width = m_video->width();
+			m_height = m_video->height();
+			m_format = m_video->format();
+			m_num_frames = m_video->num_frames();
+		} else {
+			m_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+			if (m_fd < 0)
+				EXIT("Failed to open %s: %s", filename.c_str(), strerror(errno));
+
+			const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+			m_frame_size = 0;
+			for (unsigned i = 0; i < pfi.num_planes; ++i)
+				m_frame_size += (size_t)packed_row_bytes(pfi, i, m_width) * (m_height / pfi.planes[i].ysub);
+
+			m_num_frames = lseek(m_fd, 0, SEEK_END) / m_frame_size;
+			m_buf.resize(m_frame_size);
+		}
+
+		FAIL_IF(m_num_frames == 0, "No frames in %s", filename.c_str());
+	}
+
+	uint32_t width() const { return m_width; }
+	uint32_t height() const { return m_height; }
+	PixelFormat format() const { return m_format; }
+	// 0 for the test pattern
+	uint64_t num_frames() const { return m_num_frames; }
+
+	void load(Framebuffer* fb, unsigned frame_num)
+	{
+		if (m_num_frames == 0) {
+			draw_frame(fb, frame_num);
+			return;
+		}
+
+		uint64_t n = frame_num % m_num_frames;
+
+		const PixelFormatInfo& pfi = get_pixel_format_info(m_format);
+
+		const uint8_t* src = m_buf.data();
+
+		if (m_video) {
+			m_video->prefetch(n + 1, 4);
+		} else {
+			ssize_t r = pread(m_fd, m_buf.data(), m_frame_size, n * m_frame_size);
+			FAIL_IF(r != (ssize_t)m_frame_size, "Failed to read frame %" PRIu64, n);
+		}
+
+		for (unsigned i = 0; i < pfi.num_planes; ++i) {
+			const unsigned row_bytes = packed_row_bytes(pfi, i, m_width);
+			const unsigned rows = m_height / pfi.planes[i].ysub;
+
+			if (m_video) {
+				copy_plane_rows(fb->map(i), fb->stride(i), m_video->plane(n, i), m_video->stride(i),
+						row_bytes, rows);
+			} else {
+				copy_plane_rows(fb->map(i), fb->stride(i), src, row_bytes, row_bytes, rows);
+				src += (size_t)row_bytes * rows;
+			}
+		}
+	}
+
+private:
+	uint32_t m_width;
+	uint32_t m_height;
+	PixelFormat m_format;
+
+	uint64_t m_num_frames = 0;
+
+	unique_ptr<RawVideoReader> m_video;
+
+	int m_fd = -1;
+	size_t m_frame_size = 0;
+	vector<uint8_t> m_buf;
+};
+
+static void parse_size(const string& str, uint32_t& w, uint32_t& h)
+{
+	if (sscanf(str.c_str(), "%ux%u", &w, &h) != 2 || w == 0 || h == 0)
+		EXIT("Bad size '%s'", str.c_str());
+}
+
 static void parse_crop(const string& crop_str, uint32_t& c_left, uint32_t& c_top,
 		       uint32_t& c_width, uint32_t& c_height)
 {
@@ -63,22 +203,50 @@ static void parse_crop(const string& crop_str, uint32_t& c_left, uint32_t& c_top
 	c_height = stoul(sm[4]);
 }
 
+// Dequeue a buffer, or nullptr if there's none ready
+static Framebuffer* try_dequeue(VideoStreamer* streamer)
+{
+	try {
+		return streamer->dequeue();
+	} catch (system_error& se) {
+		if (se.code() != errc::resource_unavailable_try_again)
+			FAIL("dequeue failed: %s", se.what());
+
+		return nullptr;
+	}
+}
+
 int main(int argc, char** argv)
 {
-	// XXX get from args
-	const uint32_t src_width = 800;
-	const uint32_t src_height = 480;
-	const auto src_fmt = PixelFormat::XRGB8888;
-	const uint32_t num_src_frames = 10;
-
-	const uint32_t dst_width = 800;
-	const uint32_t dst_height = 480;
+	uint32_t src_width = 800;
+	uint32_t src_height = 480;
+	auto src_fmt = PixelFormat::XRGB8888;
+	uint32_t num_frames = 0;
+	uint32_t queue_depth = 4;
+
+	uint32_t dst_width = 0;
+	uint32_t dst_height = 0;
 	uint32_t c_top, c_left, c_width, c_height;
 
 	auto dst_fmt = PixelFormat::XRGB8888;
 	bool use_selection = false;
 
+	string input_filename;
+	string filename;
+
 	OptionSet optionset = {
+		Option("s|src=", [&](string s)
+		{
+			parse_size(s, src_width, src_height);
+		}),
+		Option("S|src-format=", [&](string s)
+		{
+			src_fmt = FourCCToPixelFormat(s);
+		}),
+		Option("d|dst=", [&](string s)
+		{
+			parse_size(s, dst_width, dst_height);
+		}),
 		Option("f|format=", [&](string s)
 		{
 			dst_fmt = FourCCToPixelFormat(s);
@@ -88,6 +256,22 @@ int main(int argc, char** argv)
 			parse_crop(s, c_left, c_top, c_width, c_height);
 			use_selection = true;
 		}),
+		Option("i|input=", [&](string s)
+		{
+			input_filename = s;
+		}),
+		Option("n|frames=", [&](string s)
+		{
+			num_frames = stoul(s);
+		}),
+		Option("q|queue=", [&](string s)
+		{
+			queue_depth = stoul(s);
+		}),
+		Option("o|output=", [&](string s)
+		{
+			filename = s;
+		}),
 		Option("h|help", [&]()
 		{
 			puts(usage_str);
@@ -102,11 +286,35 @@ int main(int argc, char** argv)
 		exit(-1);
 	}
 
-	printf("%ux%u-%s -> %ux%u-%s\n", src_width, src_height, PixelFormatToFourCC(src_fmt).c_str(),
-	       dst_width, dst_height, PixelFormatToFourCC(dst_fmt).c_str());
+	// VideoStreamer tracks at most 64 buffers
+	if (queue_depth < 1 || queue_depth > 64)
+		EXIT("Bad queue depth %u", queue_depth);
+
+	FrameSource source(src_width, src_height, src_fmt);
 
-	const string filename = fmt::format("wb-out-{}x{}-{}.raw", dst_width, dst_height,
-					PixelFormatToFourCC(dst_fmt));
+	if (!input_filename.empty())
+		source.open(input_filename);
+
+	src_width = source.width();
+	src_height = source.height();
+	src_fmt = source.format();
+
+	if (num_frames == 0)
+		num_frames = source.num_frames() ? source.num_frames() : 10;
+
+	if (dst_width == 0) {
+		dst_width = src_width;
+		dst_height = src_height;
+	}
+
+	printf("%ux%u-%s -> %ux%u-%s, %u frames, queue depth %u\n",
+	       src_width, src_height, PixelFormatToFourCC(src_fmt).c_str(),
+	       dst_width, dst_height, PixelFormatToFourCC(dst_fmt).c_str(),
+	       num_frames, queue_depth);
+
+	if (filename.empty())
+		filename = fmt::format("wb-out-{}x{}-{}.raw", dst_width, dst_height,
+				       PixelFormatToFourCC(dst_fmt));
 
 	printf("writing to %s\n", filename.c_str());
 
@@ -114,9 +322,6 @@ int main(int argc, char** argv)
 
 	Card card;
 
-	uint32_t src_frame_num = 0;
-	uint32_t dst_frame_num = 0;
-
 	VideoStreamer* out = vid.get_output_streamer();
 	VideoStreamer* in = vid.get_capture_streamer();
 
@@ -128,79 +333,117 @@ int main(int argc, char** argv)
 		printf("crop -> %u,%u-%ux%u\n", c_left, c_top, c_width, c_height);
 	}
 
-	out->set_queue_size(NUM_SRC_BUFS);
-	in->set_queue_size(NUM_DST_BUFS);
+	const uint32_t num_bufs = min(queue_depth, num_frames);
+
+	out->set_queue_size(num_bufs);
+	in->set_queue_size(num_bufs);
+
+	vector<unique_ptr<Framebuffer>> fbs;
+
+	uint32_t src_frame_num = 0;
+	uint32_t dst_frame_num = 0;
 
+	// Buffers queued on each side of the device
+	uint32_t src_queued = 0;
+	uint32_t dst_queued = 0;
 
-	for (unsigned i = 0; i < min(NUM_SRC_BUFS, num_src_frames); ++i) {
+	// Fill the whole source queue before starting, so that the device
+	// always has the next frame when it finishes one
+	for (unsigned i = 0; i < num_bufs; ++i) {
 		auto fb = new DumbFramebuffer(card, src_width, src_height, src_fmt);
+		fbs.emplace_back(fb);
 
-		read_frame(fb, src_frame_num++);
+		source.load(fb, src_frame_num++);
 
 		out->queue(fb);
+		src_queued++;
 	}
 
-	for (unsigned i = 0; i < min(NUM_DST_BUFS, num_src_frames); ++i) {
+	for (unsigned i = 0; i < num_bufs; ++i) {
 		auto fb = new DumbFramebuffer(card, dst_width, dst_height, dst_fmt);
+		fbs.emplace_back(fb);
+
 		in->queue(fb);
+		dst_queued++;
 	}
 
-	vector<pollfd> fds(3);
+	// The output is written from a separate thread, so the disk doesn't
+	// hold back the capture queue
+	FrameRecorder recorder(filename, dst_width, dst_height, dst_fmt, num_bufs * 2);
+
+	vector<pollfd> fds(2);
 
 	fds[0].fd = 0;
-	fds[0].events =  POLLIN;
+	fds[0].events = POLLIN;
 	fds[1].fd = vid.fd();
-	fds[1].events =  POLLIN;
-	fds[2].fd = card.fd();
-	fds[2].events =  POLLIN;
 
-	ofstream os(filename, ofstream::binary);
+	double start = FrameScheduler::now();
+	double last_report = start;
+	uint32_t last_report_frame = 0;
 
 	out->stream_on();
 	in->stream_on();
 
-	while (true) {
+	while (dst_frame_num < num_frames) {
+		// The output side signals POLLOUT when a source buffer has been
+		// consumed, the capture side POLLIN when a frame is done
+		fds[1].events = (src_queued ? POLLOUT : 0) | (dst_queued ? POLLIN : 0);
+
 		int r = poll(fds.data(), fds.size(), -1);
 		ASSERT(r > 0);
 
 		if (fds[0].revents != 0)
 			break;
 
-		if (fds[1].revents) {
-			fds[1].revents = 0;
-
-
-			try {
-				DumbFramebuffer *dst_fb = in->dequeue();
-				printf("Writing frame %u\n", dst_frame_num);
-				for (unsigned i = 0; i < dst_fb->num_planes(); ++i)
-					os.write((char*)dst_fb->map(i), dst_fb->size(i));
-				in->queue(dst_fb);
+		if (fds[1].revents & POLLERR)
+			FAIL("Device error");
 
-				dst_frame_num++;
-
-				if (dst_frame_num >= num_src_frames)
-					break;
-
-			} catch (system_error& se) {
-				if (se.code() != errc::resource_unavailable_try_again)
-					FAIL("dequeue failed: %s", se.what());
+		if (fds[1].revents & POLLOUT) {
+			while (Framebuffer* src_fb = try_dequeue(out)) {
+				src_queued--;
 
-				break;
+				if (src_frame_num < num_frames) {
+					source.load(src_fb, src_frame_num++);
+					out->queue(src_fb);
+					src_queued++;
+				}
 			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			while (Framebuffer* dst_fb = try_dequeue(in)) {
+				dst_queued--;
 
-			DumbFramebuffer *src_fb = out->dequeue();
+				recorder.record(*dst_fb);
+				dst_frame_num++;
 
-			if (src_frame_num < num_src_frames) {
-				read_frame(src_fb, src_frame_num++);
-				out->queue(src_fb);
+				// Only queue buffers for frames still coming
+				if (dst_frame_num + dst_queued < num_frames) {
+					in->queue(dst_fb);
+					dst_queued++;
+				}
 			}
 		}
 
-		if (fds[2].revents) {
-			fds[2].revents = 0;
+		double now = FrameScheduler::now();
+
+		if (now - last_report >= 1) {
+			printf("%u frames, %.1f fps\n", dst_frame_num,
+			       (dst_frame_num - last_report_frame) / (now - last_report));
+			last_report = now;
+			last_report_frame = dst_frame_num;
 		}
 	}
 
+	double elapsed = FrameScheduler::now() - start;
+
+	printf("%u frames in %.3f s, %.1f fps\n", dst_frame_num, elapsed,
+	       elapsed > 0 ? dst_frame_num / elapsed : 0.0);
+
+	recorder.flush();
+
 	printf("exiting...\n");
+
+	out->stream_off();
+	in->stream_off();
 }